@@ -0,0 +1,469 @@
+#include "bdb_engine.hpp"
+#include <boost/rpc/log/log.hpp>
+#include <errno.h>
+#include <string.h>
+
+namespace gpm { namespace bdb {
+
+/**
+ *  Wraps a Dbc, the key and value of the current entry are kept in buffers
+ *  that are reused by every move.
+ */
+class bdb_cursor : public storage_cursor
+{
+    public:
+        bdb_cursor( bdb_engine* e )
+        :m_engine(e),m_cur(NULL)
+        {
+            e->m_db->cursor( e->txn(), &m_cur, 0 );
+        }
+        ~bdb_cursor()
+        {
+            if( m_cur )
+                m_cur->close();
+        }
+
+        bool seek( const char* k, uint32_t ks )
+        {
+            result_dbt key;
+            key.assign( k, ks );
+            if( m_cur->get( &key, &m_value, DB_SET_RANGE ) == DB_NOTFOUND )
+                return false;
+            m_key.swap( key );
+            return true;
+        }
+        bool find( const char* k, uint32_t ks )
+        {
+            Dbt key( (void*)k, ks );
+            if( m_cur->get( &key, &m_value, DB_SET ) == DB_NOTFOUND )
+                return false;
+            m_key.assign( k, ks );
+            return true;
+        }
+        bool next() { return m_cur->get( &m_key, &m_value, DB_NEXT ) != DB_NOTFOUND; }
+        bool prev() { return m_cur->get( &m_key, &m_value, DB_PREV ) != DB_NOTFOUND; }
+
+        const char* key( uint32_t& s )const   { s = m_key.get_size();   return (const char*)m_key.get_data();   }
+        const char* value( uint32_t& s )const { s = m_value.get_size(); return (const char*)m_value.get_data(); }
+
+        void put( const char* v, uint32_t vs )
+        {
+            Dbt val( (void*)v, vs );
+            m_cur->put( &m_key, &val, DB_CURRENT );
+            m_value.assign( v, vs );
+        }
+        void remove() { m_cur->del(0); }
+
+        storage_cursor* clone()const
+        {
+            bdb_cursor* c = new bdb_cursor( m_engine, NULL );
+            m_cur->dup( &c->m_cur, DB_POSITION );
+            c->m_key.assign( (const char*)m_key.get_data(), m_key.get_size() );
+            c->m_value.assign( (const char*)m_value.get_data(), m_value.get_size() );
+            return c;
+        }
+
+    private:
+        bdb_cursor( bdb_engine* e, Dbc* c ):m_engine(e),m_cur(c){}
+
+        bdb_engine*  m_engine;
+        Dbc*         m_cur;
+        result_dbt   m_key;
+        result_dbt   m_value;
+};
+
+
+bdb_engine::bdb_engine()
+:m_db(NULL),m_env(NULL)
+{
+}
+
+bdb_engine::~bdb_engine()
+{
+    if( m_db )
+        delete m_db;
+}
+
+const char* bdb_engine::db_name()const
+{
+    return m_compare ? "logical_file_name" : "ordered_keys";
+}
+
+int bdb_engine::bt_compare( Db* db, const Dbt* a, const Dbt* b )
+{
+    bdb_engine* e = (bdb_engine*)db->get_app_private();
+    return e->m_compare( (const char*)a->get_data(), a->get_size(), (const char*)b->get_data(), b->get_size() );
+}
+
+int bdb_engine::legacy_bt_compare( Db* db, const Dbt* a, const Dbt* b )
+{
+    bdb_engine* e = (bdb_engine*)db->get_app_private();
+    return e->m_options.legacy_compare( (const char*)a->get_data(), a->get_size(),
+                                        (const char*)b->get_data(), b->get_size() );
+}
+
+void bdb_engine::open( const boost::filesystem::path& p, const engine_options& o )
+{
+    m_options = o;
+    m_compare = o.compare;
+    m_env     = o.env;
+    m_db      = new Db( m_env ? m_env->get_env() : NULL, 0 );
+    try {
+        u_int32_t flags = 0;
+        if( m_env )
+        {
+            flags  = DB_THREAD | (m_env->transactional() ? DB_AUTO_COMMIT : 0);
+            m_file = boost::filesystem::system_complete(p).native_file_string();
+        }
+        else
+        {
+            if( o.password.size() )
+            {
+                m_db->set_encrypt( o.password.c_str(), 0 );
+            }
+            m_file = p.native_file_string();
+        }
+        m_db->set_app_private( this );
+        if( m_compare )
+            m_db->set_bt_compare( &bdb_engine::bt_compare );
+        m_db->open( NULL, m_file.c_str(), db_name(), DB_BTREE, DB_CREATE | flags, 0 );
+        if( !m_compare && o.recode )
+            migrate( flags );
+    }
+    catch ( const DbException& e )
+    {
+        elog( "Caught DbException" );
+        m_db->err(e.get_errno(), "Database open failed");
+    }
+    catch( const std::exception& e )
+    {
+        elog( "Caught std::exception %1%", boost::diagnostic_information( e )  );
+    }
+}
+
+/**
+ *  Keys copied by each group of migrate().
+ */
+static const u_int32_t migrate_batch = 10000;
+
+/**
+ *  Copies the raw keys of a file written before keys were encoded into m_db
+ *  and removes them.  Each group copies migrate_batch keys and records the raw
+ *  key of the last one in the "migrate_position" database of the file, a copy
+ *  that was interrupted resumes after it the next time the file is opened.  The
+ *  old database is only removed once every key has been copied.
+ */
+void bdb_engine::migrate( u_int32_t flags )
+{
+    const char* f = m_file.c_str();
+    Db old( m_env ? m_env->get_env() : NULL, 0 );
+    try {
+        if( m_options.password.size() )
+            old.set_encrypt( m_options.password.c_str(), 0 );
+        old.set_app_private( this );
+        old.set_bt_compare( &bdb_engine::legacy_bt_compare );
+        old.open( NULL, f, "logical_file_name", DB_BTREE, flags, 0 );
+    }
+    catch( const DbException& e )
+    {
+        if( e.get_errno() != ENOENT )
+            throw;
+        old.close(0);
+        return;
+    }
+
+    Db pos( m_env ? m_env->get_env() : NULL, 0 );
+    if( m_options.password.size() )
+        pos.set_encrypt( m_options.password.c_str(), 0 );
+    pos.open( NULL, f, "migrate_position", DB_BTREE, DB_CREATE | flags, 0 );
+
+    Dbt        last_name( (void*)"last", 4 );
+    result_dbt last;
+    bool       resume = pos.get( NULL, &last_name, &last, 0 ) != DB_NOTFOUND;
+
+    Dbc*        cur;
+    result_dbt  key;
+    result_dbt  val;
+    int         r;
+    old.cursor( NULL, &cur, 0 );
+    if( resume )
+    {
+        slog( "resuming the move of the keys of %1% to the ordered format", f );
+        key.assign( (const char*)last.get_data(), last.get_size() );
+        r = cur->get( &key, &val, DB_SET_RANGE );
+        if( r != DB_NOTFOUND && key.get_size() == last.get_size() 
+            && memcmp( key.get_data(), last.get_data(), last.get_size() ) == 0 )
+            r = cur->get( &key, &val, DB_NEXT );
+    }
+    else
+    {
+        slog( "moving the keys of %1% to the ordered format", f );
+        r = cur->get( &key, &val, DB_NEXT );
+    }
+
+    u_int32_t         count = 0;
+    std::vector<char> kd;
+    std::vector<char> copied;
+    try {
+        bool first = !resume;
+        do
+        {
+            if( m_env )
+                m_env->begin();
+            if( first )
+            {
+                u_int32_t n = 0;
+                m_db->truncate( txn(), &n, 0 );
+                first = false;
+            }
+            for( u_int32_t n = 0; n < migrate_batch && r != DB_NOTFOUND; ++n )
+            {
+                kd.clear();
+                m_options.recode( (const char*)key.get_data(), key.get_size(), kd );
+                Dbt nkey( &kd.front(), kd.size() );
+                m_db->put( txn(), &nkey, &val, 0 );
+                copied.assign( (const char*)key.get_data(), (const char*)key.get_data() + key.get_size() );
+                ++count;
+                r = cur->get( &key, &val, DB_NEXT );
+            }
+            if( copied.size() )
+            {
+                Dbt at( &copied.front(), copied.size() );
+                pos.put( txn(), &last_name, &at, 0 );
+            }
+            if( m_env )
+                m_env->commit();
+            if( r != DB_NOTFOUND )
+                slog( "moved %1% keys", count );
+        } while( r != DB_NOTFOUND );
+        slog( "moved %1% keys", count );
+    }
+    catch( ... )
+    {
+        if( m_env )
+            m_env->abort();
+        cur->close();
+        throw;
+    }
+    cur->close();
+    old.close(0);
+    pos.close(0);
+
+    // a stale position is never read once the old database is gone
+    remove_db( "logical_file_name", flags );
+    remove_db( "migrate_position", flags );
+}
+
+void bdb_engine::remove_db( const char* name, u_int32_t flags )
+{
+    if( m_env )
+        m_env->get_env()->dbremove( NULL, m_file.c_str(), name, flags & DB_AUTO_COMMIT );
+    else
+    {
+        Db r( NULL, 0 );
+        if( m_options.password.size() )
+            r.set_encrypt( m_options.password.c_str(), 0 );
+        r.remove( m_file.c_str(), name, 0 );
+    }
+}
+
+bool bdb_engine::get( const char* k, uint32_t ks, std::vector<char>& v )
+{
+    Dbt        key( (void*)k, ks );
+    result_dbt val;
+    if( m_db->get( txn(), &key, &val, 0 ) == DB_NOTFOUND )
+        return false;
+    const char* d = (const char*)val.get_data();
+    v.assign( d, d + val.get_size() );
+    return true;
+}
+
+void bdb_engine::put( const char* k, uint32_t ks, const char* v, uint32_t vs )
+{
+    Dbt key( (void*)k, ks );
+    Dbt val( (void*)v, vs );
+    m_db->put( txn(), &key, &val, 0 );
+}
+
+bool bdb_engine::remove( const char* k, uint32_t ks )
+{
+    Dbt key( (void*)k, ks );
+    return m_db->del( txn(), &key, 0 ) != DB_NOTFOUND;
+}
+
+void bdb_engine::clear()
+{
+    u_int32_t count = 0;
+    m_db->truncate( txn(), &count, 0 );
+}
+
+void bdb_engine::put_many( const byte_list& kv )
+{
+    std::vector<char> buf( bulk_buffer_size );
+    uint32_t i = 0;
+    while( i + 1 < kv.size() )
+    {
+        Dbt bulk( &buf.front(), buf.size() );
+        bulk.set_ulen( buf.size() );
+        bulk.set_flags( DB_DBT_USERMEM | DB_DBT_BULK );
+        DbMultipleKeyDataBuilder b( bulk );
+        uint32_t n = 0;
+        for( ; i + 1 < kv.size(); i += 2, ++n )
+        {
+            if( !b.append( (void*)kv.data(i), kv.length(i), (void*)kv.data(i+1), kv.length(i+1) ) )
+                break;
+        }
+        if( !n )
+        {
+            buf.resize( 2 * (buf.size() + kv.length(i) + kv.length(i+1)) );
+            continue;
+        }
+        Dbt unused;
+        m_db->put( txn(), &bulk, &unused, DB_MULTIPLE_KEY );
+    }
+}
+
+uint32_t bdb_engine::get_many( const byte_list& keys, byte_list& vals, std::vector<bool>& found )
+{
+    found.resize( keys.size() );
+    if( keys.empty() )
+        return 0;
+
+    uint32_t   n = 0;
+    Dbc*       cur;
+    result_dbt val;
+    m_db->cursor( txn(), &cur, 0 );
+    for( uint32_t i = 0; i < keys.size(); ++i )
+    {
+        Dbt key( (void*)keys.data(i), keys.length(i) );
+        found[i] = cur->get( &key, &val, DB_SET ) != DB_NOTFOUND;
+        if( found[i] )
+        {
+            const char* d = (const char*)val.get_data();
+            vals.bytes().insert( vals.bytes().end(), d, d + val.get_size() );
+            ++n;
+        }
+        vals.close();
+    }
+    cur->close();
+    return n;
+}
+
+uint32_t bdb_engine::remove_many( const byte_list& keys )
+{
+    if( keys.empty() )
+        return 0;
+
+    uint32_t   n = 0;
+    Dbc*       cur;
+    result_dbt val;
+    m_db->cursor( txn(), &cur, 0 );
+    for( uint32_t i = 0; i < keys.size(); ++i )
+    {
+        Dbt key( (void*)keys.data(i), keys.length(i) );
+        if( cur->get( &key, &val, DB_SET ) != DB_NOTFOUND )
+        {
+            cur->del( 0 );
+            ++n;
+        }
+    }
+    cur->close();
+    return n;
+}
+
+uint32_t bdb_engine::write_batch( const byte_list& kv, const byte_list& keys )
+{
+    if( !m_env )
+        return storage_engine::write_batch( kv, keys );
+    group_commit grp( *m_env );
+    put_many( kv );
+    uint32_t n = remove_many( keys );
+    grp.commit();
+    return n;
+}
+
+uint32_t bdb_engine::read_range( const char* first, uint32_t fs, const char* last, uint32_t ls,
+                                 byte_list& kv )
+{
+    std::vector<char> buf( bulk_buffer_size );
+
+    uint32_t   n    = 0;
+    bool       done = false;
+    u_int32_t  op   = DB_SET_RANGE;
+    Dbc*       cur;
+    result_dbt key;
+    key.assign( first, fs );
+    m_db->cursor( txn(), &cur, 0 );
+    while( !done )
+    {
+        Dbt bulk( &buf.front(), buf.size() );
+        bulk.set_ulen( buf.size() );
+        bulk.set_flags( DB_DBT_USERMEM );
+        try {
+            if( cur->get( &key, &bulk, op | DB_MULTIPLE_KEY ) == DB_NOTFOUND )
+                break;
+        }
+        catch( const DbMemoryException& )
+        {
+            // one entry is larger than the buffer
+            buf.resize( (bulk.get_size() / 1024 + 1) * 1024 );
+            continue;
+        }
+        op = DB_NEXT;
+
+        DbMultipleKeyDataIterator itr( bulk );
+        Dbt k;
+        Dbt v;
+        while( itr.next( k, v ) )
+        {
+            if( compare_keys( m_compare, (const char*)k.get_data(), k.get_size(), last, ls ) >= 0 )
+            {
+                done = true;
+                break;
+            }
+            kv.push_back( (const char*)k.get_data(), k.get_size() );
+            kv.push_back( (const char*)v.get_data(), v.get_size() );
+            ++n;
+        }
+    }
+    cur->close();
+    return n;
+}
+
+storage_cursor* bdb_engine::cursor()
+{
+    return new bdb_cursor( this );
+}
+
+/**
+ *  Without exact the key count is the one saved by the last exact call.
+ */
+db_stats bdb_engine::stats( bool exact )
+{
+    db_stats s;
+    s.name = m_file;
+    DB_BTREE_STAT* bs = NULL;
+    if( m_db->stat( txn(), &bs, exact ? 0 : DB_FAST_STAT ) == 0 && bs )
+    {
+        s.keys      = bs->bt_nkeys;
+        s.pages     = bs->bt_pagecnt;
+        s.page_size = bs->bt_pagesize;
+        s.levels    = bs->bt_levels;
+        free( bs );
+    }
+    if( m_env )
+        m_env->get_cache_stats( m_file, s );
+    return s;
+}
+
+/**
+ *  Databases in an environment are made durable by the environment when their
+ *  group commits, syncing them would only add writes.
+ */
+void bdb_engine::sync()
+{
+    if( !m_env )
+        m_db->sync(0);
+}
+
+} } // namespace gpm::bdb
@@ -0,0 +1,112 @@
+#ifndef _GPM_BDB_BDB_ENGINE_HPP_
+#define _GPM_BDB_BDB_ENGINE_HPP_
+#include <gpm/bdb/storage_engine.hpp>
+#include <db_cxx.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace gpm { namespace bdb {
+
+/**
+ *  Size of the buffers that bulk puts and reads are made with, a single
+ *  entry that does not fit gets a larger buffer.
+ */
+const uint32_t bulk_buffer_size = 1024*1024;
+
+/**
+ *  A Dbt that Berkeley DB returns a key or value in.  Free threaded handles may
+ *  not return data in memory that belongs to the handle, so the data is 
+ *  allocated for each Dbt and freed with it.
+ */
+class result_dbt : public Dbt
+{
+    public:
+        result_dbt() { set_flags( DB_DBT_REALLOC ); }
+        ~result_dbt() { free( get_data() ); }
+
+        /// replaces the data, for keys that are passed to a lookup
+        void assign( const char* d, uint32_t s )
+        {
+            void* p = realloc( get_data(), s ? s : 1 );
+            if( s )
+                memcpy( p, d, s );
+            set_data( p );
+            set_size( s );
+        }
+
+        void swap( result_dbt& r )
+        {
+            void*     d = get_data();
+            u_int32_t s = get_size();
+            set_data( r.get_data() );
+            set_size( r.get_size() );
+            r.set_data( d );
+            r.set_size( s );
+        }
+
+    private:
+        result_dbt( const result_dbt& );
+        result_dbt& operator=( const result_dbt& );
+};
+
+/**
+ *  @class bdb_engine
+ *  @brief Stores the entries in a btree of a Berkeley DB file.
+ *
+ *  Keys that are ordered by memcmp are stored in the "ordered_keys" database of
+ *  the file and use the default comparison of Berkeley DB.  Files written before
+ *  keys were encoded keep raw keys in "logical_file_name", open() copies them
+ *  into "ordered_keys" and then removes the old database.  Keys that have a
+ *  comparison of their own stay in "logical_file_name".
+ */
+class bdb_engine : public storage_engine
+{
+    public:
+        bdb_engine();
+        ~bdb_engine();
+
+        /**
+         *  Relative paths are resolved against the working directory, not the
+         *  home of the environment.
+         */
+        void     open( const boost::filesystem::path& p, const engine_options& o );
+        bool     get( const char* k, uint32_t ks, std::vector<char>& v );
+        void     put( const char* k, uint32_t ks, const char* v, uint32_t vs );
+        bool     remove( const char* k, uint32_t ks );
+        void     clear();
+
+        /// DB_MULTIPLE_KEY puts of up to bulk_buffer_size bytes
+        void     put_many( const byte_list& kv );
+        /// one cursor for all the keys and one buffer for all the values
+        uint32_t get_many( const byte_list& keys, byte_list& vals, std::vector<bool>& found );
+        uint32_t remove_many( const byte_list& keys );
+        /// both parts in one group of the environment
+        uint32_t write_batch( const byte_list& kv, const byte_list& keys );
+        /// DB_MULTIPLE_KEY cursor reads of up to bulk_buffer_size bytes
+        uint32_t read_range( const char* first, uint32_t fs, const char* last, uint32_t ls,
+                             byte_list& kv );
+
+        storage_cursor* cursor();
+        db_stats stats( bool exact );
+        void     sync();
+
+    private:
+        friend class bdb_cursor;
+
+        DbTxn*      txn()const { return m_env ? m_env->current() : NULL; }
+        const char* db_name()const;
+        void        migrate( u_int32_t flags );
+        void        remove_db( const char* name, u_int32_t flags );
+
+        static int  bt_compare( Db* db, const Dbt* a, const Dbt* b );
+        static int  legacy_bt_compare( Db* db, const Dbt* a, const Dbt* b );
+
+        Db*             m_db;
+        environment*    m_env;
+        std::string     m_file;
+        engine_options  m_options;
+};
+
+} } // namespace gpm::bdb
+
+#endif
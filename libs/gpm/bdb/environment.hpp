@@ -0,0 +1,354 @@
+#ifndef _GPM_BDB_ENVIRONMENT_HPP_
+#define _GPM_BDB_ENVIRONMENT_HPP_
+#include <db_cxx.h>
+#include <gpm/exception.hpp>
+#include <boost/rpc/log/log.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace gpm { namespace bdb {
+
+/**
+ *  Size and cache use of one database.
+ */
+struct db_stats
+{
+    db_stats():keys(0),pages(0),page_size(0),levels(0),cache_hits(0),cache_misses(0){}
+
+    std::string name;
+    uint64_t    keys;
+    uint64_t    pages;
+    uint32_t    page_size;
+    uint32_t    levels;
+    uint64_t    cache_hits;   // of the file that holds the database
+    uint64_t    cache_misses;
+};
+
+/**
+ *  State kept outside of the databases that has to follow the writes of the
+ *  outermost group, such as a log whose size the databases record.
+ */
+class group_listener
+{
+    public:
+        virtual ~group_listener(){}
+
+        /**
+         *  Called when the outermost group ends.  Must not throw, it may be called
+         *  while an exception unwinds the group.
+         *
+         *  @param rolled_back true if the writes of the group were undone
+         */
+        virtual void group_ended( bool rolled_back ) = 0;
+};
+
+/**
+ *  @class environment
+ *  @brief Transactional Berkeley DB environment shared by several keyvalue_db's.
+ *
+ *  Every database opened in the environment is written under the current
+ *  group.  Groups nest, only closing the outermost group commits the
+ *  transaction, so all the puts made while applying a block become durable
+ *  together with a single log flush.
+ *
+ *  Writes made outside of a group are committed on their own without
+ *  flushing the log, they become durable with the next group that syncs.
+ *
+ *  The lock subsystem is not initialized: all writes happen from one thread
+ *  and iterators that are left open while writing would otherwise block
+ *  against the group's transaction.  Handles are free threaded so that other
+ *  threads may read while the writer works on other databases, the owners of
+ *  the databases must keep them from reading one that is being written.  A
+ *  group belongs to the thread that began it, reads from other threads are
+ *  made outside of it.
+ *
+ *  All databases share one cache, set_cache_size() should be large enough to 
+ *  keep the upper levels of every index resident.  Without the transaction log
+ *  groups only decide when the cache is written back, a crash may leave the
+ *  databases inconsistent and they have to be rebuilt.  Logging should only be 
+ *  switched on or off after a clean close.  close() leaves a clean_shutdown 
+ *  file in the home directory that open() removes, so that owners of databases
+ *  that can be rebuilt know when they have to be.
+ */
+class environment
+{
+    public:
+        typedef boost::shared_ptr<environment> ptr;
+
+        /**
+         *  When the log is flushed to disk after a group commits.
+         *
+         *  sync_each    - every group, nothing is lost on power failure
+         *  sync_every_n - every n groups, useful while catching up with the chain
+         *  no_sync      - only on close and checkpoint, a crash may lose recent groups
+         *                 but the databases remain consistent
+         */
+        enum durability { sync_each, sync_every_n, no_sync };
+
+        environment()
+        :m_env(NULL),m_txn(NULL),m_depth(0),m_durability(sync_each),m_interval(1),m_unsynced(0),
+         m_cache_size(0),m_logging(true),m_clean(false){}
+
+        ~environment() { close(); }
+
+        void open( const boost::filesystem::path& home )
+        {
+            close();
+            if( !boost::filesystem::exists( home ) )
+                boost::filesystem::create_directory( home );
+
+            // the marker must be gone before anything is written, a crash could leave it otherwise
+            m_home  = home;
+            m_clean = boost::filesystem::exists( home / "clean_shutdown" );
+            if( m_clean )
+            {
+                boost::filesystem::remove( home / "clean_shutdown" );
+                int fd = ::open( home.native_file_string().c_str(), O_RDONLY );
+                if( fd >= 0 )
+                {
+                    ::fsync( fd );
+                    ::close( fd );
+                }
+            }
+
+            m_env = new DbEnv(0);
+            try {
+                if( m_cache_size )
+                    m_env->set_cachesize( m_cache_size / gigabyte, m_cache_size % gigabyte, 1 );
+                u_int32_t flags = DB_CREATE | DB_INIT_MPOOL | DB_THREAD;
+                if( m_logging )
+                {
+                    m_env->set_flags( DB_TXN_WRITE_NOSYNC, 1 );
+                    flags |= DB_RECOVER | DB_INIT_LOG | DB_INIT_TXN;
+                }
+                else
+                    flags |= DB_PRIVATE;
+                m_env->open( home.native_file_string().c_str(), flags, 0 );
+            }
+            catch ( const DbException& e )
+            {
+                delete m_env;
+                m_env = NULL;
+                THROW_GPM_EXCEPTION( "Error opening database environment %1%: %2%", %home %e.what() );
+            }
+        }
+
+        void close()
+        {
+            if( !m_env )
+                return;
+            if( m_txn )
+            {
+                wlog( "aborting open transaction" );
+                m_txn->abort();
+                m_txn   = NULL;
+            }
+            m_depth = 0;
+            if( m_logging )
+                m_env->txn_checkpoint( 0, 0, 0 );
+            else
+                m_env->memp_sync( NULL );
+            m_env->close(0);
+            delete m_env;
+            m_env = NULL;
+            std::ofstream marker( (m_home / "clean_shutdown").native_file_string().c_str() );
+        }
+
+        void set_durability( durability d, uint32_t n = 1 )
+        {
+            m_durability = d;
+            m_interval   = n ? n : 1;
+        }
+
+        /**
+         *  Bytes of the cache shared by all databases, 0 uses the default of
+         *  Berkeley DB.  Must be called before open().
+         */
+        void     set_cache_size( uint64_t bytes ) { m_cache_size = bytes; }
+        uint64_t cache_size()const                { return m_cache_size; }
+
+        /**
+         *  Turns the transaction log on or off, must be called before open().
+         *  Databases are opened with DB_AUTO_COMMIT only when it is on.
+         */
+        void     set_logging( bool on )           { m_logging = on; }
+        bool     transactional()const             { return m_logging; }
+
+        /**
+         *  @return true if the environment was closed by close() the last time it was
+         *          open.  Without the transaction log the databases may be damaged 
+         *          otherwise.
+         */
+        bool     closed_cleanly()const            { return m_clean; }
+
+        DbEnv* get_env()const { return m_env; }
+
+        /// l is told when each outermost group ends until it is removed
+        void add_listener( group_listener* l )    { m_listeners.push_back( l ); }
+        void remove_listener( group_listener* l )
+        {
+            m_listeners.erase( std::remove( m_listeners.begin(), m_listeners.end(), l ), m_listeners.end() );
+        }
+
+        /// true if the calling thread began the current group
+        bool in_group()const { return m_depth && m_owner == boost::this_thread::get_id(); }
+
+        /**
+         *  Adds the cache hits and misses of file, as it was passed to open, to s.
+         */
+        void get_cache_stats( const std::string& file, db_stats& s )const
+        {
+            DB_MPOOL_STAT*   gsp = NULL;
+            DB_MPOOL_FSTAT** fsp = NULL;
+            if( m_env->memp_stat( &gsp, &fsp, 0 ) )
+                return;
+            for( DB_MPOOL_FSTAT** f = fsp; f && *f; ++f )
+            {
+                if( file == (*f)->file_name )
+                {
+                    s.cache_hits   += (*f)->st_cache_hit;
+                    s.cache_misses += (*f)->st_cache_miss;
+                }
+            }
+            free( gsp );
+            free( fsp );
+        }
+
+        /// the transaction of the current group or NULL if the calling thread did not begin it
+        DbTxn* current()const 
+        { 
+            return m_txn && m_owner == boost::this_thread::get_id() ? m_txn : NULL; 
+        }
+
+        /**
+         *  @return true if committing the outermost group will flush the log,
+         *          anything it depends on must be on disk before then.
+         */
+        bool sync_due()const
+        {
+            switch( m_durability )
+            {
+                case sync_each:    return true;
+                case sync_every_n: return m_unsynced + 1 >= m_interval;
+                default:           return false;
+            }
+        }
+
+        void begin()
+        {
+            if( m_depth++ == 0 )
+            {
+                if( m_logging )
+                    m_env->txn_begin( NULL, &m_txn, 0 );
+                m_owner = boost::this_thread::get_id();
+            }
+        }
+
+        void commit()
+        {
+            if( !m_depth )
+                THROW_GPM_EXCEPTION( "Commit without a matching begin." );
+            if( --m_depth )
+                return;
+
+            bool do_sync = sync_due();
+            if( !m_logging )
+            {
+                // without a log the cache itself is written back
+                if( do_sync )
+                    m_env->memp_sync( NULL );
+                m_unsynced = do_sync ? 0 : m_unsynced + 1;
+                ended( false );
+                return;
+            }
+            DbTxn* t = m_txn;
+            m_txn = NULL;
+            t->commit( m_durability == sync_each ? DB_TXN_SYNC : DB_TXN_WRITE_NOSYNC );
+
+            if( m_durability == sync_every_n )
+            {
+                if( do_sync )
+                {
+                    m_env->log_flush( NULL );
+                    m_unsynced = 0;
+                }
+                else
+                    ++m_unsynced;
+            }
+            ended( false );
+        }
+
+        void abort()
+        {
+            if( !m_depth )
+                return;
+            m_depth = 0;
+            if( !m_txn )
+            {
+                wlog( "the writes of the group cannot be undone without the transaction log" );
+                ended( false );
+                return;
+            }
+            DbTxn* t = m_txn;
+            m_txn = NULL;
+            t->abort();
+            ended( true );
+        }
+
+    private:
+        environment( const environment& );
+        environment& operator=( const environment& );
+
+        static const uint64_t gigabyte = 1024*1024*1024;
+
+        void ended( bool rolled_back )
+        {
+            for( uint32_t i = 0; i < m_listeners.size(); ++i )
+                m_listeners[i]->group_ended( rolled_back );
+        }
+
+        DbEnv*     m_env;
+        DbTxn*     m_txn;
+        boost::thread::id m_owner; // of m_txn
+        uint32_t   m_depth;
+        durability m_durability;
+        uint32_t   m_interval;
+        uint32_t   m_unsynced;
+        uint64_t   m_cache_size;
+        bool       m_logging;
+        bool       m_clean;      // the clean_shutdown marker was found by open()
+        boost::filesystem::path      m_home;
+        std::vector<group_listener*> m_listeners;
+};
+
+/**
+ *  Opens a group for the life of the object and aborts it unless commit()
+ *  was called.
+ */
+class group_commit
+{
+    public:
+        group_commit( environment& e ):m_env(e),m_done(false) { m_env.begin(); }
+        ~group_commit() { if( !m_done ) m_env.abort(); }
+
+        void commit() { m_done = true; m_env.commit(); }
+
+    private:
+        group_commit( const group_commit& );
+        group_commit& operator=( const group_commit& );
+
+        environment& m_env;
+        bool         m_done;
+};
+
+} } // namespace gpm::bdb
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef _GPM_BDB_KEY_ENCODING_HPP_
+#define _GPM_BDB_KEY_ENCODING_HPP_
+#include <gpm/exception.hpp>
+#include <boost/rpc/raw.hpp>
+#include <boost/rpc/datastream/sha1.hpp>
+#include <boost/static_assert.hpp>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace gpm { namespace bdb {
+
+/**
+ *  Converts keys to bytes that sort like the keys when they are compared with
+ *  memcmp, so that the btree can use the default comparison of Berkeley DB
+ *  instead of unpacking both keys on every step.
+ *
+ *  encode() appends the bytes of k to d and decode() reads a key from the
+ *  front of [b,e) and returns the end of its bytes, so the encodings of the
+ *  fields of a key can be concatenated.
+ *
+ *  Types without a specialization keep their raw encoding, they are compared
+ *  by unpacking them and cannot be a field of another key.
+ */
+template<typename T>
+struct key_encoding
+{
+    enum { ordered = false };
+
+    static void encode( const T& k, std::vector<char>& d )
+    {
+        std::vector<char> r;
+        boost::rpc::raw::pack( r, k );
+        d.insert( d.end(), r.begin(), r.end() );
+    }
+    static const char* decode( const char* b, const char* e, T& k )
+    {
+        boost::rpc::raw::unpack( b, e - b, k );
+        return e;
+    }
+};
+
+/**
+ *  Unsigned integers are stored big endian.
+ */
+template<typename T>
+struct big_endian_encoding
+{
+    enum { ordered = true };
+
+    static void encode( T k, std::vector<char>& d )
+    {
+        for( int i = sizeof(T) - 1; i >= 0; --i )
+            d.push_back( char( k >> (i*8) ) );
+    }
+    static const char* decode( const char* b, const char* e, T& k )
+    {
+        if( e - b < int(sizeof(T)) )
+            THROW_GPM_EXCEPTION( "Key is truncated." );
+        k = 0;
+        for( uint32_t i = 0; i < sizeof(T); ++i )
+            k = (k << 8) | uint8_t(b[i]);
+        return b + sizeof(T);
+    }
+};
+
+template<> struct key_encoding<uint64_t> : public big_endian_encoding<uint64_t> {};
+template<> struct key_encoding<uint32_t> : public big_endian_encoding<uint32_t> {};
+
+/**
+ *  Signed integers flip the sign bit so that negative numbers come first.
+ */
+template<>
+struct key_encoding<int32_t>
+{
+    enum { ordered = true };
+
+    static void encode( int32_t k, std::vector<char>& d )
+    {
+        key_encoding<uint32_t>::encode( uint32_t(k) ^ 0x80000000u, d );
+    }
+    static const char* decode( const char* b, const char* e, int32_t& k )
+    {
+        uint32_t u;
+        b = key_encoding<uint32_t>::decode( b, e, u );
+        k = int32_t( u ^ 0x80000000u );
+        return b;
+    }
+};
+
+/**
+ *  Strings end with 0x00 0x01 and every 0x00 they contain is stored as
+ *  0x00 0xff, so a string sorts before every longer string it is a prefix of
+ *  and the field after it starts at a known place.
+ */
+template<>
+struct key_encoding<std::string>
+{
+    enum { ordered = true };
+
+    static void encode( const std::string& k, std::vector<char>& d )
+    {
+        for( uint32_t i = 0; i < k.size(); ++i )
+        {
+            d.push_back( k[i] );
+            if( k[i] == 0 )
+                d.push_back( char(0xff) );
+        }
+        d.push_back( 0 );
+        d.push_back( 1 );
+    }
+    static const char* decode( const char* b, const char* e, std::string& k )
+    {
+        k.clear();
+        while( b < e )
+        {
+            if( *b != 0 )
+            {
+                k.push_back( *b++ );
+                continue;
+            }
+            if( e - b < 2 )
+                break;
+            if( b[1] == 1 )
+                return b + 2;
+            k.push_back( 0 );
+            b += 2;
+        }
+        THROW_GPM_EXCEPTION( "Key is truncated." );
+    }
+};
+
+/**
+ *  The bytes of the hash as they are in memory.
+ */
+template<>
+struct key_encoding<boost::rpc::sha1_hashcode>
+{
+    enum { ordered = true };
+
+    static void encode( const boost::rpc::sha1_hashcode& k, std::vector<char>& d )
+    {
+        const char* h = (const char*)k.hash;
+        d.insert( d.end(), h, h + sizeof(k.hash) );
+    }
+    static const char* decode( const char* b, const char* e, boost::rpc::sha1_hashcode& k )
+    {
+        if( e - b < int(sizeof(k.hash)) )
+            THROW_GPM_EXCEPTION( "Key is truncated." );
+        memcpy( (char*)k.hash, b, sizeof(k.hash) );
+        return b + sizeof(k.hash);
+    }
+};
+
+template<typename A, typename B>
+struct key_encoding< std::pair<A,B> >
+{
+    BOOST_STATIC_ASSERT( key_encoding<A>::ordered && key_encoding<B>::ordered );
+    enum { ordered = true };
+
+    static void encode( const std::pair<A,B>& k, std::vector<char>& d )
+    {
+        key_encoding<A>::encode( k.first, d );
+        key_encoding<B>::encode( k.second, d );
+    }
+    static const char* decode( const char* b, const char* e, std::pair<A,B>& k )
+    {
+        b = key_encoding<A>::decode( b, e, k.first );
+        return key_encoding<B>::decode( b, e, k.second );
+    }
+};
+
+} } // namespace gpm::bdb
+
+#endif
@@ -1,14 +1,24 @@
 #ifndef _GPM_BDB_KEYVALUE_DB_HPP_
 #define _GPM_BDB_KEYVALUE_DB_HPP_
-#include <db_cxx.h>
 #include <boost/rpc/raw.hpp>
 #include <boost/filesystem.hpp>
+#include <gpm/bdb/storage_engine.hpp>
+#include <gpm/bdb/key_encoding.hpp>
+#include <boost/optional.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <algorithm>
 
 namespace gpm { namespace bdb {
 
 /**
  *  This class should be have the same as std::map except the back end
- *  is a database.
+ *  is a storage_engine.
+ *
+ *  Keys with a key_encoding are stored encoded and the engine orders them with
+ *  memcmp, keys without one are stored raw and ordered by unpacking them.
+ *  Values are stored raw.  The engine is a bdb_engine unless another one is
+ *  given to the constructor.
  */
 template<typename Key, typename Value>
 class keyvalue_db
@@ -17,72 +27,68 @@ class keyvalue_db
         enum state { not_found = -1 };
         typedef boost::shared_ptr<keyvalue_db> ptr;
 
-        keyvalue_db( )
-        :m_db(NULL)
+        /**
+         *  @param e the engine to store the entries in, it is opened by open()
+         */
+        keyvalue_db( const storage_engine::ptr& e = storage_engine::ptr() )
+        :m_engine(e)
         {
         }
         int  count()const
         {
             int c = 0;
-            Dbc*         cur;
-            Dbt          key;
-            Dbt          val;
-            m_db->cursor( NULL, &cur, 0 );
-            int rtn = cur->get( &key,&val, DB_NEXT );
-            while( rtn != DB_NOTFOUND )
-            {
+            boost::scoped_ptr<storage_cursor> cur( m_engine->cursor() );
+            while( cur->next() )
                 ++c;
-                rtn = cur->get( &key,&val, DB_NEXT );
-            }
             return c;
         }
 
         void open( const boost::filesystem::path& p, const std::string& password = "" )
         {
-            m_db = new Db(/*env*/0,0);
-            try {
-                if( password.size() )
-                {
-                    m_db->set_encrypt( password.c_str(), 0 );
-                }
-                m_db->set_bt_compare( &keyvalue_db::compare );
-                m_db->open( NULL, p.native_file_string().c_str(), "logical_file_name", 
-                            DB_BTREE, DB_CREATE /*oflags*/, 0 );
-            } 
-            catch ( const DbException& e )
-            {
-                elog( "Caught DbException" );
-                m_db->err(e.get_errno(), "Database open failed");
-            }
-            catch( const std::exception& e )
-            {
-                elog( "Caught std::exception %1%", boost::diagnostic_information( e )  );
-            }
-
+            engine_options o;
+            o.password = password;
+            open( p, o );
         }
 
-        ~keyvalue_db()
+        /**
+         *  Opens the database in env, all writes are made under the current
+         *  group of env and it is cached in the cache of env.  Relative paths
+         *  are resolved against the working directory, not the home of env.
+         *  Engines other than bdb_engine ignore env.
+         */
+        void open( const boost::filesystem::path& p, environment& env )
         {
-            if( m_db )
-                delete m_db;
+            engine_options o;
+            o.env = &env;
+            open( p, o );
         }
 
+        storage_engine& engine() { return *m_engine; }
+
         bool remove( const Key& k )
         {
             std::vector<char> kd;
-            boost::rpc::raw::pack(kd,k);
-            Dbt key( (void*)&kd.front(), kd.size() );
-            int rtn = m_db->del( 0, &key, 0 );
-            if( rtn == DB_NOTFOUND )
-                 return false;
-            return true;
+            key_encoding<Key>::encode(k,kd);
+            return m_engine->remove( &kd.front(), kd.size() );
         }
-        static int compare(Db *db, const Dbt *key1, const Dbt *key2)
+        /**
+         *  Removes every entry.
+         */
+        void clear()
+        {
+            m_engine->clear();
+        }
+
+        /**
+         *  Compares raw keys, used for keys without an encoding and to read
+         *  files written before keys were encoded.
+         */
+        static int raw_compare( const char* a, uint32_t as, const char* b, uint32_t bs )
         {
             Key _k1;
             Key _k2;
-            boost::rpc::raw::unpack( (const char*)key1->get_data(), key1->get_size(), _k1 );
-            boost::rpc::raw::unpack( (const char*)key2->get_data(), key2->get_size(), _k2 );
+            boost::rpc::raw::unpack( a, as, _k1 );
+            boost::rpc::raw::unpack( b, bs, _k2 );
             if( _k1 > _k2 ) return 1;
             if( _k1 == _k2 ) return 0;
             return -1;
@@ -93,195 +99,451 @@ class keyvalue_db
             std::vector<char> kd;
             std::vector<char> vd;
             boost::rpc::raw::pack(vd,v);
-            boost::rpc::raw::pack(kd,k);
-
-            Dbt val( &vd.front(), vd.size() );
-            Dbt key( &kd.front(), kd.size() );
-            m_db->put( 0, &key, &val, 0 );
+            key_encoding<Key>::encode(k,kd);
+            m_engine->put( &kd.front(), kd.size(), &vd.front(), vd.size() );
         }
 
-        struct iterator 
+        /**
+         *  A position in the database that cannot be copied, so the engine
+         *  cursor is never duplicated.  It is handed on with swap().
+         *
+         *  The key and value are only decoded when key() or value() is called,
+         *  key_bytes() and value_bytes() give the stored bytes without decoding
+         *  them.  The bytes are valid until the cursor moves.
+         */
+        class cursor : boost::noncopyable
+        {
+            public:
+                explicit cursor( keyvalue_db& db )
+                :m_cur( db.engine().cursor() ),m_valid(false),m_key_loaded(false),m_value_loaded(false)
+                {
+                }
+                ~cursor()
+                {
+                    delete m_cur;
+                }
+
+                bool end()const { return !m_valid; }
+
+                /// moves to the first key at or after k
+                bool seek( const Key& k )
+                {
+                    std::vector<char> kd;
+                    key_encoding<Key>::encode(k,kd);
+                    moved( m_cur->seek( &kd.front(), kd.size() ) );
+                    if( !m_valid )
+                        loaded( k );
+                    return m_valid;
+                }
+                /// moves to k if it is there
+                bool find( const Key& k )
+                {
+                    std::vector<char> kd;
+                    key_encoding<Key>::encode(k,kd);
+                    moved( m_cur->find( &kd.front(), kd.size() ) );
+                    loaded( k );
+                    return m_valid;
+                }
+                /// a cursor that was never positioned moves to the first entry
+                bool next() { return moved( m_cur && m_cur->next() ); }
+                /// a cursor that was never positioned moves to the last entry
+                bool prev() { return moved( m_cur && m_cur->prev() ); }
+
+                const Key& key()const
+                {
+                    if( m_valid && !m_key_loaded )
+                    {
+                        byte_view k = key_bytes();
+                        key_encoding<Key>::decode( k.data, k.data + k.size, m_key );
+                        m_key_loaded = true;
+                    }
+                    return m_key;
+                }
+                const Value& value()const
+                {
+                    if( m_valid && !m_value_loaded )
+                    {
+                        byte_view v = value_bytes();
+                        if( v.size )
+                            boost::rpc::raw::unpack( v.data, v.size, m_value );
+                        else
+                            m_value = Value();
+                        m_value_loaded = true;
+                    }
+                    return m_value;
+                }
+                byte_view key_bytes()const
+                {
+                    uint32_t    s;
+                    const char* d = m_cur->key( s );
+                    return byte_view( d, s );
+                }
+                byte_view value_bytes()const
+                {
+                    uint32_t    s;
+                    const char* d = m_cur->value( s );
+                    return byte_view( d, s );
+                }
+
+                void  set( const Value& v )
+                {
+                    std::vector<char> vd;
+                    boost::rpc::raw::pack(vd,v);
+                    m_cur->put( &vd.front(), vd.size() );
+                    m_value        = v;
+                    m_value_loaded = true;
+                }
+                void remove()
+                {
+                    m_cur->remove();
+                    m_valid = false;
+                }
+
+                void swap( cursor& c )
+                {
+                    std::swap( m_cur, c.m_cur );
+                    std::swap( m_valid, c.m_valid );
+                    std::swap( m_key_loaded, c.m_key_loaded );
+                    std::swap( m_value_loaded, c.m_value_loaded );
+                    std::swap( m_key, c.m_key );
+                    std::swap( m_value, c.m_value );
+                }
+
+            protected:
+                cursor( storage_cursor* c )
+                :m_cur(c),m_valid(false),m_key_loaded(false),m_value_loaded(false)
+                {
+                }
+
+                /// copies the position of c, which owns another engine cursor
+                void assign( const cursor& c )
+                {
+                    m_valid        = c.m_valid;
+                    m_key_loaded   = c.m_key_loaded;
+                    m_value_loaded = c.m_value_loaded;
+                    m_key          = c.m_key;
+                    m_value        = c.m_value;
+                }
+
+                storage_cursor*  m_cur;
+
+            private:
+                bool moved( bool ok )
+                {
+                    m_valid        = ok;
+                    m_key_loaded   = false;
+                    m_value_loaded = false;
+                    return ok;
+                }
+                /// the key is known without decoding it
+                void loaded( const Key& k )
+                {
+                    m_key        = k;
+                    m_key_loaded = true;
+                }
+
+                bool             m_valid;
+                mutable bool     m_key_loaded;
+                mutable bool     m_value_loaded;
+                mutable Key      m_key;
+                mutable Value    m_value;
+        }; // cursor
+
+        /**
+         *  A cursor that can be copied, every copy duplicates the engine
+         *  cursor.  Loops that do not keep copies should use a cursor.
+         */
+        struct iterator : public cursor
         {
-            bool end()
+            iterator& operator++() 
             {
-                return rtn == DB_NOTFOUND; 
+                this->next();
+                return *this;
             }
-            iterator& operator++() 
+            /**
+             *  Moves to the previous entry, an iterator that was never positioned
+             *  (search() past the last entry) moves to the last entry.
+             */
+            iterator& operator--() 
             {
-                Dbt          key;
-                Dbt          val;
-                rtn = cur->get( &key, &val, DB_NEXT );
-                if( rtn != DB_NOTFOUND )
-                {
-                    if( key.get_size() )
-                        boost::rpc::raw::unpack( (const char*)key.get_data(), key.get_size(), m_key );
-                    if( val.get_size() )
-                        boost::rpc::raw::unpack( (const char*)val.get_data(), val.get_size(), m_value );
-                }
+                this->prev();
                 return *this;
             }
             iterator& operator++(int) 
             {
-                Dbt          key;
-                Dbt          val;
-                rtn = cur->get( &key, &val, DB_NEXT );
-                if( rtn != DB_NOTFOUND )
-                {
-                    if( key.get_size() )
-                        boost::rpc::raw::unpack( (const char*)key.get_data(), key.get_size(), m_key );
-                    if( val.get_size() )
-                        boost::rpc::raw::unpack( (const char*)val.get_data(), val.get_size(), m_value );
-                }
+                this->next();
                 return *this;
             }
 
-
             iterator()
-            :cur(NULL),self(NULL)
+            :cursor( (storage_cursor*)NULL )
             {
             }
 
             iterator( const iterator& itr )
-            :self(itr.self)
+            :cursor( itr.m_cur ? itr.m_cur->clone() : NULL )
             {
-                if( itr.cur )
-                {
-                    itr.cur->dup(&cur, DB_POSITION);
-                }
-                else if( self )
-                    self->m_db->cursor( NULL, &cur, 0 );
-                rtn   = itr.rtn;
+                this->assign( itr );
             }
 
             iterator& operator = ( const iterator& i )
             {
                 if( &i == this )
                     return *this;
-                self = i.self;
-                if( i.cur )
-                {
-                    if( cur ) 
-                        cur->close();
-                    i.cur->dup(&cur, DB_POSITION );
-                }
-                rtn     = i.rtn;
-                m_key   = i.m_key;
-                m_value = i.m_value;
+                iterator tmp( i );
+                this->swap( tmp );
                 return *this;
             }
 
-            ~iterator()
-            {
-                if( cur ) 
-                    cur->close();
-            }
-
-
-            Key   key()const   { return m_key; }
-            const Value& value()const { return m_value;   }
-            void  set( const Value& v )
-            {
-                m_value = v;
-                std::vector<char> kd;
-                std::vector<char> vd;
-                boost::rpc::raw::pack(vd,v);
-                boost::rpc::raw::pack(kd,m_key);
-
-                Dbt val( &vd.front(), vd.size() );
-                Dbt key( &kd.front(), kd.size() );
-                cur->put( &key, &val, 0 );
-            }
-            void remove()
-            {
-                cur->del(0);
-                rtn = DB_NOTFOUND;
-            }
-
             private:
-                iterator( keyvalue_db* s ):self(s)
+                iterator( storage_cursor* c )
+                :cursor( c )
                 {
-                    s->m_db->cursor( NULL, &cur, 0 );
                 }
                 friend class keyvalue_db;
-
-                Key          m_key;
-                Value        m_value;
-
-
-                int          rtn;
-                Dbc*         cur;
-                keyvalue_db* self;
         }; // iterator
         iterator search( const Key& k )
         {
-            iterator itr(this);
-            itr.m_key = k;
+            iterator itr( m_engine->cursor() );
+            itr.seek( k );
+            return itr;
+        }
+        iterator find( const Key& k )
+        {
+            iterator itr( m_engine->cursor() );
+            itr.find( k );
+            return itr;
+        }
+        iterator begin()
+        {
+            iterator itr( m_engine->cursor() );
+            itr.next();
+            return itr;
+        }
 
+        bool get( const Key& k, Value& v )
+        {
             std::vector<char> kd;
-            boost::rpc::raw::pack(kd,k);
-            Dbt key( &kd.front(), kd.size() );
-            Dbt          val;
-            itr.rtn = itr.cur->get( &key, &val, DB_SET_RANGE );
-            if( itr.rtn != DB_NOTFOUND )
+            std::vector<char> vd;
+            key_encoding<Key>::encode(k,kd);
+            if( !m_engine->get( &kd.front(), kd.size(), vd ) ) { return false; }
+            if( vd.size() )
+                boost::rpc::raw::unpack( &vd.front(), vd.size(), v );
+            return true;
+        }
+        boost::optional<Value> get( const Key& k )
+        {
+            Value v;
+            if( !keyvalue_db::get( k, v ) ) { return boost::optional<Value>(); }
+            return v;
+        }
+        /**
+         *  Sets every pair of kv with one bulk put of the engine.
+         */
+        void set_many( const std::vector< std::pair<Key,Value> >& kv )
+        {
+            byte_list         l;
+            std::vector<char> vd;
+            for( uint32_t i = 0; i < kv.size(); ++i )
             {
-                Dbt key;
-                itr.rtn = itr.cur->get( &key, &val, DB_CURRENT );
-                boost::rpc::raw::unpack((const char*)key.get_data(),key.get_size(), itr.m_key );
-                boost::rpc::raw::unpack((const char*)val.get_data(),val.get_size(), itr.m_value );
+                key_encoding<Key>::encode( kv[i].first, l.bytes() );
+                l.close();
+                vd.clear();
+                boost::rpc::raw::pack( vd, kv[i].second );
+                l.push_back( vd.size() ? &vd.front() : "", vd.size() );
             }
-            return itr;
+            m_engine->put_many( l );
         }
-        iterator find( const Key& k )
+
+        /**
+         *  Looks up every key of keys with one bulk get of the engine, the keys
+         *  are passed in the order they are stored in if the encoding is ordered.
+         *
+         *  @param vals vals[i] is set to the value of keys[i] if it was found
+         *  @return the number of keys found
+         */
+        uint32_t get_many( const std::vector<Key>& keys, std::vector< boost::optional<Value> >& vals )
         {
-            iterator itr(this);
-            itr.m_key = k;
+            vals.clear();
+            vals.resize( keys.size() );
+            if( keys.empty() )
+                return 0;
+            encoded_keys ek( keys );
 
-            std::vector<char> kd;
-            boost::rpc::raw::pack(kd,k);
-            Dbt key( &kd.front(), kd.size() );
-            Dbt          val;
-            itr.rtn = itr.cur->get( &key, &val, DB_SET );
-            if( itr.rtn != DB_NOTFOUND )
+            byte_list         vl;
+            std::vector<bool> found;
+            uint32_t n = m_engine->get_many( ek.sorted, vl, found );
+            for( uint32_t i = 0; i < ek.order.size(); ++i )
             {
-                boost::rpc::raw::unpack((const char*)val.get_data(),val.get_size(), itr.m_value );
+                if( !found[i] )
+                    continue;
+                uint32_t k = ek.order[i];
+                vals[k] = Value();
+                boost::rpc::raw::unpack( vl.data(i), vl.length(i), *vals[k] );
             }
-            return itr;
+            return n;
         }
-        iterator begin()
+
+        /**
+         *  Removes every key of keys with one bulk remove of the engine.
+         *
+         *  @return the number of keys that were found and removed
+         */
+        uint32_t remove_many( const std::vector<Key>& keys )
         {
-            iterator itr(this);
-            Dbt key;
-            Dbt val;
-            itr.rtn = itr.cur->get( &key, &val, DB_NEXT );
-            if( itr.rtn != DB_NOTFOUND )
+            if( keys.empty() )
+                return 0;
+            encoded_keys ek( keys );
+            return m_engine->remove_many( ek.sorted );
+        }
+
+        /**
+         *  Moves the value of from[i] to to[i] for every key of from that is
+         *  found.  The values are copied as they are stored, without decoding
+         *  them.  No key may be in both from and to.
+         *
+         *  @param moved if it is given moved[i] is set if from[i] was found
+         *  @return the number of values moved
+         */
+        uint32_t rename_many( const std::vector<Key>& from, const std::vector<Key>& to,
+                              std::vector<bool>* moved = NULL )
+        {
+            if( moved )
+                moved->assign( from.size(), false );
+            if( from.empty() )
+                return 0;
+            encoded_keys ek( from );
+
+            byte_list         vl;
+            std::vector<bool> found;
+            if( !m_engine->get_many( ek.sorted, vl, found ) )
+                return 0;
+
+            byte_list kv;
+            byte_list rm;
+            for( uint32_t i = 0; i < ek.order.size(); ++i )
             {
-                boost::rpc::raw::unpack((const char*)key.get_data(),key.get_size(), itr.m_key );
-                boost::rpc::raw::unpack((const char*)val.get_data(),val.get_size(), itr.m_value );
+                if( !found[i] )
+                    continue;
+                if( moved )
+                    (*moved)[ek.order[i]] = true;
+                key_encoding<Key>::encode( to[ek.order[i]], kv.bytes() );
+                kv.close();
+                kv.push_back( vl.data(i), vl.length(i) );
+                rm.push_back( ek.sorted.data(i), ek.sorted.length(i) );
             }
-            return itr;
+            return m_engine->write_batch( kv, rm );
         }
 
-        bool get( const Key& k, Value& v )
+        /**
+         *  Appends the entries from first up to but not including last to out.
+         *
+         *  @return the number of entries appended
+         */
+        uint32_t read_range( const Key& first, const Key& last, std::vector< std::pair<Key,Value> >& out )
         {
-            iterator itr = find(k);
-            if( itr.end() ) { return false; }
-             v = itr.value();
-            return true;
+            std::vector<char> fd;
+            std::vector<char> ld;
+            key_encoding<Key>::encode( first, fd );
+            key_encoding<Key>::encode( last, ld );
+
+            byte_list kv;
+            uint32_t n = m_engine->read_range( &fd.front(), fd.size(), &ld.front(), ld.size(), kv );
+            out.reserve( out.size() + n );
+            for( uint32_t i = 0; i + 1 < kv.size(); i += 2 )
+            {
+                out.resize( out.size() + 1 );
+                key_encoding<Key>::decode( kv.data(i), kv.data(i) + kv.length(i), out.back().first );
+                boost::rpc::raw::unpack( kv.data(i+1), kv.length(i+1), out.back().second );
+            }
+            return n;
         }
-        boost::optional<Value> get( const Key& k )
+
+        /**
+         *  The size of the database as the engine reports it.
+         *
+         *  @param exact count the keys, which reads every page of a bdb_engine.
+         *               Otherwise the count is the one saved by the last exact call.
+         */
+        db_stats stats( bool exact = false )const
         {
-            iterator itr = find(k);
-            if( itr.end() ) { return boost::optional<Value>(); }
-            return itr.value();
+            return m_engine->stats( exact );
         }
+
+        /**
+         *  Databases in an environment are made durable by the environment
+         *  when their group commits, syncing them would only add writes.
+         */
         void sync()
         {
-            m_db->sync(0);
+            m_engine->sync();
         }
 
 
     private:
-        Db* m_db;
+        void open( const boost::filesystem::path& p, engine_options o )
+        {
+            if( !m_engine )
+                m_engine = storage_engine::create( storage_engine::berkeley_db );
+            if( key_encoding<Key>::ordered )
+            {
+                o.legacy_compare = &keyvalue_db::raw_compare;
+                o.recode         = &keyvalue_db::recode;
+            }
+            else
+                o.compare = &keyvalue_db::raw_compare;
+            m_engine->open( p, o );
+        }
+
+        /**
+         *  Encodes a raw key of a file written before keys were encoded.
+         */
+        static void recode( const char* d, uint32_t s, std::vector<char>& out )
+        {
+            Key k;
+            boost::rpc::raw::unpack( d, s, k );
+            key_encoding<Key>::encode( k, out );
+        }
+
+        /**
+         *  The encodings of a list of keys, sorted holds them in the order they
+         *  are stored in if the encoding is ordered and sorted[i] is the
+         *  encoding of keys[order[i]].
+         */
+        struct encoded_keys
+        {
+            encoded_keys( const std::vector<Key>& keys )
+            :order( keys.size() )
+            {
+                byte_list all;
+                for( uint32_t i = 0; i < keys.size(); ++i )
+                {
+                    key_encoding<Key>::encode( keys[i], all.bytes() );
+                    all.close();
+                    order[i] = i;
+                }
+                if( key_encoding<Key>::ordered )
+                    std::sort( order.begin(), order.end(), less( all ) );
+                for( uint32_t i = 0; i < order.size(); ++i )
+                    sorted.push_back( all.data( order[i] ), all.length( order[i] ) );
+            }
+
+            struct less
+            {
+                less( const byte_list& l ):k(&l){}
+
+                bool operator()( uint32_t a, uint32_t b )const
+                {
+                    return compare_keys( NULL, k->data(a), k->length(a), k->data(b), k->length(b) ) < 0;
+                }
+                const byte_list* k;
+            };
+
+            byte_list              sorted;
+            std::vector<uint32_t>  order;
+        };
+
+        storage_engine::ptr m_engine;
 };
 
 
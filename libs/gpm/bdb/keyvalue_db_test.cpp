@@ -1,12 +1,23 @@
 #include <gpm/bdb/keyvalue_db.hpp>
+#include <gpm/statedb/state_database.hpp>
 #include <boost/rpc/log/log.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <string.h>
 
 using namespace gpm::bdb;
+using gpm::account_key;
+using gpm::holder_key;
+using gpm::rank_key;
+using gpm::history_key;
 
-int main( int argc, char** argv )
+static void test( const char* engine, const char* file )
 {
-    keyvalue_db<std::string,std::string> db;
-    db.open( "kv_db_test.db" );
+    slog( "testing the %1% engine", engine );
+    keyvalue_db<std::string,std::string> db( 
+        storage_engine::create( storage_engine::parse_type( engine ) ) );
+    db.open( file );
+    db.clear();
 
     db.set( "Hello", "world" );
     db.set( "Apple", "one" );
@@ -29,12 +40,194 @@ int main( int argc, char** argv )
         ++itr;
     }
 
+    std::vector< std::pair<std::string,std::string> > kv;
+    kv.push_back( std::make_pair( "Eve", "four" ) );
+    kv.push_back( std::make_pair( "Fay", "five" ) );
+    db.set_many( kv );
+
+    std::vector<std::string> keys;
+    keys.push_back( "Fay" );
+    keys.push_back( "Gus" );
+    keys.push_back( "Apple" );
+    std::vector< boost::optional<std::string> > vals;
+    if( db.get_many( keys, vals ) != 2 || !vals[0] || *vals[0] != "five" || vals[1] || !vals[2] )
+        elog( "get_many returned the wrong values." );
+
+    std::vector< std::pair<std::string,std::string> > range;
+    db.read_range( "B", "F", range );
+    if( range.size() != 3 || range[0].first != "Boo" || range[2].first != "Eve" )
+        elog( "read_range returned the wrong entries." );
+
+    if( db.remove_many( keys ) != 2 )
+        elog( "remove_many did not remove the entries found." );
+
+    std::vector<std::string> from;
+    std::vector<std::string> to;
+    from.push_back( "Eve" );
+    to.push_back( "Ida" );
+    if( db.rename_many( from, to ) != 1 || !db.get( "Ida" ) || db.get( "Eve" ) )
+        elog( "rename_many did not move the entry." );
+
+    keyvalue_db<std::string,std::string>::cursor c( db );
+    if( !c.seek( "C" ) || c.key_bytes().size != 5 || c.key() != "Dan" || c.value() != "two" )
+        elog( "cursor did not seek to the right entry." );
+
     db.remove("Hello");
     itr = db.find( "Hello" );
     if( itr.end() )
         slog("Removed %1%", itr.key() );
     else
         elog( "Did not remove %1%", itr.key() );
+}
+
+/**
+ *  Field values around the byte boundaries of the big endian encoding.
+ */
+static std::vector<uint64_t> edge_values()
+{
+    std::vector<uint64_t> v;
+    v.push_back( 0 );
+    v.push_back( 1 );
+    v.push_back( 255 );
+    v.push_back( 256 );
+    v.push_back( 1ull << 32 );
+    v.push_back( uint64_t(-1) );
+    return v;
+}
+
+static bool bytes_less( const std::vector<char>& a, const std::vector<char>& b )
+{
+    int c = memcmp( &a.front(), &b.front(), std::min( a.size(), b.size() ) );
+    return c < 0 || ( c == 0 && a.size() < b.size() );
+}
+
+/**
+ *  The encodings of keys must sort like operator< does.
+ */
+template<typename K>
+static bool check_order( const char* name, const std::vector<K>& keys )
+{
+    std::vector< std::vector<char> > enc( keys.size() );
+    for( uint32_t i = 0; i < keys.size(); ++i )
+        key_encoding<K>::encode( keys[i], enc[i] );
+    for( uint32_t i = 0; i < keys.size(); ++i )
+        for( uint32_t j = 0; j < keys.size(); ++j )
+            if( bytes_less( enc[i], enc[j] ) != (keys[i] < keys[j]) )
+            {
+                elog( "the encoding of %1% keys %2% and %3% does not sort like operator<", name, i, j );
+                return false;
+            }
+    return true;
+}
+
+static bool test_key_order()
+{
+    std::vector<uint64_t>    v = edge_values();
+    std::vector<account_key> accounts;
+    std::vector<holder_key>  holders;
+    std::vector<rank_key>    ranks;
+    std::vector<history_key> history;
+    for( uint32_t a = 0; a < v.size(); ++a )
+        for( uint32_t b = 0; b < v.size(); ++b )
+        {
+            accounts.push_back( account_key( v[a], v[b] ) );
+            holders.push_back( holder_key( v[a], v[b] ) );
+            for( uint32_t c = 0; c < v.size(); ++c )
+            {
+                ranks.push_back( rank_key( v[a], v[b], v[c] ) );
+                history.push_back( history_key( account_key( v[a], v[c] ), v[b], v[c] ) );
+            }
+        }
+    return check_order( "account_key", accounts ) && check_order( "holder_key", holders )
+        && check_order( "rank_key", ranks )       && check_order( "history_key", history );
+}
+
+static int legacy_compare( Db* db, const Dbt* a, const Dbt* b )
+{
+    return keyvalue_db<uint64_t,std::string>::raw_compare( (const char*)a->get_data(), a->get_size(),
+                                                           (const char*)b->get_data(), b->get_size() );
+}
+
+static void put_raw( Db& db, const std::vector<char>& k, const std::string& value )
+{
+    std::vector<char> v;
+    boost::rpc::raw::pack( v, value );
+    Dbt key( (void*)&k.front(), k.size() );
+    Dbt val( &v.front(), v.size() );
+    db.put( NULL, &key, &val, 0 );
+}
+
+/**
+ *  A file with raw keys is moved to the ordered format when it is opened, starting 
+ *  after the position recorded by a move that was interrupted.
+ */
+static bool test_migrate()
+{
+    const char* file  = "kv_db_migrate.db";
+    uint64_t    total = 25000;
+    uint64_t    moved = 10000; // before the interruption
+    boost::filesystem::remove( file );
+    {
+        Db old( NULL, 0 );
+        old.set_bt_compare( &legacy_compare );
+        old.open( NULL, file, "logical_file_name", DB_BTREE, DB_CREATE, 0 );
+        Db ordered( NULL, 0 );
+        ordered.open( NULL, file, "ordered_keys", DB_BTREE, DB_CREATE, 0 );
+        Db pos( NULL, 0 );
+        pos.open( NULL, file, "migrate_position", DB_BTREE, DB_CREATE, 0 );
+        for( uint64_t i = 0; i < total; ++i )
+        {
+            std::vector<char> raw;
+            std::vector<char> enc;
+            boost::rpc::raw::pack( raw, i * 7 );
+            key_encoding<uint64_t>::encode( i * 7, enc );
+            put_raw( old, raw, boost::lexical_cast<std::string>(i) );
+            if( i < moved )
+                put_raw( ordered, enc, boost::lexical_cast<std::string>(i) );
+            if( i == moved - 1 )
+            {
+                Dbt name( (void*)"last", 4 );
+                Dbt at( &raw.front(), raw.size() );
+                pos.put( NULL, &name, &at, 0 );
+            }
+        }
+        pos.close( 0 );
+        ordered.close( 0 );
+        old.close( 0 );
+    }
 
+    {
+        keyvalue_db<uint64_t,std::string> db;
+        db.open( file );
+        uint64_t i = 0;
+        for( keyvalue_db<uint64_t,std::string>::iterator itr = db.begin(); !itr.end(); ++itr, ++i )
+            if( itr.key() != i * 7 || itr.value() != boost::lexical_cast<std::string>(i) )
+            {
+                elog( "migrate() moved the wrong entry at %1%", i );
+                return false;
+            }
+        if( i != total )
+        {
+            elog( "migrate() moved %1% of %2% entries", i, total );
+            return false;
+        }
+    }
+    try {
+        Db old( NULL, 0 );
+        old.open( NULL, file, "logical_file_name", DB_BTREE, 0, 0 );
+        old.close( 0 );
+        elog( "migrate() did not remove the old database" );
+        return false;
+    } catch ( const DbException& e ) {}
+    return true;
+}
+
+int main( int argc, char** argv )
+{
+    if( !test_key_order() || !test_migrate() )
+        return -1;
+    test( "bdb",    "kv_db_test.db" );
+    test( "memory", "kv_db_test" );
+    test( "lsm",    "kv_db_test.lsm" );
     return 0;
 }
@@ -0,0 +1,766 @@
+#include "lsm_engine.hpp"
+#include <gpm/exception.hpp>
+#include <boost/rpc/log/log.hpp>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace gpm { namespace bdb {
+
+/**
+ *  Records in the log and in runs are
+ *
+ *      uint32_t key size, uint32_t value size, key, value
+ *
+ *  in the byte order of the machine.  A removed key has no value and the
+ *  value size removed_size, a clear() in the log has the key size clear_size.
+ */
+static const uint32_t removed_size  = 0xffffffff;
+static const uint32_t clear_size    = 0xffffffff;
+static const uint32_t record_header = 2 * sizeof(uint32_t);
+
+/**
+ *  Runs are written out a buffer of this size at a time.
+ */
+static const uint32_t run_buffer_size = 1024*1024;
+
+static void append_record( std::vector<char>& out, const char* k, uint32_t ks,
+                           const char* v, uint32_t vs, bool removed )
+{
+    uint32_t h[2] = { ks, removed ? removed_size : vs };
+    out.insert( out.end(), (const char*)h, (const char*)h + sizeof(h) );
+    out.insert( out.end(), k, k + ks );
+    if( !removed )
+        out.insert( out.end(), v, v + vs );
+}
+
+/**
+ *  @return the size of the record at d, or 0 if it does not fit in the
+ *          avail bytes that are left
+ */
+static uint64_t parse_record( const char* d, uint64_t avail, uint32_t& ks, uint32_t& vs )
+{
+    if( avail < record_header )
+        return 0;
+    memcpy( &ks, d, sizeof(ks) );
+    memcpy( &vs, d + sizeof(ks), sizeof(vs) );
+    if( ks == clear_size )
+        return record_header;
+    uint64_t s = record_header + uint64_t(ks) + (vs == removed_size ? 0 : vs);
+    return s <= avail ? s : 0;
+}
+
+static void write_all( int fd, const char* d, uint64_t s, const boost::filesystem::path& p )
+{
+    while( s )
+    {
+        ssize_t w = ::write( fd, d, s );
+        if( w < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            THROW_GPM_EXCEPTION( "Error writing %1%: %2%", %p.native_file_string() %strerror(errno) );
+        }
+        d += w;
+        s -= w;
+    }
+}
+
+/**
+ *  Waits until the renames and removes in dir are on disk, they are only
+ *  durable once the directory that holds the names is synced.
+ */
+static void sync_dir( const boost::filesystem::path& dir )
+{
+    int fd = ::open( dir.native_file_string().c_str(), O_RDONLY );
+    if( fd < 0 )
+        THROW_GPM_EXCEPTION( "Error opening directory %1%: %2%", %dir.native_file_string() %strerror(errno) );
+    int r = fsync( fd );
+    int e = errno;
+    ::close( fd );
+    if( r != 0 )
+        THROW_GPM_EXCEPTION( "Error syncing directory %1%: %2%", %dir.native_file_string() %strerror(e) );
+}
+
+static std::string run_name( uint64_t first, uint64_t last )
+{
+    char n[40];
+    snprintf( n, sizeof(n), "%016llx-%016llx", (unsigned long long)first, (unsigned long long)last );
+    return n;
+}
+
+static bool parse_run_name( const std::string& n, uint64_t& first, uint64_t& last )
+{
+    if( n.size() != 33 || n[16] != '-' )
+        return false;
+    char* e;
+    first = strtoull( n.substr( 0, 16 ).c_str(), &e, 16 );
+    if( *e )
+        return false;
+    last = strtoull( n.substr( 17 ).c_str(), &e, 16 );
+    return !*e && first <= last;
+}
+
+/**
+ *  Writes a run to dir under a .tmp name, it only gets its real name once it
+ *  is complete and on disk.  A run that is not finished is removed.
+ */
+class run_writer
+{
+    public:
+        run_writer( const boost::filesystem::path& dir, const std::string& name )
+        :m_dir(dir),m_path(dir/name),m_tmp( m_path.native_file_string() + ".tmp" )
+        {
+            m_fd = ::open( m_tmp.native_file_string().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+            if( m_fd < 0 )
+                THROW_GPM_EXCEPTION( "Error creating %1%: %2%", %m_tmp.native_file_string() %strerror(errno) );
+        }
+        ~run_writer()
+        {
+            if( m_fd < 0 )
+                return;
+            ::close( m_fd );
+            try {
+                boost::filesystem::remove( m_tmp );
+            }
+            catch( const std::exception& e )
+            {
+                wlog( "%1%", boost::diagnostic_information( e ) );
+            }
+        }
+
+        void add( const std::string& k, const std::string& v, bool removed )
+        {
+            append_record( m_buf, k.data(), k.size(), v.data(), v.size(), removed );
+            if( m_buf.size() >= run_buffer_size )
+                write_buffer();
+        }
+
+        void finish()
+        {
+            write_buffer();
+            if( fsync( m_fd ) )
+                THROW_GPM_EXCEPTION( "Error syncing %1%: %2%", %m_tmp.native_file_string() %strerror(errno) );
+            ::close( m_fd );
+            m_fd = -1;
+            boost::filesystem::rename( m_tmp, m_path );
+            sync_dir( m_dir );
+        }
+
+        const boost::filesystem::path& path()const { return m_path; }
+
+    private:
+        void write_buffer()
+        {
+            if( m_buf.size() )
+                write_all( m_fd, &m_buf.front(), m_buf.size(), m_tmp );
+            m_buf.clear();
+        }
+
+        boost::filesystem::path m_dir;
+        boost::filesystem::path m_path;
+        boost::filesystem::path m_tmp;
+        int                     m_fd;
+        std::vector<char>       m_buf;
+};
+
+/**
+ *  Keeps a copy of the entry it is at and finds the next one from its key, so
+ *  it stays valid across writes, flushes and merges.
+ */
+class lsm_cursor : public storage_cursor
+{
+    public:
+        lsm_cursor( lsm_engine* e ):m_engine(e),m_positioned(false){}
+
+        bool seek( const char* k, uint32_t ks )
+        {
+            std::string s( k, ks );
+            return moved( m_engine->move( &s, true, true, m_key, m_value ) );
+        }
+        bool find( const char* k, uint32_t ks )
+        {
+            std::string s( k, ks );
+            std::string v;
+            if( m_engine->lookup( s, v ) <= 0 )
+                return false;
+            m_key.swap( s );
+            m_value.swap( v );
+            return moved( true );
+        }
+        bool next() { return moved( m_engine->move( m_positioned ? &m_key : NULL, false, true,  m_key, m_value ) ); }
+        bool prev() { return moved( m_engine->move( m_positioned ? &m_key : NULL, false, false, m_key, m_value ) ); }
+
+        const char* key( uint32_t& s )const   { s = m_key.size();   return m_key.data();   }
+        const char* value( uint32_t& s )const { s = m_value.size(); return m_value.data(); }
+
+        void put( const char* v, uint32_t vs )
+        {
+            m_value.assign( v, vs );
+            m_engine->put( m_key.data(), m_key.size(), v, vs );
+        }
+        void remove() { m_engine->remove( m_key.data(), m_key.size() ); }
+
+        storage_cursor* clone()const { return new lsm_cursor( *this ); }
+
+    private:
+        bool moved( bool ok )
+        {
+            m_positioned = m_positioned || ok;
+            return ok;
+        }
+
+        lsm_engine*  m_engine;
+        bool         m_positioned;
+        std::string  m_key;
+        std::string  m_value;
+};
+
+
+lsm_engine::run::~run()
+{
+    if( data )
+        munmap( (void*)data, size );
+}
+
+const char* lsm_engine::run::key( uint32_t i, uint32_t& ks )const
+{
+    const char* d = data + records[i];
+    memcpy( &ks, d, sizeof(ks) );
+    return d + record_header;
+}
+
+bool lsm_engine::run::value( uint32_t i, const char*& v, uint32_t& vs )const
+{
+    const char* d = data + records[i];
+    uint32_t    ks;
+    memcpy( &ks, d, sizeof(ks) );
+    memcpy( &vs, d + sizeof(ks), sizeof(vs) );
+    if( vs == removed_size )
+        return false;
+    v = d + record_header + ks;
+    return true;
+}
+
+
+lsm_engine::lsm_engine( uint64_t memtable_size, uint32_t max_runs )
+:m_memtable_size(memtable_size),m_max_runs(max_runs),m_log(-1),m_map_bytes(0),m_next_run(0)
+{
+}
+
+lsm_engine::~lsm_engine()
+{
+    if( m_log < 0 )
+        return;
+    try {
+        write_log();
+    }
+    catch( const std::exception& e )
+    {
+        elog( "%1%", boost::diagnostic_information( e ) );
+    }
+    ::close( m_log );
+}
+
+/**
+ *  Loads the runs, removes what an interrupted flush or merge left behind and
+ *  replays the log.
+ */
+void lsm_engine::open( const boost::filesystem::path& p, const engine_options& o )
+{
+    namespace bfs = boost::filesystem;
+    m_dir     = p;
+    m_compare = o.compare;
+    m_map     = map_type( key_less( o.compare ) );
+    if( !bfs::exists( p ) )
+        bfs::create_directories( p );
+
+    std::vector<uint64_t>  first;
+    std::vector<uint64_t>  last;
+    std::vector<bfs::path> paths;
+    bfs::directory_iterator end;
+    for( bfs::directory_iterator i( p ); i != end; ++i )
+    {
+        std::string n = i->path().filename();
+        uint64_t    f, l;
+        if( n.size() > 4 && n.substr( n.size() - 4 ) == ".tmp" )
+            bfs::remove( i->path() );
+        else if( parse_run_name( n, f, l ) )
+        {
+            first.push_back( f );
+            last.push_back( l );
+            paths.push_back( i->path() );
+        }
+    }
+
+    m_runs.clear();
+    m_next_run = 0;
+    for( uint32_t i = 0; i < paths.size(); ++i )
+    {
+        bool covered = false;
+        for( uint32_t j = 0; j < paths.size() && !covered; ++j )
+            covered = j != i && first[j] <= first[i] && last[i] <= last[j] &&
+                      (first[j] != first[i] || last[j] != last[i]);
+        if( covered )
+        {
+            bfs::remove( paths[i] );
+            continue;
+        }
+        m_runs.push_back( load_run( paths[i], first[i], last[i] ) );
+        m_next_run = std::max( m_next_run, last[i] + 1 );
+    }
+    std::sort( m_runs.begin(), m_runs.end(), run_before );
+
+    bfs::path lp = p / "log";
+    m_log = ::open( lp.native_file_string().c_str(), O_RDWR | O_CREAT | O_APPEND, 0644 );
+    if( m_log < 0 )
+        THROW_GPM_EXCEPTION( "Error opening %1%: %2%", %lp.native_file_string() %strerror(errno) );
+    replay_log();
+}
+
+bool lsm_engine::run_before( const run_ptr& a, const run_ptr& b )
+{
+    return a->first < b->first;
+}
+
+/**
+ *  A record that was only partly written when the process stopped is cut off.
+ */
+void lsm_engine::replay_log()
+{
+    struct stat st;
+    if( fstat( m_log, &st ) )
+        THROW_GPM_EXCEPTION( "Error reading the log of %1%: %2%", %m_dir.native_file_string() %strerror(errno) );
+
+    std::vector<char> buf( st.st_size );
+    uint64_t          read = 0;
+    while( read < buf.size() )
+    {
+        ssize_t r = pread( m_log, &buf.front() + read, buf.size() - read, read );
+        if( r < 0 && errno == EINTR )
+            continue;
+        if( r <= 0 )
+            THROW_GPM_EXCEPTION( "Error reading the log of %1%: %2%", %m_dir.native_file_string() %strerror(errno) );
+        read += r;
+    }
+
+    uint64_t off = 0;
+    while( off < buf.size() )
+    {
+        uint32_t    ks, vs;
+        const char* d = &buf.front() + off;
+        uint64_t    s = parse_record( d, buf.size() - off, ks, vs );
+        if( !s )
+            break;
+        if( ks == clear_size )
+        {
+            drop_runs();
+            m_map.clear();
+            m_map_bytes = 0;
+        }
+        else
+            apply( std::string( d + record_header, ks ), d + record_header + ks, vs, vs == removed_size );
+        off += s;
+    }
+    if( off < buf.size() )
+    {
+        wlog( "dropping %1% bytes of an unfinished write at the end of the log of %2%",
+              (buf.size() - off), m_dir.native_file_string() );
+        if( ftruncate( m_log, off ) )
+            THROW_GPM_EXCEPTION( "Error truncating the log of %1%: %2%", %m_dir.native_file_string() %strerror(errno) );
+    }
+    if( m_map_bytes >= m_memtable_size )
+        flush();
+}
+
+lsm_engine::run_ptr lsm_engine::load_run( const boost::filesystem::path& p, uint64_t first, uint64_t last )
+{
+    run_ptr r( new run() );
+    r->first = first;
+    r->last  = last;
+    r->path  = p;
+
+    int fd = ::open( p.native_file_string().c_str(), O_RDONLY );
+    if( fd < 0 )
+        THROW_GPM_EXCEPTION( "Error opening %1%: %2%", %p.native_file_string() %strerror(errno) );
+    struct stat st;
+    if( fstat( fd, &st ) )
+    {
+        ::close( fd );
+        THROW_GPM_EXCEPTION( "Error opening %1%: %2%", %p.native_file_string() %strerror(errno) );
+    }
+    r->size = st.st_size;
+    if( r->size )
+    {
+        void* d = mmap( NULL, r->size, PROT_READ, MAP_SHARED, fd, 0 );
+        if( d == MAP_FAILED )
+        {
+            ::close( fd );
+            THROW_GPM_EXCEPTION( "Error mapping %1%: %2%", %p.native_file_string() %strerror(errno) );
+        }
+        r->data = (const char*)d;
+    }
+    ::close( fd );
+
+    uint64_t s;
+    for( uint64_t off = 0; off < r->size; off += s )
+    {
+        uint32_t ks, vs;
+        s = parse_record( r->data + off, r->size - off, ks, vs );
+        if( !s || ks == clear_size )
+            THROW_GPM_EXCEPTION( "Run %1% is corrupt at byte %2%", %p.native_file_string() %off );
+        r->records.push_back( off );
+    }
+    return r;
+}
+
+/**
+ *  The removes are on disk before the log that held the clear is truncated.
+ */
+void lsm_engine::drop_runs()
+{
+    if( m_runs.empty() )
+        return;
+    for( uint32_t i = 0; i < m_runs.size(); ++i )
+        boost::filesystem::remove( m_runs[i]->path );
+    m_runs.clear();
+    sync_dir( m_dir );
+}
+
+int lsm_engine::compare( const char* a, uint32_t as, const std::string& b )const
+{
+    return compare_keys( m_compare, a, as, b.data(), b.size() );
+}
+
+uint32_t lsm_engine::lower_bound( const run& r, const std::string& k )const
+{
+    uint32_t lo = 0;
+    uint32_t hi = r.count();
+    while( lo < hi )
+    {
+        uint32_t    mid = lo + (hi - lo) / 2;
+        uint32_t    ks;
+        const char* kd  = r.key( mid, ks );
+        if( compare( kd, ks, k ) < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+uint32_t lsm_engine::upper_bound( const run& r, const std::string& k )const
+{
+    uint32_t lo = 0;
+    uint32_t hi = r.count();
+    while( lo < hi )
+    {
+        uint32_t    mid = lo + (hi - lo) / 2;
+        uint32_t    ks;
+        const char* kd  = r.key( mid, ks );
+        if( compare( kd, ks, k ) <= 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int lsm_engine::lookup( const std::string& k, std::string& v )const
+{
+    map_type::const_iterator i = m_map.find( k );
+    if( i != m_map.end() )
+    {
+        if( i->second.removed )
+            return -1;
+        v = i->second.value;
+        return 1;
+    }
+    for( int r = int(m_runs.size()) - 1; r >= 0; --r )
+    {
+        const run& rn = *m_runs[r];
+        uint32_t   x  = lower_bound( rn, k );
+        if( x == rn.count() )
+            continue;
+        uint32_t    ks;
+        const char* kd = rn.key( x, ks );
+        if( compare( kd, ks, k ) == 0 )
+        {
+            const char* vd;
+            uint32_t    vs;
+            if( !rn.value( x, vd, vs ) )
+                return -1;
+            v.assign( vd, vs );
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ *  Takes the closest key of the map and of every run and skips the keys
+ *  whose newest entry is a tombstone.
+ */
+bool lsm_engine::move( const std::string* from, bool inclusive, bool forward,
+                       std::string& key, std::string& value )const
+{
+    bool        start = from == NULL;
+    std::string cur;
+    if( from )
+        cur = *from;
+
+    while( true )
+    {
+        bool        found = false;
+        std::string best;
+
+        map_type::const_iterator m;
+        if( forward )
+        {
+            m = start ? m_map.begin() : (inclusive ? m_map.lower_bound( cur ) : m_map.upper_bound( cur ));
+            if( m != m_map.end() )
+            {
+                best  = m->first;
+                found = true;
+            }
+        }
+        else
+        {
+            m = start ? m_map.end() : m_map.lower_bound( cur );
+            if( m != m_map.begin() )
+            {
+                best  = (--m)->first;
+                found = true;
+            }
+        }
+
+        for( uint32_t r = 0; r < m_runs.size(); ++r )
+        {
+            const run& rn = *m_runs[r];
+            uint32_t   x;
+            if( forward )
+            {
+                x = start ? 0 : (inclusive ? lower_bound( rn, cur ) : upper_bound( rn, cur ));
+                if( x >= rn.count() )
+                    continue;
+            }
+            else
+            {
+                x = start ? rn.count() : lower_bound( rn, cur );
+                if( x == 0 )
+                    continue;
+                --x;
+            }
+            uint32_t    ks;
+            const char* k = rn.key( x, ks );
+            if( !found || (forward ? compare( k, ks, best ) < 0 : compare( k, ks, best ) > 0) )
+            {
+                best.assign( k, ks );
+                found = true;
+            }
+        }
+
+        if( !found )
+            return false;
+        if( lookup( best, value ) > 0 )
+        {
+            key = best;
+            return true;
+        }
+        cur.swap( best );
+        start     = false;
+        inclusive = false;
+    }
+}
+
+/**
+ *  An entry that replaces one already in the map only adds the difference.
+ */
+void lsm_engine::apply( const std::string& k, const char* v, uint32_t vs, bool removed )
+{
+    std::pair<map_type::iterator,bool> r = m_map.insert( std::make_pair( k, entry() ) );
+    entry& e = r.first->second;
+    if( !r.second )
+        m_map_bytes -= record_header + k.size() + e.value.size();
+    e.removed = removed;
+    if( removed )
+        e.value.clear();
+    else
+        e.value.assign( v, vs );
+    m_map_bytes += record_header + k.size() + e.value.size();
+}
+
+void lsm_engine::write( const char* k, uint32_t ks, const char* v, uint32_t vs, bool removed )
+{
+    append_record( m_pending, k, ks, v, vs, removed );
+    apply( std::string( k, ks ), v, vs, removed );
+}
+
+void lsm_engine::write_log()
+{
+    if( m_pending.empty() )
+        return;
+    write_all( m_log, &m_pending.front(), m_pending.size(), m_dir / "log" );
+    m_pending.clear();
+}
+
+void lsm_engine::end_write()
+{
+    write_log();
+    if( m_map_bytes >= m_memtable_size )
+        flush();
+}
+
+bool lsm_engine::get( const char* k, uint32_t ks, std::vector<char>& v )
+{
+    std::string s;
+    if( lookup( std::string( k, ks ), s ) <= 0 )
+        return false;
+    v.assign( s.begin(), s.end() );
+    return true;
+}
+
+void lsm_engine::put( const char* k, uint32_t ks, const char* v, uint32_t vs )
+{
+    write( k, ks, v, vs, false );
+    end_write();
+}
+
+void lsm_engine::put_many( const byte_list& kv )
+{
+    for( uint32_t i = 0; i + 1 < kv.size(); i += 2 )
+        write( kv.data(i), kv.length(i), kv.data(i+1), kv.length(i+1), false );
+    end_write();
+}
+
+bool lsm_engine::remove( const char* k, uint32_t ks )
+{
+    std::string v;
+    if( lookup( std::string( k, ks ), v ) <= 0 )
+        return false;
+    write( k, ks, NULL, 0, true );
+    end_write();
+    return true;
+}
+
+uint32_t lsm_engine::write_batch( const byte_list& kv, const byte_list& keys )
+{
+    for( uint32_t i = 0; i + 1 < kv.size(); i += 2 )
+        write( kv.data(i), kv.length(i), kv.data(i+1), kv.length(i+1), false );
+
+    uint32_t    n = 0;
+    std::string v;
+    for( uint32_t i = 0; i < keys.size(); ++i )
+    {
+        if( lookup( std::string( keys.data(i), keys.length(i) ), v ) <= 0 )
+            continue;
+        write( keys.data(i), keys.length(i), NULL, 0, true );
+        ++n;
+    }
+    end_write();
+    return n;
+}
+
+/**
+ *  The clear is on disk before the first run is removed, so a crash in between
+ *  finishes the clear when the log is replayed.
+ */
+void lsm_engine::clear()
+{
+    uint32_t h[2] = { clear_size, 0 };
+    m_pending.insert( m_pending.end(), (const char*)h, (const char*)h + sizeof(h) );
+    write_log();
+    if( fsync( m_log ) )
+        THROW_GPM_EXCEPTION( "Error syncing the log of %1%: %2%", %m_dir.native_file_string() %strerror(errno) );
+    drop_runs();
+    m_map.clear();
+    m_map_bytes = 0;
+    if( ftruncate( m_log, 0 ) )
+        THROW_GPM_EXCEPTION( "Error truncating the log of %1%: %2%", %m_dir.native_file_string() %strerror(errno) );
+}
+
+/**
+ *  Writes the map out as a new run and starts the log over.  Tombstones are
+ *  only written if an older run may still hold the key.
+ */
+void lsm_engine::flush()
+{
+    if( m_map.empty() )
+        return;
+    write_log();
+
+    uint64_t n = m_next_run++;
+    run_writer w( m_dir, run_name( n, n ) );
+    for( map_type::const_iterator i = m_map.begin(); i != m_map.end(); ++i )
+    {
+        if( i->second.removed && m_runs.empty() )
+            continue;
+        w.add( i->first, i->second.value, i->second.removed );
+    }
+    w.finish();
+    m_runs.push_back( load_run( w.path(), n, n ) );
+
+    m_map.clear();
+    m_map_bytes = 0;
+    if( ftruncate( m_log, 0 ) )
+        THROW_GPM_EXCEPTION( "Error truncating the log of %1%: %2%", %m_dir.native_file_string() %strerror(errno) );
+
+    if( m_runs.size() > std::max( m_max_runs, 1u ) )
+        merge();
+}
+
+/**
+ *  Merges every run into one, which is only called right after a flush so the
+ *  map is empty and tombstones can be left out.  The old runs are removed
+ *  once the new one has its name, open() removes any that a crash left.
+ */
+void lsm_engine::merge()
+{
+    uint64_t first = m_runs.front()->first;
+    uint64_t last  = m_runs.back()->last;
+    run_writer  w( m_dir, run_name( first, last ) );
+    std::string k;
+    std::string v;
+    for( bool ok = move( NULL, false, true, k, v ); ok; ok = move( &k, false, true, k, v ) )
+        w.add( k, v, false );
+    w.finish();
+
+    std::vector<run_ptr> old;
+    old.swap( m_runs );
+    m_runs.push_back( load_run( w.path(), first, last ) );
+    for( uint32_t i = 0; i < old.size(); ++i )
+        boost::filesystem::remove( old[i]->path );
+    sync_dir( m_dir );
+}
+
+storage_cursor* lsm_engine::cursor()
+{
+    return new lsm_cursor( this );
+}
+
+db_stats lsm_engine::stats( bool )
+{
+    db_stats s;
+    s.name  = m_dir.native_file_string();
+    s.keys  = m_map.size();
+    s.pages = m_runs.size();
+    for( uint32_t i = 0; i < m_runs.size(); ++i )
+        s.keys += m_runs[i]->count();
+    return s;
+}
+
+void lsm_engine::sync()
+{
+    write_log();
+    if( fsync( m_log ) )
+        THROW_GPM_EXCEPTION( "Error syncing the log of %1%: %2%", %m_dir.native_file_string() %strerror(errno) );
+}
+
+} } // namespace gpm::bdb
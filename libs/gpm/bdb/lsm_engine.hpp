@@ -0,0 +1,133 @@
+#ifndef _GPM_BDB_LSM_ENGINE_HPP_
+#define _GPM_BDB_LSM_ENGINE_HPP_
+#include <gpm/bdb/storage_engine.hpp>
+#include <boost/shared_ptr.hpp>
+#include <map>
+
+namespace gpm { namespace bdb {
+
+/**
+ *  @class lsm_engine
+ *  @brief Log structured merge tree, writes are appended and sorted later.
+ *
+ *  Writes are appended to a log and kept in a sorted map.  Once the map holds
+ *  memtable_size bytes it is written out as a run, a sorted file that never
+ *  changes again and is memory mapped for reads, and the log is started over.
+ *  When there are more than max_runs runs they are merged into one.  Lookups
+ *  check the map and then the runs from the newest to the oldest, a removed
+ *  key is kept as a tombstone until all runs are merged.
+ *
+ *  Files in the directory:
+ *
+ *      log            - the writes that are not in a run yet
+ *      <first>-<last> - a run with the writes of runs first to last (hex)
+ *
+ *  Runs are written under a .tmp name and renamed when they are complete.  A
+ *  run that is covered by another one was left by an interrupted merge and
+ *  is removed by open().  A clear() is logged before any run is removed.
+ *
+ *  Writes reach the operating system before each call returns and sync()
+ *  waits until they are on disk.  The engine is not part of the groups of an
+ *  environment and may only be used by one thread at a time.  Cursors keep
+ *  the key they are at, so writes made while they are open never invalidate
+ *  them.
+ */
+class lsm_engine : public storage_engine
+{
+    public:
+        lsm_engine( uint64_t memtable_size = 4*1024*1024, uint32_t max_runs = 4 );
+        ~lsm_engine();
+
+        /// p is the directory that holds the log and the runs
+        void     open( const boost::filesystem::path& p, const engine_options& o );
+        bool     get( const char* k, uint32_t ks, std::vector<char>& v );
+        void     put( const char* k, uint32_t ks, const char* v, uint32_t vs );
+        bool     remove( const char* k, uint32_t ks );
+        void     clear();
+
+        /// appends all of kv to the log with one write
+        void     put_many( const byte_list& kv );
+        /// the puts and the removes are appended to the log with one write
+        uint32_t write_batch( const byte_list& kv, const byte_list& keys );
+
+        storage_cursor* cursor();
+
+        /// keys counts shadowed entries as well, pages is the number of runs
+        db_stats stats( bool exact );
+        void     sync();
+
+    private:
+        lsm_engine( const lsm_engine& );
+        lsm_engine& operator=( const lsm_engine& );
+
+        friend class lsm_cursor;
+
+        struct entry
+        {
+            entry():removed(false){}
+            std::string value;
+            bool        removed;
+        };
+        typedef std::map<std::string,entry,key_less> map_type;
+
+        struct run
+        {
+            run():first(0),last(0),data(0),size(0){}
+            ~run();
+
+            uint64_t               first;
+            uint64_t               last;
+            const char*            data;
+            uint64_t               size;
+            std::vector<uint64_t>  records;  // offset of each record
+            boost::filesystem::path path;
+
+            uint32_t    count()const { return records.size(); }
+            const char* key( uint32_t i, uint32_t& ks )const;
+            bool        value( uint32_t i, const char*& v, uint32_t& vs )const;
+        };
+        typedef boost::shared_ptr<run> run_ptr;
+        static bool run_before( const run_ptr& a, const run_ptr& b );
+
+        /// index of the first record of r at or after k
+        uint32_t    lower_bound( const run& r, const std::string& k )const;
+        uint32_t    upper_bound( const run& r, const std::string& k )const;
+        int         compare( const char* a, uint32_t as, const std::string& b )const;
+
+        /**
+         *  @return 1 if k has a value, -1 if it was removed and 0 if it was never written
+         */
+        int         lookup( const std::string& k, std::string& v )const;
+
+        /**
+         *  Moves to the first key after from, or at it if inclusive, or to the last key
+         *  before it.  Starts at the first or last key if from is NULL.
+         */
+        bool        move( const std::string* from, bool inclusive, bool forward,
+                          std::string& key, std::string& value )const;
+
+        /// adds a record to the log and the map, end_write() writes the log
+        void        write( const char* k, uint32_t ks, const char* v, uint32_t vs, bool removed );
+        void        apply( const std::string& k, const char* v, uint32_t vs, bool removed );
+        void        end_write();
+        void        write_log();
+        void        replay_log();
+        void        flush();
+        void        merge();
+        run_ptr     load_run( const boost::filesystem::path& p, uint64_t first, uint64_t last );
+        void        drop_runs();
+
+        uint64_t                 m_memtable_size;
+        uint32_t                 m_max_runs;
+        boost::filesystem::path  m_dir;
+        int                      m_log;
+        std::vector<char>        m_pending;   // log records not yet written
+        map_type                 m_map;
+        uint64_t                 m_map_bytes;
+        std::vector<run_ptr>     m_runs;      // oldest first
+        uint64_t                 m_next_run;
+};
+
+} } // namespace gpm::bdb
+
+#endif
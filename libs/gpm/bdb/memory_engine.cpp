@@ -0,0 +1,113 @@
+#include "memory_engine.hpp"
+
+namespace gpm { namespace bdb {
+
+/**
+ *  Every move looks up the key of the current entry again.
+ */
+class memory_cursor : public storage_cursor
+{
+    public:
+        memory_cursor( memory_engine* e ):m_engine(e),m_positioned(false){}
+
+        bool seek( const char* k, uint32_t ks )
+        {
+            return load( m_engine->m_map.lower_bound( std::string( k, ks ) ) );
+        }
+        bool find( const char* k, uint32_t ks )
+        {
+            return load( m_engine->m_map.find( std::string( k, ks ) ) );
+        }
+        bool next()
+        {
+            memory_engine::map_type& m = m_engine->m_map;
+            return load( m_positioned ? m.upper_bound( m_key ) : m.begin() );
+        }
+        bool prev()
+        {
+            memory_engine::map_type& m = m_engine->m_map;
+            memory_engine::map_type::iterator i = m_positioned ? m.lower_bound( m_key ) : m.end();
+            if( i == m.begin() )
+                return false;
+            return load( --i );
+        }
+
+        const char* key( uint32_t& s )const   { s = m_key.size();   return m_key.data();   }
+        const char* value( uint32_t& s )const { s = m_value.size(); return m_value.data(); }
+
+        void put( const char* v, uint32_t vs )
+        {
+            m_value.assign( v, vs );
+            m_engine->m_map[m_key] = m_value;
+        }
+        void remove() { m_engine->m_map.erase( m_key ); }
+
+        storage_cursor* clone()const { return new memory_cursor( *this ); }
+
+    private:
+        bool load( memory_engine::map_type::iterator i )
+        {
+            if( i == m_engine->m_map.end() )
+                return false;
+            m_key        = i->first;
+            m_value      = i->second;
+            m_positioned = true;
+            return true;
+        }
+
+        memory_engine* m_engine;
+        bool           m_positioned;
+        std::string    m_key;
+        std::string    m_value;
+};
+
+
+memory_engine::memory_engine()
+{
+}
+
+void memory_engine::open( const boost::filesystem::path& p, const engine_options& o )
+{
+    m_name    = p.native_file_string();
+    m_compare = o.compare;
+    m_map     = map_type( key_less( o.compare ) );
+}
+
+bool memory_engine::get( const char* k, uint32_t ks, std::vector<char>& v )
+{
+    map_type::const_iterator i = m_map.find( std::string( k, ks ) );
+    if( i == m_map.end() )
+        return false;
+    v.assign( i->second.begin(), i->second.end() );
+    return true;
+}
+
+void memory_engine::put( const char* k, uint32_t ks, const char* v, uint32_t vs )
+{
+    m_map[std::string( k, ks )].assign( v, vs );
+}
+
+bool memory_engine::remove( const char* k, uint32_t ks )
+{
+    return m_map.erase( std::string( k, ks ) ) != 0;
+}
+
+void memory_engine::clear()
+{
+    m_map.clear();
+}
+
+storage_cursor* memory_engine::cursor()
+{
+    return new memory_cursor( this );
+}
+
+db_stats memory_engine::stats( bool )
+{
+    db_stats s;
+    s.name = m_name;
+    s.keys = m_map.size();
+    return s;
+}
+
+} } // namespace gpm::bdb
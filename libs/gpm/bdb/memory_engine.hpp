@@ -0,0 +1,42 @@
+#ifndef _GPM_BDB_MEMORY_ENGINE_HPP_
+#define _GPM_BDB_MEMORY_ENGINE_HPP_
+#include <gpm/bdb/storage_engine.hpp>
+#include <map>
+
+namespace gpm { namespace bdb {
+
+/**
+ *  @class memory_engine
+ *  @brief Keeps the entries in a std::map, nothing is written to disk.
+ *
+ *  Used by tests and by nodes that rebuild their state every time they start.
+ *  Cursors remember the key they are at rather than a map iterator, so writes
+ *  made while they are open never invalidate them.
+ */
+class memory_engine : public storage_engine
+{
+    public:
+        memory_engine();
+
+        void     open( const boost::filesystem::path& p, const engine_options& o );
+        bool     get( const char* k, uint32_t ks, std::vector<char>& v );
+        void     put( const char* k, uint32_t ks, const char* v, uint32_t vs );
+        bool     remove( const char* k, uint32_t ks );
+        void     clear();
+
+        storage_cursor* cursor();
+        db_stats stats( bool exact );
+        void     sync() {}
+
+    private:
+        friend class memory_cursor;
+
+        typedef std::map<std::string,std::string,key_less> map_type;
+
+        map_type     m_map;
+        std::string  m_name;
+};
+
+} } // namespace gpm::bdb
+
+#endif
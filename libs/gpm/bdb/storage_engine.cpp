@@ -0,0 +1,102 @@
+#include "storage_engine.hpp"
+#include "bdb_engine.hpp"
+#include "memory_engine.hpp"
+#include "lsm_engine.hpp"
+#include <gpm/exception.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <algorithm>
+#include <string.h>
+
+namespace gpm { namespace bdb {
+
+int compare_keys( key_compare c, const char* a, uint32_t as, const char* b, uint32_t bs )
+{
+    if( c )
+        return c( a, as, b, bs );
+    int r = memcmp( a, b, std::min( as, bs ) );
+    if( r )
+        return r;
+    return as < bs ? -1 : (as > bs ? 1 : 0);
+}
+
+storage_engine::ptr storage_engine::create( type t )
+{
+    switch( t )
+    {
+        case berkeley_db: return ptr( new bdb_engine() );
+        case memory:      return ptr( new memory_engine() );
+        case lsm:         return ptr( new lsm_engine() );
+    }
+    THROW_GPM_EXCEPTION( "Unknown storage engine %1%", %int(t) );
+}
+
+storage_engine::type storage_engine::parse_type( const std::string& name )
+{
+    if( name == "bdb" )    return berkeley_db;
+    if( name == "memory" ) return memory;
+    if( name == "lsm" )    return lsm;
+    THROW_GPM_EXCEPTION( "Unknown storage engine '%1%', expected bdb, memory or lsm", %name );
+}
+
+void storage_engine::put_many( const byte_list& kv )
+{
+    for( uint32_t i = 0; i + 1 < kv.size(); i += 2 )
+        put( kv.data(i), kv.length(i), kv.data(i+1), kv.length(i+1) );
+}
+
+uint32_t storage_engine::get_many( const byte_list& keys, byte_list& vals, std::vector<bool>& found )
+{
+    uint32_t          n = 0;
+    std::vector<char> v;
+    found.resize( keys.size() );
+    for( uint32_t i = 0; i < keys.size(); ++i )
+    {
+        found[i] = get( keys.data(i), keys.length(i), v );
+        if( found[i] )
+        {
+            vals.bytes().insert( vals.bytes().end(), v.begin(), v.end() );
+            ++n;
+        }
+        vals.close();
+    }
+    return n;
+}
+
+uint32_t storage_engine::remove_many( const byte_list& keys )
+{
+    uint32_t n = 0;
+    for( uint32_t i = 0; i < keys.size(); ++i )
+        n += remove( keys.data(i), keys.length(i) );
+    return n;
+}
+
+/**
+ *  Engines that are not written in the groups of an environment have to
+ *  override this to write both parts together.
+ */
+uint32_t storage_engine::write_batch( const byte_list& kv, const byte_list& keys )
+{
+    put_many( kv );
+    return remove_many( keys );
+}
+
+uint32_t storage_engine::read_range( const char* first, uint32_t fs, const char* last, uint32_t ls,
+                                     byte_list& kv )
+{
+    uint32_t n = 0;
+    boost::scoped_ptr<storage_cursor> c( cursor() );
+    for( bool ok = c->seek( first, fs ); ok; ok = c->next() )
+    {
+        uint32_t    ks, vs;
+        const char* k = c->key( ks );
+        if( compare_keys( m_compare, k, ks, last, ls ) >= 0 )
+            break;
+        const char* v = c->value( vs );
+        kv.push_back( k, ks );
+        kv.push_back( v, vs );
+        ++n;
+    }
+    return n;
+}
+
+} } // namespace gpm::bdb
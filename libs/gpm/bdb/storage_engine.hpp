@@ -0,0 +1,222 @@
+#ifndef _GPM_BDB_STORAGE_ENGINE_HPP_
+#define _GPM_BDB_STORAGE_ENGINE_HPP_
+#include <gpm/bdb/environment.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace gpm { namespace bdb {
+
+/**
+ *  Orders two keys like memcmp does, engines use memcmp if it is NULL.
+ */
+typedef int  (*key_compare)( const char* a, uint32_t as, const char* b, uint32_t bs );
+
+/**
+ *  Appends the encoded form of the raw key in d to out.
+ */
+typedef void (*key_recode)( const char* d, uint32_t s, std::vector<char>& out );
+
+/**
+ *  @return <0, 0 or >0 as a is ordered before, with or after b
+ */
+int compare_keys( key_compare c, const char* a, uint32_t as, const char* b, uint32_t bs );
+
+/**
+ *  Orders std::strings of key bytes for the maps of the engines.
+ */
+struct key_less
+{
+    key_less( key_compare c = NULL ):compare(c){}
+
+    bool operator()( const std::string& a, const std::string& b )const
+    {
+        return compare_keys( compare, a.data(), a.size(), b.data(), b.size() ) < 0;
+    }
+    key_compare compare;
+};
+
+/**
+ *  Bytes that belong to an engine or a cursor, valid until they are changed
+ *  by the owner.
+ */
+struct byte_view
+{
+    byte_view( const char* d = "", uint32_t s = 0 ):data(d),size(s){}
+
+    bool        empty()const { return size == 0; }
+    std::string str()const   { return std::string( data, size ); }
+
+    const char* data;
+    uint32_t    size;
+};
+
+/**
+ *  Byte strings stored back to back, the bulk operations take their keys and
+ *  values in one of these so that each of them does not need an allocation.
+ */
+class byte_list
+{
+    public:
+        byte_list():m_offset(1,0){}
+
+        uint32_t    size()const               { return m_offset.size() - 1; }
+        bool        empty()const              { return size() == 0; }
+        const char* data( uint32_t i )const   { return m_bytes.empty() ? "" : &m_bytes.front() + m_offset[i]; }
+        uint32_t    length( uint32_t i )const { return m_offset[i+1] - m_offset[i]; }
+
+        /// the item being added is appended here and ended with close()
+        std::vector<char>& bytes()            { return m_bytes; }
+        void        close()                   { m_offset.push_back( m_bytes.size() ); }
+
+        void        push_back( const char* d, uint32_t s )
+        {
+            m_bytes.insert( m_bytes.end(), d, d + s );
+            close();
+        }
+        void        clear()
+        {
+            m_bytes.clear();
+            m_offset.resize(1);
+        }
+
+    private:
+        std::vector<char>      m_bytes;
+        std::vector<uint32_t>  m_offset;
+};
+
+/**
+ *  How a storage_engine is opened, the Berkeley DB options are ignored by the
+ *  other engines.
+ */
+struct engine_options
+{
+    engine_options():env(NULL),compare(NULL),legacy_compare(NULL),recode(NULL){}
+
+    environment*  env;            // the environment to open in, NULL for a file of its own
+    std::string   password;       // encrypts a database that is not in an environment
+    key_compare   compare;        // NULL if the keys are ordered by memcmp
+    key_compare   legacy_compare; // orders the raw keys of files from before keys were encoded
+    key_recode    recode;         // encodes those keys, NULL if there are none to convert
+};
+
+/**
+ *  @class storage_cursor
+ *  @brief A position among the entries of a storage_engine.
+ *
+ *  A cursor that was never positioned moves to the first entry with next() and
+ *  to the last one with prev().  A move that fails leaves the cursor where it was.
+ */
+class storage_cursor
+{
+    public:
+        virtual ~storage_cursor(){}
+
+        /// moves to the first entry at or after k
+        virtual bool  seek( const char* k, uint32_t ks ) = 0;
+        /// moves to k if it is there
+        virtual bool  find( const char* k, uint32_t ks ) = 0;
+        virtual bool  next() = 0;
+        virtual bool  prev() = 0;
+
+        /// the entry the cursor was last moved to
+        virtual const char* key( uint32_t& s )const = 0;
+        virtual const char* value( uint32_t& s )const = 0;
+
+        /// replaces the value of the entry at the cursor
+        virtual void  put( const char* v, uint32_t vs ) = 0;
+        virtual void  remove() = 0;
+
+        /// a new cursor at the same position
+        virtual storage_cursor* clone()const = 0;
+};
+
+/**
+ *  @class storage_engine
+ *  @brief Ordered map of byte strings that a keyvalue_db stores its entries in.
+ *
+ *  The keyvalue_db encodes keys and values, engines only see bytes and order
+ *  them by memcmp unless the options give a comparison.
+ *
+ *  berkeley_db - a btree in a Berkeley DB file, written in the groups of the
+ *                environment it is opened in
+ *  memory      - a std::map that is lost on close, for tests
+ *  lsm         - a log structured merge tree for databases that are mostly
+ *                written, see lsm_engine
+ *
+ *  The bulk operations have defaults that loop over the single ones.
+ */
+class storage_engine
+{
+    public:
+        typedef boost::shared_ptr<storage_engine> ptr;
+        enum type { berkeley_db, memory, lsm };
+
+        storage_engine():m_compare(NULL){}
+        virtual ~storage_engine(){}
+
+        static ptr  create( type t );
+
+        /// "bdb", "memory" or "lsm"
+        static type parse_type( const std::string& name );
+
+        virtual void     open( const boost::filesystem::path& p, const engine_options& o ) = 0;
+
+        /// @return false if k was not found
+        virtual bool     get( const char* k, uint32_t ks, std::vector<char>& v ) = 0;
+        virtual void     put( const char* k, uint32_t ks, const char* v, uint32_t vs ) = 0;
+        /// @return false if k was not found
+        virtual bool     remove( const char* k, uint32_t ks ) = 0;
+        virtual void     clear() = 0;
+
+        /// kv holds every key followed by its value
+        virtual void     put_many( const byte_list& kv );
+
+        /**
+         *  Looks up the keys in the order they are listed.
+         *
+         *  @param vals gets an item for every key, empty if the key was not found
+         *  @return the number of keys found
+         */
+        virtual uint32_t get_many( const byte_list& keys, byte_list& vals, std::vector<bool>& found );
+
+        /// @return the number of keys that were found and removed
+        virtual uint32_t remove_many( const byte_list& keys );
+
+        /**
+         *  Puts every entry of kv and removes every key of keys as one write, a
+         *  crash never leaves only some of them done.  No key may be in both.
+         *
+         *  @return the number of keys that were found and removed
+         */
+        virtual uint32_t write_batch( const byte_list& kv, const byte_list& keys );
+
+        /**
+         *  Appends every key and value from first up to but not including last
+         *  to kv.
+         *
+         *  @return the number of entries appended
+         */
+        virtual uint32_t read_range( const char* first, uint32_t fs, const char* last, uint32_t ls,
+                                     byte_list& kv );
+
+        /// the caller owns the cursor
+        virtual storage_cursor* cursor() = 0;
+
+        /**
+         *  @param exact count the keys even if every page has to be read for it
+         */
+        virtual db_stats stats( bool exact ) = 0;
+
+        /// makes the writes durable, the environment does it for databases opened in one
+        virtual void     sync() = 0;
+
+    protected:
+        key_compare      m_compare; // set by open()
+};
+
+} } // namespace gpm::bdb
+
+#endif
@@ -43,6 +43,12 @@ class node_private
         :self(s)
         {
             m_gen_enabled    = false;
+            m_hash_threads   = 0;
+            m_sync_interval  = 1;
+            m_segment_mb     = 0;
+            m_compress_log   = false;
+            m_cache_mb       = 0;
+            m_txn_log        = true;
             m_trx_db         = NULL;
             m_block_state_db = NULL;
             slog( "Calculating hash rate...." );
@@ -68,6 +74,15 @@ class node_private
         boost::filesystem::path m_datadir;
         std::string     m_gen_name;
         bool            m_gen_enabled;
+        uint32_t        m_hash_threads;
+        uint32_t        m_sync_interval;
+        uint32_t        m_segment_mb;
+        bool            m_compress_log;
+        uint32_t        m_cache_mb;
+        bool            m_txn_log;
+
+        // shared by m_trx_db, m_block_state_db and m_state_db so a block commits once
+        bdb::environment::ptr m_env;
         /**
          *  This database stores all known transactions and whether or not
          *  they have been applied to the database.
@@ -78,12 +93,25 @@ class node_private
          *      2) Applied and confirmed (not head)
          *
          */
-        bdb::keyvalue_db<std::pair<int,boost::rpc::sha1_hashcode>,signed_transaction >*  m_trx_db;
+        typedef bdb::keyvalue_db<std::pair<int,boost::rpc::sha1_hashcode>,signed_transaction > trx_index;
+        trx_index*                                                                       m_trx_db;
         bdb::keyvalue_db<boost::rpc::sha1_hashcode, block_state>*                        m_block_state_db;
 
         state_database_transaction::ptr m_head_trx;
         state_database_transaction::ptr m_gen_trx;
 
+        // the state at the head block with the pending transactions applied, replaced
+        // whenever m_gen_trx changes.  The queries of the node read it.
+        boost::mutex                    m_snapshot_mutex;
+        state_snapshot::ptr             m_snapshot;
+
+        void update_snapshot()
+        {
+            state_snapshot::ptr s = m_gen_trx->get_snapshot();
+            boost::mutex::scoped_lock lock( m_snapshot_mutex );
+            m_snapshot = s;
+        }
+
 
         void dump( const block_chain& bc, uint32_t s = 0, uint32_t l = 10000 );
         void dump( const signed_transaction& );
@@ -106,53 +134,62 @@ class node_private
         std::vector<signed_transaction> get_transactions( const std::vector<boost::rpc::sha1_hashcode>& trx, int group )
         {
             std::vector<signed_transaction> strx(trx.size());
+            std::vector< std::pair<int,boost::rpc::sha1_hashcode> > keys(trx.size());
+            for( uint32_t i = 0; i < trx.size(); ++i )
+                keys[i] = std::make_pair(group,trx[i]);
+
+            std::vector< boost::optional<signed_transaction> > s;
+            m_trx_db->get_many( keys, s );
             for( uint32_t i = 0; i < trx.size(); ++i )
             {
-                //slog( "looking for %1% in group %2%", trx[i], group );
-                boost::optional<signed_transaction> s = m_trx_db->get( std::make_pair(group,trx[i]) );
-                if( !s )
+                if( !s[i] )
                 {
                     elog( "Unable to find transaction %1% in group %2%", trx[i], group);
                     strx.resize(0);
                     return strx;
                 }
-                strx[i] = *s;
+                strx[i] = *s[i];
             }
             return strx;
         }
         void move_transactions(  int from_group, int to_group )
         {
-            bdb::keyvalue_db<std::pair<int,boost::rpc::sha1_hashcode>,signed_transaction >::iterator itr = 
-                                                    m_trx_db->search( std::make_pair( from_group, boost::rpc::sha1_hashcode() ) );
-            while( !itr.end() && itr.key().first == from_group)
+            std::vector< std::pair<int,boost::rpc::sha1_hashcode> > from;
+            std::vector< std::pair<int,boost::rpc::sha1_hashcode> > to;
             {
-              //  slog( "%1% to %2%", boost::rpc::to_json(itr.key() ), to_group );
-                m_trx_db->set( std::make_pair( to_group, itr.key().second ), itr.value() );
-                std::pair<int,boost::rpc::sha1_hashcode> rm = std::make_pair( from_group, itr.key().second );
-                if( !m_trx_db->remove( rm ) )
+                // only the keys are decoded, the transactions are moved as bytes
+                trx_index::cursor c( *m_trx_db );
+                for( bool ok = c.seek( std::make_pair( from_group, boost::rpc::sha1_hashcode() ) );
+                     ok && c.key().first == from_group; ok = c.next() )
                 {
-                    elog( "Error removing %1%", boost::rpc::to_json(rm) );
+                    from.push_back( c.key() );
+                    to.push_back( std::make_pair( to_group, c.key().second ) );
                 }
-                itr = m_trx_db->search( std::make_pair( from_group, boost::rpc::sha1_hashcode() ) );
+            }
+            if( m_trx_db->rename_many( from, to ) != from.size() )
+            {
+                elog( "Error removing transactions of group %1%", from_group );
             }
         }
         void move_transactions(  const std::vector<boost::rpc::sha1_hashcode>& trx, int from_group, int to_group )
         {
+            std::vector< std::pair<int,boost::rpc::sha1_hashcode> > from( trx.size() );
+            std::vector< std::pair<int,boost::rpc::sha1_hashcode> > to( trx.size() );
             for( uint32_t i = 0; i < trx.size(); ++i )
             {
-                bdb::keyvalue_db<std::pair<int,boost::rpc::sha1_hashcode>,signed_transaction >::iterator itr = 
-                                                        m_trx_db->find( std::make_pair( from_group, trx[i] ) );
-                if( itr.end() )
+                from[i] = std::make_pair( from_group, trx[i] );
+                to[i]   = std::make_pair( to_group, trx[i] );
+            }
+
+            std::vector<bool> moved;
+            m_trx_db->rename_many( from, to, &moved );
+            for( uint32_t i = 0; i < trx.size(); ++i )
+            {
+                if( !moved[i] )
                 {
                     //THROW_GPM_EXCEPTION( "Unable to find transaction %1% in group %2%", %trx[i] %from_group );
                     wlog(  "Unable to find transaction %1% in group %2%", trx[i], from_group );
                 }
-                else
-                {
-                    m_trx_db->set( std::make_pair( to_group, trx[i]), itr.value() );
-                    m_trx_db->remove( std::make_pair(from_group,trx[i]) );
-                  //  itr.remove();
-                }
             }
         }
 
@@ -209,6 +246,7 @@ class node_private
                     {
                         elog( "Error applying first block." );
                     }
+                    update_snapshot();
                 }
                 m_block_state_db->set( b.state, bs );
                 m_block_chain.push_back(b);
@@ -224,8 +262,8 @@ class node_private
 
             
             //slog( "building gen block..." );
-            bdb::keyvalue_db<std::pair<int,boost::rpc::sha1_hashcode>,signed_transaction >::iterator 
-                    itr = m_trx_db->search( std::make_pair( PENDING_TRX, boost::rpc::sha1_hashcode() ) );
+            trx_index::cursor itr( *m_trx_db );
+            itr.seek( std::make_pair( PENDING_TRX, boost::rpc::sha1_hashcode() ) );
 
             std::vector<std::pair<boost::rpc::sha1_hashcode,signed_transaction> > trx_vector;
             // push them into vector
@@ -234,7 +272,7 @@ class node_private
                 trx_vector.push_back( std::make_pair(itr.key().second,itr.value()) );
         //         wlog( "%1% should equal", boost::rpc::raw::hash_sha1(trx_vector.back()) ); //itr.key().second);
         //         wlog( "%1%", itr.key().second );
-                ++itr;
+                itr.next();
             }
             // sort them
             std::sort(trx_vector.begin(), trx_vector.end(), node_private::by_time );
@@ -282,6 +320,7 @@ class node_private
             new_block.utc_time = gpm::utc_clock() / 1000000 + SECONDS_PER_BLOCK;
             new_block.state = boost::rpc::raw::hash_sha1(new_state);
             m_block_state_db->set( new_block.state, new_state );
+            update_snapshot();
 
 
             return new_block;
@@ -397,16 +436,37 @@ void node::open( const boost::filesystem::path& data_dir, bool create )
     }
     my->m_datadir = data_dir;
 
+    my->m_env = bdb::environment::ptr( new bdb::environment() );
+    my->m_env->set_cache_size( uint64_t(my->m_cache_mb) * 1024 * 1024 );
+    my->m_env->set_logging( my->m_txn_log );
+    my->m_env->open( data_dir );
+    if( !my->m_txn_log && !my->m_env->closed_cleanly() )
+        wlog( "the databases were not closed cleanly and have no transaction log, the state indexes will be rebuilt" );
+    if( my->m_sync_interval == 0 )
+        my->m_env->set_durability( bdb::environment::no_sync );
+    else if( my->m_sync_interval == 1 )
+        my->m_env->set_durability( bdb::environment::sync_each );
+    else
+        my->m_env->set_durability( bdb::environment::sync_every_n, my->m_sync_interval );
+
     my->m_trx_db         = new bdb::keyvalue_db< std::pair<int,boost::rpc::sha1_hashcode>, signed_transaction >();
-    my->m_trx_db->open(  data_dir / "trx_db" );
+    my->m_trx_db->open(  data_dir / "trx_db", *my->m_env );
     my->m_block_state_db = new bdb::keyvalue_db<boost::rpc::sha1_hashcode, block_state>(); 
-    my->m_block_state_db->open( data_dir / "block_state_db" );
+    my->m_block_state_db->open( data_dir / "block_state_db", *my->m_env );
     my->m_state_db = state_database::ptr(new state_database());
+    my->m_state_db->set_hash_threads( my->m_hash_threads );
+    my->m_state_db->set_segment_size( uint64_t(my->m_segment_mb) * 1024 * 1024 );
+    my->m_state_db->set_segment_compression( my->m_compress_log );
 
-    if( !my->m_state_db->open( data_dir/"state_db" ) )
+    if( !my->m_state_db->open( data_dir/"state_db", my->m_env ) )
     {
         THROW_GPM_EXCEPTION( "Unable to open state database: %1%", %(data_dir/"state_db") );
     }
+    if( my->m_state_db->get_log_version() != log_v1 )
+    {
+        THROW_GPM_EXCEPTION( "The state log in %1% is not log_v1, its state hashes do not match other nodes. "
+                             "Remove it to download the state again.", %(data_dir/"state_db") );
+    }
     if( !load( my->m_datadir / "blockchain", my->m_block_chain ) )
     {
         wlog(  "No current blockchain." );
@@ -418,12 +478,49 @@ void node::open( const boost::filesystem::path& data_dir, bool create )
 
     // clean up the known state.
     my->synchronize_state();
+    my->update_snapshot();
 
  //   wlog(  "initial head trx %1%    gen_trx: %2%   file: %3%", my->m_head_trx.get(),  my->m_gen_trx.get(), my->m_state_db.get() );
  //   my->m_state_db->dump();
 }
 
 
+void node::configure_hash_threads( uint32_t n )
+{
+    my->m_hash_threads = n;
+}
+
+void node::configure_sync_interval( uint32_t blocks )
+{
+    my->m_sync_interval = blocks;
+}
+
+void node::configure_log_segments( uint32_t segment_mb, bool compress )
+{
+    my->m_segment_mb   = segment_mb;
+    my->m_compress_log = compress;
+}
+
+void node::configure_storage( uint32_t cache_mb, bool txn_log )
+{
+    my->m_cache_mb = cache_mb;
+    my->m_txn_log  = txn_log;
+}
+
+bool node::verify_state()
+{
+    if( !my->m_state_db )
+        THROW_GPM_EXCEPTION( "Database not open." );
+    return my->m_state_db->verify_chunk_hashes();
+}
+
+void node::rebuild_index()
+{
+    if( !my->m_state_db )
+        THROW_GPM_EXCEPTION( "Database not open." );
+    my->m_state_db->update_index();
+}
+
 void node::configure_generation( const std::string& gn, bool on )
 {
     my->m_gen_name    = gn;
@@ -510,14 +607,14 @@ block_state node::get_block_state( const boost::rpc::sha1_hashcode& blk_state )
 
 bool node::can_register( const std::string& name )
 {
-    return my->m_gen_trx->get_name_index(name) == -1;
+    return get_snapshot()->get_name_index(name) == -1;
 }
 bool node::get_key_for_name( const std::string& name, public_key_t& pk )
 {
     if( !my->m_state_db )
         THROW_GPM_EXCEPTION( "Database not open." );
 
-    return my->m_gen_trx->get_public_key_t( name, pk );
+    return get_snapshot()->get_public_key_t( name, pk );
 }
 
 public_key_t node::get_public_key_t( const std::string& name )
@@ -526,7 +623,7 @@ public_key_t node::get_public_key_t( const std::string& name )
         THROW_GPM_EXCEPTION( "Database not open." );
 
     public_key_t pk;
-    if( !my->m_gen_trx->get_public_key_t( name, pk ) )
+    if( !get_snapshot()->get_public_key_t( name, pk ) )
         THROW_GPM_EXCEPTION( "No public key known for name '%1%'", %name );
     return pk;
 }
@@ -536,7 +633,7 @@ bool node::has_balance( const std::string& account, const std::string& type )
     bool is_null;
     if( !my->m_state_db )
         THROW_GPM_EXCEPTION( "Database not open." );
-    uint64_t b =  my->m_gen_trx->get_balance(account,type, &is_null);
+    uint64_t b =  get_snapshot()->get_balance(account,type, &is_null);
 
     return !is_null;
 }
@@ -544,14 +641,25 @@ uint64_t node::get_balance( const std::string& account, const std::string& type
 {
     if( !my->m_state_db )
         THROW_GPM_EXCEPTION( "Database not open." );
-    return my->m_gen_trx->get_balance(account,type);
+    return get_snapshot()->get_balance(account,type);
 }
 
 
+/**
+ *  Safe to call from any thread, the snapshot is replaced by the main thread.
+ */
+state_snapshot::ptr node::get_snapshot()
+{
+    boost::mutex::scoped_lock lock( my->m_snapshot_mutex );
+    if( !my->m_snapshot )
+        THROW_GPM_EXCEPTION( "Database not open." );
+    return my->m_snapshot;
+}
+
 std::vector<std::string> node::get_account_contents( const std::string& account )
 {
 //    slog( "get contents %1%", account );
-    std::vector<std::string> names =  my->m_gen_trx->get_account_contents(account);
+    std::vector<std::string> names =  get_snapshot()->get_account_contents(account);
     std::vector<std::string> n;n.resize( names.size() );
     for( uint32_t i = 0; i < names.size(); ++i )
         n[i] = names[i];
@@ -628,6 +736,7 @@ int node::add_full_block( const full_block_state& blk )
         {
             elog( "Error applying first block." );
         }
+        my->update_snapshot();
         my->m_block_state_db->set( blk.blk.state, blk.blk_state );
         my->m_block_chain.push_back(blk.blk);
         return 1;
@@ -687,6 +796,8 @@ int node::add_block( const block& blk )
             }
             else if( trx->apply( blk, (*bs).generator_name, strxs, (*bs).state_db ) )
             {
+                // everything written for this block becomes durable together
+                bdb::group_commit grp( *my->m_env );
                 my->move_transactions( HEAD_TRX, APPLIED_TRX );
                 my->move_transactions((*bs).signed_transactions, PENDING_TRX, HEAD_TRX );
 
@@ -706,9 +817,10 @@ int node::add_block( const block& blk )
                 my->m_block_chain.pop_back();
                 save( my->m_datadir / "blockchain", my->m_block_chain );
                 my->m_state_db->commit();
-                my->m_trx_db->sync();
-                my->m_block_state_db->sync();
+                grp.commit();
+                my->m_state_db->seal_log();
                 my->m_block_chain.push_back(blk);
+                my->update_snapshot();
 
                 full_block_state fbs;
                 fbs.index = my->m_block_chain.size()-1;
@@ -763,6 +875,7 @@ int node::add_block( const block& blk )
                     my->move_transactions((*bs).signed_transactions, PENDING_TRX, HEAD_TRX );
                     my->m_head_trx = trx;
                     my->m_gen_trx   = state_database_transaction::ptr( new state_database_transaction( my->m_head_trx ) );
+                    my->update_snapshot();
 
                     full_block_state fbs;
                     fbs.index = my->m_block_chain.size()-1;
@@ -864,20 +977,84 @@ void node_private::dump( const block_chain& bc, uint32_t start, uint32_t len )
     }
     std::cout<<"\n";
 }
+static std::vector<holding> to_holdings( abstract_state_database* db, const std::vector<holder>& h )
+{
+    std::vector<holding> r; r.reserve( h.size() );
+    for( uint32_t i = 0; i < h.size(); ++i )
+        r.push_back( holding( db->get_name_for_index( h[i].account ), h[i].balance ) );
+    return r;
+}
+
+std::vector<holding> node::get_holders( const std::string& type, const std::string& after, uint32_t limit )
+{
+    if( !my->m_state_db )
+        THROW_GPM_EXCEPTION( "Database not open." );
+    state_snapshot::ptr snap = get_snapshot();
+    uint64_t tidx = snap->get_name_index(type);
+    if( tidx == uint64_t(-1) )
+        return std::vector<holding>();
+
+    uint64_t start = 0;
+    if( after.size() )
+    {
+        uint64_t aidx = snap->get_name_index(after);
+        if( aidx == uint64_t(-1) )
+            THROW_GPM_EXCEPTION( "Unknown name '%1%'", %after );
+        start = aidx + 1;
+    }
+    return to_holdings( snap.get(), snap->get_holders( tidx, start, limit ) );
+}
+
+std::vector<holding> node::get_top_holders( const std::string& type, uint32_t limit )
+{
+    if( !my->m_state_db )
+        THROW_GPM_EXCEPTION( "Database not open." );
+    state_snapshot::ptr snap = get_snapshot();
+    uint64_t tidx = snap->get_name_index(type);
+    if( tidx == uint64_t(-1) )
+        return std::vector<holding>();
+    return to_holdings( snap.get(), snap->get_top_holders( tidx, limit ) );
+}
+
+state_stats node::get_state_stats()
+{
+    if( !my->m_state_db )
+        THROW_GPM_EXCEPTION( "Database not open." );
+    state_counts c = get_snapshot()->get_counts();
+    state_stats  s;
+    s.names    = c.names;
+    s.accounts = c.accounts;
+    s.holdings = c.holdings;
+    return s;
+}
+
+std::vector<bdb::db_stats> node::get_db_stats( bool exact )
+{
+    if( !my->m_state_db )
+        THROW_GPM_EXCEPTION( "Database not open." );
+    std::vector<bdb::db_stats> s;
+    s.push_back( my->m_trx_db->stats( exact ) );
+    s.push_back( my->m_block_state_db->stats( exact ) );
+    my->m_state_db->get_index_stats( s, exact );
+    return s;
+}
+
 std::vector<trx_log> node::get_transaction_log( const std::string& account, const std::string& type,
                                                           uint64_t start_date , uint64_t end_date )
 {
     std::vector<trx_log> log;
-    abstract_state_database::transfer tran = my->m_gen_trx->get_last_transfer( account, type );
-    while( !tran.end() )
+    state_snapshot::ptr snap = get_snapshot();
+    uint64_t aidx = snap->get_name_index(account);
+    uint64_t tidx = snap->get_name_index(type);
+    if( aidx == uint64_t(-1) || tidx == uint64_t(-1) )
+        return log;
+
+    history_cursor c = snap->get_history( account_key( aidx, tidx ), start_date, end_date );
+    while( !c.end() )
     {
-        if( tran.time() < start_date )
-            return log; 
-        if( tran.time() <= end_date )
-        {
-            log.push_back( trx_log( tran.from(), tran.to(), tran.type(), tran.amount(), tran.to_balance(), tran.from_balance(), tran.time() ) );
-        }
-        tran.previous(account);    
+        abstract_state_database::transfer tran( snap, c.index() );
+        log.push_back( trx_log( tran.from(), tran.to(), tran.type(), tran.amount(), tran.to_balance(), tran.from_balance(), tran.time() ) );
+        ++c;
     }
     return log;
 }
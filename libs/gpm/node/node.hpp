@@ -6,6 +6,7 @@
 #include <boost/signal.hpp>
 #include <gpm/block_chain/block.hpp>
 #include <gpm/block_chain/transaction.hpp>
+#include <gpm/bdb/environment.hpp>
 
 #include <QtConcurrentRun>
 #include <QCoreApplication>
@@ -14,6 +15,7 @@
 
 namespace gpm {
   class node_private;
+  class state_snapshot;
 
     class QFunctorEventBase : public QEvent
     {
@@ -88,6 +90,24 @@ namespace gpm {
       uint64_t     date;
   };
 
+  struct holding
+  {
+      holding( const std::string& n = std::string(), uint64_t b = 0 )
+      :name(n),balance(b){}
+
+      std::string name;
+      uint64_t    balance;
+  };
+
+  struct state_stats
+  {
+      state_stats():names(0),accounts(0),holdings(0){}
+
+      uint64_t names;
+      uint64_t accounts; // account / stock combos that were ever used
+      uint64_t holdings; // non-zero balances
+  };
+
   /**
    *  This is the interface that a node exposes to the network.  It allows other
    *  nodes to connect and query information.
@@ -100,6 +120,46 @@ namespace gpm {
       ~node();
 
       void  open( const boost::filesystem::path& data_dir, bool create = false );
+
+      /**
+       *  Number of threads used when large parts of the state log must be hashed,
+       *  0 uses one thread per core.  Must be called before open().
+       */
+      void  configure_hash_threads( uint32_t n );
+
+      /**
+       *  How often the databases are synced to disk: 1 after every block, N after
+       *  every N blocks and 0 only on close.  A crash loses at most the unsynced 
+       *  blocks, which are downloaded again.  Must be called before open().
+       */
+      void  configure_sync_interval( uint32_t blocks );
+
+      /**
+       *  Moves old history out of the state log into read only segments of segment_mb
+       *  MB, 0 keeps the whole log in one file.  Segments may be compressed, which 
+       *  saves disk space but makes reading old history slower.  Must be called 
+       *  before open().
+       */
+      void  configure_log_segments( uint32_t segment_mb, bool compress );
+
+      /**
+       *  MB of cache shared by all databases of the node, 0 uses the Berkeley DB
+       *  default.  Without the transaction log writes are cheaper but a crash may
+       *  corrupt the databases.  Must be called before open().
+       */
+      void  configure_storage( uint32_t cache_mb, bool txn_log = true );
+
+      /**
+       *  Rehashes the entire state log and rebuilds the state hash cache.
+       *
+       *  @return false if the cache was corrupted.
+       */
+      bool  verify_state();
+
+      /**
+       *  Rebuilds the indexes of the state database from the state log.
+       */
+      void  rebuild_index();
       void  configure_generation( const std::string& name, bool on = true );
       const std::string& generation_name()const;
       bool  is_generating()const;
@@ -135,6 +195,27 @@ namespace gpm {
       uint64_t                 get_balance( const std::string& account, const std::string& type );
       std::vector<std::string> get_account_contents( const std::string& account );
 
+      /**
+       *  The state as of the head block with the pending transactions applied.  The
+       *  queries of the node read the latest snapshot, which can be used from any
+       *  thread and is not affected by blocks that are applied after it was taken.
+       */
+      boost::shared_ptr<state_snapshot> get_snapshot();
+
+      /**
+       *  Lists the holders of type in the order their names were registered, pass the
+       *  name of the last holder returned as after to get the next page.
+       */
+      std::vector<holding>     get_holders( const std::string& type, const std::string& after = std::string(),
+                                            uint32_t limit = 100 );
+      std::vector<holding>     get_top_holders( const std::string& type, uint32_t limit = 10 );
+
+      /// counts the pending transactions as well
+      state_stats              get_state_stats();
+
+      /// size and cache use of every database, exact counts the keys of each one
+      std::vector<bdb::db_stats> get_db_stats( bool exact = false );
+
       std::vector<char>        get_state_chunk( uint32_t part, const boost::rpc::sha1_hashcode& hash );
                                
       uint64_t                                  get_hashrate()const; // hash/sec
@@ -159,6 +240,14 @@ BOOST_REFLECT( gpm::trx_log, BOOST_PP_SEQ_NIL,
    (from)(to)(type)(amnt)(to_bal)(from_bal)(date)
 )
 
+BOOST_REFLECT( gpm::state_stats, BOOST_PP_SEQ_NIL,
+   (names)(accounts)(holdings)
+)
+
+BOOST_REFLECT( gpm::holding, BOOST_PP_SEQ_NIL,
+   (name)(balance)
+)
+
 BOOST_REFLECT( gpm::node, BOOST_PP_SEQ_NIL,
     ( get_transaction )
     ( get_full_block )
@@ -169,6 +258,9 @@ BOOST_REFLECT( gpm::node, BOOST_PP_SEQ_NIL,
     ( has_balance )
     ( get_hashrate )
     ( get_account_contents )
+    ( get_holders )
+    ( get_top_holders )
+    ( get_state_stats )
     ( get_state_chunk )
     ( add_transaction )
     ( add_block )
@@ -0,0 +1,164 @@
+#include "change_buffer.hpp"
+#include <algorithm>
+#include <string.h>
+
+namespace gpm {
+
+change_arena::change_arena( uint32_t max_free )
+:m_max_free(max_free)
+{
+}
+
+change_arena::~change_arena()
+{
+    for( uint32_t i = 0; i < m_free.size(); ++i )
+        delete[] m_free[i];
+}
+
+char* change_arena::allocate( uint32_t& size )
+{
+    if( size > change_chunk_size )
+        return new char[size];
+    size = change_chunk_size;
+    if( m_free.empty() )
+        return new char[size];
+    char* d = m_free.back();
+    m_free.pop_back();
+    return d;
+}
+
+/**
+ *  Only standard chunks are kept, the ones made for large records are freed.
+ */
+void change_arena::release( char* d, uint32_t capacity )
+{
+    if( capacity != change_chunk_size || m_free.size() >= m_max_free )
+        delete[] d;
+    else
+        m_free.push_back( d );
+}
+
+
+change_buffer::change_buffer( const change_arena::ptr& a )
+:m_arena(a),m_size(0)
+{
+}
+
+change_buffer::~change_buffer()
+{
+    clear();
+}
+
+void change_buffer::release( chunk& c )
+{
+    if( m_arena )
+        m_arena->release( c.data, c.capacity );
+    else
+        delete[] c.data;
+    c.data = 0;
+}
+
+void change_buffer::clear()
+{
+    for( uint32_t i = 0; i < m_chunks.size(); ++i )
+        release( m_chunks[i] );
+    m_chunks.clear();
+    m_size = 0;
+}
+
+/**
+ *  Starts a new chunk if the last one cannot hold all of d.
+ */
+void change_buffer::append( const char* d, uint64_t len )
+{
+    if( !len )
+        return;
+    if( m_chunks.empty() || m_chunks.back().capacity - m_chunks.back().used < len )
+    {
+        uint32_t cap = std::max( uint64_t(change_chunk_size), len );
+        char*    cd  = m_arena ? m_arena->allocate( cap ) : new char[cap];
+        m_chunks.push_back( chunk( cd, cap ) );
+        m_chunks.back().start = m_size;
+    }
+    chunk& c = m_chunks.back();
+    memcpy( c.data + c.used, d, len );
+    c.used += len;
+    m_size += len;
+}
+
+/**
+ *  A chunk of b that fits in the unused space of our last chunk is copied there
+ *  and returned to the arena, committing an overlay of a few records would
+ *  otherwise leave a mostly empty chunk behind.  The other chunks of b are only
+ *  renumbered.
+ */
+void change_buffer::splice( change_buffer& b )
+{
+    if( &b == this )
+        return;
+    for( uint32_t i = 0; i < b.m_chunks.size(); ++i )
+    {
+        chunk& bc = b.m_chunks[i];
+        if( bc.used && m_chunks.size() && m_chunks.back().capacity - m_chunks.back().used >= bc.used )
+        {
+            chunk& c = m_chunks.back();
+            memcpy( c.data + c.used, bc.data, bc.used );
+            c.used += bc.used;
+            m_size += bc.used;
+            b.release( bc );
+            continue;
+        }
+        if( !bc.used )
+        {
+            b.release( bc );
+            continue;
+        }
+        m_chunks.push_back( bc );
+        m_chunks.back().start = m_size;
+        m_size += bc.used;
+    }
+    b.m_chunks.clear();
+    b.m_size = 0;
+}
+
+/**
+ *  Each chunk of b is copied in one piece so that no record is split.
+ */
+void change_buffer::copy( const change_buffer& b )
+{
+    for( uint32_t i = 0; i < b.m_chunks.size(); ++i )
+        append( b.m_chunks[i].data, b.m_chunks[i].used );
+}
+
+uint32_t change_buffer::find_chunk( uint64_t off )const
+{
+    return std::upper_bound( m_chunks.begin(), m_chunks.end(), off, by_start ) - m_chunks.begin() - 1;
+}
+
+const char* change_buffer::data( uint64_t off, uint64_t& avail )const
+{
+    avail = 0;
+    if( off >= m_size )
+        return 0;
+    const chunk& c = m_chunks[find_chunk(off)];
+    avail = c.start + c.used - off;
+    return c.data + (off - c.start);
+}
+
+uint64_t change_buffer::read( uint64_t off, char* buf, uint64_t len )const
+{
+    if( off >= m_size )
+        return 0;
+    uint64_t r = 0;
+    for( uint32_t i = find_chunk(off); i < m_chunks.size() && r < len; ++i )
+    {
+        const chunk& c = m_chunks[i];
+        uint64_t     o = off + r - c.start;
+        uint64_t     n = std::min( uint64_t(c.used) - o, len - r );
+        memcpy( buf + r, c.data + o, n );
+        r += n;
+    }
+    return r;
+}
+
+} // namespace gpm
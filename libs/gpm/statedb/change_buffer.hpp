@@ -0,0 +1,130 @@
+#ifndef _GPM_CHANGE_BUFFER_HPP_
+#define _GPM_CHANGE_BUFFER_HPP_
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <vector>
+
+namespace gpm {
+
+    /**
+     *  Size of the chunks that hold the records of an overlay, records that are
+     *  larger get a chunk of their own.
+     */
+    const uint32_t change_chunk_size = 64*1024;
+
+    /**
+     *  @class change_arena
+     *  @brief Recycles the chunks of the change_buffers of one chain of overlays.
+     *
+     *  The chunks of a block are returned when the database commits it and are
+     *  reused by the overlays of the next block, so applying blocks does not
+     *  allocate once the arena has warmed up.  Only used by one thread.
+     */
+    class change_arena
+    {
+        public:
+            typedef boost::shared_ptr<change_arena> ptr;
+
+            /**
+             *  @param max_free chunks kept for reuse, any more are freed
+             */
+            change_arena( uint32_t max_free = 256 );
+            ~change_arena();
+
+            /**
+             *  @param size the bytes needed, set to the capacity of the chunk
+             */
+            char* allocate( uint32_t& size );
+            void  release( char* d, uint32_t capacity );
+
+        private:
+            change_arena( const change_arena& );
+            change_arena& operator=( const change_arena& );
+
+            std::vector<char*>  m_free;
+            uint32_t            m_max_free;
+    };
+
+    /**
+     *  @class change_buffer
+     *  @brief The records of an overlay stored in a list of chunks.
+     *
+     *  Appending never moves the records that are already in the buffer and
+     *  splice() moves the chunks of another buffer to the end of this one, so
+     *  committing an overlay into its base only copies the records of chunks
+     *  that fit in the space left in the base's last chunk.
+     *
+     *  A record is never split across chunks, data() returns every record in
+     *  one piece.  Locations are offsets from the start of the buffer and do
+     *  not count the unused space at the end of each chunk.
+     */
+    class change_buffer
+    {
+        public:
+            change_buffer( const change_arena::ptr& a = change_arena::ptr() );
+            ~change_buffer();
+
+            /// chunks are allocated from a, or from the heap if it is NULL
+            void            set_arena( const change_arena::ptr& a ) { m_arena = a; }
+            const change_arena::ptr& arena()const                   { return m_arena; }
+
+            uint64_t        size()const   { return m_size; }
+            bool            empty()const  { return m_size == 0; }
+
+            /// appends len bytes of whole records, they are kept in one chunk
+            void            append( const char* d, uint64_t len );
+
+            /**
+             *  Moves the records of b to the end of this buffer and leaves b empty.
+             *  Pointers into b returned by data() are no longer valid.
+             */
+            void            splice( change_buffer& b );
+
+            /// appends a copy of the records in b
+            void            copy( const change_buffer& b );
+
+            void            clear();
+
+            /**
+             *  @param avail set to the bytes from off to the end of its chunk
+             *  @return the byte at off or NULL if off is past the end
+             */
+            const char*     data( uint64_t off, uint64_t& avail )const;
+
+            /**
+             *  Copies up to len bytes starting at off.
+             *
+             *  @return the number of bytes copied
+             */
+            uint64_t        read( uint64_t off, char* buf, uint64_t len )const;
+
+            uint32_t        chunk_count()const             { return m_chunks.size(); }
+            const char*     chunk_data( uint32_t i )const  { return m_chunks[i].data; }
+            uint64_t        chunk_size( uint32_t i )const  { return m_chunks[i].used; }
+
+        private:
+            change_buffer( const change_buffer& );
+            change_buffer& operator=( const change_buffer& );
+
+            struct chunk
+            {
+                chunk( char* d = 0, uint32_t c = 0 ):data(d),capacity(c),used(0),start(0){}
+
+                char*     data;
+                uint32_t  capacity;
+                uint32_t  used;
+                uint64_t  start;  // offset of data[0] in the buffer
+            };
+            static bool by_start( uint64_t off, const chunk& c ) { return off < c.start; }
+
+            void      release( chunk& c );
+            uint32_t  find_chunk( uint64_t off )const;
+
+            change_arena::ptr   m_arena;
+            std::vector<chunk>  m_chunks;
+            uint64_t            m_size;
+    };
+
+} // namespace gpm
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef _GPM_FLAT_INDEX_HPP_
+#define _GPM_FLAT_INDEX_HPP_
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+namespace gpm {
+
+    /**
+     *  Hash functions used by flat_index, specialize for new key types.
+     */
+    template<typename Key>
+    struct flat_hash;
+
+    template<>
+    struct flat_hash<uint64_t>
+    {
+        uint64_t operator()( uint64_t k )const
+        {
+            k ^= k >> 33; k *= 0xff51afd7ed558ccdull;
+            k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ull;
+            return k ^ (k >> 33);
+        }
+    };
+
+    template<>
+    struct flat_hash<std::string>
+    {
+        uint64_t operator()( const std::string& s )const
+        {
+            return hash( s.data(), s.size() );
+        }
+
+        // FNV-1a
+        static uint64_t hash( const char* d, size_t len )
+        {
+            uint64_t h = 0xcbf29ce484222325ull;
+            for( size_t i = 0; i < len; ++i )
+            {
+                h ^= uint8_t(d[i]);
+                h *= 0x100000001b3ull;
+            }
+            return h;
+        }
+    };
+
+    /**
+     *  @class flat_index
+     *  @brief Open addressing hash table used for the indexes kept by each state
+     *         database overlay.
+     *
+     *  All entries are stored in a single array that is probed linearly, so a
+     *  lookup touches one or two cache lines and inserting does not allocate
+     *  unless the table has to grow.  clear() keeps the array so an overlay
+     *  that is reused for every block does not reallocate either.
+     *
+     *  Entries are unordered, select() and sorted() produce ordered copies
+     *  for the queries that need them.
+     */
+    template<typename Key, typename Value, typename Hash = flat_hash<Key> >
+    class flat_index
+    {
+        public:
+            typedef std::pair<Key,Value> value_type;
+
+        private:
+            struct slot
+            {
+                slot():used(false){}
+                bool       used;
+                value_type kv;
+            };
+
+        public:
+            class const_iterator
+            {
+                public:
+                    const_iterator():m_pos(0),m_end(0){}
+
+                    const value_type& operator*()const  { return m_pos->kv;  }
+                    const value_type* operator->()const { return &m_pos->kv; }
+
+                    const_iterator& operator++()        { ++m_pos; skip(); return *this; }
+                    bool operator == ( const const_iterator& i )const { return m_pos == i.m_pos; }
+                    bool operator != ( const const_iterator& i )const { return m_pos != i.m_pos; }
+
+                private:
+                    friend class flat_index;
+                    const_iterator( const slot* p, const slot* e ):m_pos(p),m_end(e){ skip(); }
+                    void skip() { while( m_pos != m_end && !m_pos->used ) ++m_pos; }
+
+                    const slot* m_pos;
+                    const slot* m_end;
+            };
+
+            flat_index():m_size(0){}
+
+            size_t size()const  { return m_size;      }
+            bool   empty()const { return m_size == 0; }
+
+            const_iterator begin()const
+            {
+                if( m_slots.empty() ) return const_iterator();
+                return const_iterator( &m_slots.front(), &m_slots.front() + m_slots.size() );
+            }
+            const_iterator end()const
+            {
+                if( m_slots.empty() ) return const_iterator();
+                return const_iterator( &m_slots.front() + m_slots.size(), &m_slots.front() + m_slots.size() );
+            }
+
+            /**
+             *  @return a pointer to the value stored for k or NULL
+             */
+            const Value* find( const Key& k )const
+            {
+                if( !m_size ) return 0;
+                const slot& s = m_slots[probe(k)];
+                return s.used ? &s.kv.second : 0;
+            }
+            Value* find( const Key& k )
+            {
+                if( !m_size ) return 0;
+                slot& s = m_slots[probe(k)];
+                return s.used ? &s.kv.second : 0;
+            }
+
+            /**
+             *  Returns the value stored for k, inserting a default constructed value
+             *  if k is not in the index.
+             */
+            Value& operator[]( const Key& k )
+            {
+                if( (m_size + 1) * 10 > m_slots.size() * 7 )
+                    grow();
+                slot& s = m_slots[probe(k)];
+                if( !s.used )
+                {
+                    s.used      = true;
+                    s.kv.first  = k;
+                    s.kv.second = Value();
+                    ++m_size;
+                }
+                return s.kv.second;
+            }
+
+            void clear()
+            {
+                if( !m_size ) return;
+                for( size_t i = 0; i < m_slots.size(); ++i )
+                    m_slots[i].used = false;
+                m_size = 0;
+            }
+
+            void swap( flat_index& i )
+            {
+                m_slots.swap( i.m_slots );
+                std::swap( m_size, i.m_size );
+            }
+
+            /**
+             *  Copies the first limit entries with lo <= key <= hi into out in key order.
+             *  The table is not ordered, so every entry is visited, but only the first 
+             *  limit matches are sorted.
+             */
+            void select( const Key& lo, const Key& hi, std::vector<value_type>& out, 
+                         size_t limit = size_t(-1) )const
+            {
+                size_t s = out.size();
+                for( const_iterator i = begin(); i != end(); ++i )
+                    if( !(i->first < lo) && !(hi < i->first) )
+                        out.push_back( *i );
+                if( out.size() - s > limit )
+                {
+                    std::partial_sort( out.begin() + s, out.begin() + s + limit, out.end(), key_less );
+                    out.resize( s + limit );
+                }
+                else
+                    std::sort( out.begin() + s, out.end(), key_less );
+            }
+
+            /**
+             *  Copies every entry into out in key order.
+             */
+            void sorted( std::vector<value_type>& out )const
+            {
+                size_t s = out.size();
+                out.reserve( s + m_size );
+                for( const_iterator i = begin(); i != end(); ++i )
+                    out.push_back( *i );
+                std::sort( out.begin() + s, out.end(), key_less );
+            }
+
+        private:
+            static bool key_less( const value_type& a, const value_type& b ) { return a.first < b.first; }
+
+            size_t probe( const Key& k )const
+            {
+                size_t mask = m_slots.size() - 1;
+                size_t i    = size_t(Hash()(k)) & mask;
+                while( m_slots[i].used && !(m_slots[i].kv.first == k) )
+                    i = (i + 1) & mask;
+                return i;
+            }
+
+            void grow()
+            {
+                std::vector<slot> old;
+                old.swap( m_slots );
+                m_slots.resize( old.size() ? old.size() * 2 : 16 );
+                m_size = 0;
+                for( size_t i = 0; i < old.size(); ++i )
+                    if( old[i].used )
+                        (*this)[old[i].kv.first] = old[i].kv.second;
+            }
+
+            std::vector<slot> m_slots;
+            size_t            m_size;
+    };
+
+} // namespace gpm
+
+#endif
@@ -0,0 +1,392 @@
+#include "log_format.hpp"
+#include "state_database.hpp"
+#include <boost/crc.hpp>
+#include <string.h>
+
+namespace gpm {
+
+static const uint32_t v1_header = sizeof(uint16_t) + sizeof(uint32_t);
+static const uint32_t v2_header = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t);
+
+static uint32_t padded( uint32_t len ) { return (len + 3) & ~uint32_t(3); }
+
+static uint32_t payload_crc( const char* d, uint32_t len )
+{
+    boost::crc_32_type crc;
+    crc.process_bytes( d + sizeof(uint32_t), v2_header - sizeof(uint32_t) + len );
+    return crc.checksum();
+}
+
+uint64_t log_start( uint32_t version )
+{
+    return version == log_v2 ? sizeof(log_magic) : 0;
+}
+
+uint32_t header_size( uint32_t version )
+{
+    return version == log_v2 ? v2_header : v1_header;
+}
+
+uint32_t footer_size( uint32_t version )
+{
+    return version == log_v2 ? sizeof(uint32_t) : sizeof(uint64_t);
+}
+
+bool parse_header( uint32_t version, const char* d, uint64_t avail, record_header& h )
+{
+    if( avail < header_size(version) )
+        return false;
+    h.previous = -1;
+    if( version == log_v2 )
+    {
+        memcpy( (char*)&h.crc,   d,      sizeof(h.crc) );
+        memcpy( (char*)&h.id,    d + 4,  sizeof(h.id) );
+        memcpy( (char*)&h.flags, d + 6,  sizeof(h.flags) );
+        memcpy( (char*)&h.len,   d + 8,  sizeof(h.len) );
+        h.data = v2_header;
+        h.size = uint64_t(v2_header) + padded(h.len) + sizeof(uint32_t);
+        return true;
+    }
+    memcpy( (char*)&h.id,  d,                sizeof(h.id) );
+    memcpy( (char*)&h.len, d + sizeof(h.id), sizeof(h.len) );
+    h.flags = 0;
+    h.crc   = 0;
+    h.data  = v1_header;
+    h.size  = uint64_t(v1_header) + h.len + sizeof(uint64_t);
+    return true;
+}
+
+uint64_t record_before( uint32_t version, const char* footer, uint64_t end )
+{
+    if( version == log_v2 )
+    {
+        uint32_t s;
+        memcpy( (char*)&s, footer, sizeof(s) );
+        return end - s;
+    }
+    uint64_t loc;
+    memcpy( (char*)&loc, footer, sizeof(loc) );
+    return loc;
+}
+
+bool check_record( uint32_t version, const char* d, const record_header& h )
+{
+    if( version != log_v2 )
+        return true;
+    return payload_crc( d, h.len ) == h.crc;
+}
+
+/**
+ *  Writes the fields of the v2 payloads.
+ */
+class payload_writer
+{
+    public:
+        payload_writer( std::vector<char>& o, uint64_t l ):out(o),loc(l){}
+
+        void varint( uint64_t v )
+        {
+            while( v >= 0x80 )
+            {
+                out.push_back( char(v | 0x80) );
+                v >>= 7;
+            }
+            out.push_back( char(v) );
+        }
+
+        /// locations are usually just before loc, -1 is stored as 0
+        void location( uint64_t l )
+        {
+            if( l == uint64_t(-1) )
+                return varint( 0 );
+            int64_t d = int64_t(loc - l);
+            varint( (uint64_t(d) << 1 ^ uint64_t(d >> 63)) + 1 );
+        }
+
+        void bytes( const char* d, uint32_t len ) { out.insert( out.end(), d, d + len ); }
+
+        void string( const std::string& s )
+        {
+            varint( s.size() );
+            bytes( s.data(), s.size() );
+        }
+
+        template<typename T>
+        void raw( const T& v )
+        {
+            std::vector<char> d;
+            boost::rpc::raw::pack( d, v );
+            if( d.size() )
+                bytes( &d.front(), d.size() );
+        }
+
+    private:
+        std::vector<char>& out;
+        uint64_t           loc;
+};
+
+/**
+ *  Reads the fields written by payload_writer.
+ */
+class payload_reader
+{
+    public:
+        payload_reader( const char* d, uint32_t len, uint64_t l ):pos(d),end(d+len),loc(l){}
+
+        uint64_t varint()
+        {
+            uint64_t v = 0;
+            for( uint32_t shift = 0; shift < 64; shift += 7 )
+            {
+                if( pos == end )
+                    THROW_GPM_EXCEPTION( "Truncated record payload." );
+                uint8_t b = *pos++;
+                v |= uint64_t(b & 0x7f) << shift;
+                if( !(b & 0x80) )
+                    return v;
+            }
+            THROW_GPM_EXCEPTION( "Invalid varint in record payload." );
+            return 0;
+        }
+
+        uint64_t location()
+        {
+            uint64_t z = varint();
+            if( z == 0 )
+                return -1;
+            --z;
+            int64_t d = int64_t(z >> 1) ^ -int64_t(z & 1);
+            return loc - d;
+        }
+
+        void bytes( char* d, uint32_t len )
+        {
+            if( uint64_t(end - pos) < len )
+                THROW_GPM_EXCEPTION( "Truncated record payload." );
+            memcpy( d, pos, len );
+            pos += len;
+        }
+
+        std::string string()
+        {
+            uint64_t len = varint();
+            if( uint64_t(end - pos) < len )
+                THROW_GPM_EXCEPTION( "Truncated record payload." );
+            std::string s( pos, pos + len );
+            pos += len;
+            return s;
+        }
+
+        /// the rest of the payload
+        template<typename T>
+        void raw( T& v )
+        {
+            boost::rpc::raw::unpack( pos, end - pos, v );
+            pos = end;
+        }
+
+    private:
+        const char* pos;
+        const char* end;
+        uint64_t    loc;
+};
+
+/**
+ *  Writes k as a reference if keys knows it, the key is always the last field.
+ *
+ *  @return the flags of the record
+ */
+static uint16_t write_key( payload_writer& w, const public_key_t& k, key_dictionary* keys )
+{
+    if( keys )
+    {
+        if( k == public_key_t() )
+        {
+            w.location( uint64_t(-1) );
+            return key_ref;
+        }
+        uint64_t kloc = keys->find_key( k );
+        if( kloc != uint64_t(-1) )
+        {
+            w.location( kloc );
+            return key_ref;
+        }
+    }
+    w.raw( k );
+    return 0;
+}
+
+static void read_key( payload_reader& rd, uint16_t flags, public_key_t& k, key_dictionary* keys )
+{
+    if( !(flags & key_ref) )
+        return rd.raw( k );
+
+    uint64_t kloc = rd.location();
+    if( kloc == uint64_t(-1) || !keys )
+        k = public_key_t();
+    else if( !keys->get_key( kloc, k ) )
+        THROW_GPM_EXCEPTION( "No key defined at %1%", %kloc );
+}
+
+static uint16_t encode_payload( const state_record& r, uint64_t loc, std::vector<char>& out, key_dictionary* keys )
+{
+    payload_writer w( out, loc );
+    switch( r.id )
+    {
+        case define_name::id:
+        {
+            define_name dn = r;
+            w.string( dn.name );
+            return write_key( w, dn.key, keys );
+        }
+        case update_name::id:
+        {
+            update_name un = r;
+            w.location( un.name_idx );
+            w.location( un.last_update_idx );
+            return write_key( w, un.key, keys );
+        }
+        case transfer_log::id:
+        {
+            transfer_log tl = r;
+            w.varint( tl.amount );
+            w.location( tl.type_name );
+            w.location( tl.from_name );
+            w.location( tl.to_name );
+            w.varint( tl.new_from_bal );
+            w.varint( tl.new_to_bal );
+            w.location( tl.last_from_trx );
+            w.location( tl.last_to_trx );
+            w.location( tl.trx_idx );
+            break;
+        }
+        case start_trx::id:
+        {
+            start_trx st = r;
+            w.bytes( (const char*)&st.trx_hash, sizeof(st.trx_hash) );
+            w.varint( st.utc_time );
+            break;
+        }
+        default: // define_key, end_block and unknown records keep their packing
+            if( r.data.size() )
+                w.bytes( &r.data.front(), r.data.size() );
+    }
+    return 0;
+}
+
+void decode_payload( uint32_t version, const record_header& h, const char* payload,
+                     uint64_t loc, std::vector<char>& raw, key_dictionary* keys )
+{
+    raw.clear();
+    if( version != log_v2 )
+    {
+        raw.assign( payload, payload + h.len );
+        return;
+    }
+
+    payload_reader rd( payload, h.len, loc );
+    switch( h.id )
+    {
+        case define_name::id:
+        {
+            define_name dn;
+            dn.name = rd.string();
+            read_key( rd, h.flags, dn.key, keys );
+            boost::rpc::raw::pack( raw, dn );
+            break;
+        }
+        case update_name::id:
+        {
+            update_name un;
+            un.name_idx        = rd.location();
+            un.last_update_idx = rd.location();
+            read_key( rd, h.flags, un.key, keys );
+            boost::rpc::raw::pack( raw, un );
+            break;
+        }
+        case transfer_log::id:
+        {
+            transfer_log tl;
+            tl.amount        = rd.varint();
+            tl.type_name     = rd.location();
+            tl.from_name     = rd.location();
+            tl.to_name       = rd.location();
+            tl.new_from_bal  = rd.varint();
+            tl.new_to_bal    = rd.varint();
+            tl.last_from_trx = rd.location();
+            tl.last_to_trx   = rd.location();
+            tl.trx_idx       = rd.location();
+            boost::rpc::raw::pack( raw, tl );
+            break;
+        }
+        case start_trx::id:
+        {
+            start_trx st;
+            rd.bytes( (char*)&st.trx_hash, sizeof(st.trx_hash) );
+            st.utc_time = rd.varint();
+            boost::rpc::raw::pack( raw, st );
+            break;
+        }
+        default:
+            raw.assign( payload, payload + h.len );
+    }
+}
+
+void encode_record( uint32_t version, const state_record& r, uint64_t loc, std::vector<char>& out,
+                    key_dictionary* keys )
+{
+    if( version != log_v2 )
+    {
+        state_record r2(r); r2.previous = loc;
+        std::vector<char> v;
+        boost::rpc::raw::pack( v, r2 );
+        out.insert( out.end(), v.begin(), v.end() );
+        return;
+    }
+
+    size_t   start = out.size();
+    out.resize( start + v2_header );
+    uint16_t flags = encode_payload( r, loc, out, keys );
+
+    uint32_t len  = out.size() - start - v2_header;
+    uint32_t size = v2_header + padded(len) + sizeof(uint32_t);
+    out.resize( start + size - sizeof(uint32_t), 0 );
+    out.insert( out.end(), (const char*)&size, (const char*)&size + sizeof(size) );
+
+    char* d = &out[start];
+    memcpy( d + 4, (const char*)&r.id,  sizeof(r.id) );
+    memcpy( d + 6, (const char*)&flags, sizeof(flags) );
+    memcpy( d + 8, (const char*)&len,   sizeof(len) );
+    uint32_t crc = payload_crc( d, len );
+    memcpy( d, (const char*)&crc, sizeof(crc) );
+}
+
+uint64_t decode_record( uint32_t version, const char* d, uint64_t avail, uint64_t loc, state_record& r,
+                        key_dictionary* keys )
+{
+    record_header h;
+    if( !parse_header( version, d, avail, h ) || avail < h.size )
+        return 0;
+    r.id = h.id;
+    if( version == log_v2 )
+    {
+        decode_payload( version, h, d + h.data, loc, r.data, keys );
+        r.previous = loc;
+    }
+    else
+    {
+        r.data.assign( d + h.data, d + h.data + h.len );
+        memcpy( (char*)&r.previous, d + h.data + h.len, sizeof(r.previous) );
+    }
+    return h.size;
+}
+
+bool is_key_record( uint32_t version, const char* d, uint64_t avail, const char* key, uint32_t len )
+{
+    record_header h;
+    if( !parse_header( version, d, avail, h ) || h.id != define_key::id || h.len != len || avail < h.data + h.len )
+        return false;
+    return 0 == memcmp( d + h.data, key, len );
+}
+
+} // namespace gpm
@@ -0,0 +1,132 @@
+#ifndef _GPM_LOG_FORMAT_HPP_
+#define _GPM_LOG_FORMAT_HPP_
+#include <stdint.h>
+#include <vector>
+#include <gpm/crypto/crypto.hpp>
+
+namespace gpm {
+
+    struct state_record;
+
+    /**
+     *  Encodings of the state log.  The version is fixed when the log is created,
+     *  every node that exchanges state chunks with another must use the same one.
+     *
+     *  log_v1 - id, length prefixed payload packed with boost::rpc::raw and the
+     *           location of the record itself.
+     *
+     *  log_v2 - the log starts with log_magic.  Each record has a fixed 12 byte
+     *           header (crc, id, flags, length), a payload padded to 4 bytes and
+     *           a 4 byte footer with the size of the record.  The footer links
+     *           each record to the one before it so the log can be walked back
+     *           from its end.  Payloads store integers as varints and locations
+     *           as the distance back from the record.  Public keys are stored
+     *           once in a define_key record and referenced by its location.
+     */
+    enum log_version { log_v1 = 1, log_v2 = 2 };
+
+    /**
+     *  record_header::flags
+     *
+     *  key_ref - the key of a define_name / update_name is the location of a define_key
+     *            record instead of the key itself
+     */
+    enum record_flags { key_ref = 0x01 };
+
+    /**
+     *  Resolves the public keys of log_v2 records to the define_key records that
+     *  hold them.
+     */
+    class key_dictionary
+    {
+        public:
+            virtual ~key_dictionary(){}
+
+            /// @return the location of the define_key record for k or -1
+            virtual uint64_t find_key( const public_key_t& k ) = 0;
+
+            /// reads the key of the define_key record at loc
+            virtual bool     get_key( uint64_t loc, public_key_t& k ) = 0;
+    };
+
+    const char log_magic[8] = { 'G', 'P', 'M', 'L', 'O', 'G', '2', 0 };
+
+    /**
+     *  Everything about a record that can be known without decoding its payload.
+     */
+    struct record_header
+    {
+        record_header():id(0),flags(0),len(0),data(0),size(0),crc(0),previous(-1){}
+
+        uint16_t id;
+        uint16_t flags;
+        uint32_t len;      // bytes of the payload
+        uint32_t data;     // offset of the payload from the start of the record
+        uint64_t size;     // bytes of the whole record
+        uint32_t crc;      // log_v2 only
+        uint64_t previous; // location of the previous record or -1 for the first
+    };
+
+    /// location of the first record
+    uint64_t log_start( uint32_t version );
+
+    /// bytes parse_header() needs
+    uint32_t header_size( uint32_t version );
+
+    /// bytes at the end of a record that record_before() needs
+    uint32_t footer_size( uint32_t version );
+
+    /**
+     *  Parses the header at d, does not read the payload or set previous.
+     *
+     *  @return false if d does not start with a header
+     */
+    bool     parse_header( uint32_t version, const char* d, uint64_t avail, record_header& h );
+
+    /**
+     *  @param footer the footer_size() bytes before end
+     *  @return the location of the record that ends at end
+     */
+    uint64_t record_before( uint32_t version, const char* footer, uint64_t end );
+
+    /**
+     *  @return false if the payload of the complete record at d does not match its crc
+     */
+    bool     check_record( uint32_t version, const char* d, const record_header& h );
+
+    /**
+     *  Appends r, which will be stored at loc, to out.
+     *
+     *  @param keys if not NULL keys that it knows are stored as references
+     */
+    void     encode_record( uint32_t version, const state_record& r, uint64_t loc, std::vector<char>& out,
+                            key_dictionary* keys = 0 );
+
+    /**
+     *  Converts the payload of the record at loc to the boost::rpc::raw packing
+     *  used by state_record::data.
+     *
+     *  @param payload the h.len bytes at h.data
+     *  @param keys    resolves key references, if NULL they decode as empty keys
+     */
+    void     decode_payload( uint32_t version, const record_header& h, const char* payload,
+                             uint64_t loc, std::vector<char>& raw, key_dictionary* keys = 0 );
+
+    /**
+     *  Decodes the complete record at d, which is at loc.  The crc is not checked,
+     *  open() and rebuilds check every record with check_record() instead.
+     *
+     *  @return the size of the record or 0 if it is incomplete
+     */
+    uint64_t decode_record( uint32_t version, const char* d, uint64_t avail, uint64_t loc, state_record& r,
+                            key_dictionary* keys = 0 );
+
+    /**
+     *  @return true if the record at d is a define_key record that holds the packed
+     *          key in key, the payload is compared without decoding it
+     */
+    bool     is_key_record( uint32_t version, const char* d, uint64_t avail, const char* key, uint32_t len );
+
+} // namespace gpm
+
+#endif
@@ -0,0 +1,78 @@
+#include "mapped_file.hpp"
+#include <boost/rpc/log/log.hpp>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+namespace gpm {
+
+// grow the reserved address space in 64MB steps so remapping is rare
+static const uint64_t reserve_step = 64*1024*1024;
+
+mapped_file::mapped_file()
+:m_fd(-1),m_data(NULL),m_size(0),m_reserved(0){}
+
+mapped_file::~mapped_file()
+{
+    close();
+}
+
+void mapped_file::open( const boost::filesystem::path& p, uint64_t s )
+{
+    close();
+    m_path = p;
+    m_fd = ::open( p.native_file_string().c_str(), O_RDONLY );
+    if( m_fd < 0 )
+        THROW_GPM_EXCEPTION( "Error opening file %1%: %2%", %p %strerror(errno) );
+    remap( s );
+}
+
+void mapped_file::close()
+{
+    if( m_data )
+        munmap( m_data, m_reserved );
+    if( m_fd >= 0 )
+        ::close( m_fd );
+    m_fd       = -1;
+    m_data     = NULL;
+    m_size     = 0;
+    m_reserved = 0;
+}
+
+void mapped_file::remap( uint64_t s )
+{
+    if( s <= m_reserved )
+    {
+        m_size = s;
+        return;
+    }
+    if( m_data )
+        munmap( m_data, m_reserved );
+    m_data     = NULL;
+    m_size     = 0;
+    m_reserved = ((std::max( s, m_reserved * 2 ) + reserve_step - 1) / reserve_step) * reserve_step;
+
+    void* d = mmap( NULL, m_reserved, PROT_READ, MAP_SHARED, m_fd, 0 );
+    if( d == MAP_FAILED )
+    {
+        m_reserved = 0;
+        THROW_GPM_EXCEPTION( "Error mapping file %1%: %2%", %m_path %strerror(errno) );
+    }
+    m_data = (char*)d;
+    m_size = s;
+}
+
+uint64_t mapped_file::read( uint64_t pos, char* buf, uint64_t len )const
+{
+    if( pos >= m_size )
+        return 0;
+    uint64_t r = std::min( len, m_size - pos );
+    memcpy( buf, m_data + pos, r );
+    return r;
+}
+
+} // namespace gpm
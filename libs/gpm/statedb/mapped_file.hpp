@@ -0,0 +1,59 @@
+#ifndef _GPM_MAPPED_FILE_HPP_
+#define _GPM_MAPPED_FILE_HPP_
+#include <gpm/exception.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+
+namespace gpm {
+
+/**
+ *  @class mapped_file
+ *  @brief Read only memory map of a file that is appended to through another handle.
+ *
+ *  The state log is written with a buffered FILE* but read far more often
+ *  than it is written.  This class maps the file so that reads become
+ *  pointer arithmetic instead of seek/read system calls.
+ *
+ *  The mapping reserves more address space than the file currently uses so
+ *  that it only has to be replaced after the file has grown past the reserved
+ *  region.  Only the first size() bytes may be accessed, touching pages beyond
+ *  the end of the file would raise SIGBUS.
+ */
+class mapped_file
+{
+    public:
+        typedef boost::shared_ptr<mapped_file> ptr;
+
+        mapped_file();
+        ~mapped_file();
+
+        void        open( const boost::filesystem::path& p, uint64_t size );
+        void        close();
+
+        /**
+         *  Makes the first s bytes of the file available through data().  The
+         *  caller must have flushed any writes below s to the file first.
+         */
+        void        remap( uint64_t s );
+
+        const char* data()const { return m_data; }
+        uint64_t    size()const { return m_size; }
+
+        /// copies up to len bytes starting at pos, returns the number of bytes copied
+        uint64_t    read( uint64_t pos, char* buf, uint64_t len )const;
+
+    private:
+        mapped_file( const mapped_file& );
+        mapped_file& operator=( const mapped_file& );
+
+        int                      m_fd;
+        char*                    m_data;
+        uint64_t                 m_size;
+        uint64_t                 m_reserved;
+        boost::filesystem::path  m_path;
+};
+
+} // namespace gpm
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef _GPM_NAME_TABLE_HPP_
+#define _GPM_NAME_TABLE_HPP_
+#include <gpm/statedb/flat_index.hpp>
+
+namespace gpm {
+
+    /**
+     *  Most names a name_table holds.
+     */
+    const uint32_t name_table_size = 64*1024;
+
+    /**
+     *  @class name_table
+     *  @brief Caches the names that have been committed to the state log.
+     *
+     *  A name is resolved from its string or from the location of its define_name
+     *  record without going to the name_index database or decoding define_name /
+     *  update_name records.
+     *
+     *  Names are kept in two halves.  New and recently used names go to the newer
+     *  half, when it is full it replaces the older one, so the names that were not
+     *  used while it filled up are dropped and the table never holds more than
+     *  name_table_size names.
+     *
+     *  Only committed names may be interned: the location of a committed
+     *  define_name record never changes, the last edit is kept current by
+     *  state_database::commit().  An entry of the newer half replaces the one of
+     *  the older half.
+     */
+    class name_table
+    {
+        public:
+            struct entry
+            {
+                entry( uint64_t ni = -1, uint64_t le = -1 )
+                :name_idx(ni),last_edit(le){}
+
+                uint64_t    name_idx;  // location of the define_name record
+                uint64_t    last_edit; // location of the last define_name / update_name record
+            };
+
+            /**
+             *  @return false if name is not in the table
+             */
+            bool find( const std::string& name, entry& e )
+            {
+                const entry* n = m_new.names.find(name);
+                if( n )
+                {
+                    e = *n;
+                    return true;
+                }
+                const entry* o = m_old.names.find(name);
+                if( !o )
+                    return false;
+                e = *o;
+                intern( name, e.name_idx, e.last_edit );
+                return true;
+            }
+
+            /**
+             *  Finds the name defined at name_idx.
+             *
+             *  @return false if it is not in the table
+             */
+            bool find_index( uint64_t name_idx, std::string& name )
+            {
+                const std::string* n = m_new.by_index.find(name_idx);
+                if( n )
+                {
+                    name = *n;
+                    return true;
+                }
+                const std::string* o = m_old.by_index.find(name_idx);
+                if( !o )
+                    return false;
+                name = *o;
+                entry e;
+                find( name, e ); // moves it to the newer half
+                return true;
+            }
+
+            /**
+             *  Adds name to the newer half or updates its last edit.
+             */
+            void intern( const std::string& name, uint64_t name_idx, uint64_t last_edit )
+            {
+                if( m_new.names.size() >= name_table_size / 2 && !m_new.names.find(name) )
+                {
+                    m_old.swap( m_new );
+                    m_new.clear();
+                }
+                m_new.names[name]        = entry( name_idx, last_edit );
+                m_new.by_index[name_idx] = name;
+            }
+
+            /// names in both halves, a name may be counted twice
+            uint64_t size()const { return m_new.names.size() + m_old.names.size(); }
+
+            void clear()
+            {
+                m_new.clear();
+                m_old.clear();
+            }
+
+        private:
+            struct half
+            {
+                flat_index<std::string,entry>      names;
+                flat_index<uint64_t,std::string>   by_index; // name_idx -> name
+
+                void clear()            { names.clear(); by_index.clear(); }
+                void swap( half& h )    { names.swap( h.names ); by_index.swap( h.by_index ); }
+            };
+
+            half m_new;
+            half m_old;
+    };
+
+} // namespace gpm
+
+#endif
@@ -0,0 +1,437 @@
+#include "segmented_log.hpp"
+#include <boost/rpc/log/log.hpp>
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+namespace gpm {
+
+namespace bfs = boost::filesystem;
+
+static const char segment_magic[8] = { 'G', 'P', 'M', 'S', 'E', 'G', '1', 0 };
+
+// magic, start, size, block size and block count
+static const uint64_t segment_header = sizeof(segment_magic) + 2*sizeof(uint64_t) + 2*sizeof(uint32_t);
+
+static std::string hex_name( uint64_t start )
+{
+    char buf[17];
+    snprintf( buf, sizeof(buf), "%016llx", (unsigned long long)start );
+    return buf;
+}
+
+/**
+ *  @return true if name is prefix followed by a location written by hex_name()
+ */
+static bool parse_name( const std::string& name, const std::string& prefix, uint64_t& start )
+{
+    if( name.size() != prefix.size() + 16 || name.compare( 0, prefix.size(), prefix ) != 0 )
+        return false;
+    char* e = 0;
+    start = strtoull( name.c_str() + prefix.size(), &e, 16 );
+    return *e == 0;
+}
+
+static bool is_tmp( const std::string& name )
+{
+    return name.size() > 4 && name.compare( name.size() - 4, 4, ".tmp" ) == 0;
+}
+
+/**
+ *  Waits until the renames in dir are on disk, a rename is only durable once
+ *  the directory that holds the name is synced.
+ */
+static void sync_dir( const bfs::path& dir )
+{
+    int fd = ::open( dir.native_file_string().c_str(), O_RDONLY );
+    if( fd < 0 )
+        THROW_GPM_EXCEPTION( "Error opening directory %1%: %2%", %dir.native_file_string() %strerror(errno) );
+    int r = fsync( fd );
+    int e = errno;
+    ::close( fd );
+    if( r != 0 )
+        THROW_GPM_EXCEPTION( "Error syncing directory %1%: %2%", %dir.native_file_string() %strerror(e) );
+}
+
+segmented_log::segmented_log()
+:m_segment_size(0),m_compress(false),m_tail_start(0),m_tail_size(0),m_block_pos(-1){}
+
+segmented_log::~segmented_log()
+{
+    close();
+}
+
+void segmented_log::set_segment_size( uint64_t s )
+{
+    m_segment_size = s;
+}
+
+void segmented_log::set_compression( bool c )
+{
+    m_compress = c;
+}
+
+bfs::path segmented_log::tail_path( uint64_t start )const
+{
+    if( start == 0 )
+        return m_dir/"state";
+    return m_dir/("state." + hex_name(start));
+}
+
+bfs::path segmented_log::segment_path( uint64_t start )const
+{
+    return m_dir/"segments"/hex_name(start);
+}
+
+void segmented_log::open( const bfs::path& dir )
+{
+    close();
+    m_dir = dir;
+    if( !bfs::exists( dir/"segments" ) )
+        bfs::create_directory( dir/"segments" );
+
+    // older tails and temporary files were left by a seal() that did not finish
+    std::vector<uint64_t> tails;
+    if( bfs::exists( dir/"state" ) )
+        tails.push_back( 0 );
+    std::vector<bfs::path> stale;
+    bfs::directory_iterator end;
+    for( bfs::directory_iterator itr( dir ); itr != end; ++itr )
+    {
+        std::string name = itr->path().filename();
+        uint64_t    start;
+        if( parse_name( name, "state.", start ) )
+            tails.push_back( start );
+        else if( name.compare( 0, 6, "state." ) == 0 && is_tmp( name ) )
+            stale.push_back( itr->path() );
+    }
+    uint64_t tail = tails.size() ? *std::max_element( tails.begin(), tails.end() ) : 0;
+    for( uint32_t i = 0; i < tails.size(); ++i )
+        if( tails[i] != tail )
+            stale.push_back( tail_path( tails[i] ) );
+
+    for( bfs::directory_iterator itr( dir/"segments" ); itr != end; ++itr )
+    {
+        std::string name = itr->path().filename();
+        uint64_t    start;
+        if( !parse_name( name, "", start ) || start >= tail )
+        {
+            stale.push_back( itr->path() );
+            continue;
+        }
+        m_segments.push_back( segment() );
+        load_segment( itr->path(), m_segments.back() );
+    }
+    for( uint32_t i = 0; i < stale.size(); ++i )
+    {
+        wlog( "removing %1% left by an interrupted seal", stale[i].native_file_string() );
+        bfs::remove( stale[i] );
+    }
+
+    std::sort( m_segments.begin(), m_segments.end(), segment_less );
+    uint64_t expected = 0;
+    for( uint32_t i = 0; i < m_segments.size(); ++i )
+    {
+        if( m_segments[i].start != expected )
+            THROW_GPM_EXCEPTION( "State log segment at %1% is missing", %expected );
+        expected += m_segments[i].size;
+    }
+    if( expected != tail )
+        THROW_GPM_EXCEPTION( "State log segment at %1% is missing", %expected );
+
+    open_tail( tail );
+}
+
+void segmented_log::open_tail( uint64_t start )
+{
+    bfs::path p = tail_path( start );
+    m_file = gpm::file::ptr( new gpm::file( p, bfs::exists(p) ? "rb+" : "wb+" ) );
+    m_tail_start = start;
+    m_tail_size  = m_file->size();
+    m_file->seek( m_tail_size );
+    m_map.open( p, m_tail_size );
+}
+
+void segmented_log::close()
+{
+    m_map.close();
+    m_file.reset();
+    m_segments.clear();
+    m_tail_start = 0;
+    m_tail_size  = 0;
+    m_block_pos  = -1;
+    m_block.clear();
+}
+
+void segmented_log::load_segment( const bfs::path& p, segment& s )
+{
+    s.f = gpm::file::ptr( new gpm::file( p, "rb" ) );
+    char     magic[sizeof(segment_magic)];
+    uint32_t count = 0;
+    s.f->seek( 0 );
+    if( s.f->read( magic, sizeof(magic) ) != sizeof(magic) || memcmp( magic, segment_magic, sizeof(magic) ) != 0 )
+        THROW_GPM_EXCEPTION( "%1% is not a state log segment", %p.native_file_string() );
+    s.f->read( (char*)&s.start,      sizeof(s.start) );
+    s.f->read( (char*)&s.size,       sizeof(s.size) );
+    s.f->read( (char*)&s.block_size, sizeof(s.block_size) );
+    s.f->read( (char*)&count,        sizeof(count) );
+    s.blocks.resize( count + 1 );
+    s.f->read( (char*)&s.blocks.front(), s.blocks.size() * sizeof(uint64_t) );
+
+    if( !s.block_size || count != (s.size + s.block_size - 1) / s.block_size || s.blocks.back() != s.f->size() )
+        THROW_GPM_EXCEPTION( "State log segment %1% is corrupt", %p.native_file_string() );
+}
+
+/**
+ *  Writes the len bytes at d as the segment that starts at start.  Blocks that do not
+ *  get smaller when compressed are stored as they are.
+ */
+void segmented_log::write_segment( uint64_t start, const char* d, uint64_t len )
+{
+    uint32_t              count = (len + segment_block_size - 1) / segment_block_size;
+    std::vector<uint64_t> blocks( count + 1 );
+    std::vector<char>     z( compressBound( segment_block_size ) );
+    bfs::path             p   = segment_path( start );
+    bfs::path             tmp = p.native_file_string() + ".tmp";
+    {
+        gpm::file f( tmp, "wb+" );
+        f.write( segment_magic, sizeof(segment_magic) );
+        f.write( (const char*)&start, sizeof(start) );
+        f.write( (const char*)&len, sizeof(len) );
+        f.write( (const char*)&segment_block_size, sizeof(segment_block_size) );
+        f.write( (const char*)&count, sizeof(count) );
+        f.write( (const char*)&blocks.front(), blocks.size() * sizeof(uint64_t) );
+
+        uint64_t pos = segment_header + blocks.size() * sizeof(uint64_t);
+        for( uint32_t i = 0; i < count; ++i )
+        {
+            const char* b    = d + uint64_t(i) * segment_block_size;
+            uLong       blen = std::min( uint64_t(segment_block_size), len - uint64_t(i) * segment_block_size );
+            uLongf      zlen = z.size();
+            blocks[i] = pos;
+            if( m_compress && compress2( (Bytef*)&z.front(), &zlen, (const Bytef*)b, blen, Z_DEFAULT_COMPRESSION ) == Z_OK
+                && zlen < blen )
+            {
+                f.write( &z.front(), zlen );
+                pos += zlen;
+            }
+            else
+            {
+                f.write( b, blen );
+                pos += blen;
+            }
+        }
+        blocks[count] = pos;
+        f.seek( segment_header );
+        f.write( (const char*)&blocks.front(), blocks.size() * sizeof(uint64_t) );
+        f.sync();
+    }
+    bfs::rename( tmp, p );
+}
+
+const segmented_log::segment& segmented_log::find_segment( uint64_t pos )const
+{
+    std::vector<segment>::const_iterator itr = std::upper_bound( m_segments.begin(), m_segments.end(), pos, by_start );
+    if( itr == m_segments.begin() )
+        THROW_GPM_EXCEPTION( "No state log segment holds %1%", %pos );
+    return *(itr - 1);
+}
+
+/**
+ *  Decodes block b of s into m_block unless it is already there.
+ */
+void segmented_log::load_block( const segment& s, uint32_t b )
+{
+    uint64_t pos = s.start + uint64_t(b) * s.block_size;
+    if( pos == m_block_pos )
+        return;
+    m_block_pos = -1;
+
+    uLongf   len    = std::min( uint64_t(s.block_size), s.size - uint64_t(b) * s.block_size );
+    uint64_t stored = s.blocks[b+1] - s.blocks[b];
+    std::vector<char> z( stored );
+    s.f->seek( s.blocks[b] );
+    if( s.f->read( &z.front(), stored ) != stored )
+        THROW_GPM_EXCEPTION( "Error reading block %1% of the state log segment at %2%", %b %s.start );
+
+    if( stored == len )
+        m_block.swap( z );
+    else
+    {
+        m_block.resize( len );
+        uLongf out = len;
+        if( uncompress( (Bytef*)&m_block.front(), &out, (const Bytef*)&z.front(), stored ) != Z_OK || out != len )
+            THROW_GPM_EXCEPTION( "Block %1% of the state log segment at %2% is corrupt", %b %s.start );
+    }
+    m_block_pos = pos;
+}
+
+uint64_t segmented_log::read( uint64_t pos, char* buf, uint64_t len )
+{
+    uint64_t r = 0;
+    if( len && pos < m_tail_start )
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        while( len && pos < m_tail_start )
+        {
+            const segment& s = find_segment( pos );
+            load_block( s, (pos - s.start) / s.block_size );
+            uint64_t off = pos - m_block_pos;
+            uint64_t n   = std::min( len, uint64_t(m_block.size() - off) );
+            memcpy( buf, &m_block[off], n );
+            buf += n;
+            pos += n;
+            len -= n;
+            r   += n;
+        }
+    }
+    if( len )
+        r += m_map.read( pos - m_tail_start, buf, len );
+    return r;
+}
+
+const char* segmented_log::bytes( uint64_t pos, uint64_t len, std::vector<char>& buf )
+{
+    if( pos >= m_tail_start && pos - m_tail_start + len <= m_map.size() )
+        return m_map.data() + (pos - m_tail_start);
+    buf.resize( len );
+    if( !len || read( pos, &buf.front(), len ) != len )
+        return NULL;
+    return &buf.front();
+}
+
+void segmented_log::append( const char* d, uint64_t len )
+{
+    m_file->write( d, len );
+    m_tail_size += len;
+}
+
+void segmented_log::flush()
+{
+    write_out( false );
+    publish();
+}
+
+void segmented_log::sync()
+{
+    write_out( true );
+    publish();
+}
+
+void segmented_log::write_out( bool sync )
+{
+    if( sync )
+        m_file->sync();
+    else
+        m_file->flush();
+}
+
+/**
+ *  Replacing the map moves tail(), so it must not run while anything reads the log.
+ */
+void segmented_log::publish()
+{
+    m_map.remap( m_tail_size );
+}
+
+/**
+ *  Replaces the tail with one that starts at the segment holding s and ends at s.
+ *  The old tail is removed before the segments so that open() falls back to the 
+ *  old tail until the new one is the only one left.
+ */
+void segmented_log::unseal( uint64_t s )
+{
+    uint64_t          start = find_segment( s ).start;
+    std::vector<char> d( s - start );
+    if( d.size() && read( start, &d.front(), d.size() ) != d.size() )
+        THROW_GPM_EXCEPTION( "Error reading the state log segment at %1%", %start );
+
+    bfs::path old = tail_path( m_tail_start );
+    bfs::path p   = tail_path( start );
+    bfs::path tmp = p.native_file_string() + ".tmp";
+    {
+        gpm::file t( tmp, "wb+" );
+        if( d.size() )
+            t.write( &d.front(), d.size() );
+        t.sync();
+    }
+    bfs::rename( tmp, p );
+    sync_dir( m_dir );
+
+    m_map.close();
+    m_file.reset();
+    bfs::remove( old );
+    while( m_segments.size() && m_segments.back().start >= start )
+    {
+        m_segments.back().f.reset();
+        bfs::remove( segment_path( m_segments.back().start ) );
+        m_segments.pop_back();
+    }
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        m_block_pos = -1;
+    }
+    open_tail( start );
+    wlog( "moved the state log after %1% back into the tail", start );
+}
+
+void segmented_log::truncate( uint64_t s )
+{
+    if( s < m_tail_start )
+        unseal( s );
+    m_tail_size = s - m_tail_start;
+    m_file->truncate( m_tail_size );
+    m_file->seek( m_tail_size );
+    m_map.remap( m_tail_size );
+}
+
+uint32_t segmented_log::seal( uint64_t limit )
+{
+    if( !m_segment_size )
+        return 0;
+    flush();
+
+    uint64_t end = m_tail_start;
+    while( end + m_segment_size <= std::min( limit, size() ) )
+        end += m_segment_size;
+    if( end == m_tail_start )
+        return 0;
+
+    uint32_t n = 0;
+    for( uint64_t s = m_tail_start; s < end; s += m_segment_size, ++n )
+        write_segment( s, m_map.data() + (s - m_tail_start), m_segment_size );
+    sync_dir( m_dir/"segments" );
+
+    // the new tail must be complete before the old one is removed
+    bfs::path old = tail_path( m_tail_start );
+    bfs::path p   = tail_path( end );
+    bfs::path tmp = p.native_file_string() + ".tmp";
+    {
+        gpm::file t( tmp, "wb+" );
+        if( size() > end )
+            t.write( m_map.data() + (end - m_tail_start), size() - end );
+        t.sync();
+    }
+    bfs::rename( tmp, p );
+    sync_dir( m_dir );
+
+    for( uint64_t s = m_tail_start; s < end; s += m_segment_size )
+    {
+        m_segments.push_back( segment() );
+        load_segment( segment_path( s ), m_segments.back() );
+    }
+    m_map.close();
+    m_file.reset();
+    bfs::remove( old );
+    open_tail( end );
+
+    slog( "sealed %1% segments of the state log, the tail starts at %2%", n, end );
+    return n;
+}
+
+} // namespace gpm
@@ -0,0 +1,153 @@
+#ifndef _GPM_SEGMENTED_LOG_HPP_
+#define _GPM_SEGMENTED_LOG_HPP_
+#include <gpm/statedb/trx_file.hpp>
+#include <gpm/statedb/mapped_file.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#include <vector>
+
+namespace gpm {
+
+/**
+ *  Bytes of a sealed segment that are compressed and decoded together.
+ */
+const uint32_t segment_block_size = 64*1024;
+
+/**
+ *  @class segmented_log
+ *  @brief The state log stored as sealed segments followed by an active tail.
+ *
+ *  Locations in the log do not depend on which file holds the bytes.  The tail
+ *  is the only file that is appended to and it is memory mapped so that reads
+ *  of recent records are pointer arithmetic.  seal() moves whole segments from
+ *  the front of the tail into files of their own that never change again.
+ *
+ *  Sealed segments are split into segment_block_size blocks that are compressed
+ *  independently, so reading from a segment only decodes the blocks that are
+ *  read.  The last decoded block is kept for the next read.
+ *
+ *  Files in the directory:
+ *
+ *      state             - the tail of a log that was never sealed
+ *      state.<start>     - the tail that starts at location start (hex)
+ *      segments/<start>  - the sealed segment that starts at start (hex)
+ *
+ *  seal() writes the new tail under its own name before removing the old one,
+ *  open() uses the tail with the highest start and drops any segment at or past
+ *  it, so a seal() that was interrupted never leaves the log inconsistent.  The
+ *  directories are synced after each rename so that a crash cannot keep the
+ *  removal of the old tail but lose the new name.
+ */
+class segmented_log
+{
+    public:
+        segmented_log();
+        ~segmented_log();
+
+        void        open( const boost::filesystem::path& dir );
+        void        close();
+
+        /**
+         *  Size of the segments made by seal(), 0 disables sealing.  Segments that
+         *  were already sealed keep their size.
+         */
+        void        set_segment_size( uint64_t s );
+        uint64_t    segment_size()const { return m_segment_size; }
+
+        /// compress the blocks of segments sealed from now on
+        void        set_compression( bool c );
+
+        uint64_t    size()const       { return m_tail_start + m_tail_size; }
+        uint64_t    tail_start()const { return m_tail_start; }
+
+        /// the bytes from tail_start() up to the last flush() or sync()
+        const char* tail()const       { return m_map.data(); }
+
+        /**
+         *  Copies up to len bytes starting at pos.  May be called from several
+         *  threads at once as long as nothing is appended.
+         *
+         *  @return the number of bytes copied
+         */
+        uint64_t    read( uint64_t pos, char* buf, uint64_t len );
+
+        /**
+         *  @return the len bytes at pos in place if they are all in the tail, otherwise
+         *          a copy of them in buf.  NULL if the log ends before pos + len.
+         */
+        const char* bytes( uint64_t pos, uint64_t len, std::vector<char>& buf );
+
+        /// appended bytes can be read once flush() or sync() returns
+        void        append( const char* d, uint64_t len );
+        void        flush();
+
+        /// flushes and waits until the tail is on disk
+        void        sync();
+
+        /**
+         *  Writes the appended bytes to the file, and waits until they are on disk if
+         *  sync is set, but leaves the map alone.  Readers of the bytes before them
+         *  may keep running, publish() makes the new bytes readable.
+         */
+        void        write_out( bool sync );
+        void        publish();
+
+        /**
+         *  Discards the bytes after s.  Segments that hold any of them are moved back
+         *  into the tail first.
+         */
+        void        truncate( uint64_t s );
+
+        /**
+         *  Seals every complete segment at the start of the tail that ends at or
+         *  before limit and rewrites the tail without them.
+         *
+         *  @return the number of segments sealed
+         */
+        uint32_t    seal( uint64_t limit );
+
+    private:
+        segmented_log( const segmented_log& );
+        segmented_log& operator=( const segmented_log& );
+
+        struct segment
+        {
+            segment():start(0),size(0),block_size(0){}
+
+            uint64_t               start;
+            uint64_t               size;
+            uint32_t               block_size;
+            std::vector<uint64_t>  blocks;  // file offset of each block and of the end
+            gpm::file::ptr         f;
+        };
+
+        static bool by_start( uint64_t pos, const segment& s )          { return pos < s.start; }
+        static bool segment_less( const segment& a, const segment& b )  { return a.start < b.start; }
+
+        boost::filesystem::path tail_path( uint64_t start )const;
+        boost::filesystem::path segment_path( uint64_t start )const;
+        void                    open_tail( uint64_t start );
+        void                    load_segment( const boost::filesystem::path& p, segment& s );
+        void                    write_segment( uint64_t start, const char* d, uint64_t len );
+        const segment&          find_segment( uint64_t pos )const;
+        void                    load_block( const segment& s, uint32_t b );
+        void                    unseal( uint64_t s );
+
+        boost::filesystem::path  m_dir;
+        uint64_t                 m_segment_size;
+        bool                     m_compress;
+
+        std::vector<segment>     m_segments;  // by start, they cover 0 to m_tail_start
+        uint64_t                 m_tail_start;
+        uint64_t                 m_tail_size;
+        gpm::file::ptr           m_file;      // appends to the tail
+        gpm::mapped_file         m_map;       // reads of the tail
+
+        boost::mutex             m_mutex;     // the segment files and the decoded block
+        uint64_t                 m_block_pos; // location of m_block or -1
+        std::vector<char>        m_block;
+};
+
+} // namespace gpm
+
+#endif
@@ -2,14 +2,180 @@
 #include <boost/rpc/json.hpp>
 #include <boost/rpc/super_fast_hash.hpp>
 #include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <gpm/time/usclock.hpp>
 
 namespace gpm {
 
 typedef state_database_transaction sdt;
 
+/**
+ *  A key packed the way define_key records store it, on the stack.
+ */
+struct packed_key
+{
+    packed_key( const public_key_t& k ) { boost::rpc::raw::pack( data, sizeof(data), k ); }
+
+    /// see key_index
+    uint64_t hash()const { return flat_hash<std::string>::hash( data, sizeof(data) ); }
+
+    char data[sizeof(public_key_t)];
+};
+
+static uint64_t key_hash( const public_key_t& k )
+{
+    return packed_key( k ).hash();
+}
+
+/**
+ *  Overlays allocate their records from the arena of the database they are
+ *  stacked on, so the chunks of a committed block are reused by the next one.
+ */
 state_database_transaction::state_database_transaction( const abstract_state_database::ptr& new_base )
-:base(new_base)
+:base(new_base),m_version(0),m_cleared(0),m_parent(0),m_depth(0),m_flat(false)
+{
+    state_database_transaction* b = dynamic_cast<state_database_transaction*>( new_base.get() );
+    local_changes.set_arena( b ? b->local_changes.arena() : change_arena::ptr( new change_arena() ) );
+    update_depth();
+}
+
+/**
+ *  The base outlives its overlays, they hold a reference to it.
+ */
+state_database_transaction::~state_database_transaction()
+{
+    if( m_parent )
+        m_parent->remove_child( this );
+}
+
+void sdt::rebase( const abstract_state_database::ptr& new_base )
+{
+    // the old base may only be referenced by this overlay, keep it until it lets go of us
+    abstract_state_database::ptr old = base;
+    base = new_base;
+    ++m_version;
+    ++m_cleared;
+    m_view.valid = false;
+    update_depth();
+}
+
+void sdt::flatten()
+{
+    m_flat       = true;
+    m_view.valid = false;
+    for( uint32_t i = 0; i < m_children.size(); ++i )
+        m_children[i]->update_depth();
+}
+
+void sdt::remove_child( state_database_transaction* c )
+{
+    m_children.erase( std::remove( m_children.begin(), m_children.end(), c ), m_children.end() );
+}
+
+/**
+ *  A base that has a base of its own is an overlay, the chain ends at the
+ *  root database which has none.  The overlays stacked on this one are told
+ *  so that their depth follows a rebase or flatten of any overlay below them.
+ */
+void sdt::update_depth()
+{
+    state_database_transaction* p = dynamic_cast<state_database_transaction*>(base.get());
+    if( p && !p->base )
+        p = 0;
+    if( p != m_parent )
+    {
+        if( m_parent )
+            m_parent->remove_child( this );
+        if( p )
+            p->m_children.push_back( this );
+        m_parent = p;
+    }
+
+    m_depth = 0;
+    if( m_parent )
+        m_depth = m_parent->m_flat ? 1 : m_parent->m_depth + 1;
+    if( m_depth > max_overlay_depth && !m_flat )
+        flatten();
+    else
+        for( uint32_t i = 0; i < m_children.size(); ++i )
+            m_children[i]->update_depth();
+}
+
+/**
+ *  Adds the entries of layer i of the view that no newer layer replaces.
+ */
+void sdt::merge_layer( uint32_t i )
+{
+    const state_database_transaction* p = m_view.layers[i].layer;
+    for( account_index::const_iterator itr = p->last_transfer_map.begin(); itr != p->last_transfer_map.end(); ++itr )
+    {
+        uint32_t n = 0;
+        while( n < i && !m_view.layers[n].layer->last_transfer_map.find( itr->first ) )
+            ++n;
+        if( n == i )
+            m_view.accounts[itr->first] = itr->second;
+    }
+    for( name_index::const_iterator itr = p->last_name_edit_map.begin(); itr != p->last_name_edit_map.end(); ++itr )
+    {
+        uint32_t n = 0;
+        while( n < i && !m_view.layers[n].layer->last_name_edit_map.find( itr->first ) )
+            ++n;
+        if( n == i )
+            m_view.names[itr->first] = itr->second;
+    }
+    m_view.layers[i].version = p->m_version;
+}
+
+/**
+ *  Brings the view up to date with the chain of overlays below this one.  Overlays
+ *  that only gained entries since the view was built are merged again on their own,
+ *  the view is rebuilt if the chain changed or an overlay dropped its entries.
+ *
+ *  @return the root database, which the view does not cover
+ */
+abstract_state_database* sdt::update_view()
 {
+    if( m_view.valid )
+    {
+        uint32_t i = 0;
+        const state_database_transaction* p = m_parent;
+        for( ; p && i < m_view.layers.size(); p = p->m_parent, ++i )
+            if( m_view.layers[i].layer != p || m_view.layers[i].cleared != p->m_cleared )
+                break;
+        if( p || i != m_view.layers.size() )
+            m_view.valid = false;
+    }
+    if( m_view.valid )
+    {
+        for( uint32_t i = 0; i < m_view.layers.size(); ++i )
+            if( m_view.layers[i].version != m_view.layers[i].layer->m_version )
+                merge_layer( i );
+        return m_view.root;
+    }
+
+    m_view.accounts.clear();
+    m_view.names.clear();
+    m_view.layers.clear();
+    m_view.root = base.get();
+    for( const state_database_transaction* p = m_parent; p; p = p->m_parent )
+    {
+        m_view.layers.push_back( overlay_view::layer_state( p ) );
+        m_view.root = p->base.get();
+    }
+
+    // oldest first so that newer overlays replace older entries
+    for( int32_t i = m_view.layers.size() - 1; i >= 0; --i )
+    {
+        const state_database_transaction* p = m_view.layers[i].layer;
+        for( account_index::const_iterator itr = p->last_transfer_map.begin(); itr != p->last_transfer_map.end(); ++itr )
+            m_view.accounts[itr->first] = itr->second;
+        for( name_index::const_iterator itr = p->last_name_edit_map.begin(); itr != p->last_name_edit_map.end(); ++itr )
+            m_view.names[itr->first] = itr->second;
+    }
+    m_view.valid = true;
+    return m_view.root;
 }
 uint64_t sdt::size()const
 {
@@ -34,30 +200,50 @@ uint64_t  sdt::get_record( uint64_t loc, state_record& r )
         elog( " err " );
         return 0;
     }
-    loc -= start();
-    if( local_changes.size() <= loc )
+    uint64_t    avail;
+    const char* d = local_changes.data( loc - start(), avail );
+    if( !d )
     {
-        elog( "Invalid location %1%.", (loc + start()) );
+        elog( "Invalid location %1%.", loc );
         return 0;
     }
-    boost::rpc::raw::unpack(  &local_changes[loc], local_changes.size()-loc, r );
-    return boost::rpc::raw::packsize(r);
+    return decode_record( get_log_version(), d, avail, loc, r, this );
+}
+
+/**
+ *  Reads the header and the footer of the record before it, both of which may be
+ *  in a different layer than the payload.
+ */
+uint64_t sdt::get_record_header( uint64_t loc, record_header& h )
+{
+    uint32_t v = get_log_version();
+    char     buf[16];
+    if( loc == uint64_t(-1) || loc < log_start(v) || loc >= size() )
+        return 0;
+    if( read( loc, buf, header_size(v) ) != header_size(v) || !parse_header( v, buf, header_size(v), h ) )
+        return 0;
+    if( loc > log_start(v) && read( loc - footer_size(v), buf, footer_size(v) ) == footer_size(v) )
+        h.previous = record_before( v, buf, loc );
+    return h.size;
+}
+
+uint32_t sdt::get_log_version()
+{
+    return base ? base->get_log_version() : uint32_t(log_v1);
 }
 
 bool sdt::append_record(  const state_record& r )
 {
-    state_record r2(r); r2.previous = size();
-    std::vector<char> v;
-    boost::rpc::raw::pack( v, r2 );
-    local_changes.insert( local_changes.end(), v.begin(), v.end() );
-//    wlog( "VVVVVVVV APPEND at %1% VVVVVVVV", r2.previous );
-//    dump(r);
-//    wlog( "^^^^^^^ APPEND ^^^^^^^^^" );
+    m_encoded.clear();
+    encode_record( get_log_version(), r, size(), m_encoded, this );
+    local_changes.append( &m_encoded.front(), m_encoded.size() );
     return true;
 }
-bool  sdt::append( std::vector<char>& d, const account_index& idx, const name_index& nidx ) 
+bool  sdt::append( change_buffer& d, const account_index& idx, const name_index& nidx, 
+                   const state_counts& counts, const key_index& keys ) 
 {
-    local_changes.insert( local_changes.end(), d.begin(), d.end() );
+    m_counts += counts;
+    local_changes.splice( d );
     account_index::const_iterator itr = idx.begin();
     while( itr != idx.end() )
     {
@@ -70,26 +256,31 @@ bool  sdt::append( std::vector<char>& d, const account_index& idx, const name_in
        last_name_edit_map[nitr->first] = nitr->second;
         ++nitr;
     }
+    for( key_index::const_iterator kitr = keys.begin(); kitr != keys.end(); ++kitr )
+        m_local_keys[kitr->first] = kitr->second;
+    ++m_version;
     return true;
 }
 
 bool sdt::get_public_key_t( const std::string& name, public_key_t& pk )
 {
-//    slog( "%1%", name );
-    uint64_t nidx = get_last_name_edit_index(name);
-    if( nidx == -1 )
-    {
-//        wlog( "last_name_edit_map.find(%1%) == end", name );
+    name_edit e;
+    if( !find_name( name, e ) )
         return false;
-    }
-    //slog( "%1% found at %2%", name, nidx );
+    return get_public_key_at( e.last_edit, pk );
+}
+
+bool sdt::get_public_key_at( uint64_t last_edit, public_key_t& pk )
+{
+    if( base && last_edit < start() )
+        return base->get_public_key_at( last_edit, pk );
+
     state_record r;
-    if( !get_record( nidx, r ) )
+    if( !get_record( last_edit, r ) )
     {
-        elog( "Error getting record at %1%", nidx );
+        elog( "Error getting record at %1%", last_edit );
         return false;
     }
-//    slog( "record %1% at %2%", %boost::rpc::to_json(r) %nidx );
 
     if( r.id == define_name::id )
     {
@@ -102,20 +293,6 @@ bool sdt::get_public_key_t( const std::string& name, public_key_t& pk )
         update_name un = r;
         pk = un.key;
         return true;
-        /*
-        get_record( un.name_idx, r );
-        slog( "update name %1%", %boost::rpc::to_json(un) );
-        slog( "name idx r %1%", %boost::rpc::to_json(r) );
-        if( r.id == define_name::id )
-        {
-            define_name dn = r;
-            slog( "define_name %1%", %boost::rpc::to_json(dn) );
-            pk = dn.key;
-            return true;
-        }
-        elog( "un.name_idx != define name" );
-        return false;
-        */
     }
     else
     {
@@ -131,6 +308,9 @@ std::string sdt::get_name_for_index( uint64_t idx )
         wlog( "No name at index %1%", idx );
         return std::string();
     }
+    if( base && idx < start() )
+        return base->get_name_for_index( idx );
+
     state_record r;
     if( !get_record( idx, r ) )
         THROW_GPM_EXCEPTION( "Error getting record at index %1%", %idx );
@@ -148,133 +328,200 @@ std::string sdt::get_name_for_index( uint64_t idx )
     THROW_GPM_EXCEPTION( "No name at index %1%", %idx );
     return std::string();
 }
-uint64_t sdt::get_name_index( const std::string& nidx )
+/**
+ *  Indexes below the start of this overlay are passed down in one batch.
+ */
+std::vector<std::string> sdt::get_names_for_index( const std::vector<uint64_t>& idx )
 {
-    uint64_t lnidx = get_last_name_edit_index(nidx);
-    if( lnidx == uint64_t(-1) )
-        return -1;
-
-    state_record r;
-    if( !get_record( lnidx, r ) )
-    {
-        THROW_GPM_EXCEPTION( "Error getting record %1%", %lnidx );
-    }
-
-    if( r.id == define_name::id )
+    std::vector<std::string> names( idx.size() );
+    std::vector<uint64_t>    below;
+    std::vector<uint32_t>    pos;
+    uint64_t first = start();
+    for( uint32_t i = 0; i < idx.size(); ++i )
     {
-//        slog( "name_idx %1%", %lnidx );
-        return lnidx;
+        if( idx[i] < first )
+        {
+            below.push_back( idx[i] );
+            pos.push_back( i );
+        }
+        else
+            names[i] = get_name_for_index( idx[i] );
     }
-    else if( r.id == update_name::id )
+    if( below.size() )
     {
-        update_name un = r;
-//        slog( "%1%", %boost::rpc::to_json(un) );
-        return un.name_idx;
+        std::vector<std::string> bn = base->get_names_for_index( below );
+        for( uint32_t i = 0; i < bn.size(); ++i )
+            names[pos[i]].swap( bn[i] );
     }
-    THROW_GPM_EXCEPTION( "Error getting name index for %1%", %nidx );
+    return names;
+}
+
+uint64_t sdt::get_name_index( const std::string& nidx )
+{
+    name_edit e;
+    if( !find_name( nidx, e ) )
+        return -1;
+    return e.name_idx;
+}
+
+
+/**
+ *  Appends a define_key record for pk unless the log already has one, the
+ *  records that follow refer to it instead of repeating the key.
+ */
+void sdt::intern_key( const public_key_t& pk )
+{
+    if( get_log_version() != log_v2 || pk == public_key_t() || find_key( pk ) != uint64_t(-1) )
+        return;
+    m_local_keys[key_hash(pk)] = size();
+    ++m_version;
+    append_record( define_key( pk ) );
+}
+
+uint64_t sdt::find_key( const public_key_t& k )
+{
+    packed_key      pk( k );
+    const uint64_t* loc = m_local_keys.find( pk.hash() );
+    if( loc && local_key_at( *loc, pk.data, sizeof(pk.data) ) )
+        return *loc;
+    if( base )
+        return base->find_key( k );
     return -1;
 }
 
+/**
+ *  m_local_keys only refers to records in local_changes.
+ */
+bool sdt::local_key_at( uint64_t loc, const char* key, uint32_t len )
+{
+    uint64_t    avail;
+    const char* d = loc >= start() ? local_changes.data( loc - start(), avail ) : 0;
+    return d && is_key_record( get_log_version(), d, avail, key, len );
+}
 
-bool sdt::set_public_key( const std::string& name, const public_key_t& pk )
+bool sdt::get_key( uint64_t loc, public_key_t& k )
 {
-//    slog( "%1%", %name );
-    name_index::iterator itr = last_name_edit_map.find(name);
-    uint64_t lnidx = get_last_name_edit_index(name);
-    if( lnidx == uint64_t(-1) )
-    {
-//        slog( "%1% defined at %2%", %name %size() );
-        last_name_edit_map[name] = size();
-        return append_record( define_name( name, pk ) );
-    }
+    if( base && loc < start() )
+        return base->get_key( loc, k );
 
     state_record r;
-    get_record( lnidx, r );
+    if( !get_record( loc, r ) || r.id != define_key::id )
+        return false;
+    define_key dk = r;
+    k = dk.key;
+    return true;
+}
 
-    if( r.id == define_name::id )
-    {
-        define_name dn = r;
-//        slog( "update_name %1% ", %itr->second );
-        last_name_edit_map[name] = size();
-        return append_record( update_name( lnidx, pk, lnidx ) );
-    }
-    else if( r.id == update_name::id )
+bool sdt::set_public_key( const std::string& name, const public_key_t& pk )
+{
+    intern_key( pk );
+
+    name_edit e;
+    if( !find_name( name, e ) )
     {
-        update_name un = r;
-//        slog( "update name %1%", %boost::rpc::to_json( un ) );
-        last_name_edit_map[name] = size();
-        return append_record( update_name( un.name_idx, pk, lnidx ) );
+        last_name_edit_map[name] = name_edit( size(), size() );
+        ++m_counts.names;
+        ++m_version;
+        return append_record( define_name( name, pk ) );
     }
-    elog( "Error setting public key for %1%", name );
-    return false;
+    last_name_edit_map[name] = name_edit( size(), e.name_idx );
+    ++m_version;
+    return append_record( update_name( e.name_idx, pk, e.last_edit ) );
 }
 
 uint64_t sdt::get_balance( const std::string& account, const std::string& type, bool* is_null, uint64_t* loc  )
 {
-    uint64_t aidx = get_name_index(account);    
-    uint64_t tidx = get_name_index(type);    
-//    slog( "account idx: %1%   type index %2%", %aidx %tidx );
+    return get_balance_idx( get_name_index(account), get_name_index(type), is_null, loc );
+}
 
-    uint64_t itr = get_last_transfer_index( account_key(aidx,tidx) );
-    if( itr == uint64_t(-1) )
-    {
-//        slog( "balance is NULL" );
-        if( is_null ) 
-            *is_null = true;
-        if( loc ) 
-            *loc = -1;
-        return 0;
-    }
+uint64_t sdt::get_balance_idx( uint64_t aidx, uint64_t tidx, bool* is_null, uint64_t* loc  )
+{
+    account_state as;
+    bool found = find_account( account_key(aidx,tidx), as );
     if( is_null ) 
-        *is_null = false;
-
+        *is_null = !found;
     if( loc ) 
-        *loc = itr;
+        *loc = as.last_transfer;
+    return as.balance;
+}
 
+/**
+ *  Reads the balance of a from the transfer_log at loc, only needed when the
+ *  balance has not been materialized yet.
+ */
+uint64_t sdt::get_balance_at( uint64_t loc, const account_key& a )
+{
     state_record r;
-    get_record( itr, r );
+    get_record( loc, r );
     if( r.id != transfer_log::id )
     {
-        THROW_GPM_EXCEPTION( "Unexpected record type when looking for %1% : %2%", %account %type );
+        THROW_GPM_EXCEPTION( "Unexpected record type when looking for %1% : %2%", 
+                             %get_name_for_index(a.account_name) %get_name_for_index(a.type_name) );
     }
     transfer_log tl = r;
-//    slog( "tl %1%", %boost::rpc::to_json(tl) );
-    if( tl.type_name != tidx )
-        THROW_GPM_EXCEPTION( "Unexpected type when looking for %1% : %2%", %account %type );
+    if( tl.type_name != a.type_name )
+        THROW_GPM_EXCEPTION( "Unexpected type when looking for %1% : %2%", 
+                             %get_name_for_index(a.account_name) %get_name_for_index(a.type_name) );
 
-    if( tl.from_name == aidx ) return tl.new_from_bal;
-    if( tl.to_name == aidx ) return tl.new_to_bal;
+    if( tl.from_name == a.account_name ) return tl.new_from_bal;
+    if( tl.to_name == a.account_name ) return tl.new_to_bal;
 
-    THROW_GPM_EXCEPTION( "Source/Dest Mismatch looking for %1% : %2%", %account %type );
+    THROW_GPM_EXCEPTION( "Source/Dest Mismatch looking for %1% : %2%", 
+                         %get_name_for_index(a.account_name) %get_name_for_index(a.type_name) );
     return 0;
 }
 void  sdt::transfer_balance( const std::string& from, const std::string& to, const std::string& type, uint64_t amnt, uint64_t trx_pos )
 {
-    //slog( "transfer from %1% to %2%  %3% %4%", from, to, amnt, type );
+    transfer_balance_idx( get_name_index(from), get_name_index(to), get_name_index(type), amnt, trx_pos );
+}
+void  sdt::transfer_balance_idx( uint64_t from, uint64_t to, uint64_t type, uint64_t amnt, uint64_t trx_pos )
+{
     transfer_log  tl;
-    tl.from_name = get_name_index(from);    
-    tl.to_name   = get_name_index(to);    
-    tl.type_name = get_name_index(type);    
+    tl.from_name = from;
+    tl.to_name   = to;
+    tl.type_name = type;
     tl.amount    = amnt;
 
-    tl.new_from_bal = get_balance( from, type, 0, &tl.last_from_trx );
-    tl.new_to_bal   = get_balance( to, type, 0, &tl.last_to_trx );
+    bool from_null = true;
+    bool to_null   = true;
+    tl.new_from_bal = get_balance_idx( from, type, &from_null, &tl.last_from_trx );
+    tl.new_to_bal   = get_balance_idx( to, type, &to_null, &tl.last_to_trx );
+    uint64_t old_from_bal = tl.new_from_bal;
+    uint64_t old_to_bal   = tl.new_to_bal;
     tl.trx_idx = trx_pos;
-    //wlog( "\n\n ==========>   tl trx_idx = %1%", tl.trx_idx );
 
     if( tl.new_from_bal < amnt )
         THROW_GPM_EXCEPTION( "Insufficent '%1%' in account '%2%',  '%3%' available, " 
                              "attempt to transfer %4% %1% to %5%", 
-                                           %type %from  %tl.new_from_bal  %amnt %to );
+                                           %get_name_for_index(type) %get_name_for_index(from)  
+                                           %tl.new_from_bal  %amnt %get_name_for_index(to) );
 
     tl.new_from_bal -= amnt;
     tl.new_to_bal += amnt;
 
     uint64_t p = size();
-    last_transfer_map[ account_key( tl.from_name, tl.type_name) ] = p;
-    last_transfer_map[ account_key( tl.to_name, tl.type_name) ] = p;
+    // from last so that it wins if the account pays itself, matching get_balance_at()
+    last_transfer_map[ account_key( tl.to_name, tl.type_name) ]   = account_state( p, tl.new_to_bal );
+    last_transfer_map[ account_key( tl.from_name, tl.type_name) ] = account_state( p, tl.new_from_bal );
+    if( from != to )
+        count_change( !to_null, old_to_bal, tl.new_to_bal );
+    count_change( !from_null, old_from_bal, tl.new_from_bal );
+    ++m_version;
     append_record( tl );
 }
+/**
+ *  Counts the change of one account / stock combo from its state in the base.
+ */
+void sdt::count_change( bool existed, uint64_t old_balance, uint64_t new_balance )
+{
+    if( !existed )
+        ++m_counts.accounts;
+    if( !old_balance && new_balance )
+        ++m_counts.holdings;
+    else if( old_balance && !new_balance )
+        --m_counts.holdings;
+}
+
 sdt::transfer sdt::get_last_transfer( const std::string& account, const std::string& type )
 {
     return transfer( shared_from_this(), 
@@ -285,8 +532,8 @@ void sdt::issue( const std::string& type, uint64_t trx_pos  )
   //  slog( "issue %1%", type ); 
     transfer_log  tl;
     tl.type_name = get_name_index(type);    
-    tl.to_name   = get_name_index(type);    
-    tl.from_name = get_name_index(type);    
+    tl.to_name   = tl.type_name;
+    tl.from_name = tl.type_name;
     tl.amount       = uint64_t(-1);
     tl.new_from_bal = uint64_t(-1);
     tl.new_to_bal   = uint64_t(-1);
@@ -294,13 +541,14 @@ void sdt::issue( const std::string& type, uint64_t trx_pos  )
     tl.trx_idx = trx_pos;
         
     bool is_null = true;
-    get_balance( type, type, &is_null, &tl.last_from_trx );
+    get_balance_idx( tl.type_name, tl.type_name, &is_null, &tl.last_from_trx );
     if( !is_null )
         THROW_GPM_EXCEPTION( "Attempt to issue '%1%' after it has already been issued.", %type );
 
     uint64_t p = size();
-    last_transfer_map[ account_key( tl.from_name, tl.type_name) ] = p;
-    last_transfer_map[ account_key( tl.to_name, tl.type_name) ]   = p;
+    last_transfer_map[ account_key( tl.type_name, tl.type_name) ] = account_state( p, tl.new_to_bal );
+    count_change( false, 0, tl.new_to_bal );
+    ++m_version;
 //    slog( "transfer_log: %1% at %2%", %boost::rpc::to_json(tl) %p);
     append_record( tl );
 }
@@ -374,14 +622,15 @@ bool sdt::apply( const signed_transaction& trx, const std::string& gen_name )
                 elog( "Source account equals destinationa account." );
                 return false;
              }
-             public_key_t type_pub_key;
+             // resolve each name once, everything below works on name indexes
+             name_edit from_name, type_name;
              public_key_t from_pub_key;
-             if( !get_public_key_t( tr.from_name, from_pub_key ) )
+             if( !find_name( tr.from_name, from_name ) || !get_public_key_at( from_name.last_edit, from_pub_key ) )
              {
                  elog( "No public key for name %1%", tr.from_name );
                  return false;
              }
-             if( !get_public_key_t( tr.stock_name, type_pub_key ) )
+             if( !find_name( tr.stock_name, type_name ) )
              {
                  elog( "No public key for name %1%", tr.stock_name );
                  return false;
@@ -392,7 +641,7 @@ bool sdt::apply( const signed_transaction& trx, const std::string& gen_name )
                  return false;
              }
              
-             uint64_t bal = get_balance( tr.from_name, tr.stock_name );
+             uint64_t bal = get_balance_idx( from_name.name_idx, type_name.name_idx );
              if( bal < tr.amount )
              {
                  elog( "Insufficent %1% in account %2%", tr.stock_name, tr.from_name ); 
@@ -404,14 +653,17 @@ bool sdt::apply( const signed_transaction& trx, const std::string& gen_name )
     
             
              uint64_t to_idx  = get_name_index(to);    
-             if( to_idx == -1 )
+             if( to_idx == uint64_t(-1) )
              {
                 // the destination is not a registered name...
                 // is it a valid address?  else return false.
                 if( validate_address_format(to) )
                 {
                     wlog( "defining name of destination '%1%' to empty public key", to );
-                    last_name_edit_map[to] = size();
+                    to_idx = size();
+                    last_name_edit_map[to] = name_edit( to_idx, to_idx );
+                    ++m_counts.names;
+                    ++m_version;
                     append_record( define_name( to, public_key_t() ) );
                 }
                 else
@@ -421,7 +673,7 @@ bool sdt::apply( const signed_transaction& trx, const std::string& gen_name )
                 }
              }
              
-             transfer_balance( tr.from_name, to, tr.stock_name, tr.amount, trx_pos );
+             transfer_balance_idx( from_name.name_idx, to_idx, type_name.name_idx, tr.amount, trx_pos );
         }
         else
         {
@@ -463,7 +715,7 @@ bool sdt::apply( const block& b, const std::string& gen, const std::vector<signe
     uint64_t r = 0;
     if( pos < start() )
     {
-        r   += base->read( pos, buf, len );
+        r   += base->read( pos, buf, std::min( len, start() - pos ) );
         pos += r;
         buf += r;
         len -= r;
@@ -473,54 +725,75 @@ bool sdt::apply( const block& b, const std::string& gen, const std::vector<signe
     if( pos < start() )
         THROW_GPM_EXCEPTION( "Invariant broken!" );
     
-    if( local_changes.size() )
-    {
-        int av = std::min( len, uint64_t(local_changes.size()-(pos-start())) );
-        memcpy( buf, &local_changes[pos-start()], av );
-        r += av;
-    }
+    r += local_changes.read( pos - start(), buf, len );
     return r;
  }
 
+static boost::rpc::sha1_hashcode hash_chunk( const char* d, uint64_t len )
+{
+    boost::rpc::datastream<boost::rpc::sha1> ds;
+    ds.write( d, len );
+    return ds.result();
+}
+
 /**
  *  For each MB of the log, calculate the hash.
  *  Then hash all of the hashes into one.  This will allow nodes to have
  *  sparce state information.  
+ *
+ *  The log is append only so the hashes of completed chunks are cached by
+ *  the state_database, only the tail of the log needs to be hashed here.
  */
 boost::rpc::sha1_hashcode sdt::calculate_state_hash()
 {
-    std::vector<char> tmp(1024*1024);
+    chunk_hash_list done;
+    uint64_t        pos = get_chunk_hashes( done );
+
     std::vector<boost::rpc::sha1_hashcode> hashes;
+    hashes.reserve( (size() + state_chunk_size - 1) / state_chunk_size );
+    if( pos )
+        hashes.assign( done->begin(), done->begin() + pos / state_chunk_size );
 
-    uint64_t pos = 0;
+    std::vector<char> tmp(state_chunk_size);
     uint64_t r   = read( pos, &tmp.front(), tmp.size() );
     while( r == tmp.size() )
     {
-        boost::rpc::datastream<boost::rpc::sha1> ds;
-        ds.write( &tmp.front(), r );
-        hashes.push_back(ds.result());
+        hashes.push_back( hash_chunk( &tmp.front(), r ) );
         pos += r;
-        uint64_t r   = read( pos, &tmp.front(), tmp.size() );
+        r    = read( pos, &tmp.front(), tmp.size() );
     }
     if( r )
-    {
-        boost::rpc::datastream<boost::rpc::sha1> ds;
-        ds.write( &tmp.front(), r );
-        hashes.push_back(ds.result());
-    }
+        hashes.push_back( hash_chunk( &tmp.front(), r ) );
     //slog( "size: %1% ", size() );
     
     return boost::rpc::raw::hash_sha1(hashes);
 }
 
+/**
+ *  Only the chunks below start() are taken from the base, it may have grown since
+ *  this overlay was started.
+ */
+uint64_t sdt::get_chunk_hashes( chunk_hash_list& hashes )
+{
+    hashes.reset();
+    if( !base )
+        return 0;
+    uint64_t n = base->get_chunk_hashes( hashes );
+    return std::min( n, start() / state_chunk_size * state_chunk_size );
+}
+
 
 bool sdt::commit()
 {
     if( base ) 
-        base->append( local_changes, last_transfer_map, last_name_edit_map );
+        base->append( local_changes, last_transfer_map, last_name_edit_map, m_counts, m_local_keys );
     local_changes.clear();
     last_transfer_map.clear();
     last_name_edit_map.clear();
+    m_counts = state_counts();
+    m_local_keys.clear();
+    ++m_version;
+    ++m_cleared;
     return true;
 }
 void sdt::abort()
@@ -528,23 +801,31 @@ void sdt::abort()
     local_changes.clear();
     last_transfer_map.clear();
     last_name_edit_map.clear();
+    m_counts = state_counts();
+    m_local_keys.clear();
+    ++m_version;
+    ++m_cleared;
 }
 
+/**
+ *  Walks back from the end of the log, only the end_block record is decoded.
+ */
 block sdt::find_last_block()
 {
-   if( size() < 8 )
+   uint32_t v = get_log_version();
+   if( size() <= log_start(v) )
+        return block();
+
+   char footer[8];
+   if( read( size() - footer_size(v), footer, footer_size(v) ) != footer_size(v) )
         return block();
+   uint64_t      loc = record_before( v, footer, size() );
+   record_header h;
+   while( get_record_header( loc, h ) && h.id != end_block::id )
+        loc = h.previous;
 
-   uint64_t last_record = size()-sizeof(uint64_t);
-   read( last_record, (char*)&last_record, sizeof(last_record) );
    state_record r;
-   get_record( last_record, r );
-   while( r.id != end_block::id && r.previous != 0)
-   {
-        read( r.previous-8, (char*)&last_record, sizeof(last_record) );
-        get_record( last_record, r );
-   }
-   if( r.id == end_block::id )
+   if( h.id == end_block::id && get_record( loc, r ) )
    {
         end_block eb = r;
 //        wlog( "last known block %1%", boost::rpc::to_json( eb )  );
@@ -553,14 +834,89 @@ block sdt::find_last_block()
    return block();
 }
 
+/**
+ *  The snapshot starts where the database's committed log ends, the pending records 
+ *  of the database and of every overlay are appended to it from the oldest layer up.
+ */
+state_snapshot::ptr sdt::get_snapshot()
+{
+    std::vector<state_database_transaction*> layers; // newest first
+    for( state_database_transaction* p = this; p; p = dynamic_cast<state_database_transaction*>( p->base.get() ) )
+        layers.push_back( p );
+
+    state_database::ptr db = boost::dynamic_pointer_cast<state_database>( layers.back()->shared_from_this() );
+    if( !db )
+        THROW_GPM_EXCEPTION( "Snapshots can only be taken of a state_database and its overlays" );
+
+    state_snapshot::ptr s( new state_snapshot( db, db->size() - layers.back()->local_changes.size() ) );
+    s->m_totals = get_counts();
+    for( uint32_t i = layers.size(); i > 0; --i )
+    {
+        state_database_transaction* l = layers[i-1];
+        change_buffer               c;
+        c.copy( l->local_changes );
+        s->sdt::append( c, l->last_transfer_map, l->last_name_edit_map, l->m_counts, l->m_local_keys );
+    }
+    return s;
+}
+
 typedef state_database sd;
 
 
 state_database::state_database()
+:m_file_size(0),m_log_version(log_v1),m_new_log_version(log_v1),
+ m_chunk_hashes( new std::vector<boost::rpc::sha1_hashcode>() ),m_hash_threads(0),
+ m_saved(false),m_saved_file_size(0)
+{
+}
+
+state_database::~state_database()
+{
+    if( m_env )
+        m_env->remove_listener( this );
+}
+
+uint32_t sd::get_log_version()
+{
+    return m_log_version;
+}
+
+void sd::set_log_version( uint32_t v )
+{
+    if( v != log_v1 && v != log_v2 )
+        THROW_GPM_EXCEPTION( "Unknown state log version %1%", %v );
+    m_new_log_version = v;
+}
+
+void sd::set_segment_size( uint64_t s )
+{
+    m_log.set_segment_size( (s + state_chunk_size - 1) / state_chunk_size * state_chunk_size );
+}
+
+void sd::set_segment_compression( bool c )
+{
+    m_log.set_compression( c );
+}
+
+void sd::get_index_stats( std::vector<bdb::db_stats>& s, bool exact )
 {
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    s.push_back( m_transfer_db.stats( exact ) );
+    s.push_back( m_balance_db.stats( exact ) );
+    s.push_back( m_name_db.stats( exact ) );
+    s.push_back( m_name_by_index_db.stats( exact ) );
+    s.push_back( m_meta_db.stats( exact ) );
+    s.push_back( m_history_db.stats( exact ) );
+    s.push_back( m_holder_db.stats( exact ) );
+    s.push_back( m_rank_db.stats( exact ) );
+    s.push_back( m_key_db.stats( exact ) );
 }
 
-bool sd::open( const boost::filesystem::path& file )
+/**
+ *  @param env the environment shared with the caller's databases so that they can be 
+ *             committed together, if NULL the state database creates its own in file.
+ */
+bool sd::open( const boost::filesystem::path& file, const bdb::environment::ptr& env )
 {
     namespace bfs = boost::filesystem;
     if( !boost::filesystem::exists(file) )
@@ -568,18 +924,100 @@ bool sd::open( const boost::filesystem::path& file )
     if( !boost::filesystem::is_directory(file) )
         THROW_GPM_EXCEPTION( "expected state database '%1%' to be a directory", %file );
 
-    if( boost::filesystem::exists(file/"state") )
-        m_file = gpm::file::ptr( new gpm::file( file/"state", "rb+" ) );
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+
+    m_log.open( file );
+    if( m_env )
+        m_env->remove_listener( this );
+    m_env = env;
+    if( !m_env )
+    {
+        m_env = bdb::environment::ptr( new bdb::environment() );
+        m_env->open( file );
+    }
+    m_env->add_listener( this );
+    m_saved = false;
+    m_transfer_db.open( file/"transfer_index", *m_env );
+    m_balance_db.open( file/"balance_index", *m_env );
+    m_name_db.open( file/"name_index", *m_env );
+    m_name_by_index_db.open( file/"name_by_index", *m_env );
+    m_meta_db.open( file/"meta", *m_env );
+    m_history_db.open( file/"history_index", *m_env );
+    m_holder_db.open( file/"holder_index", *m_env );
+    m_rank_db.open( file/"rank_index", *m_env );
+    m_key_db.open( file/"key_index", *m_env );
+    m_names.clear();
+    clear_key_cache();
+    m_counts = state_counts();
+    m_totals = state_counts();
+
+    m_file_size = m_log.size();
+
+    // anything past the committed size was written by a commit whose group never finished
+    uint64_t indexed = m_file_size;
+    boost::optional<uint64_t> committed = m_meta_db.get( "log_size" );
+    if( !!committed && *committed < m_file_size )
+        indexed = *committed;
+    else if( !!committed && *committed > m_file_size )
+    {
+        elog( "state log is %1% bytes shorter than the index expects", (*committed - m_file_size) );
+    }
+    if( m_file_size == 0 && m_new_log_version == log_v2 )
+    {
+        m_log.append( log_magic, sizeof(log_magic) );
+        m_log.sync();
+        m_file_size = sizeof(log_magic);
+    }
+
+    m_log_version = log_v1;
+    char magic[sizeof(log_magic)];
+    if( m_log.read( 0, magic, sizeof(magic) ) == sizeof(magic) && memcmp( magic, log_magic, sizeof(log_magic) ) == 0 )
+        m_log_version = log_v2;
+    load_chunk_hashes( file/"state_hashes" );
+
+    if( m_file_size > log_start(m_log_version) && m_name_db.begin().end() )
+    {
+        wlog( "state log has no index, rebuilding it" );
+        update_index();
+    }
+    else if( m_file_size > log_start(m_log_version) && !m_env->transactional() && !m_env->closed_cleanly() )
+    {
+        wlog( "the databases were not closed cleanly without a transaction log, rebuilding the indexes" );
+        update_index();
+    }
+    else if( m_history_db.begin().end() && !m_transfer_db.begin().end() )
+    {
+        wlog( "state log has no history index, rebuilding the indexes" );
+        update_index();
+    }
     else
-        m_file = gpm::file::ptr( new gpm::file( file/"state", "wb+" ) );
-    m_transfer_db.open( file/"transfer_index" );
-    m_name_db.open( file/"name_index" );
+    {
+        if( (m_balance_db.begin().end() || m_holder_db.begin().end()) && !m_transfer_db.begin().end() )
+            build_balance_index();
+        if( m_name_by_index_db.begin().end() && !m_name_db.begin().end() )
+            build_name_by_index();
+
+        boost::optional<uint64_t> names    = m_meta_db.get( "name_count" );
+        boost::optional<uint64_t> accounts = m_meta_db.get( "account_count" );
+        boost::optional<uint64_t> holdings = m_meta_db.get( "holding_count" );
+        if( !!names && !!accounts && !!holdings )
+        {
+            m_totals.names    = *names;
+            m_totals.accounts = *accounts;
+            m_totals.holdings = *holdings;
+        }
+        else
+            count_indexes();
+        if( indexed < m_file_size )
+            index_uncommitted( indexed );
+    }
+    update_chunk_hashes();
     return true;
 }
 
 uint64_t sd::size()const
 {
-    return m_file->size() + local_changes.size();
+    return m_file_size + local_changes.size();
 }
 uint64_t  sd::start()const 
 {
@@ -588,126 +1026,1154 @@ uint64_t  sd::start()const
 
 uint64_t sd::read( uint64_t pos, char* buf, uint64_t len )
 {
-//    slog( "pos: %1%  size: %2%", %pos %len );
-    uint64_t r = 0;
-    if( pos < m_file->size() )
-    {
-        m_file->seek(pos);
-        r += m_file->read( buf, len );
-        len -= r;
-        pos += r;
-        buf += r;
-    }
-//    slog( "pos: %1%  size: %2%", %pos %len );
-    if( len  && local_changes.size() )
-    {
-        uint64_t m =  std::min( uint64_t(local_changes.size()-(pos-m_file->size())),len);
-        memcpy( buf, &local_changes[pos-m_file->size()], m );
-        r += m;
-    }
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    uint64_t r = m_log.read( pos, buf, len );
+    len -= r;
+    pos += r;
+    buf += r;
+    if( len && pos >= m_file_size )
+        r += local_changes.read( pos - m_file_size, buf, len );
     return r;
 }
+
+/**
+ *  Records in the tail of the log are parsed directly out of the memory map, 
+ *  sealed records are copied out of their segment and records that are still
+ *  pending are unpacked from local_changes.
+ */
 uint64_t     sd::get_record( uint64_t loc, state_record& r )
 {
-    //slog( "%1%", %loc );
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
     r.id = 0;
-    if( sizeof(r.id) != read( loc,(char*)&r.id, sizeof(r.id ) ) )
+    if( loc == uint64_t(-1) )
         return 0;
-   // slog( "id: %1%", %r.id );
-    uint32_t len = 0;
-    if( sizeof(len) != read( loc + sizeof(r.id), (char*)&len, sizeof(len) ) )
-        return 0;
-   // slog( "len: %1%", %len );
-    r.data.resize(len);
-    if( len )
+    if( loc >= m_file_size )
     {
-        if( len != read( loc + sizeof(r.id) + sizeof(len), &r.data.front(), len ) )
+        uint64_t    avail;
+        const char* d = local_changes.data( loc - m_file_size, avail );
+        if( !d )
             return 0;
+        return decode_record( m_log_version, d, avail, loc, r, this );
     }
-    if( sizeof(r.previous) == read( loc + sizeof(r.id) + sizeof(len) + len, (char*)&r.previous, sizeof(r.previous) ) )
-        return sizeof(r.previous) + sizeof(r.id) + sizeof(len) + len;
+    if( loc < log_start(m_log_version) )
+        return 0;
+    if( loc >= m_log.tail_start() )
+        return decode_record( m_log_version, m_log.tail() + (loc - m_log.tail_start()), m_file_size - loc, loc, r, this );
 
-    return 0;
+    record_header     h;
+    std::vector<char> buf;
+    const char*       d = m_log.bytes( loc, header_size(m_log_version), buf );
+    if( !d || !parse_header( m_log_version, d, header_size(m_log_version), h ) )
+        return 0;
+    if( !(d = m_log.bytes( loc, h.size, buf )) )
+        return 0;
+    return decode_record( m_log_version, d, h.size, loc, r, this );
 }
 
-bool      sd::commit()
+/**
+ *  Keys found in the older half of the cache move back to the newer half.
+ */
+bool sd::get_cached_key( uint64_t loc, public_key_t& k )
 {
-    if( local_changes.size() )
+    if( loc >= m_file_size )
+        return false;
+    const public_key_t* c = m_key_cache.find( loc );
+    if( c )
     {
-        m_file->write( &local_changes.front(), local_changes.size() );
-        account_index::const_iterator itr = last_transfer_map.begin();
-        while( itr != last_transfer_map.end() )
-        {
-            m_transfer_db.set( itr->first, itr->second );
-            ++itr;
-        }
-        name_index::const_iterator nitr = last_name_edit_map.begin();
-        while( nitr != last_name_edit_map.end() )
-        {
-            m_name_db.set( nitr->first, nitr->second );
-            ++nitr;
-        }
-        m_transfer_db.sync();
-        m_name_db.sync();
-        local_changes.clear();
-        last_transfer_map.clear();
-        last_name_edit_map.clear();
+        k = *c;
+        return true;
     }
+    if( !(c = m_old_key_cache.find( loc )) )
+        return false;
+    k = *c;
+    cache_key( loc, k );
+    return true;
 }
 
-
-uint64_t sd::get_last_name_edit_index( const std::string& nidx )
+/**
+ *  Only records committed to the file are cached, pending records may still be aborted.
+ *  When the newer half fills up it replaces the older half, so only the keys that were
+ *  not used since then are dropped.
+ */
+void sd::cache_key( uint64_t loc, const public_key_t& k )
 {
-//   slog( " '%1%'", %nidx );
-    uint64_t idx = sdt::get_last_name_edit_index(nidx);
-    if( idx == uint64_t(-1) )
+    if( loc >= m_file_size )
+        return;
+    if( m_key_cache.size() >= key_cache_size / 2 )
     {
-        boost::optional<uint64_t> i = m_name_db.get(nidx);
-        if( !!i ) { return *i; }
-        return -1;
+        m_old_key_cache.swap( m_key_cache );
+        m_key_cache.clear();
     }
-    return idx;
+    m_key_cache[loc] = k;
 }
 
-uint64_t  sdt::get_last_name_edit_index( const std::string& nidx )
+void sd::clear_key_cache()
 {
-     //slog( " '%1%'", %nidx );
-     name_index::const_iterator itr = last_name_edit_map.find(nidx);
-     if( itr == last_name_edit_map.end() ) 
-     {
- //       slog( "trx does not have '%1%'", %nidx );
-        if( base ) 
+    m_key_cache.clear();
+    m_old_key_cache.clear();
+}
+
+/**
+ *  Compares the committed define_key record at loc with key without decoding it.
+ */
+bool sd::committed_key_at( uint64_t loc, const char* key, uint32_t len )
+{
+    if( loc < log_start(m_log_version) || loc >= m_file_size )
+        return false;
+    if( loc >= m_log.tail_start() )
+        return is_key_record( m_log_version, m_log.tail() + (loc - m_log.tail_start()), m_file_size - loc, key, len );
+
+    record_header     h;
+    std::vector<char> buf;
+    const char*       d = m_log.bytes( loc, header_size(m_log_version), buf );
+    if( !d || !parse_header( m_log_version, d, header_size(m_log_version), h ) || h.size > m_file_size - loc )
+        return false;
+    if( !(d = m_log.bytes( loc, h.size, buf )) )
+        return false;
+    return is_key_record( m_log_version, d, h.size, key, len );
+}
+
+bool sd::get_public_key_at( uint64_t last_edit, public_key_t& pk )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    if( get_cached_key( last_edit, pk ) )
+        return true;
+    if( !sdt::get_public_key_at( last_edit, pk ) )
+        return false;
+    cache_key( last_edit, pk );
+    return true;
+}
+
+uint64_t sd::find_key( const public_key_t& k )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    uint64_t loc = sdt::find_key( k );
+    if( loc != uint64_t(-1) )
+        return loc;
+    packed_key pk( k );
+    if( m_key_db.get( pk.hash(), loc ) && committed_key_at( loc, pk.data, sizeof(pk.data) ) )
+        return loc;
+    return -1;
+}
+
+bool sd::get_key( uint64_t loc, public_key_t& k )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    if( get_cached_key( loc, k ) )
+        return true;
+    if( !sdt::get_key( loc, k ) )
+        return false;
+    cache_key( loc, k );
+    return true;
+}
+
+/**
+ *  Loads the hashes of completed chunks from p, entries beyond the end of the
+ *  log are dropped.  The cache ends with a crc of the hashes before it, if the
+ *  crc or the hash of the last cached chunk does not match, every chunk is
+ *  hashed again and the cache is rewritten.  verify_chunk_hashes() checks the
+ *  rest of them against the log.
+ */
+void sd::load_chunk_hashes( const boost::filesystem::path& p )
+{
+    m_chunk_hashes.reset( new std::vector<boost::rpc::sha1_hashcode>() );
+    std::vector<boost::rpc::sha1_hashcode>& cached = *m_chunk_hashes;
+    m_hash_crc.reset();
+    if( !boost::filesystem::exists(p) )
+    {
+        m_hash_file = gpm::file::ptr( new gpm::file( p, "wb+" ) );
+        save_chunk_hashes();
+        return;
+    }
+
+    m_hash_file = gpm::file::ptr( new gpm::file( p, "rb+" ) );
+    uint64_t size = m_hash_file->size();
+    uint64_t n    = size / sizeof(boost::rpc::sha1_hashcode);
+    uint32_t crc  = 0;
+    cached.resize(n);
+    m_hash_file->seek(0);
+    if( n )
+        m_hash_file->read( (char*)&cached.front(), n * sizeof(boost::rpc::sha1_hashcode) );
+    bool valid = size == n * sizeof(boost::rpc::sha1_hashcode) + sizeof(crc);
+    if( valid )
+    {
+        m_hash_file->read( (char*)&crc, sizeof(crc) );
+        boost::crc_32_type c;
+        if( n )
+            c.process_bytes( &cached.front(), n * sizeof(boost::rpc::sha1_hashcode) );
+        valid = c.checksum() == crc;
+    }
+
+    bool rewrite = !valid || n > m_file_size / state_chunk_size;
+    if( rewrite )
+        cached.resize( std::min( n, m_file_size / state_chunk_size ) );
+    if( valid && cached.size() )
+    {
+        boost::rpc::sha1_hashcode last;
+        hash_log_chunks( cached.size() - 1, 1, &last );
+        valid = last == cached.back();
+    }
+    if( !valid )
+    {
+        wlog( "State hash cache %1% does not match the log, rehashing %2% chunks.", p, cached.size() );
+        if( cached.size() )
+            hash_log_chunks( 0, cached.size(), &cached.front() );
+    }
+    if( rewrite || !valid )
+        save_chunk_hashes();
+    else if( n )
+        m_hash_crc.process_bytes( &cached.front(), n * sizeof(boost::rpc::sha1_hashcode) );
+}
+
+/**
+ *  Writes count hashes to the cache starting with entry first, followed by the
+ *  crc of every entry up to and including them.
+ */
+void sd::append_chunk_hashes( uint64_t first, const boost::rpc::sha1_hashcode* h, uint64_t count )
+{
+    m_hash_file->seek( first * sizeof(boost::rpc::sha1_hashcode) );
+    if( count )
+    {
+        m_hash_file->write( (const char*)h, count * sizeof(boost::rpc::sha1_hashcode) );
+        m_hash_crc.process_bytes( h, count * sizeof(boost::rpc::sha1_hashcode) );
+    }
+    uint32_t crc = m_hash_crc.checksum();
+    m_hash_file->write( (const char*)&crc, sizeof(crc) );
+    m_hash_file->flush();
+}
+
+/**
+ *  Replaces the cache with m_chunk_hashes.
+ */
+void sd::save_chunk_hashes()
+{
+    m_hash_file->truncate( 0 );
+    m_hash_crc.reset();
+    if( m_chunk_hashes->size() )
+        append_chunk_hashes( 0, &m_chunk_hashes->front(), m_chunk_hashes->size() );
+    else
+        append_chunk_hashes( 0, 0, 0 );
+}
+
+/**
+ *  Hashes every threads'th chunk starting with chunk first + offset.
+ */
+static void hash_chunk_range( const char* data, uint64_t first, uint64_t count, 
+                              uint32_t offset, uint32_t threads, boost::rpc::sha1_hashcode* out )
+{
+    for( uint64_t i = offset; i < count; i += threads )
+        out[i] = hash_chunk( data + (first + i) * state_chunk_size, state_chunk_size );
+}
+
+/**
+ *  Hashes count complete chunks starting with chunk first into out.  The chunks
+ *  are independent so they are spread over a pool of worker threads, each 
+ *  worker writes its own slots of out so the result is in log order.
+ */
+static void hash_chunks( const char* data, uint64_t first, uint64_t count, 
+                         uint32_t threads, boost::rpc::sha1_hashcode* out )
+{
+    if( threads == 0 )
+        threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    if( threads > count )
+        threads = count;
+    if( threads <= 1 )
+    {
+        hash_chunk_range( data, first, count, 0, 1, out );
+        return;
+    }
+    boost::thread_group workers;
+    for( uint32_t t = 1; t < threads; ++t )
+        workers.create_thread( boost::bind( hash_chunk_range, data, first, count, t, threads, out ) );
+    hash_chunk_range( data, first, count, 0, threads, out );
+    workers.join_all();
+}
+
+void sd::set_hash_threads( uint32_t n )
+{
+    m_hash_threads = n;
+}
+
+/**
+ *  Hashes count chunks of the log starting with chunk first into out.  Sealed chunks 
+ *  are copied out of their segments one at a time, the rest are hashed in place.
+ */
+void sd::hash_log_chunks( uint64_t first, uint64_t count, boost::rpc::sha1_hashcode* out )
+{
+    std::vector<char> buf;
+    uint64_t i = 0;
+    for( ; i < count && (first + i) * state_chunk_size < m_log.tail_start(); ++i )
+        out[i] = hash_chunk( m_log.bytes( (first + i) * state_chunk_size, state_chunk_size, buf ), state_chunk_size );
+    if( i < count )
+        hash_chunks( m_log.tail() + ((first + i) * state_chunk_size - m_log.tail_start()), 0, count - i, 
+                     m_hash_threads, out + i );
+}
+
+/**
+ *  @return m_chunk_hashes after copying it if a caller of get_chunk_hashes() still 
+ *          holds it, lists that were handed out never change
+ */
+std::vector<boost::rpc::sha1_hashcode>& sd::own_chunk_hashes()
+{
+    if( !m_chunk_hashes.unique() )
+        m_chunk_hashes.reset( new std::vector<boost::rpc::sha1_hashcode>( *m_chunk_hashes ) );
+    return *m_chunk_hashes;
+}
+
+/**
+ *  Hashes any chunks of the file that have been completed since the last 
+ *  call and appends them to the persisted cache.  Only called by the thread
+ *  that modifies the database, which is the only one that replaces the map of
+ *  the log, so the chunks are hashed without the lock.
+ */
+void sd::update_chunk_hashes()
+{
+    uint64_t n;
+    {
+        boost::recursive_mutex::scoped_lock lock( m_mutex );
+        n = m_chunk_hashes->size();
+    }
+    uint64_t total = m_file_size / state_chunk_size;
+    if( total <= n )
+        return;
+
+    std::vector<boost::rpc::sha1_hashcode> added( total - n );
+    hash_log_chunks( n, total - n, &added.front() );
+
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    if( m_chunk_hashes->size() != n )
+        return; // verify_chunk_hashes() replaced them meanwhile
+    append_chunk_hashes( n, &added.front(), added.size() );
+    std::vector<boost::rpc::sha1_hashcode>& hashes = own_chunk_hashes();
+    hashes.insert( hashes.end(), added.begin(), added.end() );
+}
+
+bool sd::verify_chunk_hashes()
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    uint64_t total = m_file_size / state_chunk_size;
+    std::vector<boost::rpc::sha1_hashcode> hashes(total);
+    if( total )
+        hash_log_chunks( 0, total, &hashes.front() );
+
+    uint64_t n = std::min( total, uint64_t(m_chunk_hashes->size()) );
+    bool valid = std::equal( m_chunk_hashes->begin(), m_chunk_hashes->begin() + n, hashes.begin() );
+    if( !valid )
+        elog( "State hash cache did not match the log." );
+
+    m_chunk_hashes.reset( new std::vector<boost::rpc::sha1_hashcode>() );
+    m_chunk_hashes->swap( hashes );
+    save_chunk_hashes();
+    return valid;
+}
+
+/**
+ *  The list is shared, not copied.  commit() hashes the chunks it completes, so
+ *  readers never hash here, a chunk that is not hashed yet is left to the caller.
+ */
+uint64_t sd::get_chunk_hashes( chunk_hash_list& hashes )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    hashes = m_chunk_hashes;
+    return m_chunk_hashes->size() * state_chunk_size;
+}
+
+/**
+ *  Unpacks the payload of the record h at d, which is at loc.  Log_v1 payloads
+ *  are unpacked in place.
+ */
+template<typename T>
+static void unpack_record( uint32_t version, const record_header& h, const char* d, uint64_t loc, T& m )
+{
+    if( version == log_v1 )
+    {
+        boost::rpc::raw::unpack( d + h.data, h.len, m );
+        return;
+    }
+    std::vector<char> raw;
+    decode_payload( version, h, d + h.data, loc, raw );
+    boost::rpc::raw::unpack( raw, m );
+}
+
+/**
+ *  Adds the history entries for the transfer_log at loc to out, one for each
+ *  side of the transfer.
+ */
+static void history_entries( const transfer_log& tl, uint64_t time, uint64_t loc, std::vector<history_key>& out )
+{
+    out.push_back( history_key( account_key( tl.from_name, tl.type_name ), time, loc ) );
+    if( tl.to_name != tl.from_name )
+        out.push_back( history_key( account_key( tl.to_name, tl.type_name ), time, loc ) );
+}
+
+/**
+ *  Writes the sorted history keys to the history index, the value of each entry
+ *  is the location that is also in its key.
+ */
+void sd::set_history( const std::vector<history_key>& history )
+{
+    std::vector< std::pair<history_key,uint64_t> > entries( history.size() );
+    for( uint32_t i = 0; i < history.size(); ++i )
+        entries[i] = std::make_pair( history[i], history[i].loc );
+    m_history_db.set_many( entries );
+}
+
+/**
+ *  Appends the pending records to the log and updates the indexes in one group of
+ *  the environment.  The group only becomes durable once the outermost group commits,
+ *  the log is synced before then so the indexes never refer to data that is not on disk.
+ *
+ *  Only the thread that modifies the database commits, so the log is written and
+ *  synced and the index entries are prepared without the lock.  The lock is taken
+ *  to read the old balances, and to write the indexes and publish the new size of
+ *  the log together.  The environment has no lock subsystem, so readers have to be
+ *  kept out of the indexes while they are written.
+ */
+bool      sd::commit()
+{
+    if( !local_changes.size() )
+        return true;
+
+    if( m_env->in_group() && !m_saved )
+    {
+        boost::recursive_mutex::scoped_lock lock( m_mutex );
+        m_saved           = true;
+        m_saved_file_size = m_file_size;
+        m_saved_totals    = m_totals;
+        m_saved_counts    = m_counts;
+        m_saved_changes.copy( local_changes );
+        m_saved_transfers = last_transfer_map;
+        m_saved_names     = last_name_edit_map;
+        m_saved_keys      = m_local_keys;
+    }
+
+    uint64_t first = m_file_size;
+    uint64_t last  = m_file_size + local_changes.size();
+    for( uint32_t i = 0; i < local_changes.chunk_count(); ++i )
+        m_log.append( local_changes.chunk_data(i), local_changes.chunk_size(i) );
+    m_log.write_out( m_env->sync_due() );
+
+    // write in key order so the btree pages are visited sequentially
+    std::vector<account_index::value_type> transfers;
+    last_transfer_map.sorted( transfers );
+
+    // the rank index is keyed by balance so the old entries have to be found first
+    std::vector<account_key> accounts( transfers.size() );
+    for( uint32_t i = 0; i < transfers.size(); ++i )
+        accounts[i] = transfers[i].first;
+    std::vector< boost::optional<uint64_t> > old;
+    {
+        boost::recursive_mutex::scoped_lock lock( m_mutex );
+        m_balance_db.get_many( accounts, old );
+    }
+
+    std::vector<rank_key>                          old_ranks;
+    std::vector<holder_key>                        old_holders;
+    std::vector< std::pair<rank_key,uint64_t> >    ranks;
+    std::vector< std::pair<holder_key,uint64_t> >  holders;
+    std::vector< std::pair<account_key,uint64_t> > last_transfers( transfers.size() );
+    std::vector< std::pair<account_key,uint64_t> > balances( transfers.size() );
+    for( uint32_t i = 0; i < transfers.size(); ++i )
+    {
+        const account_key& k   = transfers[i].first;
+        uint64_t           bal = transfers[i].second.balance;
+
+        if( !!old[i] && *old[i] && *old[i] != bal )
+            old_ranks.push_back( rank_key( k.type_name, *old[i], k.account_name ) );
+        if( bal )
+        {
+            holders.push_back( std::make_pair( holder_key( k.type_name, k.account_name ), bal ) );
+            ranks.push_back( std::make_pair( rank_key( k.type_name, bal, k.account_name ), bal ) );
+        }
+        else if( !!old[i] && *old[i] )
+            old_holders.push_back( holder_key( k.type_name, k.account_name ) );
+
+        last_transfers[i] = std::make_pair( k, transfers[i].second.last_transfer );
+        balances[i]       = std::make_pair( k, bal );
+    }
+    std::sort( holders.begin(), holders.end() );
+    std::sort( ranks.begin(), ranks.end() );
+
+    std::vector<name_index::value_type> names;
+    last_name_edit_map.sorted( names );
+    std::vector< std::pair<std::string,uint64_t> > edits( names.size() );
+    std::vector< std::pair<uint64_t,std::string> > defined;
+    for( uint32_t i = 0; i < names.size(); ++i )
+    {
+        edits[i] = std::make_pair( names[i].first, names[i].second.last_edit );
+        if( names[i].second.name_idx >= first )
+            defined.push_back( std::make_pair( names[i].second.name_idx, names[i].first ) );
+    }
+    std::sort( defined.begin(), defined.end() );
+
+    // the history index has an entry for every transfer, not only the last one
+    std::vector<history_key> history;
+    record_header h;
+    uint64_t      avail;
+    const char*   d;
+    for( uint64_t off = 0; 
+         (d = local_changes.data( off, avail )) && parse_header( m_log_version, d, avail, h ); 
+         off += h.size )
+    {
+        if( h.id == transfer_log::id )
+        {
+            transfer_log tl;
+            unpack_record( m_log_version, h, d, first + off, tl );
+            history_entries( tl, get_transfer_time(tl), first + off, history );
+        }
+    }
+    std::sort( history.begin(), history.end() );
+
+    std::vector<key_index::value_type> keys;
+    m_local_keys.sorted( keys );
+
+    {
+        boost::recursive_mutex::scoped_lock lock( m_mutex );
+        bdb::group_commit grp( *m_env );
+        m_rank_db.remove_many( old_ranks );
+        m_holder_db.remove_many( old_holders );
+        m_holder_db.set_many( holders );
+        m_rank_db.set_many( ranks );
+        m_transfer_db.set_many( last_transfers );
+        m_balance_db.set_many( balances );
+        m_name_db.set_many( edits );
+        m_name_by_index_db.set_many( defined );
+        set_history( history );
+        m_key_db.set_many( keys );
+
+        m_totals += m_counts;
+        save_counts();
+        m_meta_db.set( "log_size", last );
+        grp.commit();
+
+        m_log.publish();
+        m_file_size = last;
+        for( uint32_t i = 0; i < names.size(); ++i )
+            m_names.intern( names[i].first, names[i].second.name_idx, names[i].second.last_edit );
+
+        local_changes.clear();
+        last_transfer_map.clear();
+        last_name_edit_map.clear();
+        m_counts = state_counts();
+        m_local_keys.clear();
+        ++m_version;
+        ++m_cleared;
+    }
+    update_chunk_hashes();
+    return true;
+}
+
+/**
+ *  The indexes were rolled back with the group, the log is cut back to the size
+ *  they cover and the pending changes that were committed in the group return.
+ *  A commit() that failed on its own only has to drop the records it appended.
+ */
+void sd::group_ended( bool rolled_back )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    try {
+        if( rolled_back && m_saved )
+        {
+            wlog( "group rolled back, returning the state log to %1% bytes", m_saved_file_size );
+            truncate_log( m_saved_file_size );
+            m_totals = m_saved_totals;
+            m_counts = m_saved_counts;
+            local_changes.clear();
+            local_changes.copy( m_saved_changes );
+            last_transfer_map  = m_saved_transfers;
+            last_name_edit_map = m_saved_names;
+            m_local_keys       = m_saved_keys;
+            m_names.clear();
+            clear_key_cache();
+            ++m_version;
+            ++m_cleared;
+        }
+        else if( rolled_back && m_log.size() != m_file_size )
+            truncate_log( m_file_size );
+    }
+    catch ( const boost::exception& e )
+    {
+        elog( "unable to restore the state after a rollback: %1%", boost::diagnostic_information(e) );
+    }
+    m_saved = false;
+    m_saved_changes.clear();
+    m_saved_transfers.clear();
+    m_saved_names.clear();
+    m_saved_keys.clear();
+}
+
+/**
+ *  Drops the bytes of the log after s and the hashes of the chunks that held them.
+ */
+void sd::truncate_log( uint64_t s )
+{
+    m_log.truncate( s );
+    m_file_size = s;
+    if( m_chunk_hashes->size() > m_file_size / state_chunk_size )
+    {
+        own_chunk_hashes().resize( m_file_size / state_chunk_size );
+        save_chunk_hashes();
+    }
+}
+
+/**
+ *  A segment of recent history stays in the tail where it is read in place, only
+ *  hashed chunks are sealed so the hashes never have to read a segment.
+ */
+uint32_t sd::seal_log()
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    uint64_t seg = m_log.segment_size();
+    if( !seg || m_file_size <= 2 * seg )
+        return 0;
+    return m_log.seal( std::min( uint64_t(m_chunk_hashes->size()) * state_chunk_size, m_file_size - seg ) );
+}
+
+
+uint64_t  sdt::get_last_name_edit_index( const std::string& nidx )
+{
+    name_edit e;
+    if( !find_name( nidx, e ) )
+        return -1;
+    return e.last_edit;
+}
+
+bool sdt::find_name( const std::string& name, name_edit& e )
+{
+    const name_edit* itr = last_name_edit_map.find(name);
+    if( itr )
+    {
+        e = *itr;
+        return true;
+    }
+    if( m_flat && base )
+    {
+        abstract_state_database* root = update_view();
+        itr = m_view.names.find(name);
+        if( itr )
+        {
+            e = *itr;
+            return true;
+        }
+        return root->find_name( name, e );
+    }
+    if( base ) 
+        return base->find_name( name, e );
+    return false;
+}
+
+/**
+ *  Names that are not in the local overlay are looked up in the name_table
+ *  first, the name_index database is only consulted for names that are not
+ *  in the table yet or were dropped from it.
+ */
+bool sd::find_name( const std::string& name, name_edit& e )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    return sdt::find_name( name, e ) || find_committed_name( name, e );
+}
+
+bool sd::find_committed_name( const std::string& name, name_edit& e )
+{
+    name_table::entry ent;
+    if( m_names.find( name, ent ) )
+    {
+        e = name_edit( ent.last_edit, ent.name_idx );
+        return true;
+    }
+
+    boost::optional<uint64_t> le = m_name_db.get(name);
+    if( !le ) 
+        return false;
+
+    state_record r;
+    if( !get_record( *le, r ) )
+        THROW_GPM_EXCEPTION( "Error getting record %1%", %*le );
+
+    if( r.id == define_name::id )
+        e = name_edit( *le, *le );
+    else if( r.id == update_name::id )
+    {
+        update_name un = r;
+        e = name_edit( *le, un.name_idx );
+    }
+    else
+        THROW_GPM_EXCEPTION( "Error getting name index for %1%", %name );
+
+    m_names.intern( name, e.name_idx, e.last_edit );
+    return true;
+}
+
+/**
+ *  Looks up a committed name index in the name_table, then in the name_by_index
+ *  database.  Only indexes that are not the location of a define_name record 
+ *  have to be decoded from the log.
+ */
+std::string sd::get_committed_name( uint64_t idx )
+{
+    std::string name;
+    if( m_names.find_index( idx, name ) )
+        return name;
+
+    boost::optional<std::string> n = m_name_by_index_db.get( idx );
+    if( !n )
+        return sdt::get_name_for_index( idx );
+
+    boost::optional<uint64_t> le = m_name_db.get( *n );
+    if( !!le )
+        m_names.intern( *n, idx, *le );
+    return *n;
+}
+
+std::string sd::get_name_for_index( uint64_t idx )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    if( idx < m_file_size )
+        return get_committed_name( idx );
+    return sdt::get_name_for_index( idx );
+}
+
+/**
+ *  Names that are neither pending nor interned are read from the index in one
+ *  get_many() and interned along with their last edits.
+ */
+std::vector<std::string> sd::get_names_for_index( const std::vector<uint64_t>& idx )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    std::vector<std::string> names( idx.size() );
+    std::vector<uint64_t>    missing;
+    std::vector<uint32_t>    pos;     // of each missing index in idx
+    for( uint32_t i = 0; i < idx.size(); ++i )
+    {
+        if( idx[i] >= m_file_size )
+        {
+            names[i] = sdt::get_name_for_index( idx[i] );
+            continue;
+        }
+        if( !m_names.find_index( idx[i], names[i] ) )
+        {
+            missing.push_back( idx[i] );
+            pos.push_back( i );
+        }
+    }
+    if( missing.empty() )
+        return names;
+
+    std::vector< boost::optional<std::string> > found;
+    m_name_by_index_db.get_many( missing, found );
+
+    std::vector<std::string>  edited;
+    std::vector<uint64_t>     edited_idx;
+    for( uint32_t i = 0; i < missing.size(); ++i )
+    {
+        if( !found[i] )
+        {
+            names[pos[i]] = sdt::get_name_for_index( missing[i] );
+            continue;
+        }
+        names[pos[i]] = *found[i];
+        edited.push_back( *found[i] );
+        edited_idx.push_back( missing[i] );
+    }
+
+    std::vector< boost::optional<uint64_t> > last_edits;
+    m_name_db.get_many( edited, last_edits );
+    for( uint32_t i = 0; i < edited.size(); ++i )
+        if( !!last_edits[i] )
+            m_names.intern( edited[i], edited_idx[i], *last_edits[i] );
+    return names;
+}
+
+uint64_t  sdt::get_last_transfer_index( const account_key& a )
+{
+    account_state as;
+    find_account( a, as );
+    return as.last_transfer;
+}
+
+bool sdt::find_account( const account_key& a, account_state& as )
+{
+    const account_state* itr = last_transfer_map.find(a);
+    if( itr )
+    {
+        as = *itr;
+        return true;
+    }
+    if( m_flat && base )
+    {
+        abstract_state_database* root = update_view();
+        itr = m_view.accounts.find(a);
+        if( itr )
+        {
+            as = *itr;
+            return true;
+        }
+        return root->find_account( a, as );
+    }
+    if( base ) 
+        return base->find_account( a, as );
+    return false;
+}
+
+bool sd::find_account( const account_key& a, account_state& as )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    return sdt::find_account( a, as ) || find_committed_account( a, as );
+}
+
+bool sd::find_committed_account( const account_key& a, account_state& as )
+{
+    boost::optional<uint64_t> lt = m_transfer_db.get(a);
+    if( !lt ) 
+        return false;
+
+    as.last_transfer = *lt;
+    boost::optional<uint64_t> bal = m_balance_db.get(a);
+    as.balance = !!bal ? *bal : get_balance_at( *lt, a );
+    return true;
+}
+
+history_cursor::history_cursor()
+:m_start_time(0),m_db_valid(false),m_from_db(false),m_index(-1),m_time(-1)
+{
+}
+
+void history_cursor::add_pending( uint64_t time, uint64_t loc )
+{
+    m_pending.push_back( std::make_pair( time, loc ) );
+}
+
+/**
+ *  Checks the history index entry under m_itr against the account and start time.
+ */
+void history_cursor::read_db()
+{
+    m_db_valid = !m_itr.end() && m_itr.key().account == m_account && m_itr.key().time >= m_start_time;
+    if( m_db_valid )
+        m_db_key = m_itr.key();
+}
+
+/**
+ *  Selects the newer of the next pending transfer and the next indexed transfer.
+ */
+void history_cursor::update()
+{
+    m_index = -1;
+    if( m_pending.size() && 
+        ( !m_db_valid || m_pending.back() > std::make_pair( m_db_key.time, m_db_key.loc ) ) )
+    {
+        m_time    = m_pending.back().first;
+        m_index   = m_pending.back().second;
+        m_from_db = false;
+    }
+    else if( m_db_valid )
+    {
+        m_time    = m_db_key.time;
+        m_index   = m_db_key.loc;
+        m_from_db = true;
+    }
+}
+
+history_cursor& history_cursor::operator++()
+{
+    if( end() )
+        return *this;
+    if( m_from_db )
+    {
+        --m_itr;
+        read_db();
+    }
+    else
+        m_pending.pop_back();
+    update();
+    return *this;
+}
+
+/**
+ *  The time of the transaction that made tl, the same as transfer::time().
+ */
+uint64_t sdt::get_transfer_time( const transfer_log& tl )
+{
+    state_record r;
+    if( !get_record( tl.trx_idx, r ) )
+        return -1;
+    if( r.id == start_trx::id )
+    {
+        start_trx s = r;
+        return s.utc_time;
+    }
+    return 1000000ll*60*60*24;
+}
+
+/**
+ *  Adds the transfers of c's account that were written at or after first to c by
+ *  following the account's chain of transfer_log records back from the last one.
+ */
+void sdt::add_local_history( history_cursor& c, uint64_t first, uint64_t start_time, uint64_t end_time )
+{
+    uint64_t loc = get_last_transfer_index( c.m_account );
+    while( loc != uint64_t(-1) && loc >= first )
+    {
+        state_record r;
+        if( !get_record( loc, r ) || r.id != transfer_log::id )
+        {
+            elog( "Expected transfer_log at %1%", loc );
+            break;
+        }
+        transfer_log tl = r;
+        uint64_t t = get_transfer_time( tl );
+        if( t >= start_time && t <= end_time )
+            c.add_pending( t, loc );
+
+        uint64_t prev = tl.from_name == c.m_account.account_name ? tl.last_from_trx : tl.last_to_trx;
+        if( prev != uint64_t(-1) && prev >= loc )
         {
-  //          slog( "asking base '%1%'", %nidx );
-            return base->get_last_name_edit_index(nidx);
+            elog( "transfer_log at %1% links forward to %2%", loc, prev );
+            break;
         }
-        return -1;
-     }
-    return itr->second;
+        loc = prev;
+    }
+    std::sort( c.m_pending.begin(), c.m_pending.end() );
+    c.update();
 }
-uint64_t  sdt::get_last_transfer_index( const account_key& a )
+
+history_cursor sdt::get_history( const account_key& a, uint64_t start_time, uint64_t end_time )
 {
-     account_index::const_iterator itr = last_transfer_map.find(a);
-     if( itr == last_transfer_map.end() ) 
-     {
-        if( base ) 
-            return base->get_last_transfer_index(a);
-        return -1;
-     }
-    return itr->second;
+    history_cursor c;
+    if( base )
+        c = base->get_history( a, start_time, end_time );
+    c.m_account    = a;
+    c.m_start_time = start_time;
+    add_local_history( c, start(), start_time, end_time );
+    return c;
+}
+
+/**
+ *  Positions the cursor on the newest indexed transfer at or before end_time and
+ *  adds the transfers that have not been committed yet.
+ */
+history_cursor sd::get_history( const account_key& a, uint64_t start_time, uint64_t end_time )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    history_cursor c;
+    c.m_account    = a;
+    c.m_start_time = start_time;
+
+    history_key last( a, end_time, uint64_t(-1) );
+    m_history_db.search( last ).swap( c.m_itr );
+    if( c.m_itr.end() || c.m_itr.key() > last )
+        --c.m_itr;
+    c.read_db();
+
+    add_local_history( c, m_file_size, start_time, end_time );
+    return c;
+}
+
+/**
+ *  Copies newer into out and adds the balances of type changed by this overlay
+ *  that newer does not replace.
+ */
+void sdt::merge_holders( uint64_t type, const holder_map& newer, holder_map& out )
+{
+    out = newer;
+    for( account_index::const_iterator itr = last_transfer_map.begin(); itr != last_transfer_map.end(); ++itr )
+        if( itr->first.type_name == type && !newer.find( itr->first.account_name ) )
+            out[itr->first.account_name] = itr->second.balance;
+}
+
+static bool by_account( const holder& a, const holder& b ) { return a.account < b.account; }
+static bool by_rank( const holder& a, const holder& b )
+{
+    if( a.balance != b.balance ) return a.balance > b.balance;
+    return a.account < b.account;
+}
+
+/**
+ *  Adds the non-zero balances in h to out, except that of the account skip.
+ */
+static void add_holders( const holder_map& h, uint64_t start_account, std::vector<holder>& out,
+                         uint64_t skip = uint64_t(-1) )
+{
+    for( holder_map::const_iterator itr = h.begin(); itr != h.end(); ++itr )
+        if( itr->first >= start_account && itr->second && itr->first != skip )
+            out.push_back( holder( itr->first, itr->second ) );
+}
+
+std::vector<holder> sdt::get_holders( uint64_t type, uint64_t start_account, uint32_t limit, const holder_map& newer )
+{
+    holder_map merged;
+    merge_holders( type, newer, merged );
+    if( base )
+        return base->get_holders( type, start_account, limit, merged );
+
+    std::vector<holder> r;
+    add_holders( merged, start_account, r );
+    std::sort( r.begin(), r.end(), by_account );
+    if( r.size() > limit )
+        r.resize( limit );
+    return r;
+}
+
+std::vector<holder> sdt::get_top_holders( uint64_t type, uint32_t limit, const holder_map& newer )
+{
+    holder_map merged;
+    merge_holders( type, newer, merged );
+    if( base )
+        return base->get_top_holders( type, limit, merged );
+
+    // the account of a stock is its issuer
+    std::vector<holder> r;
+    add_holders( merged, 0, r, type );
+    std::sort( r.begin(), r.end(), by_rank );
+    if( r.size() > limit )
+        r.resize( limit );
+    return r;
 }
 
+/**
+ *  Merges the holder_index, which is in account order, with the balances changed by 
+ *  the overlays.  Reads at most limit + the number of changed balances entries.
+ */
+std::vector<holder> sd::get_holders( uint64_t type, uint64_t start_account, uint32_t limit, const holder_map& newer )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    holder_map merged;
+    merge_holders( type, newer, merged );
+    return committed_holders( type, start_account, limit, merged );
+}
 
-uint64_t  sd::get_last_transfer_index( const account_key& a )
+std::vector<holder> sd::committed_holders( uint64_t type, uint64_t start_account, uint32_t limit, 
+                                           const holder_map& merged )
 {
-    uint64_t idx = sdt::get_last_transfer_index(a);
-    if( idx == uint64_t(-1) )
+    std::vector<holder_map::value_type> pending;
+    merged.select( start_account, uint64_t(-1), pending );
+
+    std::vector<holder> r;
+    uint32_t p = 0;
+    bdb::keyvalue_db<holder_key,uint64_t>::iterator itr = m_holder_db.search( holder_key( type, start_account ) );
+    while( r.size() < limit )
     {
-        boost::optional<uint64_t> i = m_transfer_db.get(a);
-        if( !!i ) { return *i; }
-        return -1;
+        bool in_db = !itr.end() && itr.key().type_name == type;
+        if( !in_db && p == pending.size() )
+            break;
+        if( p < pending.size() && ( !in_db || pending[p].first <= itr.key().account_name ) )
+        {
+            // changed balances replace the committed ones
+            if( in_db && pending[p].first == itr.key().account_name )
+                ++itr;
+            if( pending[p].second )
+                r.push_back( holder( pending[p].first, pending[p].second ) );
+            ++p;
+        }
+        else
+        {
+            r.push_back( holder( itr.key().account_name, itr.value() ) );
+            ++itr;
+        }
+    }
+    return r;
+}
+
+/**
+ *  Reads the first limit committed holders in rank order, skipping those whose balance
+ *  was changed by an overlay, and ranks them together with the changed balances.
+ */
+std::vector<holder> sd::get_top_holders( uint64_t type, uint32_t limit, const holder_map& newer )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    holder_map merged;
+    merge_holders( type, newer, merged );
+    return committed_top_holders( type, limit, merged );
+}
+
+std::vector<holder> sd::committed_top_holders( uint64_t type, uint32_t limit, const holder_map& merged )
+{
+    std::vector<holder> r;
+    bdb::keyvalue_db<rank_key,uint64_t>::iterator itr = m_rank_db.search( rank_key( type, uint64_t(-1), 0 ) );
+    while( !itr.end() && itr.key().type_name == type && r.size() < limit )
+    {
+        if( !merged.find( itr.key().account_name ) && itr.key().account_name != type )
+            r.push_back( holder( itr.key().account_name, itr.key().balance ) );
+        ++itr;
+    }
+    add_holders( merged, 0, r, type );
+    std::sort( r.begin(), r.end(), by_rank );
+    if( r.size() > limit )
+        r.resize( limit );
+    return r;
+}
+
+/**
+ *  Databases created before the balance_index and holder_index existed only have the
+ *  transfer_index, fills in the balance of every account from the last transfer_log 
+ *  that touched it.
+ */
+void sd::build_balance_index()
+{
+    slog( "building balance index" );
+    bdb::group_commit grp( *m_env );
+    m_holder_db.clear();
+    m_rank_db.clear();
+    uint64_t count = 0;
+    bdb::keyvalue_db<account_key,uint64_t>::iterator itr = m_transfer_db.begin();
+    while( !itr.end() )
+    {
+        uint64_t bal = get_balance_at( itr.value(), itr.key() );
+        m_balance_db.set( itr.key(), bal );
+        if( bal )
+        {
+            m_holder_db.set( holder_key( itr.key().type_name, itr.key().account_name ), bal );
+            m_rank_db.set( rank_key( itr.key().type_name, bal, itr.key().account_name ), bal );
+        }
+        ++count;
+        ++itr;
+    }
+    grp.commit();
+    slog( "indexed %1% balances", count );
+}
+
+/**
+ *  Databases created before the name_by_index existed, fills it in from the
+ *  name_index.
+ */
+void sd::build_name_by_index()
+{
+    slog( "building name by index" );
+    bdb::group_commit grp( *m_env );
+    uint64_t count = 0;
+    bdb::keyvalue_db<std::string,uint64_t>::iterator itr = m_name_db.begin();
+    while( !itr.end() )
+    {
+        name_edit e;
+        if( find_name( itr.key(), e ) )
+            m_name_by_index_db.set( e.name_idx, itr.key() );
+        ++count;
+        ++itr;
     }
-    return idx;
+    grp.commit();
+    slog( "indexed %1% names", count );
+}
+
+/**
+ *  Databases created before the counts were kept, counts the indexes once.
+ */
+void sd::count_indexes()
+{
+    slog( "counting indexes" );
+    m_totals.names    = m_name_db.count();
+    m_totals.accounts = m_transfer_db.count();
+    m_totals.holdings = m_holder_db.count();
+
+    bdb::group_commit grp( *m_env );
+    save_counts();
+    grp.commit();
+}
+
+void sd::save_counts()
+{
+    m_meta_db.set( "name_count",    m_totals.names );
+    m_meta_db.set( "account_count", m_totals.accounts );
+    m_meta_db.set( "holding_count", m_totals.holdings );
 }
 
 
@@ -758,267 +2224,923 @@ bool tran::update()
 }
 
 
-bool tran::previous( const std::string& account )
+bool tran::previous( const std::string& account )
+{
+    if( m_to == m_from )
+    {
+        m_index = -1;
+        return false;
+    }
+    if( account == m_to )
+    {
+        if( m_prev_to < m_index )
+        {
+            m_index = m_prev_to;
+            return update();
+        }
+    }
+    else if( account == m_from )
+    {
+        if( m_prev_from < m_index )
+        {
+            m_index = m_prev_from;
+            return update();
+        }
+    }
+    m_index = -1;
+    return false; 
+}
+
+void sdt::dump( const state_record& r )
+{
+    std::cerr<< std::dec << "prev: "<<r.previous<<"  ";
+    if( r.id == gpm::define_name::id )
+    {
+        gpm::define_name dn = r;
+        std::cerr << "define " << dn.name << " =>  " << boost::rpc::super_fast_hash(boost::rpc::to_json(dn.key)) <<"\n";
+    }
+    if( r.id == gpm::update_name::id )
+    {
+        gpm::update_name dn = r;
+        std::cerr << "update " << dn.name_idx << " =>  " << boost::rpc::super_fast_hash(boost::rpc::to_json(dn.key)) << "last update: " << dn.last_update_idx <<"\n";
+    }
+    if( r.id == gpm::transfer_log::id )
+    {
+        gpm::transfer_log tl = r;
+        std::cerr << boost::rpc::to_json(tl) << std::endl;
+    }
+    if( r.id == gpm::define_key::id )
+    {
+        gpm::define_key dk = r;
+        std::cerr << "key " << boost::rpc::super_fast_hash(boost::rpc::to_json(dk.key)) <<"\n";
+    }
+    if( r.id == gpm::start_trx::id )
+    {
+        gpm::start_trx tl = r;
+        std::cerr << boost::rpc::to_json(tl) << std::endl;
+    }
+    if( r.id == gpm::end_block::id )
+    {
+        gpm::end_block tl = r;
+        std::cerr << boost::rpc::to_json(tl) << std::endl;
+    }
+}
+void sdt::dump(int max)
+{
+    state_record r;
+    int c = 0;
+    uint64_t p = log_start( get_log_version() );
+    uint64_t len = get_record( p, r ); 
+    while (len && c < max)
+    {
+        ++c;
+        std::cerr<< std::dec << p << " ] prev: "<<r.previous<<"  ";
+        if( r.id == gpm::define_name::id )
+        {
+            gpm::define_name dn = r;
+            std::cerr << "define " << dn.name << " =>  " << boost::rpc::super_fast_hash(boost::rpc::to_json(dn.key)) <<"\n";
+        }
+        if( r.id == gpm::update_name::id )
+        {
+            gpm::update_name dn = r;
+            std::cerr << "update " << dn.name_idx << " =>  " << boost::rpc::super_fast_hash(boost::rpc::to_json(dn.key)) << "last update: " << dn.last_update_idx <<"\n";
+        }
+        if( r.id == gpm::transfer_log::id )
+        {
+            gpm::transfer_log tl = r;
+            std::cerr << boost::rpc::to_json(tl) << std::endl;
+        }
+        if( r.id == gpm::define_key::id )
+        {
+            gpm::define_key dk = r;
+            std::cerr << "key " << boost::rpc::super_fast_hash(boost::rpc::to_json(dk.key)) <<"\n";
+        }
+        if( r.id == gpm::start_trx::id )
+        {
+            gpm::start_trx tl = r;
+            std::cerr << boost::rpc::to_json(tl) << std::endl;
+        }
+        if( r.id == gpm::end_block::id )
+        {
+            gpm::end_block tl = r;
+            std::cerr << boost::rpc::to_json(tl) << std::endl;
+        }
+        p += len;
+        len = get_record( p, r ); 
+    }
+}
+
+name_cursor::name_cursor()
+:m_db_valid(false),m_end(true)
+{
+}
+
+/**
+ *  Adds the sorted names of one overlay, names is left empty.
+ */
+void name_cursor::add_run( std::vector<std::string>& names )
+{
+    if( names.empty() )
+        return;
+    m_runs.push_back( std::vector<std::string>() );
+    m_runs.back().swap( names );
+    m_pos.push_back( 0 );
+}
+
+void name_cursor::read_db()
+{
+    m_db_valid = !m_itr.end() && !(m_last < m_itr.key());
+    if( m_db_valid )
+        m_db_name = m_itr.key();
+}
+
+/**
+ *  Selects the smallest name at the head of the runs and the name index.
+ */
+void name_cursor::update()
+{
+    const std::string* n = m_db_valid ? &m_db_name : 0;
+    for( uint32_t i = 0; i < m_runs.size(); ++i )
+        if( m_pos[i] < m_runs[i].size() && ( !n || m_runs[i][m_pos[i]] < *n ) )
+            n = &m_runs[i][m_pos[i]];
+    m_end = !n;
+    if( n )
+        m_name = *n;
+}
+
+name_cursor& name_cursor::operator++()
+{
+    if( m_end )
+        return *this;
+    for( uint32_t i = 0; i < m_runs.size(); ++i )
+        if( m_pos[i] < m_runs[i].size() && m_runs[i][m_pos[i]] == m_name )
+            ++m_pos[i];
+    if( m_db_valid && m_db_name == m_name )
+    {
+        ++m_itr;
+        read_db();
+    }
+    update();
+    return *this;
+}
+
+/**
+ *  The first limit names of the cursor cannot come from beyond the first limit of any run.
+ */
+void sdt::add_local_names( name_cursor& c, const std::string& start, const std::string& end, uint32_t limit )
+{
+    std::vector<name_index::value_type> local;
+    last_name_edit_map.select( start, end, local, limit );
+    std::vector<std::string> names( local.size() );
+    for( uint32_t i = 0; i < local.size(); ++i )
+        names[i].swap( local[i].first );
+    c.add_run( names );
+}
+
+name_cursor sdt::get_names( const std::string& start, const std::string& end, uint32_t limit )
+{
+    name_cursor c;
+    if( base )
+        c = base->get_names( start, end, limit );
+    else
+        c.m_last = end;
+    add_local_names( c, start, end, limit );
+    c.update();
+    return c;
+}
+
+name_cursor sd::get_names( const std::string& start, const std::string& end, uint32_t limit )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    name_cursor c;
+    c.m_last = end;
+    m_name_db.search( start ).swap( c.m_itr );
+    c.read_db();
+    add_local_names( c, start, end, limit );
+    c.update();
+    return c;
+}
+
+std::vector<std::string> sdt::query_names( const std::string& start, const std::string& end, uint32_t limit  )
+{
+    std::vector<std::string> names;
+    name_cursor c = get_names( start, end, limit );
+    while( !c.end() && names.size() < limit )
+    {
+        names.push_back( c.name() );
+        ++c;
+    }
+    return names;
+}
+
+uint64_t sdt::name_count()
+{
+    return get_counts().names;
+}
+
+state_counts sdt::get_counts()
+{
+    state_counts c;
+    if( base ) 
+        c = base->get_counts();
+    c += m_counts;
+    return c;
+}
+
+state_counts sd::get_counts()
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    state_counts c = m_totals;
+    c += m_counts;
+    return c;
+}
+
+std::vector<uint64_t>  sdt::get_account_contents_idx( uint64_t acnt_idx )
+{
+    std::vector<uint64_t> cts;
+
+    account_key lak( acnt_idx, 0 ); 
+    account_key uak( acnt_idx, uint64_t(-1) ); 
+
+    std::vector<account_index::value_type> local;
+    last_transfer_map.select( lak, uak, local );
+    for( uint32_t i = 0; i < local.size(); ++i )
+        cts.push_back( local[i].first.type_name );
+
+    if( base ) 
+    {
+        std::vector<uint64_t> bcts(base->get_account_contents_idx(acnt_idx) );
+        cts.insert(cts.end(), bcts.begin(), bcts.end() );
+    }
+    return cts;
+}
+std::vector<std::string>  sdt::get_account_contents( const std::string& acnt )
+{
+    uint64_t aidx = get_name_index(acnt);
+    if( aidx == uint64_t(-1) )
+        return std::vector<std::string>();
+
+    std::vector<uint64_t> types = get_account_contents_idx( aidx );
+    std::sort( types.begin(), types.end() );
+    types.erase( std::unique( types.begin(), types.end() ), types.end() );
+
+    std::vector<std::string> names = get_names_for_index( types );
+    std::sort(names.begin(),names.end());
+    return names;
+}
+std::vector<uint64_t>  sd::get_account_contents_idx( uint64_t acnt_idx )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    std::vector<uint64_t> cts = sdt::get_account_contents_idx(acnt_idx);
+
+    std::vector< std::pair<account_key,uint64_t> > range;
+    m_transfer_db.read_range( account_key( acnt_idx, 0 ), account_key( acnt_idx + 1, 0 ), range );
+    for( uint32_t i = 0; i < range.size(); ++i )
+        cts.push_back( range[i].first.type_name );
+    std::sort(cts.begin(),cts.end());
+    cts.erase( std::unique( cts.begin(), cts.end() ), cts.end() );
+    return cts;
+}
+/**
+ *  The indexes rebuilt from one range of the log.
+ */
+struct range_index
+{
+    range_index():records(0),corrupt(-1){}
+
+    account_index                   accounts;
+    name_index                      defines; // define_name records by name
+    flat_index<uint64_t,uint64_t>   updates; // name index -> last update_name record
+    key_index                       keys;    // define_key records
+    std::vector<history_key>        history;
+    // history entries whose start_trx is before the range and the location of the start_trx
+    std::vector< std::pair<uint64_t,uint64_t> > untimed;
+    uint64_t                        records;
+    uint64_t                        corrupt; // first record that failed its crc
+};
+
+/**
+ *  Size of the ranges the log is split into for update_index(), small enough
+ *  to balance the work and to report progress.
+ */
+static const uint64_t index_range_size = 16 * state_chunk_size;
+
+/**
+ *  The time of the start_trx record at loc within the range at d, see sdt::get_transfer_time().
+ */
+static uint64_t record_time( uint32_t version, const char* d, uint64_t begin, uint64_t end, uint64_t loc )
 {
-    if( m_to == m_from )
-    {
-        m_index = -1;
-        return false;
-    }
-    if( account == m_to )
+    record_header h;
+    if( !parse_header( version, d + (loc - begin), end - loc, h ) || end - loc < h.size )
+        return -1;
+    if( h.id != start_trx::id )
+        return 1000000ll*60*60*24;
+    start_trx st;
+    unpack_record( version, h, d + (loc - begin), loc, st );
+    return st.utc_time;
+}
+
+/**
+ *  Indexes the records between begin and end, which are at d, later records replace 
+ *  the entries of earlier ones.  Only reads d so any number of ranges may be indexed 
+ *  at once.
+ */
+static void index_range( uint32_t version, const char* d, uint64_t begin, uint64_t end, range_index& out )
+{
+    uint64_t pos = begin;
+    record_header h;
+    while( pos < end && parse_header( version, d + (pos - begin), end - pos, h ) )
     {
-        if( m_prev_to < m_index )
+        const char* rd = d + (pos - begin);
+        if( !check_record( version, rd, h ) )
         {
-            m_index = m_prev_to;
-            return update();
+            out.corrupt = pos;
+            return;
         }
-    }
-    else if( account == m_from )
-    {
-        if( m_prev_from < m_index )
+        if( h.id == define_name::id )
         {
-            m_index = m_prev_from;
-            return update();
+            define_name dn;
+            unpack_record( version, h, rd, pos, dn );
+            out.defines[dn.name] = name_edit( pos, pos );
+        }
+        else if( h.id == update_name::id )
+        {
+            update_name un;
+            unpack_record( version, h, rd, pos, un );
+            out.updates[un.name_idx] = pos;
         }
+        else if( h.id == define_key::id )
+        {
+            define_key dk;
+            unpack_record( version, h, rd, pos, dk );
+            out.keys[key_hash(dk.key)] = pos;
+        }
+        else if( h.id == transfer_log::id )
+        {
+            transfer_log tl;
+            unpack_record( version, h, rd, pos, tl );
+            // from last so that it wins if the account pays itself, matching transfer_balance_idx()
+            out.accounts[ account_key( tl.to_name, tl.type_name ) ]   = account_state( pos, tl.new_to_bal );
+            out.accounts[ account_key( tl.from_name, tl.type_name ) ] = account_state( pos, tl.new_from_bal );
+            if( tl.trx_idx >= begin && tl.trx_idx < end )
+                history_entries( tl, record_time( version, d, begin, end, tl.trx_idx ), pos, out.history );
+            else
+            {
+                uint64_t first = out.history.size();
+                history_entries( tl, -1, pos, out.history );
+                for( uint64_t e = first; e < out.history.size(); ++e )
+                    out.untimed.push_back( std::make_pair( e, tl.trx_idx ) );
+            }
+        }
+        ++out.records;
+        pos += h.size;
     }
-    m_index = -1;
-    return false; 
 }
 
-void sdt::dump( const state_record& r )
+/**
+ *  Worker that indexes every threads'th range starting with offset.  Ranges that
+ *  are sealed are copied out of their segments first.
+ */
+static void index_ranges( uint32_t version, segmented_log* log, const std::vector<uint64_t>* bounds, std::vector<range_index>* out,
+                          uint32_t offset, uint32_t threads, boost::mutex* m, uint64_t* done )
 {
-    std::cerr<< std::dec << "prev: "<<r.previous<<"  ";
-    if( r.id == gpm::define_name::id )
+    std::vector<char> buf;
+    for( uint32_t i = offset; i + 1 < bounds->size(); i += threads )
     {
-        gpm::define_name dn = r;
-        std::cerr << "define " << dn.name << " =>  " << boost::rpc::super_fast_hash(boost::rpc::to_json(dn.key)) <<"\n";
+        uint64_t    begin = (*bounds)[i];
+        uint64_t    end   = (*bounds)[i+1];
+        const char* d     = log->bytes( begin, end - begin, buf );
+        if( d )
+            index_range( version, d, begin, end, (*out)[i] );
+        else
+            (*out)[i].corrupt = begin;
+
+        boost::mutex::scoped_lock lock(*m);
+        *done += (*bounds)[i+1] - (*bounds)[i];
+        slog( "indexed %1% of %2% MB", (*done / (1024*1024)), (bounds->back() / (1024*1024)) );
     }
-    if( r.id == gpm::update_name::id )
+}
+
+/**
+ *  Rebuilds transfer_index, balance_index and name_index from the log in the event 
+ *  that they were lost or are out of date.
+ *
+ *  Finding where records start requires a sequential walk, but it only reads the 
+ *  record headers.  The log is then split at record boundaries into ranges that are 
+ *  decoded in parallel, and the per range indexes are merged in log order so that
+ *  the last record to touch a key wins.  A partial record at the end of the log is
+ *  discarded.
+ *
+ *  Like commit() it is only called by the thread that modifies the database, the
+ *  log is scanned and indexed without the lock, which is only held to truncate
+ *  the log and to replace the indexes.
+ */
+void sd::update_index( )
+{
+    uint64_t start_time = gpm::utc_clock();
+
+    // find the record boundaries that split the log into ranges
+    std::vector<uint64_t> bounds;
+    std::vector<char>     buf;
+    uint32_t hs   = header_size( m_log_version );
+    uint64_t pos  = log_start( m_log_version );
+    uint64_t last = pos;
+    bounds.push_back(pos);
+    record_header h;
+    while( m_file_size - pos >= hs && parse_header( m_log_version, m_log.bytes( pos, hs, buf ), hs, h ) 
+           && m_file_size - pos >= h.size )
     {
-        gpm::update_name dn = r;
-        std::cerr << "update " << dn.name_idx << " =>  " << boost::rpc::super_fast_hash(boost::rpc::to_json(dn.key)) << "last update: " << dn.last_update_idx <<"\n";
+        last = pos;
+        pos += h.size;
+        if( pos - bounds.back() >= index_range_size )
+            bounds.push_back(pos);
     }
-    if( r.id == gpm::transfer_log::id )
+    // a write that was torn inside the last record can leave a valid header
+    const char* ld = pos != last ? m_log.bytes( last, pos - last, buf ) : NULL;
+    if( ld && parse_header( m_log_version, ld, pos - last, h ) && !check_record( m_log_version, ld, h ) )
     {
-        gpm::transfer_log tl = r;
-        std::cerr << boost::rpc::to_json(tl) << std::endl;
+        while( bounds.back() > last )
+            bounds.pop_back();
+        pos = last;
     }
-    if( r.id == gpm::start_trx::id )
+    if( bounds.back() != pos )
+        bounds.push_back(pos);
+
+    if( pos != m_file_size )
     {
-        gpm::start_trx tl = r;
-        std::cerr << boost::rpc::to_json(tl) << std::endl;
+        boost::recursive_mutex::scoped_lock lock( m_mutex );
+        wlog( "discarding %1% bytes of partial record at the end of the log", (m_file_size - pos) );
+        truncate_log( pos );
     }
-    if( r.id == gpm::end_block::id )
+    slog( "indexing %1% bytes of the state log in %2% ranges", m_file_size, (bounds.size()-1) );
+
+    std::vector<range_index> ranges( bounds.size() - 1 );
+    uint32_t threads = m_hash_threads;
+    if( threads == 0 )
+        threads = std::max( 1u, boost::thread::hardware_concurrency() );
+    if( threads > ranges.size() )
+        threads = ranges.size();
+
+    boost::mutex m;
+    uint64_t     done = 0;
+    if( threads > 1 )
     {
-        gpm::end_block tl = r;
-        std::cerr << boost::rpc::to_json(tl) << std::endl;
+        boost::thread_group workers;
+        for( uint32_t t = 1; t < threads; ++t )
+            workers.create_thread( boost::bind( index_ranges, m_log_version, &m_log, &bounds, &ranges, t, threads, &m, &done ) );
+        index_ranges( m_log_version, &m_log, &bounds, &ranges, 0, threads, &m, &done );
+        workers.join_all();
     }
-}
-void sdt::dump(int max)
-{
-    state_record r;
-    int c = 0;
-    uint64_t p = 0;
-    uint64_t len = get_record( p, r ); 
-    while (len && c < max)
+    else
+        index_ranges( m_log_version, &m_log, &bounds, &ranges, 0, 1, &m, &done );
+
+    for( uint32_t i = 0; i < ranges.size(); ++i )
+        if( ranges[i].corrupt != uint64_t(-1) )
+            THROW_GPM_EXCEPTION( "State log record at %1% does not match its crc", %ranges[i].corrupt );
+
+    // merge the ranges in log order
+    account_index                      accounts;
+    name_index                         names;
+    flat_index<uint64_t,std::string>   names_by_idx;
+    key_index                          keys;
+    std::vector<history_key>           history;
+    uint64_t                           records = 0;
+    for( uint32_t i = 0; i < ranges.size(); ++i )
     {
-        ++c;
-        std::cerr<< std::dec << p << " ] prev: "<<r.previous<<"  ";
-        if( r.id == gpm::define_name::id )
+        // transfers whose start_trx is in an earlier range are timed here
+        for( uint32_t u = 0; u < ranges[i].untimed.size(); ++u )
         {
-            gpm::define_name dn = r;
-            std::cerr << "define " << dn.name << " =>  " << boost::rpc::super_fast_hash(boost::rpc::to_json(dn.key)) <<"\n";
-        }
-        if( r.id == gpm::update_name::id )
-        {
-            gpm::update_name dn = r;
-            std::cerr << "update " << dn.name_idx << " =>  " << boost::rpc::super_fast_hash(boost::rpc::to_json(dn.key)) << "last update: " << dn.last_update_idx <<"\n";
+            transfer_log tl;
+            tl.trx_idx = ranges[i].untimed[u].second;
+            ranges[i].history[ranges[i].untimed[u].first].time = get_transfer_time( tl );
         }
-        if( r.id == gpm::transfer_log::id )
+        history.insert( history.end(), ranges[i].history.begin(), ranges[i].history.end() );
+        for( account_index::const_iterator itr = ranges[i].accounts.begin(); itr != ranges[i].accounts.end(); ++itr )
+            accounts[itr->first] = itr->second;
+        for( name_index::const_iterator itr = ranges[i].defines.begin(); itr != ranges[i].defines.end(); ++itr )
         {
-            gpm::transfer_log tl = r;
-            std::cerr << boost::rpc::to_json(tl) << std::endl;
+            names[itr->first] = itr->second;
+            names_by_idx[itr->second.name_idx] = itr->first;
         }
-        if( r.id == gpm::start_trx::id )
+        for( key_index::const_iterator itr = ranges[i].keys.begin(); itr != ranges[i].keys.end(); ++itr )
+            keys[itr->first] = itr->second;
+        records += ranges[i].records;
+    }
+    for( uint32_t i = 0; i < ranges.size(); ++i )
+    {
+        for( flat_index<uint64_t,uint64_t>::const_iterator itr = ranges[i].updates.begin(); itr != ranges[i].updates.end(); ++itr )
         {
-            gpm::start_trx tl = r;
-            std::cerr << boost::rpc::to_json(tl) << std::endl;
+            const std::string* n = names_by_idx.find(itr->first);
+            if( !n )
+            {
+                wlog( "update_name at %1% refers to undefined name %2%", itr->second, itr->first );
+                continue;
+            }
+            name_edit& e = names[*n];
+            if( itr->second > e.last_edit || e.last_edit == uint64_t(-1) )
+                e.last_edit = itr->second;
         }
-        if( r.id == gpm::end_block::id )
+    }
+
+    std::vector<account_index::value_type> sorted_accounts;
+    accounts.sorted( sorted_accounts );
+    std::vector< std::pair<account_key,uint64_t> > last_transfers( sorted_accounts.size() );
+    std::vector< std::pair<account_key,uint64_t> > balances( sorted_accounts.size() );
+    std::vector< std::pair<holder_key,uint64_t> >  holders;
+    std::vector< std::pair<rank_key,uint64_t> >    ranks;
+    for( uint32_t i = 0; i < sorted_accounts.size(); ++i )
+    {
+        const account_key& k   = sorted_accounts[i].first;
+        uint64_t           bal = sorted_accounts[i].second.balance;
+        last_transfers[i] = std::make_pair( k, sorted_accounts[i].second.last_transfer );
+        balances[i]       = std::make_pair( k, bal );
+        if( bal )
         {
-            gpm::end_block tl = r;
-            std::cerr << boost::rpc::to_json(tl) << std::endl;
+            holders.push_back( std::make_pair( holder_key( k.type_name, k.account_name ), bal ) );
+            ranks.push_back( std::make_pair( rank_key( k.type_name, bal, k.account_name ), bal ) );
         }
-        p += len;
-        len = get_record( p, r ); 
     }
+    uint64_t holdings = holders.size();
+    std::sort( holders.begin(), holders.end() );
+    std::sort( ranks.begin(), ranks.end() );
+
+    std::vector<name_index::value_type> sorted_names;
+    names.sorted( sorted_names );
+    std::vector< std::pair<std::string,uint64_t> > edits( sorted_names.size() );
+    std::vector< std::pair<uint64_t,std::string> > by_index( sorted_names.size() );
+    for( uint32_t i = 0; i < sorted_names.size(); ++i )
+    {
+        edits[i]    = std::make_pair( sorted_names[i].first, sorted_names[i].second.last_edit );
+        by_index[i] = std::make_pair( sorted_names[i].second.name_idx, sorted_names[i].first );
+    }
+    std::sort( by_index.begin(), by_index.end() );
+    std::sort( history.begin(), history.end() );
+    std::vector<key_index::value_type> sorted_keys;
+    keys.sorted( sorted_keys );
+
+    {
+        // replace the indexes in one group
+        boost::recursive_mutex::scoped_lock lock( m_mutex );
+        bdb::group_commit grp( *m_env );
+        m_transfer_db.clear();
+        m_balance_db.clear();
+        m_name_db.clear();
+        m_name_by_index_db.clear();
+        m_history_db.clear();
+        m_holder_db.clear();
+        m_rank_db.clear();
+        m_key_db.clear();
+
+        m_transfer_db.set_many( last_transfers );
+        m_balance_db.set_many( balances );
+        m_holder_db.set_many( holders );
+        m_rank_db.set_many( ranks );
+        m_name_db.set_many( edits );
+        m_name_by_index_db.set_many( by_index );
+        set_history( history );
+        m_key_db.set_many( sorted_keys );
+        m_totals.names    = sorted_names.size();
+        m_totals.accounts = sorted_accounts.size();
+        m_totals.holdings = holdings;
+        save_counts();
+        m_meta_db.set( "log_size", m_file_size );
+        grp.commit();
+        m_names.clear();
+        clear_key_cache();
+    }
+
+    uint64_t elapsed = std::max( uint64_t(1), gpm::utc_clock() - start_time );
+    slog( "indexed %1% records, %2% accounts and %3% names in %4% ms (%5% MB/s)", 
+          records, sorted_accounts.size(), sorted_names.size(), (elapsed / 1000),
+          (m_file_size / elapsed) ); // bytes per microsecond == MB per second
 }
 
-std::vector<std::string> sdt::query_names( const std::string& start, const std::string& end, uint32_t limit  )
-{
-    std::vector<std::string> names;
-    if( base ) 
-        names = base->query_names(start,end,limit);
 
-    name_index::const_iterator s = last_name_edit_map.lower_bound(start);
-    name_index::const_iterator e = last_name_edit_map.upper_bound(end);
-    while( s != e ){  names.push_back(s->first); ++s; }
-    if( names.size() > limit ) 
-        names.resize(limit);
+/**
+ *  Bytes past the size recorded with the indexes were appended by a commit whose
+ *  group never committed.  The complete records among them become pending changes
+ *  again and are committed, anything after the last of them is discarded.
+ */
+void sd::index_uncommitted( uint64_t from )
+{
+    record_header     h;
+    std::vector<char> buf;
+    uint32_t          hs  = header_size( m_log_version );
+    uint64_t          end = from;
+    while( m_file_size - end >= hs )
+    {
+        const char* d = m_log.bytes( end, hs, buf );
+        if( !d || !parse_header( m_log_version, d, hs, h ) || h.size > m_file_size - end )
+            break;
+        end += h.size;
+    }
 
-    std::sort(names.begin(),names.end());
-    names.erase( std::unique( names.begin(), names.end() ), names.end() );
-    return names;
+    std::vector<char> data( end - from );
+    if( data.size() && m_log.read( from, &data.front(), data.size() ) != data.size() )
+        THROW_GPM_EXCEPTION( "Unable to read the state log from %1%", %from );
+    range_index ri;
+    if( data.size() )
+        index_range( m_log_version, &data.front(), from, end, ri );
+    if( ri.corrupt != uint64_t(-1) )
+        end = ri.corrupt;
+
+    wlog( "indexing %1% bytes that were not committed to the index, discarding %2%", (end - from), (m_file_size - end) );
+    truncate_log( from );
+    if( end == from )
+        return;
+    local_changes.append( &data.front(), end - from );
+
+    for( name_index::const_iterator itr = ri.defines.begin(); itr != ri.defines.end(); ++itr )
+    {
+        last_name_edit_map[itr->first] = itr->second;
+        ++m_counts.names;
+    }
+    for( flat_index<uint64_t,uint64_t>::const_iterator itr = ri.updates.begin(); itr != ri.updates.end(); ++itr )
+    {
+        state_record r;
+        if( !get_record( itr->first, r ) || r.id != define_name::id )
+            THROW_GPM_EXCEPTION( "Expected define_name at %1%", %itr->first );
+        define_name dn = r;
+        last_name_edit_map[dn.name] = name_edit( itr->second, itr->first );
+    }
+    for( account_index::const_iterator itr = ri.accounts.begin(); itr != ri.accounts.end(); ++itr )
+    {
+        account_state old;
+        bool existed = find_committed_account( itr->first, old );
+        count_change( existed, existed ? old.balance : 0, itr->second.balance );
+        last_transfer_map[itr->first] = itr->second;
+    }
+    for( key_index::const_iterator itr = ri.keys.begin(); itr != ri.keys.end(); ++itr )
+        m_local_keys[itr->first] = itr->second;
+    commit();
 }
-std::vector<std::string> sd::query_names( const std::string& start, const std::string& end, uint32_t limit  )
-{
-    std::vector<std::string> names;
-    if( base ) 
-        names = base->query_names(start,end,limit);
 
-    name_index::const_iterator s = last_name_edit_map.lower_bound(start);
-    name_index::const_iterator e = last_name_edit_map.upper_bound(end);
-    while( s != e ){  names.push_back(s->first); ++s; }
+/**
+ *  A name whose index entry is newer than bound is followed back through its
+ *  update_name records, it did not exist yet if it was defined after bound.
+ */
+bool sd::find_name_at( const std::string& name, name_edit& e, uint64_t bound )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    if( !find_committed_name( name, e ) || e.name_idx >= bound )
+        return false;
+    while( e.last_edit >= bound )
+    {
+        state_record r;
+        if( !get_record( e.last_edit, r ) || r.id != update_name::id )
+            THROW_GPM_EXCEPTION( "Expected update_name at %1%", %e.last_edit );
+        update_name un = r;
+        e.last_edit = un.last_update_idx;
+    }
+    return true;
+}
 
-    bdb::keyvalue_db<std::string,uint64_t>::iterator itr = m_name_db.search(start);
-    while( !itr.end() && itr.key() <= end )
+/**
+ *  Follows the account's chain of transfer_log records back from the last one
+ *  to the last one before bound, the balance is read from that record.
+ */
+bool sd::find_account_at( const account_key& a, account_state& as, uint64_t bound )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    if( !find_committed_account( a, as ) )
+        return false;
+    if( as.last_transfer < bound )
+        return true;
+    while( as.last_transfer != uint64_t(-1) && as.last_transfer >= bound )
     {
-        names.push_back( itr.key() );
-        if( names.size() > limit )
-            return names;
-        ++itr;
+        state_record r;
+        if( !get_record( as.last_transfer, r ) || r.id != transfer_log::id )
+            THROW_GPM_EXCEPTION( "Expected transfer_log at %1%", %as.last_transfer );
+        transfer_log tl = r;
+        as.last_transfer = tl.from_name == a.account_name ? tl.last_from_trx : tl.last_to_trx;
     }
-    std::sort(names.begin(),names.end());
-    names.erase( std::unique( names.begin(), names.end() ), names.end() );
+    if( as.last_transfer == uint64_t(-1) )
+        return false;
+    as.balance = get_balance_at( as.last_transfer, a );
+    return true;
+}
 
+/**
+ *  The transfers are read into the cursor at once so that it never reads the
+ *  index without holding the lock.
+ */
+history_cursor sd::get_history_at( const account_key& a, uint64_t start_time, uint64_t end_time, uint64_t bound )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    history_cursor c;
+    c.m_account    = a;
+    c.m_start_time = start_time;
+
+    history_key last( a, end_time, uint64_t(-1) );
+    history_index::iterator itr = m_history_db.search( last );
+    if( itr.end() || itr.key() > last )
+        --itr;
+    for( ; !itr.end() && itr.key().account == a && itr.key().time >= start_time; --itr )
+        if( itr.key().loc < bound )
+            c.add_pending( itr.key().time, itr.key().loc );
+    std::reverse( c.m_pending.begin(), c.m_pending.end() );
+    c.update();
+    return c;
+}
+
+std::vector<std::string> sd::query_names_at( const std::string& start, const std::string& end, 
+                                             uint32_t limit, uint64_t bound )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    std::vector<std::string> names;
+    name_edit e;
+    bdb::keyvalue_db<std::string,uint64_t>::iterator itr = m_name_db.search( start );
+    for( ; !itr.end() && !(end < itr.key()) && names.size() < limit; ++itr )
+        if( itr.value() < bound || find_name_at( itr.key(), e, bound ) )
+            names.push_back( itr.key() );
     return names;
 }
 
-uint64_t sdt::name_count()
+std::vector<uint64_t> sd::get_account_contents_at( uint64_t acnt, uint64_t bound )
 {
-    int count = 0;
-    if( base ) count = base->name_count();
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    std::vector<uint64_t> cts;
+    account_state as;
+    std::vector< std::pair<account_key,uint64_t> > range;
+    m_transfer_db.read_range( account_key( acnt, 0 ), account_key( acnt + 1, 0 ), range );
+    for( uint32_t i = 0; i < range.size(); ++i )
+        if( range[i].second < bound || find_account_at( range[i].first, as, bound ) )
+            cts.push_back( range[i].first.type_name );
+    return cts;
+}
 
-    name_index::const_iterator itr = last_name_edit_map.begin();
-    while( itr != last_name_edit_map.end() )
+/**
+ *  Adds the balance at bound of every holder of type that a record committed after
+ *  bound changed and that out does not replace already, 0 if it held none then.
+ */
+void sd::holders_changed_since( uint64_t type, uint64_t bound, holder_map& out )
+{
+    account_state as;
+    state_record  r;
+    for( uint64_t loc = bound; loc < m_file_size; )
     {
-        if( base->get_name_index(itr->first) == -1 )
-            ++count;
-        ++itr;
+        uint64_t n = get_record( loc, r );
+        if( !n )
+            THROW_GPM_EXCEPTION( "Unable to read record at %1%", %loc );
+        if( r.id == transfer_log::id )
+        {
+            transfer_log tl = r;
+            if( tl.type_name == type )
+            {
+                uint64_t accounts[2] = { tl.from_name, tl.to_name };
+                for( uint32_t i = 0; i < 2; ++i )
+                    if( !out.find( accounts[i] ) )
+                        out[accounts[i]] = find_account_at( account_key( accounts[i], type ), as, bound ) ? as.balance : 0;
+            }
+        }
+        loc += n;
     }
-    return count;
 }
-uint64_t sd::name_count()
+
+/**
+ *  The pending changes of the database are newer than bound and are left out.
+ */
+std::vector<holder> sd::get_holders_at( uint64_t type, uint64_t start_account, uint32_t limit,
+                                        const holder_map& newer, uint64_t bound )
 {
-    int count = m_name_db.count();
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    holder_map merged = newer;
+    holders_changed_since( type, bound, merged );
+    return committed_holders( type, start_account, limit, merged );
+}
 
-    name_index::const_iterator itr = last_name_edit_map.begin();
-    while( itr != last_name_edit_map.end() )
-    {
-        if( m_name_db.find(itr->first).end() )
-            ++count;
-        ++itr;
-    }
-    return count;
+std::vector<holder> sd::get_top_holders_at( uint64_t type, uint32_t limit, const holder_map& newer, uint64_t bound )
+{
+    boost::recursive_mutex::scoped_lock lock( m_mutex );
+    holder_map merged = newer;
+    holders_changed_since( type, bound, merged );
+    return committed_top_holders( type, limit, merged );
 }
 
-std::vector<uint64_t>  sdt::get_account_contents_idx( uint64_t acnt_idx )
+/**
+ *  The arena of the database is only used by the writer, a snapshot may be
+ *  released by any thread.
+ */
+state_snapshot::state_snapshot( const state_database::ptr& db, uint64_t bound )
+:state_database_transaction(db),m_db(db),m_bound(bound)
 {
-    std::vector<uint64_t> cts;
+    local_changes.set_arena( change_arena::ptr() );
+}
 
-    account_key lak( acnt_idx,   0 ); 
-    account_key uak( acnt_idx+1, 0 ); 
+static void read_only()
+{
+    THROW_GPM_EXCEPTION( "State snapshots are read only" );
+}
 
-    account_index::const_iterator s = last_transfer_map.lower_bound(lak);
-    account_index::const_iterator e = last_transfer_map.upper_bound(uak);
-    while( s != e ){  cts.push_back( s->first.type_name ); ++s; }
+uint64_t state_snapshot::start()const
+{
+    return m_bound;
+}
 
-    if( base ) 
+state_counts state_snapshot::get_counts()
+{
+    return m_totals;
+}
+
+bool state_snapshot::find_name( const std::string& name, name_edit& e )
+{
+    const name_edit* itr = last_name_edit_map.find(name);
+    if( itr )
     {
-        std::vector<uint64_t> bcts(base->get_account_contents_idx(acnt_idx) );
-        cts.insert(cts.end(), bcts.begin(), bcts.end() );
+        e = *itr;
+        return true;
     }
-    return cts;
+    return m_db->find_name_at( name, e, m_bound );
 }
-std::vector<std::string>  sdt::get_account_contents( const std::string& acnt )
+
+bool state_snapshot::find_account( const account_key& a, account_state& as )
 {
-    slog( "get account contents %1%", acnt );
-    std::vector<std::string> names;
-    if( base ) 
-        names = base->get_account_contents( acnt );
-    
-    account_key lak( get_name_index(acnt),   0 ); 
-    account_key uak( get_name_index(acnt)+1, 0 ); 
+    const account_state* itr = last_transfer_map.find(a);
+    if( itr )
+    {
+        as = *itr;
+        return true;
+    }
+    return m_db->find_account_at( a, as, m_bound );
+}
 
+history_cursor state_snapshot::get_history( const account_key& a, uint64_t start_time, uint64_t end_time )
+{
+    history_cursor c = m_db->get_history_at( a, start_time, end_time, m_bound );
+    add_local_history( c, m_bound, start_time, end_time );
+    return c;
+}
 
-    account_index::const_iterator s = last_transfer_map.lower_bound(lak);
-    account_index::const_iterator e = last_transfer_map.upper_bound(uak);
-    while( s != e ){  names.push_back( get_name_for_index(s->first.type_name) ); ++s; }
+/**
+ *  The first limit names of the database and the names changed since the snapshot
+ *  include the first limit names of the snapshot.
+ */
+name_cursor state_snapshot::names_at( const std::string& start, const std::string& end, uint32_t limit )
+{
+    name_cursor c;
+    c.m_last = end;
+    std::vector<std::string> names = m_db->query_names_at( start, end, limit, m_bound );
+    c.add_run( names );
+    add_local_names( c, start, end, limit );
+    c.update();
+    return c;
+}
 
-    std::sort(names.begin(),names.end());
-    /*
-    BOOST_FOREACH( const std::string& s, names )
+name_cursor state_snapshot::get_names( const std::string& start, const std::string& end, uint32_t limit )
+{
+    return names_at( start, end, limit );
+}
+
+std::vector<std::string> state_snapshot::query_names( const std::string& start, const std::string& end, uint32_t limit )
+{
+    std::vector<std::string> names;
+    name_cursor c = names_at( start, end, limit );
+    while( !c.end() && names.size() < limit )
     {
-        slog( "found in trx %1%", %s );
+        names.push_back( c.name() );
+        ++c;
     }
-    */
-    names.erase( std::unique( names.begin(), names.end() ), names.end() );
     return names;
 }
-std::vector<uint64_t>  sd::get_account_contents_idx( uint64_t acnt_idx )
+
+std::vector<uint64_t> state_snapshot::get_account_contents_idx( uint64_t acnt )
 {
-    std::vector<uint64_t> cts = sdt::get_account_contents_idx(acnt_idx);
-    account_key ak( acnt_idx, 0 ); 
-    
-   bdb::keyvalue_db<account_key,uint64_t>::iterator itr = m_transfer_db.search(ak);
-   while( !itr.end() )
-   {
-        if( itr.key().account_name == ak.account_name )
-        {
-            cts.push_back( itr.key().type_name );
-        }
-        else
-        {
-            std::sort(cts.begin(),cts.end());
-            cts.erase( std::unique( cts.begin(), cts.end() ), cts.end() );
-            return cts;
-        }
-        ++itr;
-   }
-   return cts;
+    std::vector<uint64_t> cts = m_db->get_account_contents_at( acnt, m_bound );
+    std::vector<account_index::value_type> local;
+    last_transfer_map.select( account_key( acnt, 0 ), account_key( acnt, uint64_t(-1) ), local );
+    for( uint32_t i = 0; i < local.size(); ++i )
+        cts.push_back( local[i].first.type_name );
+    return cts;
 }
-std::vector<std::string>  sd::get_account_contents( const std::string& acnt )
+
+std::vector<holder> state_snapshot::get_holders( uint64_t type, uint64_t start_account, uint32_t limit, 
+                                                 const holder_map& newer )
 {
-//   slog( "query %1%", %acnt );
-   std::vector<std::string> names = sdt::get_account_contents(acnt);
-   account_key ak( get_name_index(acnt), 0 ); 
-//   slog( "%1%  keys %2%", %get_name_index(acnt)  %m_transfer_db.count() ); 
-   bdb::keyvalue_db<account_key,uint64_t>::iterator itr = m_transfer_db.search(ak);
-   while( !itr.end() )
-   {
-        if( itr.key().account_name == ak.account_name )
-        {
-            names.push_back( get_name_for_index( itr.key().type_name ) );
-        }
-        else
-        {
-            std::sort(names.begin(),names.end());
-            names.erase( std::unique( names.begin(), names.end() ), names.end() );
-            return names;
-        }
-        ++itr;
-   }
-    return names;
+    holder_map merged;
+    merge_holders( type, newer, merged );
+    return m_db->get_holders_at( type, start_account, limit, merged, m_bound );
 }
 
-/**
- *  Parses the file and updates the index in the event that data was lost.
- */
-void sd::update_index( )
+std::vector<holder> state_snapshot::get_top_holders( uint64_t type, uint32_t limit, const holder_map& newer )
 {
-
+    holder_map merged;
+    merge_holders( type, newer, merged );
+    return m_db->get_top_holders_at( type, limit, merged, m_bound );
 }
 
+bool state_snapshot::set_public_key( const std::string& name, const public_key_t& pk )                    { read_only(); return false; }
+void state_snapshot::transfer_balance_idx( uint64_t from, uint64_t to, uint64_t type, uint64_t amnt, uint64_t trx_pos ) { read_only(); }
+void state_snapshot::issue( const std::string& type, uint64_t trx_pos )                                   { read_only(); }
+bool state_snapshot::apply( const signed_transaction& trx, const std::string& gen_name )                  { read_only(); return false; }
+bool state_snapshot::apply( const block& b, const std::string& gen, const std::vector<signed_transaction>& trxs, 
+                            const boost::rpc::sha1_hashcode& check )                                      { read_only(); return false; }
+bool state_snapshot::append_record( const state_record& r )                                               { read_only(); return false; }
+bool state_snapshot::append( change_buffer& d, const account_index& idx, const name_index& nidx,
+                             const state_counts& counts, const key_index& keys )                          { read_only(); return false; }
+bool state_snapshot::commit()                                                                             { read_only(); return false; }
+void state_snapshot::abort()                                                                              { read_only(); }
+void state_snapshot::rebase( const abstract_state_database::ptr& new_base )                               { read_only(); }
+
 
 } // namespace gpm
 
@@ -6,8 +6,19 @@
 #include <gpm/crypto/crypto.hpp>
 #include <gpm/bdb/keyvalue_db.hpp>
 #include <gpm/statedb/trx_file.hpp>
+#include <gpm/statedb/mapped_file.hpp>
+#include <gpm/statedb/segmented_log.hpp>
+#include <gpm/statedb/flat_index.hpp>
+#include <gpm/statedb/name_table.hpp>
+#include <gpm/statedb/log_format.hpp>
+#include <gpm/statedb/change_buffer.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/crc.hpp>
 
 namespace gpm {
+    struct transfer_log;
+    class  state_snapshot;
+
     struct account_key
     {
         account_key( uint64_t n = 0, uint64_t t = 0 )
@@ -34,6 +45,267 @@ namespace gpm {
         }
     };
 
+    /**
+     *  Key of the holder index, orders account_keys by stock first so that all
+     *  holders of a stock are adjacent.
+     */
+    struct holder_key
+    {
+        holder_key( uint64_t t = 0, uint64_t a = 0 )
+        :type_name(t),account_name(a){}
+
+        uint64_t type_name;
+        uint64_t account_name;
+
+        bool operator < ( const holder_key& k )const
+        {
+            if( type_name != k.type_name ) return type_name < k.type_name;
+            return account_name < k.account_name;
+        }
+        bool operator > ( const holder_key& k )const { return k < *this; }
+        bool operator == ( const holder_key& k )const
+        {
+            return type_name == k.type_name && account_name == k.account_name;
+        }
+    };
+
+    /**
+     *  Key of the rank index, orders the holders of each stock by balance from
+     *  the largest to the smallest.
+     */
+    struct rank_key
+    {
+        rank_key( uint64_t t = 0, uint64_t b = 0, uint64_t a = 0 )
+        :type_name(t),balance(b),account_name(a){}
+
+        uint64_t type_name;
+        uint64_t balance;
+        uint64_t account_name;
+
+        bool operator < ( const rank_key& k )const
+        {
+            if( type_name != k.type_name ) return type_name < k.type_name;
+            if( balance != k.balance )     return balance > k.balance;
+            return account_name < k.account_name;
+        }
+        bool operator > ( const rank_key& k )const { return k < *this; }
+        bool operator == ( const rank_key& k )const
+        {
+            return type_name == k.type_name && balance == k.balance && account_name == k.account_name;
+        }
+    };
+
+    /**
+     *  An account holding a stock.
+     */
+    struct holder
+    {
+        holder( uint64_t a = -1, uint64_t b = 0 )
+        :account(a),balance(b){}
+
+        uint64_t account; // name index
+        uint64_t balance;
+    };
+
+    /**
+     *  Key of the history index, orders the transfers of each account / stock
+     *  combo by time.
+     */
+    struct history_key
+    {
+        history_key( const account_key& a = account_key(), uint64_t t = 0, uint64_t l = 0 )
+        :account(a),time(t),loc(l){}
+
+        account_key account;
+        uint64_t    time;
+        uint64_t    loc;  // location of the transfer_log
+
+        bool operator < ( const history_key& k )const
+        {
+            if( account < k.account ) return true;
+            if( !(account == k.account) ) return false;
+            if( time != k.time ) return time < k.time;
+            return loc < k.loc;
+        }
+        bool operator > ( const history_key& k )const { return k < *this; }
+        bool operator == ( const history_key& k )const
+        {
+            return account == k.account && time == k.time && loc == k.loc;
+        }
+    };
+
+    namespace bdb {
+
+    /**
+     *  The fields of the index keys in the order they are compared, the
+     *  balance of a rank_key is stored inverted so that larger balances
+     *  come first.
+     */
+    template<>
+    struct key_encoding<account_key>
+    {
+        enum { ordered = true };
+        static void encode( const account_key& k, std::vector<char>& d )
+        {
+            key_encoding<uint64_t>::encode( k.account_name, d );
+            key_encoding<uint64_t>::encode( k.type_name, d );
+        }
+        static const char* decode( const char* b, const char* e, account_key& k )
+        {
+            b = key_encoding<uint64_t>::decode( b, e, k.account_name );
+            return key_encoding<uint64_t>::decode( b, e, k.type_name );
+        }
+    };
+
+    template<>
+    struct key_encoding<holder_key>
+    {
+        enum { ordered = true };
+        static void encode( const holder_key& k, std::vector<char>& d )
+        {
+            key_encoding<uint64_t>::encode( k.type_name, d );
+            key_encoding<uint64_t>::encode( k.account_name, d );
+        }
+        static const char* decode( const char* b, const char* e, holder_key& k )
+        {
+            b = key_encoding<uint64_t>::decode( b, e, k.type_name );
+            return key_encoding<uint64_t>::decode( b, e, k.account_name );
+        }
+    };
+
+    template<>
+    struct key_encoding<rank_key>
+    {
+        enum { ordered = true };
+        static void encode( const rank_key& k, std::vector<char>& d )
+        {
+            key_encoding<uint64_t>::encode( k.type_name, d );
+            key_encoding<uint64_t>::encode( ~k.balance, d );
+            key_encoding<uint64_t>::encode( k.account_name, d );
+        }
+        static const char* decode( const char* b, const char* e, rank_key& k )
+        {
+            b = key_encoding<uint64_t>::decode( b, e, k.type_name );
+            b = key_encoding<uint64_t>::decode( b, e, k.balance );
+            k.balance = ~k.balance;
+            return key_encoding<uint64_t>::decode( b, e, k.account_name );
+        }
+    };
+
+    template<>
+    struct key_encoding<history_key>
+    {
+        enum { ordered = true };
+        static void encode( const history_key& k, std::vector<char>& d )
+        {
+            key_encoding<account_key>::encode( k.account, d );
+            key_encoding<uint64_t>::encode( k.time, d );
+            key_encoding<uint64_t>::encode( k.loc, d );
+        }
+        static const char* decode( const char* b, const char* e, history_key& k )
+        {
+            b = key_encoding<account_key>::decode( b, e, k.account );
+            b = key_encoding<uint64_t>::decode( b, e, k.time );
+            return key_encoding<uint64_t>::decode( b, e, k.loc );
+        }
+    };
+
+    } // namespace bdb
+
+    /**
+     *  Maps every transfer of an account / stock combo to its location, the value
+     *  repeats the location stored in the key.
+     */
+    typedef bdb::keyvalue_db<history_key,uint64_t> history_index;
+
+    /**
+     *  Streams the transfers of one account / stock combo from the newest to the
+     *  oldest within a time range.  Transfers that are committed come from the
+     *  history index, the few that are still in overlays are merged in by time.
+     */
+    class history_cursor
+    {
+        public:
+            history_cursor();
+
+            bool     end()const    { return m_index == uint64_t(-1); }
+            /// location of the current transfer_log
+            uint64_t index()const  { return m_index; }
+            uint64_t time()const   { return m_time;  }
+
+            /// moves to the next older transfer
+            history_cursor& operator++();
+
+        private:
+            friend class state_database_transaction;
+            friend class state_database;
+            friend class state_snapshot;
+
+            void add_pending( uint64_t time, uint64_t loc );
+            void read_db();
+            void update();
+
+            account_key                                  m_account;
+            uint64_t                                     m_start_time;
+
+            // (time, location) of transfers that are not in the history index, oldest first
+            std::vector< std::pair<uint64_t,uint64_t> >  m_pending;
+            history_index::iterator                      m_itr;
+            bool                                         m_db_valid;
+            history_key                                  m_db_key;
+            bool                                         m_from_db;
+
+            uint64_t                                     m_index;
+            uint64_t                                     m_time;
+    };
+
+    /**
+     *  Streams the names within a range in order.  Committed names come from the
+     *  name index, each overlay adds a sorted run of the names it changed.  The
+     *  runs and the index are merged as the cursor advances so reading the first 
+     *  n names only reads n entries of the index.
+     */
+    class name_cursor
+    {
+        public:
+            name_cursor();
+
+            bool               end()const  { return m_end;  }
+            const std::string& name()const { return m_name; }
+
+            /// moves to the next name, names in several sources are returned once
+            name_cursor& operator++();
+
+        private:
+            friend class state_database_transaction;
+            friend class state_database;
+            friend class state_snapshot;
+
+            void add_run( std::vector<std::string>& names );
+            void read_db();
+            void update();
+
+            std::string                                        m_last; // inclusive upper bound
+            std::vector< std::vector<std::string> >            m_runs;
+            std::vector<uint32_t>                              m_pos;
+            bdb::keyvalue_db<std::string,uint64_t>::iterator   m_itr;
+            bool                                               m_db_valid;
+            std::string                                        m_db_name;
+
+            bool                                               m_end;
+            std::string                                        m_name;
+    };
+
+    template<>
+    struct flat_hash<account_key>
+    {
+        uint64_t operator()( const account_key& k )const
+        {
+            flat_hash<uint64_t> h;
+            return h( k.account_name ^ h( k.type_name ) );
+        }
+    };
+
     struct state_record
     {
         uint16_t          id;       // the type of record
@@ -59,16 +331,99 @@ namespace gpm {
         }
     };
 
+    /**
+     *  The state hash is calculated over fixed size chunks of the log so
+     *  that completed chunks never have to be hashed again.
+     */
+    const uint64_t state_chunk_size = 1024*1024;
+
+    /**
+     *  The hashes of the complete chunks of a log.  A list is shared with every
+     *  caller of get_chunk_hashes() and never changes once it was handed out,
+     *  hashes of new chunks are added to a copy.
+     */
+    typedef boost::shared_ptr< const std::vector<boost::rpc::sha1_hashcode> > chunk_hash_list;
+
+    /**
+     *  Everything an overlay needs to know about a name it has modified.  The
+     *  name index (the location of the define_name record) identifies a name
+     *  in account_key and transfer_log.
+     */
+    struct name_edit
+    {
+        name_edit( uint64_t le = -1, uint64_t ni = -1 )
+        :last_edit(le),name_idx(ni){}
+
+        uint64_t last_edit; // location of the last define_name / update_name record
+        uint64_t name_idx;  // location of the define_name record
+    };
+
     /**
      *  Maps the name to the last index that modified its public key
      */
-    typedef std::map<std::string,uint64_t> name_index;
+    typedef flat_index<std::string,name_edit> name_index;
+
+    /**
+     *  The balance of an account / stock combo along with the last transfer_log
+     *  that changed it.  The balance is a copy of the new_from_bal / new_to_bal
+     *  field of that record so it can be read without going to the log.
+     */
+    struct account_state
+    {
+        account_state( uint64_t lt = -1, uint64_t b = 0 )
+        :last_transfer(lt),balance(b){}
+
+        uint64_t last_transfer;
+        uint64_t balance;
+    };
+
+    /**
+     *  Number of names, account / stock combos and non-zero balances.  Overlays 
+     *  keep the change relative to their base, the database keeps the totals in
+     *  its meta index so reading them never scans an index.
+     */
+    struct state_counts
+    {
+        state_counts():names(0),accounts(0),holdings(0){}
+
+        state_counts& operator += ( const state_counts& c )
+        {
+            names    += c.names;
+            accounts += c.accounts;
+            holdings += c.holdings;
+            return *this;
+        }
+
+        int64_t names;
+        int64_t accounts;
+        int64_t holdings;
+    };
 
     /**
      * Maps the account / stock combo to the index of the last record that modified
-     * them.
+     * them and the resulting balance.
+     */
+    typedef flat_index<account_key, account_state >  account_index;
+
+    /**
+     *  Balances of the holders of one stock by account, used to pass the changes 
+     *  of newer overlays down to the database that answers a holder query.
      */
-    typedef std::map<account_key, uint64_t >  account_index;
+    typedef flat_index<uint64_t, uint64_t>  holder_map;
+
+    /**
+     *  Maps the hash of a public key to the location of the define_key record
+     *  that holds it.  Keys with the same hash replace each other, so lookups
+     *  must compare the key stored at the location.
+     */
+    typedef flat_index<uint64_t, uint64_t>  key_index;
+
+    /**
+     *  Most keys a state_database keeps decoded in memory.  They are kept in two
+     *  halves, the keys that were not used while the newer half filled up are 
+     *  dropped when it fills up again.
+     */
+    const uint32_t key_cache_size = 16*1024;
 
     /**
      *   The purpose of the state log is to provide a complete history of all changes and
@@ -96,7 +451,8 @@ namespace gpm {
      *   The abstract state database defines the queries that may be performed
      *   upon the state.
      */
-    class abstract_state_database : public boost::enable_shared_from_this<abstract_state_database>
+    class abstract_state_database : public boost::enable_shared_from_this<abstract_state_database>,
+                                    public key_dictionary
     {
         public:
             typedef boost::shared_ptr<abstract_state_database> ptr;
@@ -143,17 +499,37 @@ namespace gpm {
             virtual std::vector<std::string>  get_account_contents( const std::string& acnt ) = 0;
             virtual std::vector<uint64_t>     get_account_contents_idx( uint64_t acnt ) = 0;
             virtual uint64_t                  name_count() = 0;
+            virtual state_counts              get_counts() = 0;
             virtual std::vector<std::string>  query_names( const std::string& start, const std::string& end, uint32_t limit = -1 ) = 0;
+
+            /**
+             *  @return a cursor over the names with start <= name <= end in order, it
+             *          may end after the first limit names
+             */
+            virtual name_cursor               get_names( const std::string& start, const std::string& end, 
+                                                         uint32_t limit = -1 ) = 0;
             
             virtual bool     get_public_key_t( const std::string& name, public_key_t& pk       )                             = 0;
             virtual bool     set_public_key( const std::string& name, const public_key_t& pk )                             = 0;
             virtual std::string get_name_for_index(uint64_t idx)= 0;
 
+            /**
+             *  Resolves many name indexes at once, names[i] is the name at idx[i].
+             */
+            virtual std::vector<std::string> get_names_for_index( const std::vector<uint64_t>& idx ) = 0;
+
             virtual uint64_t  get_name_index( const std::string& nidx )                                                   = 0;
             virtual transfer  get_last_transfer( const std::string& account, const std::string& type )                    = 0;
 
             virtual uint64_t get_balance( const std::string& account, const std::string& type, bool* is_null = 0, uint64_t* loc = 0 )   = 0;
             virtual void     transfer_balance( const std::string& from, const std::string& to, const std::string& type, uint64_t amnt, uint64_t trx_pos=-1 ) = 0;
+
+            /**
+             *  Same as get_balance / transfer_balance, but the account and type are identified by 
+             *  their name index so that no names have to be resolved.
+             */
+            virtual uint64_t get_balance_idx( uint64_t account, uint64_t type, bool* is_null = 0, uint64_t* loc = 0 )   = 0;
+            virtual void     transfer_balance_idx( uint64_t from, uint64_t to, uint64_t type, uint64_t amnt, uint64_t trx_pos=-1 ) = 0;
             virtual void     issue( const std::string& type, uint64_t trx_pos = -1 ) = 0;
 
             virtual bool     apply( const signed_transaction& trx, const std::string& gen_name ) = 0;
@@ -161,21 +537,94 @@ namespace gpm {
                                                                                                 const boost::rpc::sha1_hashcode& check ) = 0;
 
             virtual boost::rpc::sha1_hashcode calculate_state_hash() = 0;
+
+            /**
+             *  Sets hashes to the hash of every complete state_chunk_size chunk at the
+             *  start of the log that can no longer change.  The list may hold more
+             *  hashes than the bytes returned cover, they must not be used.
+             *
+             *  @return the number of bytes covered by hashes
+             */
+            virtual uint64_t get_chunk_hashes( chunk_hash_list& hashes ) = 0;
             virtual bool     append_record( const state_record& r ) = 0;
-            virtual bool     append( std::vector<char>& d, const account_index& idx, const name_index& nidx ) = 0;
+
+            /**
+             *  Takes the records in d, which is left empty, along with the indexes that
+             *  describe them.
+             */
+            virtual bool     append( change_buffer& d, const account_index& idx, const name_index& nidx,
+                                     const state_counts& counts, const key_index& keys ) = 0;
 
             virtual uint64_t get_record( uint64_t loc, state_record& r ) = 0;
+
+            /**
+             *  Reads the key from the define_name / update_name record at last_edit.
+             */
+            virtual bool     get_public_key_at( uint64_t last_edit, public_key_t& pk ) = 0;
             virtual uint64_t read( uint64_t pos, char* buf, uint64_t len ) = 0;
 
+            /**
+             *  Reads the header of the record at loc without copying its payload.
+             *
+             *  @return the size of the record or 0 if there is none at loc
+             */
+            virtual uint64_t get_record_header( uint64_t loc, record_header& h ) = 0;
+
+            /// the log_version the log is encoded with
+            virtual uint32_t get_log_version() = 0;
+
             virtual uint64_t  size()const = 0;
             virtual uint64_t  start()const = 0;
 
 
             virtual uint64_t      get_last_name_edit_index( const std::string& nidx ) = 0;
             virtual uint64_t      get_last_transfer_index( const account_key& a ) = 0;
+
+            /**
+             *  Resolves the last edit and name index of name in one lookup.
+             *
+             *  @return false if name is not defined
+             */
+            virtual bool          find_name( const std::string& name, name_edit& e ) = 0;
+
+            /**
+             *  Resolves the balance and last transfer of an account / stock combo.
+             *
+             *  @return false if the account has never held the stock
+             */
+            virtual bool          find_account( const account_key& a, account_state& s ) = 0;
+
+            /**
+             *  @return a cursor over the transfers of a with start_time <= time <= end_time, newest first
+             */
+            virtual history_cursor get_history( const account_key& a, uint64_t start_time, uint64_t end_time ) = 0;
+
+            /**
+             *  Lists the accounts holding a non-zero balance of type in order of their name 
+             *  index, starting with start_account.  Pass the last account + 1 to get the
+             *  next page.
+             *
+             *  @param newer balances changed by overlays above this one, they replace ours
+             */
+            virtual std::vector<holder> get_holders( uint64_t type, uint64_t start_account, uint32_t limit,
+                                                     const holder_map& newer = holder_map() ) = 0;
+
+            /**
+             *  @return the limit accounts holding the most of type, largest first.  The
+             *          issuer's own account, which holds everything it has not handed
+             *          out, is left out.
+             */
+            virtual std::vector<holder> get_top_holders( uint64_t type, uint32_t limit, 
+                                                         const holder_map& newer = holder_map() ) = 0;
     };
 
 
+    /**
+     *  The number of overlays a lookup may walk before the overlay merges the
+     *  indexes below it into one view.
+     */
+    const uint32_t max_overlay_depth = 4;
+
     /**
      *  This class implements the full interface for the state_database, but keeps all writes local
      *  until commit() is called.
@@ -185,15 +634,19 @@ namespace gpm {
         public:
             typedef boost::shared_ptr<state_database_transaction> ptr;
             state_database_transaction( const abstract_state_database::ptr& new_base = abstract_state_database::ptr() );
+            virtual ~state_database_transaction();
 
             void     dump(int max = 1000);
             void     dump(const state_record& r );
 
             // returns the number of names in the database
             virtual uint64_t                          name_count();
+            virtual state_counts                      get_counts();
 
             // returns names between start and end in order limited to the first limit names after start. 
             virtual std::vector<std::string>  query_names( const std::string& start, const std::string& end, uint32_t limit = -1 );
+            virtual name_cursor               get_names( const std::string& start, const std::string& end, 
+                                                         uint32_t limit = -1 );
 
 
             virtual std::vector<std::string>  get_account_contents( const std::string& acnt );
@@ -204,11 +657,14 @@ namespace gpm {
             bool     set_public_key( const std::string& name, const public_key_t& pk );
             
             std::string get_name_for_index(uint64_t idx);
+            std::vector<std::string> get_names_for_index( const std::vector<uint64_t>& idx );
             uint64_t    get_name_index( const std::string& nidx );
             transfer    get_last_transfer( const std::string& account, const std::string& type );
             
             uint64_t get_balance( const std::string& account, const std::string& type, bool* is_null = 0, uint64_t* loc = 0 );
             void     transfer_balance( const std::string& from, const std::string& to, const std::string& type, uint64_t amnt , uint64_t trx_pos = -1);
+            uint64_t get_balance_idx( uint64_t account, uint64_t type, bool* is_null = 0, uint64_t* loc = 0 );
+            void     transfer_balance_idx( uint64_t from, uint64_t to, uint64_t type, uint64_t amnt, uint64_t trx_pos = -1 );
             void     issue( const std::string& type , uint64_t trx_pos = -1);
             
             bool     apply( const signed_transaction& trx, const std::string& gen_name );
@@ -216,11 +672,18 @@ namespace gpm {
                                                                                    const boost::rpc::sha1_hashcode& check );
             
             boost::rpc::sha1_hashcode calculate_state_hash();
+            uint64_t                  get_chunk_hashes( chunk_hash_list& hashes );
 
             uint64_t         read( uint64_t pos, char* buf, uint64_t len );
             uint64_t         get_record( uint64_t loc, state_record& r );
+            uint64_t         get_record_header( uint64_t loc, record_header& h );
+            uint32_t         get_log_version();
             bool             append_record( const state_record& r );
-            bool             append( std::vector<char>& d, const account_index& idx, const name_index& nidx );
+            bool             append( change_buffer& d, const account_index& idx, const name_index& nidx,
+                                     const state_counts& counts, const key_index& keys );
+            virtual bool     get_public_key_at( uint64_t last_edit, public_key_t& pk );
+            virtual uint64_t find_key( const public_key_t& k );
+            virtual bool     get_key( uint64_t loc, public_key_t& k );
 
             uint64_t  size()const;
             uint64_t  start()const;
@@ -229,16 +692,95 @@ namespace gpm {
             virtual  bool commit();
             virtual  void abort();
 
-            virtual void rebase( const abstract_state_database::ptr& new_base ) { base = new_base; }
+            virtual void rebase( const abstract_state_database::ptr& new_base );
+
+            /**
+             *  Merges the indexes of every overlay below this one into a single view so
+             *  that lookups no longer walk the chain of bases.  Entries added to a merged
+             *  overlay are merged on the next lookup, the view is only rebuilt when the
+             *  chain changes or an overlay commits, aborts or is rebased.  Overlays that
+             *  are stacked deeper than max_overlay_depth flatten themselves, and their
+             *  depth follows a rebase or flatten of the overlays below them.
+             */
+            void flatten();
+
+            /// overlays below this one that a lookup walks before it reaches a view or the root
+            uint32_t depth()const { return m_depth; }
+
+            /**
+             *  Copies the records and indexes of this overlay and the overlays below it
+             *  into a snapshot that other threads can query while this one is modified.
+             *  Must be called from the thread that modifies the overlays.
+             */
+            boost::shared_ptr<state_snapshot> get_snapshot();
 
             virtual uint64_t      get_last_name_edit_index( const std::string& nidx );
             virtual uint64_t      get_last_transfer_index( const account_key& a );
+            virtual bool          find_name( const std::string& name, name_edit& e );
+            virtual bool          find_account( const account_key& a, account_state& s );
+            virtual history_cursor get_history( const account_key& a, uint64_t start_time, uint64_t end_time );
+            virtual std::vector<holder> get_holders( uint64_t type, uint64_t start_account, uint32_t limit,
+                                                     const holder_map& newer = holder_map() );
+            virtual std::vector<holder> get_top_holders( uint64_t type, uint32_t limit, 
+                                                         const holder_map& newer = holder_map() );
 
         protected:
+            void     merge_holders( uint64_t type, const holder_map& newer, holder_map& out );
+            void     add_local_history( history_cursor& c, uint64_t first, uint64_t start_time, uint64_t end_time );
+            void     add_local_names( name_cursor& c, const std::string& start, const std::string& end, uint32_t limit );
+            void     count_change( bool existed, uint64_t old_balance, uint64_t new_balance );
+            uint64_t get_transfer_time( const transfer_log& tl );
+            uint64_t get_balance_at( uint64_t loc, const account_key& a );
+            void     intern_key( const public_key_t& pk );
+            bool     local_key_at( uint64_t loc, const char* key, uint32_t len );
+
             abstract_state_database::ptr      base;
-            std::vector<char>                 local_changes;
+            change_buffer                     local_changes; // shares the arena of the base
+            std::vector<char>                 m_encoded;     // the record append_record() is encoding
             account_index                     last_transfer_map;
             name_index                        last_name_edit_map;
+            state_counts                      m_counts;  // change made by the local records
+            key_index                         m_local_keys; // define_key records in local_changes
+            uint64_t                          m_version; // bumped whenever the local indexes change
+            uint64_t                          m_cleared; // bumped when they are emptied or replaced
+
+        private:
+            /**
+             *  The indexes of the overlays between this one and the root database,
+             *  newer overlays replace the entries of older ones.
+             */
+            struct overlay_view
+            {
+                overlay_view():valid(false),root(0){}
+
+                account_index             accounts;
+                name_index                names;
+                bool                      valid;
+                abstract_state_database*  root;
+
+                struct layer_state
+                {
+                    layer_state( const state_database_transaction* l )
+                    :layer(l),version(l->m_version),cleared(l->m_cleared){}
+
+                    const state_database_transaction* layer;
+                    uint64_t                          version;
+                    uint64_t                          cleared;
+                };
+                // the overlays merged into the view, newest first
+                std::vector<layer_state>  layers;
+            };
+
+            void                     update_depth();
+            void                     remove_child( state_database_transaction* c );
+            void                     merge_layer( uint32_t i );
+            abstract_state_database* update_view();
+
+            state_database_transaction*       m_parent; // base if it is an overlay
+            std::vector<state_database_transaction*> m_children; // overlays whose base is this one
+            uint32_t                          m_depth;  // overlays below this one that a lookup walks
+            bool                              m_flat;
+            overlay_view                      m_view;
     };
 
 
@@ -246,36 +788,244 @@ namespace gpm {
      *  Identical to the state_databaase_transaction, except that commit writes
      *  the changes to the file.
      */
-    class state_database : public state_database_transaction
+    class state_database : public state_database_transaction, public bdb::group_listener
     {
         public:
             typedef boost::shared_ptr<state_database> ptr;
             state_database();
+            ~state_database();
             
-            bool open( const boost::filesystem::path& file );
-            virtual uint64_t                  name_count() ;
-            virtual std::vector<std::string>  query_names( const std::string& start, const std::string& end, uint32_t limit = -1 );
+            bool open( const boost::filesystem::path& file, 
+                       const bdb::environment::ptr& env = bdb::environment::ptr() );
+            state_counts                      get_counts();
+            name_cursor                       get_names( const std::string& start, const std::string& end, 
+                                                         uint32_t limit = -1 );
         
             uint64_t read( uint64_t pos, char* buf, uint64_t len );
             uint64_t get_record( uint64_t loc, state_record& r );
+            uint64_t get_chunk_hashes( chunk_hash_list& hashes );
+            uint32_t get_log_version();
+            bool     get_public_key_at( uint64_t last_edit, public_key_t& pk );
+            uint64_t find_key( const public_key_t& k );
+            bool     get_key( uint64_t loc, public_key_t& k );
 
-            uint64_t      get_last_name_edit_index( const std::string& nidx );
-            uint64_t      get_last_transfer_index( const account_key& a );
+            /**
+             *  The log_version used if open() creates a new log, existing logs keep
+             *  the version they were created with.  Defaults to log_v1, which is 
+             *  what other nodes expect when exchanging state chunks.  The state hash
+             *  is calculated over the bytes of the log, so a log_v2 log does not hash
+             *  like a log_v1 log of the same blocks and must not be used by a node.
+             */
+            void     set_log_version( uint32_t v );
+
+            /**
+             *  Seals the log into segments of s bytes, rounded up to whole chunks, once
+             *  a segment of newer history follows them.  0 keeps the whole log in one
+             *  file.  Must be called before open().
+             */
+            void     set_segment_size( uint64_t s );
+
+            /// compress the segments sealed from now on
+            void     set_segment_compression( bool c );
+
+            /**
+             *  Seals the complete segments of committed history, see set_segment_size().
+             *  Call it after the group that committed the log, sealing rewrites files.
+             *
+             *  @return the number of segments sealed
+             */
+            uint32_t seal_log();
+
+            /// appends the stats of every index, see keyvalue_db::stats()
+            void     get_index_stats( std::vector<bdb::db_stats>& s, bool exact = false );
+
+            bool          find_name( const std::string& name, name_edit& e );
+            bool          find_account( const account_key& a, account_state& s );
+            history_cursor get_history( const account_key& a, uint64_t start_time, uint64_t end_time );
+
+            /**
+             *  Lookups as of the moment the log was bound bytes long, used by snapshots.
+             *  Only committed records are visible to them, the indexes are followed by 
+             *  walking the records written after bound back to the version before it.
+             */
+            bool          find_name_at( const std::string& name, name_edit& e, uint64_t bound );
+            bool          find_account_at( const account_key& a, account_state& s, uint64_t bound );
+            history_cursor get_history_at( const account_key& a, uint64_t start_time, uint64_t end_time, uint64_t bound );
+            std::vector<std::string> query_names_at( const std::string& start, const std::string& end, 
+                                                     uint32_t limit, uint64_t bound );
+            std::vector<uint64_t>    get_account_contents_at( uint64_t acnt, uint64_t bound );
+            std::vector<holder>      get_holders_at( uint64_t type, uint64_t start_account, uint32_t limit,
+                                                     const holder_map& newer, uint64_t bound );
+            std::vector<holder>      get_top_holders_at( uint64_t type, uint32_t limit, 
+                                                         const holder_map& newer, uint64_t bound );
+
+            std::vector<holder> get_holders( uint64_t type, uint64_t start_account, uint32_t limit,
+                                             const holder_map& newer = holder_map() );
+            std::vector<holder> get_top_holders( uint64_t type, uint32_t limit, 
+                                                 const holder_map& newer = holder_map() );
 
-            virtual std::vector<std::string>  get_account_contents( const std::string& acnt );
             virtual std::vector<uint64_t>     get_account_contents_idx( uint64_t acnt );
+            std::string               get_name_for_index( uint64_t idx );
+            std::vector<std::string>  get_names_for_index( const std::vector<uint64_t>& idx );
             bool      commit();
             uint64_t  size()const;
             uint64_t  start()const;
             
+            /**
+             *  Rebuilds the indexes from the log using the same worker threads as
+             *  the state hash.
+             */
             void  update_index();
 
+            /**
+             *  Sets the number of worker threads used to hash the log when many chunks
+             *  need to be hashed at once.  0 uses one thread per core.
+             */
+            void      set_hash_threads( uint32_t n );
+
+            /**
+             *  Rehashes every complete chunk of the log and replaces the cached hashes.
+             *
+             *  @return false if any cached hash did not match the log
+             */
+            bool      verify_chunk_hashes();
+
+            /**
+             *  If the outermost group that commit() was called in is rolled back, the
+             *  log, the totals and the pending changes return to where they were when
+             *  the first commit() of the group started.
+             */
+            void      group_ended( bool rolled_back );
+
         private:
             void rebase( abstract_state_database::ptr& new_base ){};
+            void truncate_log( uint64_t s );
+            void index_uncommitted( uint64_t from );
+            void load_chunk_hashes( const boost::filesystem::path& p );
+            void update_chunk_hashes();
+            void append_chunk_hashes( uint64_t first, const boost::rpc::sha1_hashcode* h, uint64_t count );
+            void save_chunk_hashes();
+            void hash_log_chunks( uint64_t first, uint64_t count, boost::rpc::sha1_hashcode* out );
+            std::vector<boost::rpc::sha1_hashcode>& own_chunk_hashes();
+            void build_balance_index();
+            void build_name_by_index();
+            void count_indexes();
+            void save_counts();
+            void set_history( const std::vector<history_key>& history );
+            void holders_changed_since( uint64_t type, uint64_t bound, holder_map& out );
+            std::vector<holder> committed_holders( uint64_t type, uint64_t start_account, uint32_t limit, 
+                                                   const holder_map& merged );
+            std::vector<holder> committed_top_holders( uint64_t type, uint32_t limit, const holder_map& merged );
+            std::string get_committed_name( uint64_t idx );
+            bool        find_committed_name( const std::string& name, name_edit& e );
+            bool        find_committed_account( const account_key& a, account_state& s );
+            bool        get_cached_key( uint64_t loc, public_key_t& k );
+            void        cache_key( uint64_t loc, const public_key_t& k );
+            void        clear_key_cache();
+            bool        committed_key_at( uint64_t loc, const char* key, uint32_t len );
 
-            gpm::file::ptr                      m_file;
+            gpm::segmented_log                  m_log;
+            uint64_t                            m_file_size; // bytes committed to m_log
+            uint32_t                            m_log_version;
+            uint32_t                            m_new_log_version; // for a new m_log
+
+            // hashes of the complete chunks of m_log, persisted in m_hash_file and
+            // shared with the callers of get_chunk_hashes(), see own_chunk_hashes()
+            boost::shared_ptr< std::vector<boost::rpc::sha1_hashcode> > m_chunk_hashes;
+            gpm::file::ptr                                              m_hash_file;
+            boost::crc_32_type                                          m_hash_crc; // of the hashes in m_hash_file
+            uint32_t                                                    m_hash_threads;
+
+            // must outlive the databases below
+            bdb::environment::ptr                     m_env;
             bdb::keyvalue_db<account_key,uint64_t>    m_transfer_db;
+            bdb::keyvalue_db<account_key,uint64_t>    m_balance_db;
             bdb::keyvalue_db<std::string,uint64_t>    m_name_db;
+            bdb::keyvalue_db<uint64_t,std::string>    m_name_by_index_db; // define_name location -> name
+            bdb::keyvalue_db<std::string,uint64_t>    m_meta_db;     // log_size = bytes covered by the indexes
+            history_index                             m_history_db;
+            bdb::keyvalue_db<holder_key,uint64_t>     m_holder_db;   // non-zero balances by stock
+            bdb::keyvalue_db<rank_key,uint64_t>       m_rank_db;     // non-zero balances by stock and balance
+            bdb::keyvalue_db<uint64_t,uint64_t>       m_key_db;      // key hash -> define_key location
+            name_table                                m_names; // committed names
+            state_counts                              m_totals; // of the committed state
+            flat_index<uint64_t,public_key_t>         m_key_cache;     // committed record location -> key
+            flat_index<uint64_t,public_key_t>         m_old_key_cache; // the half filled before m_key_cache
+
+            // the state before the first commit() of the current group, see group_ended()
+            bool                                      m_saved;
+            uint64_t                                  m_saved_file_size;
+            state_counts                              m_saved_totals;
+            state_counts                              m_saved_counts;
+            change_buffer                             m_saved_changes;
+            account_index                             m_saved_transfers;
+            name_index                                m_saved_names;
+            key_index                                 m_saved_keys;
+
+            /**
+             *  Held while the log, the indexes or the caches above are used, so that 
+             *  snapshots can be read by other threads while the writer commits.
+             *  Pending changes are only used by the writer and are not guarded.
+             */
+            boost::recursive_mutex                    m_mutex;
+    };
+
+    /**
+     *  An immutable view of the state as it was when the snapshot was taken.  The 
+     *  records of the overlays it was taken from are copied into the snapshot, 
+     *  older records are read from the state_database, whose indexes move on as
+     *  blocks are committed.  Lookups that find a record written after the snapshot
+     *  follow the chain of records back to the version the snapshot was taken at.
+     *
+     *  Snapshots are reference counted and keep the database open.  Any number of
+     *  threads may query one while the writer applies and commits blocks.  They 
+     *  cannot be modified.  Holders are only indexed for the latest balances, the
+     *  holders of a snapshot replace the balances changed since it was taken.
+     */
+    class state_snapshot : public state_database_transaction
+    {
+        public:
+            typedef boost::shared_ptr<state_snapshot> ptr;
+
+            uint64_t                  start()const;
+            state_counts              get_counts();
+            bool                      find_name( const std::string& name, name_edit& e );
+            bool                      find_account( const account_key& a, account_state& s );
+            history_cursor            get_history( const account_key& a, uint64_t start_time, uint64_t end_time );
+
+            /// reads every name in the range at once
+            name_cursor               get_names( const std::string& start, const std::string& end, uint32_t limit = -1 );
+            std::vector<std::string>  query_names( const std::string& start, const std::string& end, uint32_t limit = -1 );
+            std::vector<uint64_t>     get_account_contents_idx( uint64_t acnt );
+
+            std::vector<holder> get_holders( uint64_t type, uint64_t start_account, uint32_t limit,
+                                             const holder_map& newer = holder_map() );
+            std::vector<holder> get_top_holders( uint64_t type, uint32_t limit, 
+                                                 const holder_map& newer = holder_map() );
+
+            // all modifications throw
+            bool     set_public_key( const std::string& name, const public_key_t& pk );
+            void     transfer_balance_idx( uint64_t from, uint64_t to, uint64_t type, uint64_t amnt, uint64_t trx_pos = -1 );
+            void     issue( const std::string& type, uint64_t trx_pos = -1 );
+            bool     apply( const signed_transaction& trx, const std::string& gen_name );
+            bool     apply( const block& b, const std::string& gen, const std::vector<signed_transaction>& trxs, 
+                                                                                   const boost::rpc::sha1_hashcode& check );
+            bool     append_record( const state_record& r );
+            bool     append( change_buffer& d, const account_index& idx, const name_index& nidx,
+                             const state_counts& counts, const key_index& keys );
+            bool     commit();
+            void     abort();
+            void     rebase( const abstract_state_database::ptr& new_base );
+
+        private:
+            friend class state_database_transaction;
+            state_snapshot( const state_database::ptr& db, uint64_t bound );
+
+            name_cursor names_at( const std::string& start, const std::string& end, uint32_t limit );
+
+            state_database::ptr  m_db;
+            uint64_t             m_bound;  // bytes committed to m_db when the snapshot was taken
+            state_counts         m_totals;
     };
     struct define_name
     {
@@ -327,6 +1077,17 @@ namespace gpm {
         std::string      generator;
         uint32_t          block_num;
     };
+    /**
+     *  Stores a public key once so that define_name / update_name records
+     *  can refer to it by location, only written to log_v2 logs.
+     */
+    struct define_key
+    {
+        enum id_enum{ id = 0x06 };
+        define_key( const public_key_t& k = public_key_t() )
+        :key(k){}
+        public_key_t key;
+    };
 
 } // namesapce gpm
 
@@ -362,9 +1123,26 @@ BOOST_REFLECT( gpm::end_block, BOOST_PP_SEQ_NIL,
     (blk)
     (generator)
 )
+BOOST_REFLECT( gpm::define_key, BOOST_PP_SEQ_NIL,
+    (key)
+)
 BOOST_REFLECT( gpm::account_key, BOOST_PP_SEQ_NIL,
     (account_name)
     (type_name)
 )
+BOOST_REFLECT( gpm::holder_key, BOOST_PP_SEQ_NIL,
+    (type_name)
+    (account_name)
+)
+BOOST_REFLECT( gpm::rank_key, BOOST_PP_SEQ_NIL,
+    (type_name)
+    (balance)
+    (account_name)
+)
+BOOST_REFLECT( gpm::history_key, BOOST_PP_SEQ_NIL,
+    (account)
+    (time)
+    (loc)
+)
 
 #endif
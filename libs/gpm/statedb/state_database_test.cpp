@@ -1,8 +1,1144 @@
 #include <gpm/statedb/state_database.hpp>
+#include <gpm/statedb/log_format.hpp>
+#include <gpm/statedb/segmented_log.hpp>
+#include <gpm/statedb/trx_file.hpp>
+#include <gpm/statedb/change_buffer.hpp>
+#include <gpm/statedb/name_table.hpp>
 #include <gpm/crypto/crypto.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+#include <boost/lexical_cast.hpp>
 
 using namespace gpm;
 
+/**
+ *  @return a state database directory that does not exist yet
+ */
+static boost::filesystem::path fresh_dir( const char* name )
+{
+    boost::filesystem::remove_all( name );
+    return name;
+}
+
+/**
+ *  Names and transfers that every test database starts with.
+ */
+static void fill( abstract_state_database& db, const public_key_t* pub_key )
+{
+    db.set_public_key( "dan", pub_key[0] );
+    db.set_public_key( "scott", pub_key[1] );
+    db.set_public_key( "dollar", pub_key[2] );
+    db.issue( "dollar" );
+    db.transfer_balance( "dollar", "dan", "dollar", 10000 );
+    db.transfer_balance( "dan", "scott", "dollar", 500 );
+}
+
+/**
+ *  A log_v2 database reads back what was written, after it is reopened as well,
+ *  and a damaged record fails its crc.
+ */
+static bool test_log_v2( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_v2.dat" );
+    {
+        state_database db;
+        db.set_log_version( log_v2 );
+        db.open( dir );
+        fill( db, pub_key );
+        db.commit();
+        db.transfer_balance( "scott", "dan", "dollar", 7 );
+        db.commit();
+    }
+    state_database db;
+    db.open( dir );
+    bool is_null = true;
+    if( db.get_log_version() != log_v2 || db.get_balance( "scott", "dollar", &is_null ) != 493 
+        || db.get_balance( "dan", "dollar", &is_null ) != 9507 )
+    {
+        elog( "log_v2 database did not read back its balances" );
+        return false;
+    }
+    public_key_t pk;
+    if( !db.get_public_key_t( "scott", pk ) || pk != pub_key[1] )
+    {
+        elog( "log_v2 database did not read back the key of scott" );
+        return false;
+    }
+
+    state_record      r = define_name( "scott", pub_key[1] );
+    std::vector<char> enc;
+    encode_record( log_v2, r, 64, enc );
+    record_header h;
+    state_record  back;
+    if( !parse_header( log_v2, &enc.front(), enc.size(), h ) || !check_record( log_v2, &enc.front(), h )
+        || decode_record( log_v2, &enc.front(), enc.size(), 64, back ) != enc.size() || back.data != r.data )
+    {
+        elog( "log_v2 record did not round trip" );
+        return false;
+    }
+    enc[h.data] ^= 1;
+    if( check_record( log_v2, &enc.front(), h ) )
+    {
+        elog( "damaged log_v2 record passed its crc" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Transfers a dollar back and forth until the committed log is at least len bytes.
+ */
+/// db must not have pending records
+static bool file_matches( state_database& db, const boost::filesystem::path& dir )
+{
+    uint64_t          len = db.size();
+    std::vector<char> file_bytes( len ), read_bytes( len );
+    gpm::file         f( dir/"state", "rb" );
+    if( f.size() != len || f.read( &file_bytes.front(), len ) != len )
+        return false;
+    return db.read( 0, &read_bytes.front(), len ) == len && read_bytes == file_bytes;
+}
+
+/**
+ *  Committed bytes are read from the map of the log and match the file after every
+ *  commit, pending bytes follow them.
+ */
+static bool test_mapped_reads( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_mapped.dat" );
+    {
+        state_database db;
+        db.open( dir );
+        fill( db, pub_key );
+        db.commit();
+        for( uint32_t i = 0; i < 3; ++i )
+        {
+            uint64_t committed = db.size();
+            db.transfer_balance( "dan", "scott", "dollar", 1 );
+            state_record r;
+            if( !db.get_record( committed, r ) || r.id != transfer_log::id )
+            {
+                elog( "the pending record after the mapped log was not read" );
+                return false;
+            }
+            db.commit();
+            if( db.size() == committed || !file_matches( db, dir ) )
+            {
+                elog( "the mapped log does not match the file after commit %1%", i );
+                return false;
+            }
+        }
+    }
+    state_database db;
+    db.open( dir );
+    if( !file_matches( db, dir ) || db.get_balance( "scott", "dollar" ) != 503 )
+    {
+        elog( "the mapped log does not match the file after reopening" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Balances come from the overlays and the balance index, including balances that
+ *  went to zero and accounts that never held the stock.
+ */
+static bool test_balances( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_balances.dat" );
+    {
+        state_database::ptr db( new state_database() );
+        db->open( dir );
+        fill( *db, pub_key );
+        db->commit();
+
+        state_database_transaction::ptr trx( new state_database_transaction( db ) );
+        trx->transfer_balance( "scott", "dan", "dollar", 500 );
+        bool is_null = true;
+        if( trx->get_balance( "scott", "dollar", &is_null ) != 0 || is_null 
+            || db->get_balance( "scott", "dollar" ) != 500 )
+        {
+            elog( "the overlay did not replace the committed balance" );
+            return false;
+        }
+        trx->commit();
+        db->commit();
+    }
+    state_database db;
+    db.open( dir );
+    bool is_null = true;
+    if( db.get_balance( "dan", "dollar", &is_null ) != 10000 || is_null 
+        || db.get_balance( "scott", "dollar", &is_null ) != 0 || is_null )
+    {
+        elog( "the balance index did not return the committed balances" );
+        return false;
+    }
+    db.get_balance( "scott", "dan", &is_null );
+    if( !is_null )
+    {
+        elog( "an account that never held a stock has a balance" );
+        return false;
+    }
+    return true;
+}
+
+static void grow_log( state_database& db, uint64_t len )
+{
+    while( db.size() < len )
+    {
+        for( uint32_t i = 0; i < 1000; ++i )
+            db.transfer_balance( i % 2 ? "scott" : "dan", i % 2 ? "dan" : "scott", "dollar", 1 );
+        db.commit();
+    }
+}
+
+/**
+ *  The chunk hashes are shared instead of copied, a list that was handed out
+ *  does not change, and a damaged cache is repaired when the database opens.
+ */
+static bool test_chunk_hashes( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_hashes.dat" );
+    boost::rpc::sha1_hashcode state_hash;
+    {
+        state_database db;
+        db.open( dir );
+        fill( db, pub_key );
+        grow_log( db, 2 * state_chunk_size + 1000 );
+
+        chunk_hash_list first, again;
+        if( db.get_chunk_hashes( first ) != 2 * state_chunk_size || first->size() != 2 
+            || db.get_chunk_hashes( again ) != 2 * state_chunk_size || again != first )
+        {
+            elog( "expected the same list of two chunk hashes" );
+            return false;
+        }
+        grow_log( db, 3 * state_chunk_size + 1000 );
+        if( db.get_chunk_hashes( again ) != 3 * state_chunk_size || again->size() != 3 || first->size() != 2 
+            || (*again)[1] != (*first)[1] )
+        {
+            elog( "a list that was handed out changed when a chunk was added" );
+            return false;
+        }
+        state_hash = db.calculate_state_hash();
+    }
+    {
+        gpm::file f( dir/"state_hashes", "rb+" );
+        char c;
+        f.seek( 0 );
+        f.read( &c, 1 );
+        c ^= 1;
+        f.seek( 0 );
+        f.write( &c, 1 );
+    }
+    state_database db;
+    db.open( dir );
+    if( db.calculate_state_hash() != state_hash || !db.verify_chunk_hashes() )
+    {
+        elog( "the damaged first chunk hash was not replaced when the database opened" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Rolling back the group that commit() was called in rolls back the log and
+ *  returns the committed transfers to the pending changes.
+ */
+static bool test_group_rollback( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_rollback.dat" );
+    bdb::environment::ptr env( new bdb::environment() );
+    env->open( dir );
+    state_database::ptr db( new state_database() );
+    db->open( dir, env );
+    fill( *db, pub_key );
+    db->commit();
+    state_counts counts = db->get_counts();
+
+    db->transfer_balance( "dan", "scott", "dollar", 100 );
+    uint64_t size = db->size();
+    {
+        bdb::group_commit grp( *env );
+        db->commit();
+        db->set_public_key( "quinn", pub_key[3] );
+        db->transfer_balance( "dan", "quinn", "dollar", 1 );
+        db->commit();
+    }
+    public_key_t pk;
+    if( db->size() != size || db->get_balance( "dan", "dollar" ) != 9400 || db->get_public_key_t( "quinn", pk )
+        || db->get_counts().accounts != counts.accounts || db->get_counts().names != counts.names )
+    {
+        elog( "the state did not return to where it was before the group" );
+        return false;
+    }
+    db->commit();
+    db.reset();
+
+    db = state_database::ptr( new state_database() );
+    db->open( dir, env );
+    if( db->get_balance( "dan", "dollar" ) != 9400 || db->get_balance( "scott", "dollar" ) != 600 
+        || db->get_public_key_t( "quinn", pk ) )
+    {
+        elog( "the transfers of the rolled back group were not discarded" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Without the transaction log the indexes are trusted after a clean close and
+ *  rebuilt from the log when the environment was not closed.
+ */
+static bool test_clean_shutdown( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_nolog.dat" );
+    bdb::environment::ptr env( new bdb::environment() );
+    env->set_logging( false );
+    env->open( dir );
+    {
+        state_database db;
+        db.open( dir, env );
+        fill( db, pub_key );
+        db.commit();
+    }
+    env->close();
+
+    env->open( dir );
+    if( !env->closed_cleanly() )
+    {
+        elog( "the environment did not leave a clean shutdown marker" );
+        return false;
+    }
+    {
+        // a wrong count that only a rebuild corrects
+        bdb::keyvalue_db<std::string,uint64_t> meta;
+        meta.open( dir/"meta", *env );
+        meta.set( "name_count", 1000 );
+    }
+    env->close();
+    boost::filesystem::remove( dir/"clean_shutdown" );
+
+    env->open( dir );
+    state_database db;
+    db.open( dir, env );
+    if( env->closed_cleanly() || db.get_counts().names != 3 || db.get_balance( "scott", "dollar" ) != 500 )
+    {
+        elog( "the indexes were not rebuilt after an unclean shutdown" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Queries a snapshot until done is set, ok is cleared if it ever sees a balance 
+ *  other than the one it was taken with.
+ */
+struct snapshot_reader
+{
+    snapshot_reader( const state_snapshot::ptr& s ):snap(s),done(false),ok(true),reads(0){}
+
+    void operator()()
+    {
+        try {
+            uint64_t type = snap->get_name_index( "dollar" );
+            uint64_t dan  = snap->get_name_index( "dan" );
+            while( !done && ok )
+            {
+                ok = snap->get_balance( "dan", "dollar" ) == 9507 && snap->get_balance( "scott", "dollar" ) == 493;
+
+                std::vector<holder> h = snap->get_holders( type, dan, 2 );
+                ok = ok && h.size() == 2 && h[0].account == dan && h[0].balance == 9507 && h[1].balance == 493;
+
+                uint32_t n = 0;
+                for( history_cursor c = snap->get_history( account_key( dan, type ), 0, uint64_t(-1) ); !c.end(); ++c )
+                    ++n;
+                ok = ok && n == 3;
+                ++reads;
+            }
+        } catch ( const boost::exception& e )
+        {
+            elog( "snapshot reader caught exception: %1%", boost::diagnostic_information(e) );
+            ok = false;
+        }
+    }
+
+    state_snapshot::ptr snap;
+    volatile bool       done;
+    volatile bool       ok;
+    volatile uint64_t   reads;
+};
+
+/**
+ *  A snapshot taken before several commits keeps answering with the state it was
+ *  taken at while another thread reads it during the commits.
+ */
+static bool test_snapshot_reader( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_snapshot.dat" );
+    state_database::ptr db( new state_database() );
+    db->open( dir );
+    fill( *db, pub_key );
+    db->commit();
+    db->transfer_balance( "scott", "dan", "dollar", 7 );
+
+    snapshot_reader rd( db->get_snapshot() );
+    boost::thread   t( boost::ref( rd ) );
+    for( uint32_t i = 0; i < 20 && rd.ok; ++i )
+    {
+        for( uint32_t j = 0; j < 500; ++j )
+            db->transfer_balance( j % 2 ? "scott" : "dan", j % 2 ? "dan" : "scott", "dollar", 1 + i );
+        db->transfer_balance( "dan", "scott", "dollar", 1 );
+        db->commit();
+    }
+    rd.done = true;
+    t.join();
+    if( !rd.ok || !rd.reads )
+    {
+        elog( "a snapshot changed while the database committed, %1% reads", rd.reads );
+        return false;
+    }
+
+    state_snapshot::ptr latest = db->get_snapshot();
+    if( latest->get_balance( "dan", "dollar" ) != 9487 || latest->get_balance( "scott", "dollar" ) != 513 )
+    {
+        elog( "a new snapshot did not see the committed transfers" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Byte i of a test log is pattern(i) so any read can be checked.
+ */
+/**
+ *  Overlays stacked on a flattened overlay see what is added below them, and
+ *  their depth follows a rebase or flatten of the overlays they are stacked on.
+ */
+static bool test_overlay_depth( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_depth.dat" );
+    state_database::ptr db( new state_database() );
+    db->open( dir );
+    fill( *db, pub_key );
+    db->commit();
+
+    std::vector<state_database_transaction::ptr> t;
+    t.push_back( state_database_transaction::ptr( new state_database_transaction( db ) ) );
+    for( uint32_t i = 1; i < max_overlay_depth + 2; ++i )
+        t.push_back( state_database_transaction::ptr( new state_database_transaction( t.back() ) ) );
+    state_database_transaction::ptr top = t.back();
+    if( t[max_overlay_depth]->depth() != max_overlay_depth + 1 || top->depth() != 1 
+        || top->get_balance( "dan", "dollar" ) != 9500 )
+    {
+        elog( "the overlay deeper than max_overlay_depth was not flattened" );
+        return false;
+    }
+
+    t[0]->transfer_balance( "dan", "scott", "dollar", 100 );
+    if( top->get_balance( "dan", "dollar" ) != 9400 || top->get_balance( "scott", "dollar" ) != 600 )
+    {
+        elog( "the view did not merge the transfer added below it" );
+        return false;
+    }
+    t[3]->transfer_balance( "scott", "dan", "dollar", 50 );
+    t[1]->transfer_balance( "dan", "scott", "dollar", 5 );
+    if( top->get_balance( "dan", "dollar" ) != 9450 || top->get_balance( "scott", "dollar" ) != 550 )
+    {
+        elog( "an older overlay replaced the entries of a newer one in the view" );
+        return false;
+    }
+    t[0]->commit();
+    if( top->get_balance( "dan", "dollar" ) != 9450 || t[1]->get_balance( "scott", "dollar" ) != 605 )
+    {
+        elog( "the view was not rebuilt after an overlay below it committed" );
+        return false;
+    }
+
+    t[2]->rebase( db );
+    if( t[2]->depth() != 0 || t[3]->depth() != 1 || t[4]->depth() != 2 )
+    {
+        elog( "the depth of the overlays stacked on a rebased overlay did not change" );
+        return false;
+    }
+    t[3]->flatten();
+    if( t[4]->depth() != 1 || top->get_balance( "scott", "dollar" ) != 550 )
+    {
+        elog( "the depth of the overlay stacked on a flattened overlay did not change" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Keys are found by comparing the bytes of their define_key records, whether the
+ *  record is pending, committed or in a database that was reopened.
+ */
+static bool test_find_key( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_keys.dat" );
+    {
+        state_database db;
+        db.set_log_version( log_v2 );
+        db.open( dir );
+        fill( db, pub_key );
+        if( db.find_key( pub_key[1] ) == uint64_t(-1) || db.find_key( pub_key[3] ) != uint64_t(-1) )
+        {
+            elog( "find_key did not match the pending define_key records" );
+            return false;
+        }
+        db.commit();
+        db.set_public_key( "quinn", pub_key[3] );
+        uint64_t     loc = db.find_key( pub_key[3] );
+        public_key_t pk;
+        if( loc == uint64_t(-1) || !db.get_key( loc, pk ) || pk != pub_key[3] )
+        {
+            elog( "find_key did not find a key pending on top of committed ones" );
+            return false;
+        }
+        db.commit();
+    }
+    state_database db;
+    db.open( dir );
+    for( uint32_t i = 0; i < 4; ++i )
+    {
+        uint64_t     loc = db.find_key( pub_key[i] );
+        public_key_t pk;
+        if( loc == uint64_t(-1) || !db.get_key( loc, pk ) || pk != pub_key[i] 
+            || !db.get_key( loc, pk ) || pk != pub_key[i] )
+        {
+            elog( "find_key did not find committed key %1% after reopening", i );
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ *  Names that were not interned yet are read from the index in a batch, in the
+ *  order they were asked for, along with pending names.
+ */
+static bool test_names_for_index( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_names.dat" );
+    const char* expect[] = { "scott", "quinn", "dollar", "dan", "scott" };
+    std::vector<uint64_t> idx( 5 );
+    {
+        state_database db;
+        db.open( dir );
+        fill( db, pub_key );
+        db.commit();
+        for( uint32_t i = 0; i < 5; ++i )
+            idx[i] = db.get_name_index( expect[i] );
+    }
+    // reopened, so none of the committed names are interned
+    state_database db;
+    db.open( dir );
+    db.set_public_key( "quinn", pub_key[3] );
+    idx[1] = db.get_name_index( "quinn" );
+
+    std::vector<std::string> names = db.get_names_for_index( idx );
+    for( uint32_t i = 0; i < 5; ++i )
+        if( names.size() != 5 || names[i] != expect[i] )
+        {
+            elog( "get_names_for_index returned the wrong name at %1%", i );
+            return false;
+        }
+    name_edit e;
+    if( !db.find_name( "dollar", e ) || e.name_idx != idx[2] )
+    {
+        elog( "the names read in a batch were not interned with their index" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  The issuer holds everything it has not handed out, it is left out of the ranking
+ *  whether its balance is committed or changed by an overlay.
+ */
+static bool test_top_holders( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_top.dat" );
+    state_database::ptr db( new state_database() );
+    db->open( dir );
+    fill( *db, pub_key );
+    db->commit();
+
+    uint64_t            type = db->get_name_index( "dollar" );
+    std::vector<holder> top  = db->get_top_holders( type, 10 );
+    if( top.size() != 2 || top[0].account != db->get_name_index( "dan" ) || top[0].balance != 9500
+        || top[1].account != db->get_name_index( "scott" ) )
+    {
+        elog( "the committed ranking of dollar is wrong" );
+        return false;
+    }
+
+    state_database_transaction::ptr trx( new state_database_transaction( db ) );
+    trx->transfer_balance( "dollar", "scott", "dollar", 20000 );
+    top = trx->get_top_holders( type, 10 );
+    if( top.size() != 2 || top[0].account != db->get_name_index( "scott" ) || top[0].balance != 20500 )
+    {
+        elog( "the ranking of dollar with a pending issue is wrong" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  The name_table holds at most name_table_size names and keeps the ones that
+ *  are used while new names are interned.
+ */
+static bool test_name_table()
+{
+    name_table t;
+    name_table::entry e;
+    std::string       name;
+    for( uint64_t i = 0; i < 4 * name_table_size; ++i )
+    {
+        t.intern( boost::lexical_cast<std::string>(i), i * 10, i * 10 + 1 );
+        if( !t.find( "0", e ) || e.name_idx != 0 || !t.find_index( 0, name ) || name != "0" )
+        {
+            elog( "a name that is used was dropped from the name_table after %1% names", i );
+            return false;
+        }
+    }
+    if( t.size() > name_table_size )
+    {
+        elog( "the name_table holds %1% names", t.size() );
+        return false;
+    }
+    if( t.find( "1", e ) || !t.find( boost::lexical_cast<std::string>(4 * name_table_size - 1), e ) 
+        || e.last_edit != (4 * name_table_size - 1) * 10 + 1 )
+    {
+        elog( "the name_table did not drop the oldest names" );
+        return false;
+    }
+    t.intern( "0", 0, 7 );
+    if( !t.find( "0", e ) || e.last_edit != 7 )
+    {
+        elog( "the name_table did not update the last edit" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Ordered queries stop at their limit, the pending names are merged with the
+ *  committed ones and the contents of an account come from one range read.
+ */
+static bool test_ordered_queries( const public_key_t* pub_key )
+{
+    flat_index<uint64_t,uint64_t> idx;
+    for( uint64_t i = 0; i < 1000; ++i )
+        idx[(i * 7919) % 1000] = i;
+    std::vector< std::pair<uint64_t,uint64_t> > sel;
+    idx.select( 100, 900, sel, 10 );
+    for( uint64_t i = 0; i < 10; ++i )
+        if( sel.size() != 10 || sel[i].first != 100 + i )
+        {
+            elog( "select did not return the first entries of the range" );
+            return false;
+        }
+
+    boost::filesystem::path dir = fresh_dir( "test_state_db_ordered.dat" );
+    state_database db;
+    db.open( dir );
+    fill( db, pub_key );
+    db.commit();
+    db.set_public_key( "carl", pub_key[3] );
+    db.set_public_key( "zed", pub_key[3] );
+    db.set_public_key( "alice", pub_key[3] );
+
+    std::vector<std::string> names = db.query_names( "b", "z", 3 );
+    if( names.size() != 3 || names[0] != "carl" || names[1] != "dan" || names[2] != "dollar" )
+    {
+        elog( "query_names did not merge the first pending and committed names" );
+        return false;
+    }
+
+    db.issue( "carl" );
+    db.transfer_balance( "carl", "dan", "carl", 5 );
+    std::vector<std::string> cts = db.get_account_contents( "dan" );
+    if( cts.size() != 2 || cts[0] != "carl" || cts[1] != "dollar" )
+    {
+        elog( "the contents of dan are wrong" );
+        return false;
+    }
+    return true;
+}
+
+static char pattern( uint64_t i ) { return char( i * 7 + (i >> 9) ); }
+
+static bool check_bytes( gpm::segmented_log& log, uint64_t pos, uint64_t len )
+{
+    std::vector<char> buf( len );
+    if( log.read( pos, &buf.front(), len ) != len )
+        return false;
+    for( uint64_t i = 0; i < len; ++i )
+        if( buf[i] != pattern( pos + i ) )
+            return false;
+    return true;
+}
+
+static void append_pattern( gpm::segmented_log& log, uint64_t len )
+{
+    std::vector<char> d( len );
+    for( uint64_t i = 0; i < len; ++i )
+        d[i] = pattern( log.size() + i );
+    log.append( &d.front(), len );
+    log.sync();
+}
+
+/**
+ *  Sealing, reads across the last segment and the tail, moving segments back into
+ *  the tail, and reopening after a seal that stopped half way.
+ */
+/**
+ *  Writes through a small page size and clean cache read back the same before and
+ *  after commit, and a transaction stacked on another only reaches it on commit.
+ */
+static bool test_file_transaction()
+{
+    boost::filesystem::path p( "test_trx_file.dat" );
+    boost::filesystem::remove( p );
+    gpm::file::ptr base( new gpm::file( p, "wb+" ) );
+
+    uint64_t          len = 10 * 512 + 100;
+    std::vector<char> in( len );
+    for( uint64_t i = 0; i < len; ++i )
+        in[i] = pattern( i );
+
+    file_transaction::ptr trx( new file_transaction( base, 512, 2 ) );
+    trx->seek( 0 );
+    trx->write( &in.front(), 300 );
+    trx->write( &in[300], len - 300 );
+    std::vector<char> out( len );
+    trx->seek( 0 );
+    if( base->size() != 0 || trx->size() != len || trx->read( &out.front(), len ) != len || out != in )
+    {
+        elog( "file_transaction did not read back its uncommitted writes" );
+        return false;
+    }
+    if( !trx->commit() || base->size() != len )
+    {
+        elog( "file_transaction did not write its pages to the base" );
+        return false;
+    }
+
+    file_transaction::ptr child( new file_transaction( trx, 512, 2 ) );
+    char c = 'x';
+    child->seek( 700 );
+    child->write( &c, 1 );
+    trx->seek( 700 );
+    trx->read( &c, 1 );
+    if( c != in[700] )
+    {
+        elog( "a write to a stacked file_transaction reached its base before commit" );
+        return false;
+    }
+    child->commit();
+    in[700] = 'x';
+    trx->commit();
+
+    // reads every page twice through a cache of two pages
+    file_transaction reader( base, 512, 2 );
+    for( uint32_t pass = 0; pass < 2; ++pass )
+    {
+        std::fill( out.begin(), out.end(), 0 );
+        for( uint64_t pos = 0; pos < len; pos += 333 )
+        {
+            uint64_t n = std::min( uint64_t(333), len - pos );
+            reader.seek( pos );
+            if( reader.read( &out[pos], n ) != n )
+                break;
+        }
+        if( out != in )
+        {
+            elog( "file_transaction read back the wrong bytes after commit" );
+            return false;
+        }
+    }
+    try {
+        file_transaction bad( base, 1000 );
+        elog( "file_transaction accepted a page size that is not a power of 2" );
+        return false;
+    } catch ( const boost::exception& e ) {}
+    return true;
+}
+
+static bool test_segmented_log()
+{
+    boost::filesystem::path dir = fresh_dir( "test_segmented_log" );
+    boost::filesystem::create_directory( dir );
+    const uint64_t seg = 4 * segment_block_size + 100;
+    {
+        gpm::segmented_log log;
+        log.open( dir );
+        log.set_segment_size( seg );
+        log.set_compression( true );
+        append_pattern( log, 3 * seg + 5000 );
+        if( log.seal( 2 * seg + 10 ) != 2 || log.tail_start() != 2 * seg )
+        {
+            elog( "expected two sealed segments, the tail starts at %1%", log.tail_start() );
+            return false;
+        }
+        if( !check_bytes( log, 0, log.size() ) || !check_bytes( log, 2 * seg - 300, 600 ) 
+            || !check_bytes( log, seg - 10, 20 ) )
+        {
+            elog( "reads across sealed segments and the tail do not match" );
+            return false;
+        }
+        append_pattern( log, 1000 );
+        log.truncate( seg + 50 );
+        if( log.tail_start() != seg || log.size() != seg + 50 || !check_bytes( log, 0, seg + 50 ) )
+        {
+            elog( "truncating into a segment did not move it back into the tail" );
+            return false;
+        }
+        append_pattern( log, seg );
+        if( log.seal( log.size() ) != 1 || log.tail_start() != 2 * seg )
+        {
+            elog( "the segment moved back into the tail was not sealed again" );
+            return false;
+        }
+    }
+    {
+        gpm::segmented_log log;
+        log.open( dir );
+        if( log.tail_start() != 2 * seg || log.size() != 2 * seg + 50 || !check_bytes( log, 0, log.size() ) )
+        {
+            elog( "reopened segmented log does not match" );
+            return false;
+        }
+    }
+
+    // a seal that wrote a segment and a temporary tail but crashed before the rename
+    // and one that renamed the new tail but did not remove the old one yet
+    char name[64];
+    snprintf( name, sizeof(name), "%016llx", (unsigned long long)(3 * seg) );
+    boost::filesystem::copy_file( dir/"segments"/"0000000000000000", dir/"segments"/name );
+    { gpm::file t( dir/(std::string("state.") + name + ".tmp"), "wb+" ); t.write( "x", 1 ); }
+    snprintf( name, sizeof(name), "state.%016llx", (unsigned long long)seg );
+    { gpm::file t( dir/name, "wb+" ); t.write( "stale", 5 ); }
+    {
+        gpm::segmented_log log;
+        log.open( dir );
+        if( log.tail_start() != 2 * seg || log.size() != 2 * seg + 50 || !check_bytes( log, 0, log.size() ) 
+            || boost::filesystem::exists( dir/name ) )
+        {
+            elog( "segmented log did not recover from an interrupted seal" );
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ *  Small overlays are copied into the tail chunk of their base when they are
+ *  spliced, chunks are reused through the arena and data() stops at the end of
+ *  each chunk.
+ */
+/**
+ *  Rebuilding the indexes from the log gives back the balances, names and counts
+ *  that commit() indexed.
+ */
+static bool test_update_index( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_rebuild.dat" );
+    state_database db;
+    db.open( dir );
+    fill( db, pub_key );
+    db.set_public_key( "quinn", pub_key[3] );
+    db.set_public_key( "quinn", pub_key[0] );
+    db.transfer_balance( "dan", "quinn", "dollar", 42 );
+    grow_log( db, 64 * 1024 );
+
+    uint64_t                 dan    = db.get_balance( "dan", "dollar" );
+    uint64_t                 scott  = db.get_balance( "scott", "dollar" );
+    state_counts             counts = db.get_counts();
+    std::vector<std::string> names  = db.query_names( "", "~" );
+    name_edit                quinn;
+    db.find_name( "quinn", quinn );
+
+    db.update_index();
+    name_edit    e;
+    public_key_t pk;
+    if( db.get_balance( "dan", "dollar" ) != dan || db.get_balance( "scott", "dollar" ) != scott
+        || db.get_balance( "quinn", "dollar" ) != 42 || db.query_names( "", "~" ) != names )
+    {
+        elog( "the rebuilt indexes lost balances or names" );
+        return false;
+    }
+    if( !db.find_name( "quinn", e ) || e.name_idx != quinn.name_idx || e.last_edit != quinn.last_edit
+        || !db.get_public_key_t( "quinn", pk ) || pk != pub_key[0] )
+    {
+        elog( "the rebuilt name index does not resolve the update of quinn" );
+        return false;
+    }
+    state_counts c = db.get_counts();
+    if( c.names != counts.names || c.accounts != counts.accounts || c.holdings != counts.holdings )
+    {
+        elog( "the rebuilt counts differ from the ones commit() kept" );
+        return false;
+    }
+    return true;
+}
+
+/// appends a start_trx at time t and a transfer of 1 from dan to scott that refers to it
+static void timed_transfer( abstract_state_database& db, uint64_t t )
+{
+    uint64_t trx = db.size();
+    db.append_record( start_trx( boost::rpc::sha1_hashcode(), t ) );
+    db.transfer_balance( "dan", "scott", "dollar", 1, trx );
+}
+
+/**
+ *  The history of an account is returned newest first between two times, merging
+ *  the history index with the transfers pending in the database and an overlay.
+ */
+static bool test_history( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_history.dat" );
+    state_database::ptr db( new state_database() );
+    db->open( dir );
+    fill( *db, pub_key );
+    timed_transfer( *db, 1000 );
+    timed_transfer( *db, 2000 );
+    db->commit();
+    timed_transfer( *db, 3000 );
+    state_database_transaction::ptr trx( new state_database_transaction( db ) );
+    timed_transfer( *trx, 4000 );
+
+    account_key    dan( db->get_name_index( "dan" ), db->get_name_index( "dollar" ) );
+    uint64_t       expect[] = { 4000, 3000, 2000 };
+    uint32_t       n = 0;
+    for( history_cursor c = trx->get_history( dan, 1500, 4000 ); !c.end(); ++c, ++n )
+    {
+        state_record r;
+        if( n >= 3 || c.time() != expect[n] || !trx->get_record( c.index(), r ) || r.id != transfer_log::id )
+        {
+            elog( "the history of dan is wrong at %1%", n );
+            return false;
+        }
+    }
+    if( n != 3 )
+    {
+        elog( "the history of dan has %1% transfers between the times instead of 3", n );
+        return false;
+    }
+    if( !db->get_history( dan, 1500, 1900 ).end() )
+    {
+        elog( "the history of dan has a transfer in a range without any" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Pages of query_names merge the names of every overlay with the name index in
+ *  order, a name edited in several layers is listed once.
+ */
+static bool test_name_pages( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_pages.dat" );
+    state_database::ptr db( new state_database() );
+    db->open( dir );
+    fill( *db, pub_key );
+    db->commit();
+    state_database_transaction::ptr t1( new state_database_transaction( db ) );
+    t1->set_public_key( "emma", pub_key[3] );
+    t1->set_public_key( "carl", pub_key[3] );
+    state_database_transaction::ptr t2( new state_database_transaction( t1 ) );
+    t2->set_public_key( "bob", pub_key[3] );
+    t2->set_public_key( "dan", pub_key[3] );
+    t2->set_public_key( "carl", pub_key[0] );
+
+    const char* expect[] = { "bob", "carl", "dan", "dollar", "emma", "scott" };
+    std::vector<std::string> all;
+    std::string              start;
+    for( std::vector<std::string> page = t2->query_names( start, "~", 4 ); !page.empty(); 
+         page = t2->query_names( start, "~", 4 ) )
+    {
+        all.insert( all.end(), page.begin(), page.end() );
+        start = page.back() + '\0';
+    }
+    if( all != std::vector<std::string>( expect, expect + 6 ) )
+    {
+        elog( "the pages of query_names did not list every name once in order" );
+        return false;
+    }
+    std::vector<std::string> c = t2->query_names( "c", "d", 10 );
+    if( c.size() != 1 || c[0] != "carl" || t2->name_count() != 6 )
+    {
+        elog( "query_names did not stop at the end of the range" );
+        return false;
+    }
+    return true;
+}
+
+static bool counts_are( abstract_state_database& db, int64_t names, int64_t accounts, int64_t holdings )
+{
+    state_counts c = db.get_counts();
+    return c.names == names && c.accounts == accounts && c.holdings == holdings && db.name_count() == uint64_t(names);
+}
+
+/**
+ *  Overlays count the names, accounts and non-zero balances they add, the counts
+ *  reach the committed totals on commit and survive reopening.
+ */
+static bool test_counts( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_counts.dat" );
+    {
+        state_database::ptr db( new state_database() );
+        db->open( dir );
+        fill( *db, pub_key );
+        db->commit();
+        if( !counts_are( *db, 3, 3, 3 ) )
+        {
+            elog( "the counts of the filled database are wrong" );
+            return false;
+        }
+
+        state_database_transaction::ptr trx( new state_database_transaction( db ) );
+        trx->transfer_balance( "scott", "dan", "dollar", 500 );
+        trx->set_public_key( "quinn", pub_key[3] );
+        trx->transfer_balance( "dan", "quinn", "dollar", 1 );
+        if( !counts_are( *trx, 4, 4, 3 ) || !counts_are( *db, 3, 3, 3 ) )
+        {
+            elog( "the counts of the overlay are wrong" );
+            return false;
+        }
+        state_database_transaction::ptr aborted( new state_database_transaction( trx ) );
+        aborted->set_public_key( "zed", pub_key[3] );
+        aborted->abort();
+        trx->commit();
+        db->commit();
+        if( !counts_are( *aborted, 4, 4, 3 ) )
+        {
+            elog( "the counts of an aborted overlay were kept" );
+            return false;
+        }
+    }
+    state_database db;
+    db.open( dir );
+    if( !counts_are( db, 4, 4, 3 ) )
+    {
+        elog( "the committed counts were not saved" );
+        return false;
+    }
+    return true;
+}
+
+/**
+ *  Chunks hashed on several workers give the hashes of a single thread, in log order.
+ */
+static bool test_hash_threads( const public_key_t* pub_key )
+{
+    boost::filesystem::path dir = fresh_dir( "test_state_db_threads.dat" );
+    chunk_hash_list           single;
+    boost::rpc::sha1_hashcode state_hash;
+    {
+        state_database db;
+        db.set_hash_threads( 1 );
+        db.open( dir );
+        fill( db, pub_key );
+        grow_log( db, 5 * state_chunk_size + 1000 );
+        db.verify_chunk_hashes();
+        db.get_chunk_hashes( single );
+        state_hash = db.calculate_state_hash();
+    }
+    boost::filesystem::remove( dir/"state_hashes" );
+
+    state_database db;
+    db.set_hash_threads( 3 );
+    db.open( dir );
+    chunk_hash_list pooled;
+    if( db.get_chunk_hashes( pooled ) != 5 * state_chunk_size || *pooled != *single 
+        || db.calculate_state_hash() != state_hash )
+    {
+        elog( "the chunks hashed on a pool of workers differ from a single thread" );
+        return false;
+    }
+    db.set_hash_threads( 0 );
+    if( !db.verify_chunk_hashes() )
+    {
+        elog( "rehashing with a worker per core did not match the cached hashes" );
+        return false;
+    }
+    return true;
+}
+
+static bool test_change_buffer()
+{
+    change_arena::ptr a( new change_arena() );
+    std::vector<char> rec( 1000 );
+    for( uint32_t i = 0; i < rec.size(); ++i )
+        rec[i] = pattern( i );
+
+    change_buffer parent( a ), child( a );
+    parent.append( &rec.front(), 100 );
+    child.append( &rec[100], 200 );
+    const char* child_chunk = child.chunk_data( 0 );
+    parent.splice( child );
+    if( parent.chunk_count() != 1 || parent.size() != 300 || !child.empty() || child.chunk_count() != 0 )
+    {
+        elog( "a child that fits was not copied into the tail chunk of its parent" );
+        return false;
+    }
+    std::vector<char> buf( 300 );
+    if( parent.read( 0, &buf.front(), buf.size() ) != 300 || memcmp( &buf.front(), &rec.front(), 300 ) != 0 )
+    {
+        elog( "spliced records do not match" );
+        return false;
+    }
+
+    change_buffer reuse( a );
+    reuse.append( &rec.front(), 10 );
+    if( reuse.chunk_data( 0 ) != child_chunk )
+    {
+        elog( "the chunk returned by splice was not reused" );
+        return false;
+    }
+
+    // fill the tail chunk so the next record starts a new chunk
+    uint64_t used = parent.size();
+    while( change_chunk_size - used >= rec.size() )
+    {
+        parent.append( &rec.front(), rec.size() );
+        used += rec.size();
+    }
+    parent.append( &rec.front(), rec.size() );
+    uint64_t    avail;
+    const char* d = parent.data( used - 1, avail );
+    if( parent.chunk_count() != 2 || !d || avail != 1 || *d != rec[rec.size()-1] )
+    {
+        elog( "data() at the end of a chunk returned %1% bytes", avail );
+        return false;
+    }
+    d = parent.data( used, avail );
+    if( !d || avail != rec.size() || d != parent.chunk_data( 1 ) || parent.data( parent.size(), avail ) )
+    {
+        elog( "data() at the start of a chunk returned %1% bytes", avail );
+        return false;
+    }
+
+    change_buffer small( a ), big( a );
+    small.append( &rec.front(), rec.size() );
+    for( uint32_t i = 0; i < change_chunk_size / rec.size(); ++i )
+        big.append( &rec.front(), rec.size() );
+    const char* moved = big.chunk_data( 0 );
+    parent.splice( small );
+    parent.splice( big );
+    if( parent.chunk_count() != 3 || parent.chunk_data( 2 ) != moved || parent.chunk_size( 1 ) != 2 * rec.size() )
+    {
+        elog( "a child that does not fit in the tail chunk was not moved" );
+        return false;
+    }
+    return true;
+}
+
 int main( int argc, char** argv )
 {
     try {
@@ -118,10 +1254,53 @@ int main( int argc, char** argv )
 
     slog("scott:dan = %1%", sbal );
 
+    if( !test_log_v2( pub_key ) )
+        return -1;
+    if( !test_segmented_log() )
+        return -1;
+    if( !test_chunk_hashes( pub_key ) )
+        return -1;
+    if( !test_change_buffer() )
+        return -1;
+    if( !test_snapshot_reader( pub_key ) )
+        return -1;
+    if( !test_group_rollback( pub_key ) )
+        return -1;
+    if( !test_clean_shutdown( pub_key ) )
+        return -1;
+    if( !test_overlay_depth( pub_key ) )
+        return -1;
+    if( !test_find_key( pub_key ) )
+        return -1;
+    if( !test_names_for_index( pub_key ) )
+        return -1;
+    if( !test_top_holders( pub_key ) )
+        return -1;
+    if( !test_name_table() )
+        return -1;
+    if( !test_ordered_queries( pub_key ) )
+        return -1;
+    if( !test_file_transaction() )
+        return -1;
+    if( !test_mapped_reads( pub_key ) )
+        return -1;
+    if( !test_hash_threads( pub_key ) )
+        return -1;
+    if( !test_balances( pub_key ) )
+        return -1;
+    if( !test_update_index( pub_key ) )
+        return -1;
+    if( !test_history( pub_key ) )
+        return -1;
+    if( !test_name_pages( pub_key ) )
+        return -1;
+    if( !test_counts( pub_key ) )
+        return -1;
 
     } catch ( const boost::exception& e )
     {
         elog( "caught exception: %1%", boost::diagnostic_information(e) );
+        return -1;
     }
 
     return 0;
@@ -1,5 +1,7 @@
 #include "trx_file.hpp"
 #include <boost/rpc/log/log.hpp>
+#include <unistd.h>
+#include <errno.h>
 
 
 namespace gpm {
@@ -34,6 +36,21 @@ void file::flush()
     if( m_file ) fflush(m_file);
 }
 
+void file::sync()
+{
+    if( !m_file ) return;
+    fflush(m_file);
+    if( fsync( fileno(m_file) ) != 0 )
+        THROW_GPM_EXCEPTION( "Error syncing file %1%: %2%", %m_path %strerror(errno) );
+}
+
+void file::truncate( uint64_t s )
+{
+    fflush(m_file);
+    if( ftruncate( fileno(m_file), s ) != 0 )
+        THROW_GPM_EXCEPTION( "Error truncating file %1%: %2%", %m_path %strerror(errno) );
+}
+
 void file::open( const boost::filesystem::path& p, const char* mode )
 {
     close();
@@ -82,9 +99,17 @@ uint64_t file::size()
 bool file::eof()const { return feof(m_file); }
 
 
-file_transaction::file_transaction( const abstract_file::ptr& base )
-:m_file(base),m_pos(0)
+/// pages allocated at once when the pool is empty
+static const uint32_t pages_per_slab = 64;
+
+/// most bytes commit() writes at once
+static const uint64_t max_write_run = 1024*1024;
+
+file_transaction::file_transaction( const abstract_file::ptr& base, uint32_t page_size, uint32_t max_clean )
+:m_file(base),m_pos(0),m_size(0),m_page_size(page_size),m_max_clean(max_clean),m_dirty(0)
 {
+    if( !m_page_size || (m_page_size & (m_page_size - 1)) )
+        THROW_GPM_EXCEPTION( "Page size %1% is not a power of 2", %m_page_size );
 //    rout( status, "NEW TRX %1%", %this );
     if( m_file ) 
     {
@@ -97,12 +122,74 @@ file_transaction::file_transaction( const abstract_file::ptr& base )
     }
 }
 
+file_transaction::~file_transaction()
+{
+    for( uint32_t i = 0; i < m_slabs.size(); ++i )
+        delete[] m_slabs[i];
+}
+
+char* file_transaction::alloc_page()
+{
+    if( m_free.empty() )
+    {
+        char* slab = new char[ uint64_t(m_page_size) * pages_per_slab ];
+        m_slabs.push_back( slab );
+        for( uint32_t i = pages_per_slab; i > 0; --i )
+            m_free.push_back( slab + uint64_t(i - 1) * m_page_size );
+    }
+    char* d = m_free.back();
+    m_free.pop_back();
+    return d;
+}
+
+/**
+ *  Reads page p from the file, the part past the end of the file is zeroed.
+ */
+void file_transaction::load_page( uint64_t p, char* d )
+{
+    uint64_t old_pos = m_file->pos();
+    m_file->seek( p * m_page_size );
+    uint64_t r = m_file->read( d, m_page_size );
+    m_file->seek( old_pos );
+    if( r < m_page_size )
+        memset( d + r, 0, m_page_size - r );
+}
+
+/**
+ *  Returns the pages of the clean cache to the pool, the dirty pages stay.
+ */
+void file_transaction::drop_clean_pages()
+{
+    std::vector<page_table::value_type> pages;
+    pages.reserve( m_dirty );
+    for( page_table::const_iterator itr = m_pages.begin(); itr != m_pages.end(); ++itr )
+    {
+        if( itr->second.dirty )
+            pages.push_back( *itr );
+        else
+            m_free.push_back( itr->second.data );
+    }
+    m_pages.clear();
+    for( uint32_t i = 0; i < pages.size(); ++i )
+        m_pages[pages[i].first] = pages[i].second;
+}
+
+/**
+ *  Returns page p from the dirty pages or the clean cache, a page that is in 
+ *  neither is read into the clean cache unless caching is disabled.
+ */
 file_transaction::page* file_transaction::find_page( uint64_t p )
 {
-    std::map<uint64_t, page>::iterator itr = m_dirty_pages.find(p);
-    if( itr != m_dirty_pages.end() )
-        return &itr->second;
-    return NULL;
+    page* pg = m_pages.find(p);
+    if( pg || !m_max_clean )
+        return pg;
+    if( m_pages.size() - m_dirty >= m_max_clean )
+        drop_clean_pages();
+    char* d = alloc_page();
+    load_page( p, d );
+    pg = &m_pages[p];
+    *pg = page( d );
+    return pg;
 }
 
 /**
@@ -111,18 +198,20 @@ file_transaction::page* file_transaction::find_page( uint64_t p )
  */
 file_transaction::page& file_transaction::dirty_page( uint64_t p )
 {
-    std::map<uint64_t, page>::iterator itr = m_dirty_pages.find(p);
-    if( itr != m_dirty_pages.end() )
-        return itr->second;
-    page pg;
-    page& np = m_dirty_pages.insert( std::make_pair( p, pg ) ).first->second;
-    memset( np, 0, sizeof(np) );
-    
-    uint64_t old_pos = m_file->pos();
-    m_file->seek( p * sizeof(page) );
-    m_file->read( np, sizeof(page) );
-    m_file->seek( old_pos );
-    return np;
+    page* pg = m_pages.find(p);
+    if( !pg )
+    {
+        char* d = alloc_page();
+        load_page( p, d );
+        pg = &m_pages[p];
+        *pg = page( d );
+    }
+    if( !pg->dirty )
+    {
+        pg->dirty = true;
+        ++m_dirty;
+    }
+    return *pg;
 }
 
 
@@ -131,31 +220,19 @@ file_transaction::page& file_transaction::dirty_page( uint64_t p )
  */
 uint64_t file_transaction::read( char* data, uint64_t len )
 {
-//    rout( status, "pos %1%  len %2%", %m_pos  %len );
 //    rout( status, "filetrx read %3% pos %1%  len %2%", %m_pos  %len %this );
-    uint64_t start_page = m_pos / sizeof(page);
-    uint32_t start_page_pos = m_pos % sizeof(page);
-
     char* pos  = data;
     const char* end  = data + len;
-    while( pos != end && m_pos != m_size )
+    while( pos != end && m_pos < m_size )
     {
-        uint32_t page_pos  = m_pos % sizeof(page);
-//        rout( status, "pos-data: %1%   page_pos %2%  len: %3%   sizeof(page)-page_pos: %4%", %(pos-data) %page_pos %len %(sizeof(page)-page_pos) );
-        uint32_t read_size = 
-            std::min( uint64_t(sizeof(page) - page_pos), 
+        uint32_t page_pos  = m_pos & (m_page_size - 1);
+        uint64_t read_size = 
+            std::min( uint64_t(m_page_size - page_pos), 
                       uint64_t(len - (pos - data) ) );
+        read_size = std::min( read_size, m_size - m_pos );
 
-        if( m_pos + read_size >= m_size ) 
-        {
-            if( m_pos >= m_size )
-                return (pos - data);
-//            rout( status, "m_size: %1%   m_pos: %2%", %m_size %m_pos );
-            read_size = m_size - m_pos;
-        }
-
-        page* p = find_page( m_pos / sizeof(page) );
-        if( p ) memcpy( pos, &((*p)[page_pos]), read_size );
+        page* p = find_page( m_pos / m_page_size );
+        if( p ) memcpy( pos, p->data + page_pos, read_size );
         else
         {
             uint64_t fp = m_file->pos();
@@ -181,9 +258,9 @@ uint64_t file_transaction::write( const char* data, uint64_t len )
     const char* end = data + len;
     while( pos != end )
     {
-        uint32_t page_pos  = m_pos % sizeof(page);
-        uint32_t write_size = std::min( uint64_t(sizeof(page) - page_pos), uint64_t(len - (pos - data) ) );
-        memcpy( &dirty_page(m_pos/sizeof(page))[page_pos], pos, write_size );
+        uint32_t page_pos   = m_pos & (m_page_size - 1);
+        uint32_t write_size = std::min( uint64_t(m_page_size - page_pos), uint64_t(len - (pos - data) ) );
+        memcpy( dirty_page(m_pos / m_page_size).data + page_pos, pos, write_size );
         pos   += write_size;
         m_pos += write_size;
         if( m_pos > m_size )
@@ -198,27 +275,53 @@ bool     file_transaction::eof()const { return m_pos >= m_size; }
 
 void     file_transaction::seek( uint64_t p ) { m_pos = p; }
 
+/**
+ *  The dirty pages are written in order, adjacent pages are copied into one 
+ *  buffer so that each run of up to max_write_run bytes takes a single seek
+ *  and write.  The last page is cut at the size of the transaction.
+ */
 bool file_transaction::commit()
 {
-    std::map<uint64_t,page>::iterator itr = m_dirty_pages.begin();
-    while( itr != m_dirty_pages.end() )
-    {
-        uint64_t cp = m_file->pos();
-        m_file->seek( itr->first * sizeof(page) );
+    std::vector<page_table::value_type> pages;
+    m_pages.sorted( pages );
 
-        if( (itr->first + 1) * sizeof(page) < m_size )
+    uint64_t cp = m_file->pos();
+    uint32_t i  = 0;
+    while( i < pages.size() )
+    {
+        if( !pages[i].second.dirty )
         {
-            if( !m_file->write( itr->second, sizeof(page) ) ) return false;
+            ++i;
+            continue;
         }
-        else
+        uint64_t first = pages[i].first;
+        uint32_t max_n = std::max( uint64_t(1), max_write_run / m_page_size );
+        uint32_t n     = 0;
+        while( i + n < pages.size() && n < max_n && pages[i+n].second.dirty && pages[i+n].first == first + n )
+            ++n;
+
+        uint64_t begin = first * m_page_size;
+        uint64_t end   = std::min( (first + n) * m_page_size, m_size );
+        if( end > begin )
         {
-            if( !m_file->write( itr->second, m_size - (itr->first * sizeof(page)) ) )
+            m_io.resize( uint64_t(n) * m_page_size );
+            for( uint32_t j = 0; j < n; ++j )
+                memcpy( &m_io[uint64_t(j) * m_page_size], pages[i+j].second.data, m_page_size );
+            m_file->seek( begin );
+            if( m_file->write( &m_io.front(), end - begin ) != end - begin )
+            {
+                m_file->seek( cp );
                 return false;
+            }
         }
-        m_file->seek(cp);
-        ++itr;
+        for( uint32_t j = 0; j < n; ++j )
+            m_pages.find( first + j )->dirty = false;
+        m_dirty -= n; // the runs written before a failed one stay clean
+        i += n;
     }
-    m_dirty_pages.clear();
+    m_file->seek( cp );
+    if( m_pages.size() > m_max_clean )
+        drop_clean_pages();
     return true;
 }
 
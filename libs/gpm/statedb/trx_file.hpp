@@ -3,6 +3,7 @@
 #include <gpm/exception.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <gpm/statedb/flat_index.hpp>
 
 
 namespace gpm {
@@ -61,6 +62,10 @@ class file : public abstract_file
 
         void flush();
 
+        /// flushes and waits until the data is on disk
+        void sync();
+        void truncate( uint64_t s );
+
         ~file();
 
     private:
@@ -69,6 +74,11 @@ class file : public abstract_file
 };
 
 
+/**
+ *  Default page size of a file_transaction.
+ */
+const uint32_t file_page_size = 4096;
+
 /**
  *  Caches writes to an abstract_file.  This class is designed to allow
  *  transactions to be chained together.  
@@ -77,20 +87,25 @@ class file : public abstract_file
  *  parallel transactions open at once can result in errors because
  *  they will not see eachothers changes and thus will stomp on them if
  *  two parallel transactions modify parts of the same page.
+ *
+ *  Pages that are read from the base are kept as clean pages until
+ *  max_clean of them are cached, then the clean pages are dropped.  Pages
+ *  come from a pool owned by the transaction and go back to it when they
+ *  are dropped.  commit() writes each run of adjacent dirty pages with one
+ *  write and keeps them as clean pages.
  */
 class file_transaction : public abstract_file
 {
     public: 
         typedef boost::shared_ptr<file_transaction> ptr;
-        struct page 
-        { 
-            char data[1024];
-            operator char*(){ return data; }
-            operator const char*()const { return data; }
-        };
 
-        file_transaction( const abstract_file::ptr& base );
-        ~file_transaction(){};
+        /**
+         *  @param page_size must be a power of 2
+         *  @param max_clean clean pages cached for reads, 0 reads through to base
+         */
+        file_transaction( const abstract_file::ptr& base, uint32_t page_size = file_page_size,
+                          uint32_t max_clean = 1024 );
+        ~file_transaction();
 
 
         virtual uint64_t   read( char* data, uint64_t len );
@@ -106,14 +121,39 @@ class file_transaction : public abstract_file
         // this is needed to support deep copying of chained transactions
         void  change_source( const abstract_file::ptr& s ) { m_file = s; }
         const abstract_file::ptr& source()const { return m_file; }
+
+        uint32_t page_size()const { return m_page_size; }
         
     private:
-        page* find_page( uint64_t p );
-        page& dirty_page( uint64_t p );
+        file_transaction( const file_transaction& );
+        file_transaction& operator=( const file_transaction& );
+
+        struct page
+        {
+            page( char* d = 0 ):data(d),dirty(false){}
+
+            char* data;
+            bool  dirty;
+        };
+        typedef flat_index<uint64_t,page> page_table;
+
+        char*    alloc_page();
+        void     load_page( uint64_t p, char* d );
+        page*    find_page( uint64_t p );
+        page&    dirty_page( uint64_t p );
+        void     drop_clean_pages();
+
+        abstract_file::ptr       m_file;
         uint64_t                 m_pos;
         uint64_t                 m_size;
-        std::map<uint64_t, page> m_dirty_pages;
-        abstract_file::ptr       m_file;
+        uint32_t                 m_page_size;
+        uint32_t                 m_max_clean;
+
+        page_table               m_pages;
+        uint64_t                 m_dirty;     // pages in m_pages that are dirty
+        std::vector<char*>       m_free;      // pages that can be reused
+        std::vector<char*>       m_slabs;     // memory of all pages
+        std::vector<char>        m_io;        // a run of pages being committed
 };
 
 } // namespace gpm
@@ -48,6 +48,10 @@ int main( int argc, char** argv )
         std::string gen_name("none" );
         std::string data_dir( "gpm_data" );
         bool do_create;
+        uint32_t hash_threads = 0;
+        uint32_t sync_interval = 1;
+        uint32_t log_segment_mb = 0;
+        uint32_t cache_mb = 0;
         uint16_t server_port = 8000;
         std::string backbone_network("239.255.255.1:4794");
         std::string urn("free_market");
@@ -64,6 +68,14 @@ int main( int argc, char** argv )
             ("keychain,k", po::value<std::string>(&keys)->default_value(keys), "File containing private keys" )
             ("client,C", po::value<std::vector<std::string> >(&clients), "One or more client to connect to HOST:PORT" )
             ("server_port,p",    po::value<uint16_t>(&server_port)->default_value(server_port), "The URN to be used by this node" )
+            ("verify", "Rehash the entire state log on startup" )
+            ("reindex", "Rebuild the state indexes from the state log on startup" )
+            ("hash_threads", po::value<uint32_t>(&hash_threads)->default_value(hash_threads), "Threads used to hash the state log, 0 for one per core" )
+            ("sync_interval", po::value<uint32_t>(&sync_interval)->default_value(sync_interval), "Sync the databases every N blocks, 0 to only sync on exit" )
+            ("log_segment_mb", po::value<uint32_t>(&log_segment_mb)->default_value(log_segment_mb), "Move old state history into segments of N MB, 0 to keep one file" )
+            ("compress_log", "Compress the segments of the state log" )
+            ("cache_mb", po::value<uint32_t>(&cache_mb)->default_value(cache_mb), "MB of cache shared by the databases, 0 for the default" )
+            ("no_txn_log", "Do not log database writes, faster but a crash may corrupt the databases" )
         ;
 
         po::variables_map vm;
@@ -77,7 +89,15 @@ int main( int argc, char** argv )
         }
     
         get_keychain().open( keys );
+        get_node()->configure_hash_threads( hash_threads );
+        get_node()->configure_sync_interval( sync_interval );
+        get_node()->configure_log_segments( log_segment_mb, vm.count("compress_log") != 0 );
+        get_node()->configure_storage( cache_mb, vm.count("no_txn_log") == 0 );
         get_node()->open( data_dir, true );
+        if( vm.count("verify") && !get_node()->verify_state() )
+            wlog( "State hash cache was corrupted and has been rebuilt." );
+        if( vm.count("reindex") )
+            get_node()->rebuild_index();
 
         gpm::server server(get_node(), server_port);
         for( uint32_t i = 0; i < clients.size(); ++i )
@@ -125,6 +145,7 @@ int main( int argc, char** argv )
                 std::cout << "genkey [alias]                  - generates a key\n";
                 std::cout << "list_keys                       - lists keys\n";
                 std::cout << "dump start len                  - dump trx\n";
+                std::cout << "dbstats [exact]                 - size and cache hits of each database\n";
             }
             else if( cmd == "ln" )
             {
@@ -171,6 +192,18 @@ int main( int argc, char** argv )
                 ss >> name;
                 get_node()->configure_generation( name, name != "off" );
             }
+            else if( cmd == "dbstats" )
+            {
+                std::string exact;
+                ss >> exact;
+                std::vector<gpm::bdb::db_stats> st = n->get_db_stats( exact == "exact" );
+                for( uint32_t i = 0; i < st.size(); ++i )
+                {
+                    std::cout << st[i].name << ": " << st[i].keys << " keys, " << st[i].pages << " pages of "
+                              << st[i].page_size << ", " << st[i].levels << " levels, cache " 
+                              << st[i].cache_hits << " hits / " << st[i].cache_misses << " misses\n";
+                }
+            }
             else if( cmd == "dump" )
             {
                 int start = 0;